@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "router.h"
+
+// lookup cost of the compiled radix tree with 10k routes, run with: chinook_router_bench [iterations]
+
+#define ROUTE_GROUPS 2500 // 4 routes each
+#define PATHS_N 4096
+
+static int dummy_handler([[maybe_unused]] const struct HttpRequest *req,
+                         [[maybe_unused]] const struct route_params *params,
+                         [[maybe_unused]] struct HttpResponse *res, [[maybe_unused]] void *user) {
+	return 0;
+}
+
+static double now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double) t.tv_sec * 1e9 + (double) t.tv_nsec;
+}
+
+int main(const int argc, char *argv[]) {
+	const long iterations = argc > 1 ? strtol(argv[1], NULL, 10) : 2000;
+	// router_compile logs to stdout and ~/chinook_log.txt, stdout is only the result
+	log_set_level(ERROR);
+	router_t *r = router_create();
+	if (r == NULL)
+		return EXIT_FAILURE;
+	char pattern[256];
+	const double build_start = now_ns();
+	for (int i = 0; i < ROUTE_GROUPS; i++) {
+		snprintf(pattern, sizeof(pattern), "/api/v1/resource%d", i);
+		int stat = router_add(r, HTTP_METHOD_GET, pattern, dummy_handler, NULL);
+		snprintf(pattern, sizeof(pattern), "/api/v1/resource%d/:id", i);
+		stat |= router_add(r, HTTP_METHOD_GET, pattern, dummy_handler, NULL);
+		snprintf(pattern, sizeof(pattern), "/api/v1/resource%d/:id/items/:item", i);
+		stat |= router_add(r, HTTP_METHOD_POST, pattern, dummy_handler, NULL);
+		snprintf(pattern, sizeof(pattern), "/static/site%d/*path", i);
+		stat |= router_add(r, HTTP_METHOD_GET, pattern, dummy_handler, NULL);
+		if (stat != 0) {
+			fprintf(stderr, "router_add failed\n");
+			return EXIT_FAILURE;
+		}
+	}
+	if (router_compile(r) == -1)
+		return EXIT_FAILURE;
+	const double build_ns = now_ns() - build_start;
+
+	static char paths[PATHS_N][128];
+	static size_t lens[PATHS_N];
+	static enum HttpMethod methods[PATHS_N];
+	srand(1);
+	for (int i = 0; i < PATHS_N; i++) {
+		const int group = rand() % ROUTE_GROUPS;
+		methods[i] = HTTP_METHOD_GET;
+		switch (i % 4) {
+			case 0:
+				snprintf(paths[i], sizeof(paths[i]), "/api/v1/resource%d", group);
+				break;
+			case 1:
+				snprintf(paths[i], sizeof(paths[i]), "/api/v1/resource%d/%d", group, rand());
+				break;
+			case 2:
+				snprintf(paths[i], sizeof(paths[i]), "/api/v1/resource%d/%d/items/%d", group, rand(), rand());
+				methods[i] = HTTP_METHOD_POST;
+				break;
+			default:
+				snprintf(paths[i], sizeof(paths[i]), "/static/site%d/css/main-%d.css", group, rand());
+				break;
+		}
+		lens[i] = strlen(paths[i]);
+	}
+
+	struct route_match m;
+	size_t found = 0;
+	const double start = now_ns();
+	for (long it = 0; it < iterations; it++) {
+		for (int i = 0; i < PATHS_N; i++) {
+			found += router_match(r, methods[i], paths[i], lens[i], &m) == ROUTE_FOUND;
+		}
+	}
+	const double elapsed = now_ns() - start;
+	const double lookups = (double) iterations * PATHS_N;
+	if (found != (size_t) lookups) {
+		fprintf(stderr, "%zu of %.0f lookups matched\n", found, lookups);
+		return EXIT_FAILURE;
+	}
+	printf("{\"routes\": %d, \"build_ms\": %.2f, \"lookups\": %.0f, \"ns_per_lookup\": %.2f}\n",
+	       ROUTE_GROUPS * 4, build_ns / 1e6, lookups, elapsed / lookups);
+	router_destroy(r);
+	return EXIT_SUCCESS;
+}
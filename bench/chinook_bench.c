@@ -0,0 +1,690 @@
+#ifdef __linux__
+#define _GNU_SOURCE // memmem
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/errno.h>
+
+#include "poller.h"
+#include "histogram.h"
+
+/* http/1.1 load generator, e.g.
+ *   chinook_bench -c 64 -t 4 -d 10 -P 8 -m "GET /:9,HEAD /:1"
+ * with -r the load is open loop: every connection has a fixed schedule and latency is measured from when a
+ * request was due, not from when it could be sent, so a stalled server isn't hidden (coordinated omission).
+ * without -r each connection sends as fast as responses come back.
+ * the result is one json object on stdout, latencies in microseconds
+ */
+
+#define BENCH_MIX_MAX 16
+#define BENCH_READ_BUF_SIZE 65536
+#define BENCH_PIPELINE_MAX 1024
+#define BENCH_EVENTS_MAX 256
+#define BENCH_LATENCY_MAX_NS (60ull * 1000 * 1000 * 1000)
+#define BENCH_HIST_SUB_BITS 7 // < 1% bucket error
+#define BENCH_RETRY_NS 1000000 // don't spin on a refused connection
+
+struct request_kind {
+	char *data;
+	size_t len;
+	bool head;
+	unsigned int weight;
+};
+
+struct options {
+	const char *host;
+	const char *port;
+	unsigned int threads;
+	unsigned int connections;
+	unsigned int pipeline;
+	bool close;
+	double rate; // total requests/s, 0 is closed loop
+	double duration_sec;
+	size_t body_size;
+	struct request_kind mix[BENCH_MIX_MAX];
+	size_t nmix;
+	unsigned int total_weight;
+};
+
+struct in_flight {
+	uint64_t due_ns;
+	bool head;
+};
+
+struct conn {
+	int fd;
+	bool connecting;
+	unsigned int interest;
+	uint64_t next_due_ns; // open loop only
+	uint64_t interval_ns;
+	uint64_t retry_ns; // after a failed connect
+	struct in_flight fifo[BENCH_PIPELINE_MAX];
+	size_t fifo_head;
+	size_t inflight;
+	char *out;
+	size_t out_len;
+	size_t out_off;
+	size_t out_cap;
+	char in[BENCH_READ_BUF_SIZE];
+	size_t in_len;
+	// response being read
+	bool in_body;
+	bool until_close;
+	bool close_after;
+	size_t body_left;
+	int status;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct options *opt;
+	const struct sockaddr_storage *addr;
+	socklen_t addr_len;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t rng;
+	poller_t *poller;
+	struct conn *conns;
+	size_t nconns;
+	size_t conn_offset; // index of the first connection across all workers
+	// results
+	struct histogram latency;
+	uint64_t responses;
+	uint64_t errors;
+	uint64_t connects;
+	uint64_t missed;
+	uint64_t bytes_read;
+	uint64_t status[6]; // 1xx - 5xx, other
+};
+
+static uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+static uint64_t xorshift(uint64_t *s) {
+	uint64_t x = *s;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	return *s = x;
+}
+
+static const struct request_kind *pick_request(struct worker *w) {
+	const struct options *opt = w->opt;
+	if (opt->nmix == 1)
+		return &opt->mix[0];
+	unsigned int r = (unsigned int) (xorshift(&w->rng) % opt->total_weight);
+	for (size_t i = 0; i < opt->nmix; i++) {
+		if (r < opt->mix[i].weight)
+			return &opt->mix[i];
+		r -= opt->mix[i].weight;
+	}
+	return &opt->mix[opt->nmix - 1];
+}
+
+static int set_interest(struct worker *w, struct conn *c, const unsigned int events) {
+	if (c->interest == events)
+		return 0;
+	c->interest = events;
+	return poller_mod(w->poller, c->fd, events, c);
+}
+
+static void conn_close(struct worker *w, struct conn *c, const bool failed) {
+	if (c->fd != -1) {
+		poller_del(w->poller, c->fd);
+		close(c->fd);
+	}
+	if (failed)
+		w->errors += c->inflight > 0 ? c->inflight : 1;
+	c->fd = -1;
+	c->connecting = false;
+	c->inflight = 0;
+	c->fifo_head = 0;
+	c->out_len = 0;
+	c->out_off = 0;
+	c->in_len = 0;
+	c->in_body = false;
+	c->until_close = false;
+	c->close_after = false;
+}
+
+static int conn_open(struct worker *w, struct conn *c) {
+	const int fd = socket(w->addr->ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket failed");
+		return -1;
+	}
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl failed");
+		close(fd);
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *) w->addr, w->addr_len) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	c->connecting = true;
+	c->interest = POLLER_WRITE;
+	if (poller_add(w->poller, fd, POLLER_WRITE, c) == -1) {
+		close(fd);
+		c->fd = -1;
+		return -1;
+	}
+	w->connects++;
+	return 0;
+}
+
+static int flush(struct worker *w, struct conn *c) {
+	while (c->out_off < c->out_len) {
+		const ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return set_interest(w, c, POLLER_READ | POLLER_WRITE);
+			return -1;
+		}
+		c->out_off += (size_t) n;
+	}
+	c->out_off = 0;
+	c->out_len = 0;
+	return set_interest(w, c, POLLER_READ);
+}
+
+static int queue_request(struct conn *c, const struct request_kind *k, const uint64_t due_ns, const size_t depth) {
+	if (c->out_len + k->len > c->out_cap) {
+		const size_t cap = c->out_cap == 0 ? k->len * depth : (c->out_len + k->len) * 2;
+		char *out = realloc(c->out, cap);
+		if (out == NULL) {
+			perror("realloc failed");
+			return -1;
+		}
+		c->out = out;
+		c->out_cap = cap;
+	}
+	memcpy(c->out + c->out_len, k->data, k->len);
+	c->out_len += k->len;
+	c->fifo[(c->fifo_head + c->inflight) % depth] = (struct in_flight){.due_ns = due_ns, .head = k->head};
+	c->inflight++;
+	return 0;
+}
+
+// sends whatever is due and fits in the pipeline
+static void fill(struct worker *w, struct conn *c, const uint64_t now) {
+	const struct options *opt = w->opt;
+	if (c->fd == -1) {
+		if ((opt->rate > 0 && c->next_due_ns > now) || c->retry_ns > now)
+			return;
+		if (conn_open(w, c) == -1) {
+			w->errors++;
+			c->retry_ns = now + BENCH_RETRY_NS;
+		}
+		return;
+	}
+	if (c->connecting)
+		return;
+	const size_t depth = opt->close ? 1 : opt->pipeline;
+	bool queued = false;
+	while (c->inflight < depth) {
+		uint64_t due = now;
+		if (opt->rate > 0) {
+			if (c->next_due_ns > now)
+				break;
+			due = c->next_due_ns;
+			c->next_due_ns += c->interval_ns;
+		}
+		if (queue_request(c, pick_request(w), due, depth) == -1) {
+			conn_close(w, c, true);
+			return;
+		}
+		queued = true;
+	}
+	if (queued && flush(w, c) == -1)
+		conn_close(w, c, true);
+}
+
+static size_t parse_content_length(const char *headers, const char *end, bool *found, bool *close_conn) {
+	size_t len = 0;
+	const char *line = memchr(headers, '\n', (size_t) (end - headers));
+	while (line != NULL && line + 1 < end) {
+		line++;
+		const char *eol = memchr(line, '\n', (size_t) (end - line));
+		if (eol == NULL)
+			break;
+		if ((size_t) (eol - line) > 15 && strncasecmp(line, "content-length:", 15) == 0) {
+			len = strtoul(line + 15, NULL, 10);
+			*found = true;
+		} else if ((size_t) (eol - line) > 11 && strncasecmp(line, "connection:", 11) == 0) {
+			const char *v = line + 11;
+			while (*v == ' ')
+				v++;
+			*close_conn = strncasecmp(v, "close", 5) == 0;
+		}
+		line = eol;
+	}
+	return len;
+}
+
+static void complete_response(struct worker *w, struct conn *c, const uint64_t now) {
+	const size_t depth = w->opt->close ? 1 : w->opt->pipeline;
+	const struct in_flight *f = &c->fifo[c->fifo_head];
+	histogram_record(&w->latency, now - f->due_ns);
+	c->fifo_head = (c->fifo_head + 1) % depth;
+	c->inflight--;
+	w->responses++;
+	const int class = c->status / 100;
+	w->status[class >= 1 && class <= 5 ? class - 1 : 5]++;
+	c->in_body = false;
+	if (w->opt->close)
+		c->close_after = true;
+}
+
+// returns -1 when the stream can't be parsed
+static int parse_responses(struct worker *w, struct conn *c, const uint64_t now) {
+	size_t off = 0;
+	while (off < c->in_len) {
+		if (!c->in_body) {
+			if (c->inflight == 0)
+				return -1; // response nobody asked for
+			const char *start = c->in + off;
+			const char *end = memmem(start, c->in_len - off, "\r\n\r\n", 4);
+			if (end == NULL) {
+				if (off == 0 && c->in_len == sizeof(c->in))
+					return -1; // headers don't fit
+				break;
+			}
+			end += 4;
+			if (c->in_len - off < 12 || strncmp(start, "HTTP/1.", 7) != 0)
+				return -1;
+			c->status = atoi(start + 9);
+			bool found = false;
+			bool close_conn = false;
+			const size_t len = parse_content_length(start, end, &found, &close_conn);
+			c->close_after = close_conn;
+			c->in_body = true;
+			c->until_close = false;
+			if (c->fifo[c->fifo_head].head || c->status / 100 == 1 || c->status == 204 || c->status == 304) {
+				c->body_left = 0;
+			} else if (found) {
+				c->body_left = len;
+			} else {
+				c->until_close = true;
+				c->body_left = 0;
+			}
+			off = (size_t) (end - c->in);
+		}
+		if (c->until_close) {
+			off = c->in_len;
+			break;
+		}
+		const size_t avail = c->in_len - off;
+		const size_t take = avail < c->body_left ? avail : c->body_left;
+		c->body_left -= take;
+		off += take;
+		if (c->body_left > 0)
+			break;
+		complete_response(w, c, now);
+		if (c->close_after) {
+			off = c->in_len;
+			break;
+		}
+	}
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return 0;
+}
+
+static void on_readable(struct worker *w, struct conn *c) {
+	for (;;) {
+		const ssize_t n = recv(c->fd, c->in + c->in_len, sizeof(c->in) - c->in_len, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			conn_close(w, c, true);
+			return;
+		}
+		if (n == 0) {
+			// an until close body ends here, anything else still in flight is lost
+			if (c->in_body && c->until_close)
+				complete_response(w, c, now_ns());
+			w->errors += c->inflight;
+			conn_close(w, c, false);
+			return;
+		}
+		w->bytes_read += (uint64_t) n;
+		c->in_len += (size_t) n;
+		if (parse_responses(w, c, now_ns()) == -1) {
+			conn_close(w, c, true);
+			return;
+		}
+		if (c->close_after && !c->in_body) {
+			// server or client asked to close, requests already pipelined behind it are lost
+			w->errors += c->inflight;
+			conn_close(w, c, false);
+			return;
+		}
+		if ((size_t) n < sizeof(c->in))
+			break;
+	}
+}
+
+static void on_event(struct worker *w, struct conn *c, const unsigned int events) {
+	if (c->fd == -1)
+		return;
+	if (c->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+			conn_close(w, c, true);
+			c->retry_ns = now_ns() + BENCH_RETRY_NS;
+			return;
+		}
+		c->connecting = false;
+		if (set_interest(w, c, POLLER_READ) == -1)
+			conn_close(w, c, true);
+		return;
+	}
+	if (events & POLLER_WRITE) {
+		if (flush(w, c) == -1) {
+			conn_close(w, c, true);
+			return;
+		}
+	}
+	if (events & (POLLER_READ | POLLER_HUP))
+		on_readable(w, c);
+}
+
+static void *worker_routine(void *arg) {
+	struct worker *w = arg;
+	const struct options *opt = w->opt;
+	const bool open_loop = opt->rate > 0;
+	struct poller_event events[BENCH_EVENTS_MAX];
+	for (size_t i = 0; i < w->nconns; i++) {
+		struct conn *c = &w->conns[i];
+		if (open_loop) {
+			c->interval_ns = (uint64_t) (1e9 * opt->connections / opt->rate);
+			// spread the schedules so connections don't fire in lockstep
+			c->next_due_ns = w->start_ns + c->interval_ns * (w->conn_offset + i) / opt->connections;
+		}
+		fill(w, c, now_ns());
+	}
+	int timeout_ms = 1;
+	for (uint64_t now = now_ns(); now < w->end_ns; now = now_ns()) {
+		const int n = poller_wait(w->poller, events, BENCH_EVENTS_MAX, timeout_ms);
+		if (n == -1)
+			break;
+		for (int i = 0; i < n; i++)
+			on_event(w, events[i].data, events[i].events);
+		now = now_ns();
+		// closed loop only needs a refill where something happened, open loop has timers on every connection
+		if (open_loop) {
+			uint64_t next = w->end_ns;
+			for (size_t i = 0; i < w->nconns; i++) {
+				fill(w, &w->conns[i], now);
+				if (w->conns[i].next_due_ns < next)
+					next = w->conns[i].next_due_ns;
+			}
+			// poll timeouts are in ms, spin through the last one so requests go out on time
+			timeout_ms = next > now + 1000000 ? 1 : 0;
+		} else {
+			for (int i = 0; i < n; i++)
+				fill(w, events[i].data, now);
+			for (size_t i = 0; i < w->nconns; i++) {
+				if (w->conns[i].fd == -1)
+					fill(w, &w->conns[i], now);
+			}
+		}
+	}
+	for (size_t i = 0; i < w->nconns; i++) {
+		struct conn *c = &w->conns[i];
+		// requests that were due but never sent show the server fell behind the target rate
+		if (open_loop && c->next_due_ns < w->end_ns)
+			w->missed += (w->end_ns - c->next_due_ns) / c->interval_ns + 1;
+		conn_close(w, c, false);
+		free(c->out);
+	}
+	return NULL;
+}
+
+static int add_mix(struct options *opt, const char *spec, const char *host) {
+	if (opt->nmix == BENCH_MIX_MAX) {
+		fprintf(stderr, "at most %d request kinds\n", BENCH_MIX_MAX);
+		return -1;
+	}
+	char method[16];
+	char path[1024];
+	char copy[1100];
+	unsigned int weight = 1;
+	size_t spec_len = strlen(spec);
+	const char *colon = strrchr(spec, ':');
+	if (colon != NULL && colon[1] != '\0' && strspn(colon + 1, "0123456789") == strlen(colon + 1)) {
+		weight = (unsigned int) strtoul(colon + 1, NULL, 10);
+		spec_len = (size_t) (colon - spec);
+	}
+	if (spec_len >= sizeof(copy) || weight == 0)
+		goto bad_spec;
+	memcpy(copy, spec, spec_len);
+	copy[spec_len] = '\0';
+	if (sscanf(copy, "%15s %1023s", method, path) != 2 || path[0] != '/')
+		goto bad_spec;
+	const bool has_body = strcmp(method, "POST") == 0 || strcmp(method, "PUT") == 0 || strcmp(method, "PATCH") == 0;
+	const size_t body = has_body ? opt->body_size : 0;
+	char length[48] = "";
+	if (has_body)
+		snprintf(length, sizeof(length), "Content-Length: %zu\r\n", body);
+	char head[2048];
+	const int head_len = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: chinook_bench\r\n%s%s\r\n",
+	                              method, path, host, opt->close ? "Connection: close\r\n" : "", length);
+	if (head_len < 0 || (size_t) head_len >= sizeof(head))
+		return -1;
+	struct request_kind *k = &opt->mix[opt->nmix];
+	k->len = (size_t) head_len + body;
+	k->data = malloc(k->len);
+	if (k->data == NULL) {
+		perror("malloc failed");
+		return -1;
+	}
+	memcpy(k->data, head, (size_t) head_len);
+	memset(k->data + head_len, 'x', body);
+	k->head = strcmp(method, "HEAD") == 0;
+	k->weight = weight;
+	opt->total_weight += weight;
+	opt->nmix++;
+	return 0;
+bad_spec:
+	fprintf(stderr, "bad request spec \"%s\", expected \"METHOD /path[:weight]\"\n", spec);
+	return -1;
+}
+
+static int parse_mix(struct options *opt, const char *mix) {
+	char *copy = strdup(mix);
+	if (copy == NULL)
+		return -1;
+	int stat = 0;
+	char *save = NULL;
+	for (char *spec = strtok_r(copy, ",", &save); spec != NULL && stat == 0; spec = strtok_r(NULL, ",", &save))
+		stat = add_mix(opt, spec, opt->host);
+	free(copy);
+	if (stat == 0 && opt->nmix == 0) {
+		fprintf(stderr, "empty request mix\n");
+		return -1;
+	}
+	return stat;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+	        "usage: %s [options]\n"
+	        "  -H, --host HOST         server address (127.0.0.1)\n"
+	        "  -p, --port PORT         server port (8080)\n"
+	        "  -t, --threads N         load generator threads (1)\n"
+	        "  -c, --connections N     open connections, spread over the threads (16)\n"
+	        "  -d, --duration SEC      length of the run (10)\n"
+	        "  -P, --pipeline N        requests in flight per connection (1)\n"
+	        "  -k, --close             send Connection: close, one request per connection\n"
+	        "  -r, --rate N            target requests/s over all connections, open loop (0 = as fast as possible)\n"
+	        "  -m, --mix SPEC          comma separated \"METHOD /path[:weight]\" (\"GET /\")\n"
+	        "  -b, --body-size N       body bytes sent with POST/PUT/PATCH (0)\n",
+	        name);
+}
+
+static void print_results(const struct options *opt, struct worker *total, const double elapsed_sec) {
+	const struct histogram *h = &total->latency;
+	printf("{\"config\": {\"host\": \"%s\", \"port\": \"%s\", \"threads\": %u, \"connections\": %u, "
+	       "\"pipeline\": %u, \"keep_alive\": %s, \"rate\": %.0f, \"duration_s\": %.2f}, ",
+	       opt->host, opt->port, opt->threads, opt->connections, opt->pipeline,
+	       opt->close ? "false" : "true", opt->rate, opt->duration_sec);
+	printf("\"requests\": %llu, \"errors\": %llu, \"connects\": %llu, \"missed\": %llu, ",
+	       (unsigned long long) total->responses, (unsigned long long) total->errors,
+	       (unsigned long long) total->connects, (unsigned long long) total->missed);
+	printf("\"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu}, ",
+	       (unsigned long long) total->status[0], (unsigned long long) total->status[1],
+	       (unsigned long long) total->status[2], (unsigned long long) total->status[3],
+	       (unsigned long long) total->status[4], (unsigned long long) total->status[5]);
+	printf("\"rps\": %.1f, \"read_bytes_per_s\": %.0f, ", (double) total->responses / elapsed_sec,
+	       (double) total->bytes_read / elapsed_sec);
+	printf("\"latency_us\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p99.9\": %.2f, "
+	       "\"p99.99\": %.2f, \"max\": %.2f}}\n",
+	       histogram_mean(h) / 1e3, (double) histogram_percentile(h, 50) / 1e3,
+	       (double) histogram_percentile(h, 90) / 1e3, (double) histogram_percentile(h, 99) / 1e3,
+	       (double) histogram_percentile(h, 99.9) / 1e3, (double) histogram_percentile(h, 99.99) / 1e3,
+	       (double) histogram_percentile(h, 100) / 1e3);
+}
+
+int main(const int argc, char *argv[]) {
+	struct options opt = {
+		.host = "127.0.0.1",
+		.port = "8080",
+		.threads = 1,
+		.connections = 16,
+		.pipeline = 1,
+		.duration_sec = 10
+	};
+	const char *mix = "GET /";
+	const struct option long_opts[] = {
+		{"host", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"connections", required_argument, NULL, 'c'},
+		{"duration", required_argument, NULL, 'd'},
+		{"pipeline", required_argument, NULL, 'P'},
+		{"close", no_argument, NULL, 'k'},
+		{"rate", required_argument, NULL, 'r'},
+		{"mix", required_argument, NULL, 'm'},
+		{"body-size", required_argument, NULL, 'b'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int ch;
+	while ((ch = getopt_long(argc, argv, "H:p:t:c:d:P:kr:m:b:h", long_opts, NULL)) != -1) {
+		switch (ch) {
+			case 'H': opt.host = optarg; break;
+			case 'p': opt.port = optarg; break;
+			case 't': opt.threads = (unsigned int) strtoul(optarg, NULL, 10); break;
+			case 'c': opt.connections = (unsigned int) strtoul(optarg, NULL, 10); break;
+			case 'd': opt.duration_sec = strtod(optarg, NULL); break;
+			case 'P': opt.pipeline = (unsigned int) strtoul(optarg, NULL, 10); break;
+			case 'k': opt.close = true; break;
+			case 'r': opt.rate = strtod(optarg, NULL); break;
+			case 'm': mix = optarg; break;
+			case 'b': opt.body_size = strtoul(optarg, NULL, 10); break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (opt.threads == 0 || opt.connections < opt.threads || opt.pipeline == 0 ||
+	    opt.pipeline > BENCH_PIPELINE_MAX || opt.duration_sec <= 0 || opt.rate < 0) {
+		fprintf(stderr, "need threads >= 1, connections >= threads, pipeline 1 - %d, duration > 0, rate >= 0\n",
+		        BENCH_PIPELINE_MAX);
+		return EXIT_FAILURE;
+	}
+	if (parse_mix(&opt, mix) == -1)
+		return EXIT_FAILURE;
+
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *res;
+	const int gai = getaddrinfo(opt.host, opt.port, &hints, &res);
+	if (gai != 0) {
+		fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(gai));
+		return EXIT_FAILURE;
+	}
+	struct sockaddr_storage addr;
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	const socklen_t addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct worker *workers = calloc(opt.threads, sizeof(*workers));
+	struct conn *conns = calloc(opt.connections, sizeof(*conns));
+	if (workers == NULL || conns == NULL) {
+		perror("calloc failed");
+		return EXIT_FAILURE;
+	}
+	const uint64_t start = now_ns();
+	const uint64_t end = start + (uint64_t) (opt.duration_sec * 1e9);
+	size_t next_conn = 0;
+	for (unsigned int i = 0; i < opt.threads; i++) {
+		struct worker *w = &workers[i];
+		w->opt = &opt;
+		w->addr = &addr;
+		w->addr_len = addr_len;
+		w->start_ns = start;
+		w->end_ns = end;
+		w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+		w->nconns = opt.connections / opt.threads + (i < opt.connections % opt.threads);
+		w->conns = &conns[next_conn];
+		w->conn_offset = next_conn;
+		next_conn += w->nconns;
+		for (size_t j = 0; j < w->nconns; j++)
+			w->conns[j].fd = -1;
+		w->poller = poller_create();
+		if (w->poller == NULL || histogram_init(&w->latency, BENCH_HIST_SUB_BITS, BENCH_LATENCY_MAX_NS) == -1)
+			return EXIT_FAILURE;
+		if (pthread_create(&w->thread, NULL, worker_routine, w) != 0) {
+			perror("pthread_create failed");
+			return EXIT_FAILURE;
+		}
+	}
+	struct worker total = {0};
+	if (histogram_init(&total.latency, BENCH_HIST_SUB_BITS, BENCH_LATENCY_MAX_NS) == -1)
+		return EXIT_FAILURE;
+	for (unsigned int i = 0; i < opt.threads; i++) {
+		struct worker *w = &workers[i];
+		pthread_join(w->thread, NULL);
+		histogram_merge(&total.latency, &w->latency);
+		total.responses += w->responses;
+		total.errors += w->errors;
+		total.connects += w->connects;
+		total.missed += w->missed;
+		total.bytes_read += w->bytes_read;
+		for (size_t j = 0; j < 6; j++)
+			total.status[j] += w->status[j];
+		histogram_free(&w->latency);
+		poller_destroy(w->poller);
+	}
+	const double elapsed_sec = (double) (now_ns() - start) / 1e9;
+	print_results(&opt, &total, elapsed_sec);
+	histogram_free(&total.latency);
+	for (size_t i = 0; i < opt.nmix; i++)
+		free(opt.mix[i].data);
+	free(conns);
+	free(workers);
+	return EXIT_SUCCESS;
+}
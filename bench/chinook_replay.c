@@ -0,0 +1,766 @@
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <getopt.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/errno.h>
+
+#include "capture.h"
+#include "histogram.h"
+#include "json_parse.h"
+#include "poller.h"
+
+/* replays traffic captured by a server with capture.path set, e.g.
+ *   chinook_replay -f traffic.cap.4711 -s 4 > after.json
+ *   chinook_replay --compare before.json after.json
+ * every captured connection is opened at its captured time divided by the speed and sends what its client sent,
+ * when it sent it. data the client only sent after the server had answered waits for an answer in the replay too,
+ * so a slower server pushes a connection's next request back instead of having it pipelined, and how far back is
+ * reported as lag. latency is from the last data sent to the first byte back.
+ * -s 0 ignores the timing and keeps only that order. the result is one json object, times in microseconds
+ */
+
+#define REPLAY_EVENTS_MAX 256
+#define REPLAY_READ_BUF_SIZE 65536
+#define REPLAY_LATENCY_MAX_NS (60ull * 1000 * 1000 * 1000)
+#define REPLAY_HIST_SUB_BITS 7 // < 1% bucket error
+#define REPLAY_COMPARE_KEY_MAX 64
+
+struct options {
+	const char *file;
+	const char *host;
+	const char *port;
+	unsigned int threads;
+	unsigned int speed_permille; // 1000 is as captured, 0 as fast as the server answers
+	size_t concurrency; // open connections at most, 0 is no limit
+	double duration_sec; // the replay stops here even with connections left, 0 runs it to the end
+};
+
+// something the client did, in capture order
+struct step {
+	uint64_t at_us; // since the capture started
+	const uint8_t *data;
+	size_t len;
+	bool after_response; // the client had an answer before sending this
+};
+
+struct conn {
+	uint64_t open_us;
+	uint64_t close_us;
+	struct step *steps;
+	size_t nsteps;
+	size_t cap;
+	bool responded; // while loading: a response record since the last data
+	// replay
+	int fd;
+	bool connecting;
+	bool done;
+	unsigned int interest;
+	size_t next; // step being sent
+	size_t off; // bytes of it out
+	bool awaiting; // sent data that nothing has come back for yet
+	bool answered; // something came back since the last step went out
+	uint64_t await_from_ns;
+	uint64_t answered_ns;
+};
+
+struct worker {
+	pthread_t thread;
+	const struct options *opt;
+	const struct sockaddr_storage *addr;
+	socklen_t addr_len;
+	uint64_t start_ns;
+	uint64_t end_ns; // UINT64_MAX without a duration
+	poller_t *poller;
+	struct conn **conns; // by open time
+	size_t nconns;
+	size_t next_open;
+	struct conn **active;
+	size_t nactive;
+	// results
+	struct histogram latency;
+	struct histogram lag; // how late steps went out behind their captured time
+	uint64_t exchanges;
+	uint64_t errors;
+	uint64_t unanswered; // data still waiting for an answer when the connection ended
+	uint64_t connects;
+	uint64_t bytes_sent;
+	uint64_t bytes_read;
+	uint64_t status[6]; // 1xx - 5xx, other
+};
+
+static uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+// when something captured at at_us is due in this replay
+static uint64_t due_ns(const struct worker *w, const uint64_t at_us) {
+	if (w->opt->speed_permille == 0)
+		return w->start_ns;
+	return w->start_ns + (uint64_t) ((double) at_us * 1000 * 1000 / w->opt->speed_permille);
+}
+
+struct event {
+	enum capture_record type;
+	uint64_t at_us;
+	size_t seq; // position in the file, ties keep it
+	const uint8_t *data;
+	size_t len;
+	uint32_t id;
+};
+
+static int event_cmp(const void *a, const void *b) {
+	const struct event *x = a;
+	const struct event *y = b;
+	if (x->id != y->id)
+		return x->id < y->id ? -1 : 1;
+	if (x->at_us != y->at_us)
+		return x->at_us < y->at_us ? -1 : 1;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int conn_cmp(const void *a, const void *b) {
+	const struct conn *x = *(struct conn *const *) a;
+	const struct conn *y = *(struct conn *const *) b;
+	return x->open_us < y->open_us ? -1 : x->open_us > y->open_us;
+}
+
+static int add_step(struct conn *c, const struct event *e) {
+	if (c->nsteps == c->cap) {
+		const size_t cap = c->cap == 0 ? 8 : c->cap * 2;
+		struct step *steps = realloc(c->steps, sizeof(*steps) * cap);
+		if (steps == NULL) {
+			perror("realloc failed");
+			return -1;
+		}
+		c->steps = steps;
+		c->cap = cap;
+	}
+	c->steps[c->nsteps++] = (struct step) {
+		.at_us = e->at_us, .data = e->data, .len = e->len, .after_response = c->responded
+	};
+	c->responded = false;
+	return 0;
+}
+
+/* the records of a connection can be in more than one thread's buffer (a websocket moves to a stream loop), so
+ * they're sorted by connection and time before they're turned into steps. a record cut off at the end is dropped
+ */
+static struct conn *load_capture(const uint8_t *buf, const size_t len, size_t *nconns, uint64_t *span_us) {
+	if (len < CAPTURE_MAGIC_LEN || memcmp(buf, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != 0) {
+		fprintf(stderr, "not a capture file\n");
+		return NULL;
+	}
+	size_t nevents = 0;
+	size_t cap = 1024;
+	struct event *events = malloc(sizeof(*events) * cap);
+	if (events == NULL) {
+		perror("malloc failed");
+		return NULL;
+	}
+	uint32_t max_id = 0;
+	*span_us = 0;
+	size_t off = CAPTURE_MAGIC_LEN;
+	while (off < len) {
+		struct event e = {.type = (enum capture_record) buf[off], .seq = nevents};
+		size_t o = off + 1;
+		uint64_t id;
+		uint64_t data_len = 0;
+		size_t n = capture_varint_get(buf + o, len - o, &id);
+		if (n == 0)
+			break;
+		o += n;
+		n = capture_varint_get(buf + o, len - o, &e.at_us);
+		if (n == 0)
+			break;
+		o += n;
+		if (e.type == CAPTURE_DATA) {
+			n = capture_varint_get(buf + o, len - o, &data_len);
+			if (n == 0 || data_len > len - o - n)
+				break;
+			o += n;
+			e.data = buf + o;
+			e.len = (size_t) data_len;
+			o += e.len;
+		} else if (e.type != CAPTURE_OPEN && e.type != CAPTURE_RESPONSE && e.type != CAPTURE_CLOSE) {
+			fprintf(stderr, "bad record type %d at offset %zu\n", (int) e.type, off);
+			free(events);
+			return NULL;
+		}
+		if (id == 0 || id > UINT32_MAX) {
+			fprintf(stderr, "bad connection id at offset %zu\n", off);
+			free(events);
+			return NULL;
+		}
+		e.id = (uint32_t) id;
+		if (e.id > max_id)
+			max_id = e.id;
+		if (e.at_us > *span_us)
+			*span_us = e.at_us;
+		if (nevents == cap) {
+			cap *= 2;
+			struct event *tmp = realloc(events, sizeof(*events) * cap);
+			if (tmp == NULL) {
+				perror("realloc failed");
+				free(events);
+				return NULL;
+			}
+			events = tmp;
+		}
+		events[nevents++] = e;
+		off = o;
+	}
+	if (off < len)
+		fprintf(stderr, "capture ends in the middle of a record, %zu bytes ignored\n", len - off);
+	qsort(events, nevents, sizeof(*events), event_cmp);
+	// ids are dense, a connection whose open was lost to max-bytes stays empty and is skipped
+	struct conn *conns = calloc((size_t) max_id + 1, sizeof(*conns));
+	if (conns == NULL) {
+		perror("calloc failed");
+		free(events);
+		return NULL;
+	}
+	for (size_t i = 0; i < nevents; i++) {
+		const struct event *e = &events[i];
+		struct conn *c = &conns[e->id];
+		switch (e->type) {
+			case CAPTURE_OPEN:
+				c->open_us = e->at_us;
+				c->close_us = e->at_us;
+				c->fd = -2; // seen, -1 once it's replayed
+				break;
+			case CAPTURE_DATA:
+				if (add_step(c, e) == -1) {
+					free(events);
+					return NULL;
+				}
+				break;
+			case CAPTURE_RESPONSE:
+				c->responded = true;
+				break;
+			case CAPTURE_CLOSE:
+				break;
+		}
+		if (e->at_us > c->close_us)
+			c->close_us = e->at_us;
+	}
+	free(events);
+	*nconns = (size_t) max_id + 1;
+	return conns;
+}
+
+static int set_interest(struct worker *w, struct conn *c, const unsigned int events) {
+	if (c->interest == events)
+		return 0;
+	c->interest = events;
+	return poller_mod(w->poller, c->fd, events, c);
+}
+
+static void conn_finish(struct worker *w, struct conn *c, const bool failed) {
+	if (c->fd >= 0) {
+		poller_del(w->poller, c->fd);
+		close(c->fd);
+	}
+	if (failed)
+		w->errors++;
+	if (c->awaiting)
+		w->unanswered++;
+	c->fd = -1;
+	c->done = true;
+}
+
+static int conn_open(struct worker *w, struct conn *c) {
+	const int fd = socket(w->addr->ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		perror("socket failed");
+		return -1;
+	}
+	const int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) == -1) {
+		perror("fcntl failed");
+		close(fd);
+		return -1;
+	}
+	if (connect(fd, (const struct sockaddr *) w->addr, w->addr_len) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	c->fd = fd;
+	c->connecting = true;
+	c->interest = POLLER_WRITE;
+	if (poller_add(w->poller, fd, POLLER_WRITE, c) == -1) {
+		close(fd);
+		c->fd = -1;
+		return -1;
+	}
+	w->connects++;
+	return 0;
+}
+
+// when the next step can go out, UINT64_MAX while it waits for an answer
+static uint64_t step_due(const struct worker *w, const struct conn *c) {
+	const struct step *s = &c->steps[c->next];
+	if (s->after_response && !c->answered)
+		return UINT64_MAX;
+	const uint64_t due = due_ns(w, s->at_us);
+	return s->after_response && c->answered_ns > due ? c->answered_ns : due;
+}
+
+// sends the steps that are due, closes once the captured connection would have
+static void progress(struct worker *w, struct conn *c, const uint64_t now) {
+	if (c->connecting || c->done)
+		return;
+	while (c->next < c->nsteps) {
+		const struct step *s = &c->steps[c->next];
+		if (c->off == 0) {
+			const uint64_t due = step_due(w, c);
+			if (due > now) {
+				if (set_interest(w, c, POLLER_READ) == -1)
+					conn_finish(w, c, true);
+				return;
+			}
+			histogram_record(&w->lag, now - due_ns(w, s->at_us));
+			c->answered = false;
+		}
+		const ssize_t n = send(c->fd, s->data + c->off, s->len - c->off, 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (set_interest(w, c, POLLER_READ | POLLER_WRITE) == -1)
+					conn_finish(w, c, true);
+				return;
+			}
+			conn_finish(w, c, true);
+			return;
+		}
+		w->bytes_sent += (uint64_t) n;
+		c->off += (size_t) n;
+		if (c->off < s->len)
+			continue;
+		c->off = 0;
+		c->next++;
+		// a request the client sent in pieces is timed from its last one, the gaps are the client's
+		c->awaiting = true;
+		c->await_from_ns = now;
+	}
+	if (set_interest(w, c, POLLER_READ) == -1) {
+		conn_finish(w, c, true);
+		return;
+	}
+	// the last answer is waited for even when the client closed right after it was captured
+	if (!c->awaiting && due_ns(w, c->close_us) <= now)
+		conn_finish(w, c, false);
+}
+
+static void on_readable(struct worker *w, struct conn *c) {
+	char buf[REPLAY_READ_BUF_SIZE];
+	for (;;) {
+		const ssize_t n = recv(c->fd, buf, sizeof(buf), 0);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				return;
+			conn_finish(w, c, true);
+			return;
+		}
+		if (n == 0) {
+			// steps the server didn't take are lost, a close it would have made anyway isn't an error
+			conn_finish(w, c, c->next < c->nsteps);
+			return;
+		}
+		w->bytes_read += (uint64_t) n;
+		const uint64_t now = now_ns();
+		if (c->awaiting) {
+			histogram_record(&w->latency, now - c->await_from_ns);
+			w->exchanges++;
+			c->awaiting = false;
+			// a response is only recognised where an answer starts, bodies read later aren't looked at
+			int class = 6;
+			if (n >= 12 && memcmp(buf, "HTTP/1.", 7) == 0)
+				class = (buf[9] - '0');
+			w->status[class >= 1 && class <= 5 ? class - 1 : 5]++;
+		}
+		if (!c->answered) {
+			c->answered = true;
+			c->answered_ns = now;
+		}
+		if ((size_t) n < sizeof(buf))
+			return;
+	}
+}
+
+static void on_event(struct worker *w, struct conn *c, const unsigned int events) {
+	if (c->fd < 0)
+		return;
+	if (c->connecting) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		if (getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len) == -1 || err != 0) {
+			conn_finish(w, c, true);
+			return;
+		}
+		c->connecting = false;
+		if (set_interest(w, c, POLLER_READ) == -1)
+			conn_finish(w, c, true);
+		return;
+	}
+	if (events & (POLLER_READ | POLLER_HUP))
+		on_readable(w, c);
+}
+
+static void *worker_routine(void *arg) {
+	struct worker *w = arg;
+	const struct options *opt = w->opt;
+	struct poller_event events[REPLAY_EVENTS_MAX];
+	for (uint64_t now = now_ns(); now < w->end_ns; now = now_ns()) {
+		while (w->next_open < w->nconns && (opt->concurrency == 0 || w->nactive < opt->concurrency) &&
+		       due_ns(w, w->conns[w->next_open]->open_us) <= now) {
+			struct conn *c = w->conns[w->next_open++];
+			histogram_record(&w->lag, now - due_ns(w, c->open_us));
+			if (conn_open(w, c) == -1) {
+				w->errors++;
+				c->done = true;
+				continue;
+			}
+			w->active[w->nactive++] = c;
+		}
+		if (w->nactive == 0 && w->next_open == w->nconns)
+			break;
+		uint64_t next = w->next_open < w->nconns ? due_ns(w, w->conns[w->next_open]->open_us) : UINT64_MAX;
+		for (size_t i = 0; i < w->nactive;) {
+			struct conn *c = w->active[i];
+			progress(w, c, now);
+			if (c->done) {
+				w->active[i] = w->active[--w->nactive];
+				continue;
+			}
+			if (!c->connecting && c->off == 0) {
+				const uint64_t due = c->next < c->nsteps ? step_due(w, c) : due_ns(w, c->close_us);
+				if (due < next)
+					next = due;
+			}
+			i++;
+		}
+		// poll timeouts are in ms, spin through the last one so data goes out on time
+		int timeout_ms = 100;
+		if (next != UINT64_MAX)
+			timeout_ms = next > now + 1000000 ? (int) ((next - now) / 1000000 < 100 ? (next - now) / 1000000 : 100) : 0;
+		const int n = poller_wait(w->poller, events, REPLAY_EVENTS_MAX, timeout_ms);
+		if (n == -1)
+			break;
+		for (int i = 0; i < n; i++)
+			on_event(w, events[i].data, events[i].events);
+	}
+	// cut off by the duration
+	for (size_t i = 0; i < w->nactive; i++)
+		conn_finish(w, w->active[i], false);
+	return NULL;
+}
+
+static void print_histogram(const char *name, const struct histogram *h, const bool last) {
+	printf("\"%s\": {\"mean\": %.2f, \"p50\": %.2f, \"p90\": %.2f, \"p99\": %.2f, \"p99.9\": %.2f, \"max\": %.2f}%s",
+	       name, histogram_mean(h) / 1e3, (double) histogram_percentile(h, 50) / 1e3,
+	       (double) histogram_percentile(h, 90) / 1e3, (double) histogram_percentile(h, 99) / 1e3,
+	       (double) histogram_percentile(h, 99.9) / 1e3, (double) histogram_percentile(h, 100) / 1e3,
+	       last ? "}\n" : ", ");
+}
+
+static void print_results(const struct options *opt, const struct worker *total, const size_t nconns,
+                          const uint64_t span_us, const double elapsed_sec) {
+	printf("{\"config\": {\"file\": \"%s\", \"host\": \"%s\", \"port\": \"%s\", \"threads\": %u, \"speed\": %g, "
+	       "\"concurrency\": %zu}, ",
+	       opt->file, opt->host, opt->port, opt->threads, opt->speed_permille / 1e3, opt->concurrency);
+	printf("\"connections\": %zu, \"captured_s\": %.3f, \"elapsed_s\": %.3f, ", nconns, (double) span_us / 1e6,
+	       elapsed_sec);
+	printf("\"exchanges\": %llu, \"errors\": %llu, \"unanswered\": %llu, \"connects\": %llu, ",
+	       (unsigned long long) total->exchanges, (unsigned long long) total->errors,
+	       (unsigned long long) total->unanswered, (unsigned long long) total->connects);
+	printf("\"status\": {\"1xx\": %llu, \"2xx\": %llu, \"3xx\": %llu, \"4xx\": %llu, \"5xx\": %llu, \"other\": %llu}, ",
+	       (unsigned long long) total->status[0], (unsigned long long) total->status[1],
+	       (unsigned long long) total->status[2], (unsigned long long) total->status[3],
+	       (unsigned long long) total->status[4], (unsigned long long) total->status[5]);
+	printf("\"exchanges_per_s\": %.1f, \"sent_bytes_per_s\": %.0f, \"read_bytes_per_s\": %.0f, ",
+	       (double) total->exchanges / elapsed_sec, (double) total->bytes_sent / elapsed_sec,
+	       (double) total->bytes_read / elapsed_sec);
+	print_histogram("latency_us", &total->latency, false);
+	print_histogram("lag_us", &total->lag, true);
+}
+
+// a number from a result, "latency_us.p99.9" is "p99.9" in the latency_us object
+static int result_get(const json_value *root, const char *key, double *out) {
+	char path[REPLAY_COMPARE_KEY_MAX];
+	snprintf(path, sizeof(path), "%s", key);
+	char *dot = strchr(path, '.');
+	if (dot != NULL)
+		*dot = '\0';
+	const json_value *v = json_object_get(root, path);
+	if (dot != NULL)
+		v = json_object_get(v, dot + 1);
+	return json_get_number(v, out);
+}
+
+static json_value *read_result(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return NULL;
+	}
+	char text[8192];
+	const size_t n = fread(text, 1, sizeof(text) - 1, fp);
+	fclose(fp);
+	text[n] = '\0';
+	json_value *v = json_parse(text);
+	if (v == NULL)
+		fprintf(stderr, "%s is not a replay result\n", path);
+	return v;
+}
+
+/* before and after per metric, with the change in percent. with a threshold a change for the worse past it is a
+ * regression and the exit status is 1, so a script can gate on it
+ */
+static int compare(const char *before_path, const char *after_path, const double threshold_pct) {
+	static const struct {
+		const char *key;
+		bool higher_better;
+	} metrics[] = {
+		{"exchanges_per_s", true}, {"read_bytes_per_s", true}, {"errors", false}, {"unanswered", false},
+		{"latency_us.mean", false}, {"latency_us.p50", false}, {"latency_us.p90", false},
+		{"latency_us.p99", false}, {"latency_us.p99.9", false}, {"latency_us.max", false}, {"lag_us.p99", false}
+	};
+	json_value *before = read_result(before_path);
+	json_value *after = read_result(after_path);
+	if (before == NULL || after == NULL) {
+		json_free(before);
+		json_free(after);
+		return 2;
+	}
+	int regressions = 0;
+	printf("{");
+	for (size_t i = 0; i < sizeof(metrics) / sizeof(metrics[0]); i++) {
+		double b;
+		double a;
+		if (result_get(before, metrics[i].key, &b) == -1 || result_get(after, metrics[i].key, &a) == -1) {
+			fprintf(stderr, "\"%s\" missing from a result\n", metrics[i].key);
+			continue;
+		}
+		const double change = fabs(b) >= DBL_EPSILON ? (a - b) / b * 100 : (fabs(a) >= DBL_EPSILON ? 100 : 0);
+		const double worse = metrics[i].higher_better ? -change : change;
+		const bool regressed = threshold_pct > 0 && worse > threshold_pct;
+		regressions += regressed;
+		printf("%s\"%s\": {\"before\": %.2f, \"after\": %.2f, \"change_pct\": %.1f%s}", i > 0 ? ", " : "",
+		       metrics[i].key, b, a, change, regressed ? ", \"regressed\": true" : "");
+	}
+	printf(", \"regressions\": %d}\n", regressions);
+	json_free(before);
+	json_free(after);
+	return regressions > 0 ? 1 : 0;
+}
+
+static uint8_t *read_file(const char *path, size_t *len) {
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		return NULL;
+	}
+	uint8_t *buf = NULL;
+	if (fseek(fp, 0, SEEK_END) == 0) {
+		const long size = ftell(fp);
+		rewind(fp);
+		buf = size > 0 ? malloc((size_t) size) : NULL;
+		if (buf != NULL && fread(buf, 1, (size_t) size, fp) == (size_t) size) {
+			*len = (size_t) size;
+		} else {
+			fprintf(stderr, "can't read %s\n", path);
+			free(buf);
+			buf = NULL;
+		}
+	}
+	fclose(fp);
+	return buf;
+}
+
+static void usage(const char *name) {
+	fprintf(stderr,
+	        "usage: %s -f FILE [options]\n"
+	        "       %s --compare BEFORE.json AFTER.json [--threshold PCT]\n"
+	        "  -f, --file FILE         capture written by a server with capture.path set, path.PID\n"
+	        "  -H, --host HOST         server address (127.0.0.1)\n"
+	        "  -p, --port PORT         server port (8080)\n"
+	        "  -t, --threads N         replay threads, connections are spread over them (1)\n"
+	        "  -s, --speed X           1 replays at the captured pace, 4 four times as fast, 0 without waiting (1)\n"
+	        "  -c, --concurrency N     connections open at once at most, later ones are delayed (0 = no limit)\n"
+	        "  -d, --duration SEC      stop after this long even if the capture isn't done (0 = no limit)\n"
+	        "  -C, --compare           compare two results instead of replaying\n"
+	        "  -T, --threshold PCT     with --compare, exit 1 if a metric got worse by more than this\n",
+	        name, name);
+}
+
+int main(const int argc, char *argv[]) {
+	struct options opt = {
+		.host = "127.0.0.1",
+		.port = "8080",
+		.threads = 1,
+		.speed_permille = 1000
+	};
+	bool compare_mode = false;
+	double speed = 1;
+	double threshold_pct = 0;
+	const struct option long_opts[] = {
+		{"file", required_argument, NULL, 'f'},
+		{"host", required_argument, NULL, 'H'},
+		{"port", required_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"speed", required_argument, NULL, 's'},
+		{"concurrency", required_argument, NULL, 'c'},
+		{"duration", required_argument, NULL, 'd'},
+		{"compare", no_argument, NULL, 'C'},
+		{"threshold", required_argument, NULL, 'T'},
+		{"help", no_argument, NULL, 'h'},
+		{NULL, 0, NULL, 0}
+	};
+	int ch;
+	while ((ch = getopt_long(argc, argv, "f:H:p:t:s:c:d:CT:h", long_opts, NULL)) != -1) {
+		switch (ch) {
+			case 'f': opt.file = optarg; break;
+			case 'H': opt.host = optarg; break;
+			case 'p': opt.port = optarg; break;
+			case 't': opt.threads = (unsigned int) strtoul(optarg, NULL, 10); break;
+			case 's': speed = strtod(optarg, NULL); break;
+			case 'c': opt.concurrency = strtoul(optarg, NULL, 10); break;
+			case 'd': opt.duration_sec = strtod(optarg, NULL); break;
+			case 'C': compare_mode = true; break;
+			case 'T': threshold_pct = strtod(optarg, NULL); break;
+			default:
+				usage(argv[0]);
+				return EXIT_FAILURE;
+		}
+	}
+	if (compare_mode) {
+		if (argc - optind != 2) {
+			usage(argv[0]);
+			return 2;
+		}
+		return compare(argv[optind], argv[optind + 1], threshold_pct);
+	}
+	if (opt.file == NULL || opt.threads == 0 || !(speed >= 0 && speed <= UINT_MAX / 1000) || opt.duration_sec < 0) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	opt.speed_permille = (unsigned int) (speed * 1000 + 0.5);
+	if (opt.speed_permille == 0 && speed > 0)
+		opt.speed_permille = 1; // a tiny speed still waits rather than rounding down to 0
+
+	size_t file_len = 0;
+	uint8_t *file = read_file(opt.file, &file_len);
+	if (file == NULL)
+		return EXIT_FAILURE;
+	size_t nids;
+	uint64_t span_us;
+	struct conn *by_id = load_capture(file, file_len, &nids, &span_us);
+	if (by_id == NULL) {
+		free(file);
+		return EXIT_FAILURE;
+	}
+	struct conn **order = malloc(sizeof(*order) * nids);
+	if (order == NULL) {
+		perror("malloc failed");
+		return EXIT_FAILURE;
+	}
+	size_t nconns = 0;
+	for (size_t i = 0; i < nids; i++) {
+		if (by_id[i].fd == -2)
+			order[nconns++] = &by_id[i];
+	}
+	qsort(order, nconns, sizeof(*order), conn_cmp);
+
+	struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+	struct addrinfo *res;
+	const int gai = getaddrinfo(opt.host, opt.port, &hints, &res);
+	if (gai != 0) {
+		fprintf(stderr, "getaddrinfo failed: %s\n", gai_strerror(gai));
+		return EXIT_FAILURE;
+	}
+	struct sockaddr_storage addr;
+	memcpy(&addr, res->ai_addr, res->ai_addrlen);
+	const socklen_t addr_len = res->ai_addrlen;
+	freeaddrinfo(res);
+	signal(SIGPIPE, SIG_IGN);
+
+	struct worker *workers = calloc(opt.threads, sizeof(*workers));
+	struct conn **lists = malloc(sizeof(*lists) * (nconns + 1) * 2);
+	if (workers == NULL || lists == NULL) {
+		perror("malloc failed");
+		return EXIT_FAILURE;
+	}
+	const uint64_t start = now_ns();
+	// a connection's open is its captured time, round robin keeps each worker's list in that order
+	size_t list_off = 0;
+	for (unsigned int i = 0; i < opt.threads; i++) {
+		struct worker *w = &workers[i];
+		w->opt = &opt;
+		w->addr = &addr;
+		w->addr_len = addr_len;
+		w->start_ns = start;
+		w->end_ns = opt.duration_sec > 0 ? start + (uint64_t) (opt.duration_sec * 1e9) : UINT64_MAX;
+		w->conns = &lists[list_off];
+		for (size_t j = i; j < nconns; j += opt.threads) {
+			order[j]->fd = -1;
+			w->conns[w->nconns++] = order[j];
+		}
+		w->active = &lists[list_off + w->nconns];
+		list_off += w->nconns * 2;
+		w->poller = poller_create();
+		if (w->poller == NULL || histogram_init(&w->latency, REPLAY_HIST_SUB_BITS, REPLAY_LATENCY_MAX_NS) == -1 ||
+		    histogram_init(&w->lag, REPLAY_HIST_SUB_BITS, REPLAY_LATENCY_MAX_NS) == -1)
+			return EXIT_FAILURE;
+		if (pthread_create(&w->thread, NULL, worker_routine, w) != 0) {
+			perror("pthread_create failed");
+			return EXIT_FAILURE;
+		}
+	}
+	struct worker total = {0};
+	if (histogram_init(&total.latency, REPLAY_HIST_SUB_BITS, REPLAY_LATENCY_MAX_NS) == -1 ||
+	    histogram_init(&total.lag, REPLAY_HIST_SUB_BITS, REPLAY_LATENCY_MAX_NS) == -1)
+		return EXIT_FAILURE;
+	for (unsigned int i = 0; i < opt.threads; i++) {
+		struct worker *w = &workers[i];
+		pthread_join(w->thread, NULL);
+		histogram_merge(&total.latency, &w->latency);
+		histogram_merge(&total.lag, &w->lag);
+		total.exchanges += w->exchanges;
+		total.errors += w->errors;
+		total.unanswered += w->unanswered;
+		total.connects += w->connects;
+		total.bytes_sent += w->bytes_sent;
+		total.bytes_read += w->bytes_read;
+		for (size_t j = 0; j < 6; j++)
+			total.status[j] += w->status[j];
+		histogram_free(&w->latency);
+		histogram_free(&w->lag);
+		poller_destroy(w->poller);
+	}
+	const double elapsed_sec = (double) (now_ns() - start) / 1e9;
+	print_results(&opt, &total, nconns, span_us, elapsed_sec);
+	histogram_free(&total.latency);
+	histogram_free(&total.lag);
+	for (size_t i = 0; i < nids; i++)
+		free(by_id[i].steps);
+	free(by_id);
+	free(order);
+	free(lists);
+	free(workers);
+	free(file);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+#define _GNU_SOURCE // sched_getaffinity, pthread_attr_setaffinity_np
+
+#include <dirent.h>
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "affinity.h"
+#include "log.h"
+
+size_t affinity_cpus(const int *want, const size_t nwant, int *out, const size_t outn) {
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+		sys_error_printf("sched_getaffinity failed");
+		return 0;
+	}
+	size_t n = 0;
+	if (nwant > 0) {
+		for (size_t i = 0; i < nwant && n < outn; i++) {
+			if (want[i] >= 0 && want[i] < CPU_SETSIZE && CPU_ISSET((size_t) want[i], &allowed))
+				out[n++] = want[i];
+			else
+				lprintf(WARN, "cpu %d isn't available to this process, skipped", want[i]);
+		}
+		return n;
+	}
+	for (int cpu = 0; cpu < CPU_SETSIZE && n < outn; cpu++) {
+		if (CPU_ISSET((size_t) cpu, &allowed))
+			out[n++] = cpu;
+	}
+	return n;
+#else
+	(void) want;
+	(void) nwant;
+	(void) out;
+	(void) outn;
+	return 0;
+#endif
+}
+
+int affinity_attr_set(pthread_attr_t *attr, const int cpu) {
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET((size_t) cpu, &set);
+	const int stat = pthread_attr_setaffinity_np(attr, sizeof(set), &set);
+	if (stat != 0) {
+		errno = stat;
+		sys_error_printf("pthread_attr_setaffinity_np failed");
+		return -1;
+	}
+	return 0;
+#else
+	(void) attr;
+	(void) cpu;
+	return -1;
+#endif
+}
+
+// the cpu's directory in sysfs has a nodeN link, no libnuma needed
+int affinity_node(const int cpu) {
+#ifdef __linux__
+	char path[64];
+	snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+	DIR *dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+	int node = 0;
+	const struct dirent *e;
+	while ((e = readdir(dir)) != NULL) {
+		if (strncmp(e->d_name, "node", 4) == 0 && e->d_name[4] >= '0' && e->d_name[4] <= '9') {
+			node = atoi(e->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+#else
+	(void) cpu;
+	return 0;
+#endif
+}
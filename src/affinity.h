@@ -0,0 +1,19 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// cpu pinning and numa node lookup. linux only, elsewhere nothing is pinned and every cpu is node 0.
+// memory a pinned thread touches first comes from its own node, so per-thread state (stacks, arena
+// blocks, metrics shards) is node local as long as the thread is pinned before it starts
+
+#define AFFINITY_CPUS_MAX 256
+
+// the cpus this process may run on, limited to want if nwant > 0. returns how many, 0 if unknown
+size_t affinity_cpus(const int *want, size_t nwant, int *out, size_t outn);
+// the new thread starts on cpu, -1 if pinning isn't supported
+int affinity_attr_set(pthread_attr_t *attr, int cpu);
+int affinity_node(int cpu);
+
+#endif //AFFINITY_H
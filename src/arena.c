@@ -0,0 +1,140 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "server.h"
+#include "log.h"
+#include "metrics.h"
+
+#define ALIGN_UP(n, a) (((n) + ((a) - 1)) & ~((size_t) (a) - 1))
+
+struct arena_block {
+	struct arena_block *next;
+	size_t size; // usable bytes after the header
+	int size_class; // -1 when larger than every class, freed instead of cached
+	alignas(ARENA_ALIGN) char data[];
+};
+
+struct block_cache {
+	struct arena_block *head;
+	size_t n;
+};
+
+static size_t size_classes[BUFFER_SIZE_CLASSES_MAX] = {1024 * 4, 1024 * 64, REQUEST_MAX_SIZE_BYTES};
+static size_t nsize_classes = 3;
+static thread_local struct block_cache block_cache[BUFFER_SIZE_CLASSES_MAX];
+
+void arena_set_size_classes(const size_t *sizes, const size_t n) {
+	if (n == 0 || n > BUFFER_SIZE_CLASSES_MAX)
+		return;
+	memcpy(size_classes, sizes, sizeof(*sizes) * n);
+	nsize_classes = n;
+}
+
+static struct arena_block *block_get(const size_t min_size) {
+	int size_class = -1;
+	for (size_t i = 0; i < nsize_classes; i++) {
+		if (size_classes[i] >= min_size) {
+			size_class = (int) i;
+			break;
+		}
+	}
+	if (size_class != -1 && block_cache[size_class].head != NULL) {
+		struct arena_block *b = block_cache[size_class].head;
+		block_cache[size_class].head = b->next;
+		block_cache[size_class].n--;
+		metrics_memory_add(METRIC_MEMORY_ARENA_CACHED, -(int64_t) (sizeof(*b) + b->size));
+		metrics_memory_add(METRIC_MEMORY_ARENA_USED, (int64_t) (sizeof(*b) + b->size));
+		return b;
+	}
+	const size_t size = size_class == -1 ? ALIGN_UP(min_size, ARENA_ALIGN) : size_classes[size_class];
+	struct arena_block *b = malloc(sizeof(*b) + size);
+	if (b == NULL) {
+		sys_error_printf("malloc failed");
+		return NULL;
+	}
+	b->size = size;
+	b->size_class = size_class;
+	metrics_memory_add(METRIC_MEMORY_ARENA_USED, (int64_t) (sizeof(*b) + size));
+	return b;
+}
+
+static void block_put(struct arena_block *b) {
+	const int64_t bytes = (int64_t) (sizeof(*b) + b->size);
+	metrics_memory_add(METRIC_MEMORY_ARENA_USED, -bytes);
+	if (b->size_class == -1 || block_cache[b->size_class].n >= ARENA_CACHE_BLOCKS_PER_CLASS) {
+		free(b);
+		return;
+	}
+	metrics_memory_add(METRIC_MEMORY_ARENA_CACHED, bytes);
+	b->next = block_cache[b->size_class].head;
+	block_cache[b->size_class].head = b;
+	block_cache[b->size_class].n++;
+}
+
+void arena_init(arena_t *a) {
+	a->blocks = NULL;
+	a->ptr = NULL;
+	a->end = NULL;
+	a->last = NULL;
+}
+
+void *arena_alloc(arena_t *a, size_t size) {
+	size = ALIGN_UP(size == 0 ? 1 : size, ARENA_ALIGN);
+	if (a->ptr != NULL && (size_t) (a->end - a->ptr) >= size) {
+		void *p = a->ptr;
+		a->ptr += size;
+		a->last = p;
+		return p;
+	}
+	// the rest of the current block is abandoned until the reset
+	struct arena_block *b = block_get(size);
+	if (b == NULL)
+		return NULL;
+	b->next = a->blocks;
+	a->blocks = b;
+	a->ptr = b->data + size;
+	a->end = b->data + b->size;
+	a->last = b->data;
+	return b->data;
+}
+
+void *arena_realloc(arena_t *a, void *ptr, const size_t old_size, const size_t size) {
+	if (ptr == NULL)
+		return arena_alloc(a, size);
+	if (ptr == a->last) {
+		const size_t new_end = ALIGN_UP(size, ARENA_ALIGN);
+		if ((size_t) (a->end - (char *) ptr) >= new_end) {
+			a->ptr = (char *) ptr + new_end;
+			return ptr;
+		}
+	}
+	void *p = arena_alloc(a, size);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, ptr, old_size < size ? old_size : size);
+	return p;
+}
+
+char *arena_strndup(arena_t *a, const char *s, const size_t len) {
+	char *p = arena_alloc(a, len + 1);
+	if (p == NULL)
+		return NULL;
+	memcpy(p, s, len);
+	p[len] = '\0';
+	return p;
+}
+
+void arena_reset(arena_t *a) {
+	struct arena_block *b = a->blocks;
+	while (b != NULL) {
+		struct arena_block *next = b->next;
+		block_put(b);
+		b = next;
+	}
+	arena_init(a);
+}
+
+void arena_destroy(arena_t *a) {
+	arena_reset(a);
+}
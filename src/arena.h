@@ -0,0 +1,34 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_CACHE_BLOCKS_PER_CLASS 4
+
+/* bump allocator for request scoped memory. blocks come from a per-thread cache split into
+ * the configured size classes (buffers.size-classes), so after warm up a request does no malloc/free.
+ * everything allocated is released at once with arena_reset()
+ */
+
+struct arena_block;
+
+typedef struct arena {
+	struct arena_block *blocks; // current block first
+	char *ptr;
+	char *end;
+	void *last; // most recent allocation, arena_realloc() grows it in place
+} arena_t;
+
+// call once at startup before any thread allocates, sizes ascending
+void arena_set_size_classes(const size_t *sizes, size_t n);
+void arena_init(arena_t *a);
+// ARENA_ALIGN aligned, NULL if out of memory
+void *arena_alloc(arena_t *a, size_t size);
+void *arena_realloc(arena_t *a, void *ptr, size_t old_size, size_t size);
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+// gives every block back to the thread's cache, the arena can be reused straight away
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+
+#endif //ARENA_H
@@ -0,0 +1,230 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+#include "capture.h"
+#include "log.h"
+
+// one per thread that captured, kept until capture_stop() like the metric shards
+struct capture_buffer {
+	struct capture_buffer *next;
+	pthread_mutex_t lock; // uncontended but for capture_flush() from another thread
+	uint64_t first_ns; // when the oldest record still in data was added
+	size_t len;
+	uint8_t data[CAPTURE_BUFFER_BYTES];
+};
+
+// the buffer list and writes to fd. a buffer's own lock is taken before this one
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct capture_buffer *buffers;
+static thread_local struct capture_buffer *local;
+static int fd = -1;
+static uint64_t start_ns;
+static unsigned int sample = 1;
+static size_t max_bytes;
+static size_t written;
+static atomic_bool full; // past max_bytes or a failed write, nothing is recorded anymore
+static atomic_uint connections; // seen while capturing, sampled or not
+static atomic_uint next_id;
+
+static uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+int capture_start(const struct capture_options *opt) {
+	if (opt->path == NULL)
+		return 0;
+	// the pid keeps a handed off server from truncating the file the draining one still writes to
+	char path[PATH_MAX];
+	if (snprintf(path, sizeof(path), "%s.%ld", opt->path, (long) getpid()) >= (int) sizeof(path)) {
+		lprintf(ERROR, "capture path %s too long", opt->path);
+		return -1;
+	}
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd == -1) {
+		sys_error_printf("can't open capture file %s", path);
+		return -1;
+	}
+	if (write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN) {
+		sys_error_printf("write failed");
+		close(fd);
+		fd = -1;
+		return -1;
+	}
+	written = CAPTURE_MAGIC_LEN;
+	sample = opt->sample > 0 ? opt->sample : 1;
+	max_bytes = opt->max_bytes;
+	start_ns = now_ns();
+	atomic_init(&full, false);
+	atomic_init(&connections, 0);
+	atomic_init(&next_id, 1);
+	lprintf(LOG, "capturing 1 in %u connections to %s", sample, path);
+	return 0;
+}
+
+static struct capture_buffer *buffer_register(void) {
+	struct capture_buffer *b = malloc(sizeof(*b));
+	if (b == NULL) {
+		sys_error_printf("malloc failed");
+		return NULL;
+	}
+	b->len = 0;
+	b->first_ns = 0;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_mutex_lock(&mutex);
+	b->next = buffers;
+	buffers = b;
+	pthread_mutex_unlock(&mutex);
+	local = b;
+	return b;
+}
+
+// b's records and then an optional record too big for any buffer, in one write
+static void flush(struct capture_buffer *b, const uint8_t *head, const size_t head_len, const void *data,
+                  const size_t n) {
+	struct iovec iov[3] = {
+		{.iov_base = b->data, .iov_len = b->len},
+		{.iov_base = (void *) head, .iov_len = head_len},
+		{.iov_base = (void *) data, .iov_len = n}
+	};
+	const size_t total = b->len + head_len + n;
+	b->len = 0;
+	if (total == 0)
+		return;
+	pthread_mutex_lock(&mutex);
+	if (fd == -1 || atomic_load_explicit(&full, memory_order_relaxed)) {
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	if (max_bytes > 0 && written + total > max_bytes) {
+		atomic_store(&full, true);
+		pthread_mutex_unlock(&mutex);
+		lprintf(LOG, "capture reached %zu bytes, stopped", written);
+		return;
+	}
+	struct iovec *v = iov;
+	int vcnt = 3;
+	size_t left = total;
+	while (left > 0) {
+		const ssize_t w = writev(fd, v, vcnt);
+		if (w == -1) {
+			atomic_store(&full, true);
+			pthread_mutex_unlock(&mutex);
+			sys_error_printf("capture write failed, stopped");
+			return;
+		}
+		left -= (size_t) w;
+		written += (size_t) w;
+		size_t done = (size_t) w;
+		while (vcnt > 0 && done >= v->iov_len) {
+			done -= v->iov_len;
+			v++;
+			vcnt--;
+		}
+		if (vcnt > 0) {
+			v->iov_base = (char *) v->iov_base + done;
+			v->iov_len -= done;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+static void record(const enum capture_record type, const uint32_t id, const void *data, const size_t n) {
+	if (atomic_load_explicit(&full, memory_order_relaxed))
+		return;
+	struct capture_buffer *b = local != NULL ? local : buffer_register();
+	if (b == NULL)
+		return;
+	pthread_mutex_lock(&b->lock);
+	const uint64_t now = now_ns();
+	uint8_t head[1 + 3 * CAPTURE_VARINT_MAX];
+	size_t head_len = 0;
+	head[head_len++] = (uint8_t) type;
+	head_len += capture_varint_put(head + head_len, id);
+	head_len += capture_varint_put(head + head_len, (now - start_ns) / 1000);
+	if (type == CAPTURE_DATA)
+		head_len += capture_varint_put(head + head_len, n);
+	if (b->len + head_len + n > sizeof(b->data)) {
+		if (head_len + n > sizeof(b->data)) {
+			flush(b, head, head_len, data, n);
+			pthread_mutex_unlock(&b->lock);
+			return;
+		}
+		flush(b, NULL, 0, NULL, 0);
+	}
+	if (b->len == 0)
+		b->first_ns = now;
+	memcpy(b->data + b->len, head, head_len);
+	if (n > 0)
+		memcpy(b->data + b->len + head_len, data, n);
+	b->len += head_len + n;
+	if (now - b->first_ns >= CAPTURE_FLUSH_MS * 1000000ull)
+		flush(b, NULL, 0, NULL, 0);
+	pthread_mutex_unlock(&b->lock);
+}
+
+uint32_t capture_open(void) {
+	if (fd == -1 || atomic_load_explicit(&full, memory_order_relaxed))
+		return 0;
+	if (atomic_fetch_add_explicit(&connections, 1, memory_order_relaxed) % sample != 0)
+		return 0;
+	// ids are dense so replay can index connections by them
+	const uint32_t id = atomic_fetch_add_explicit(&next_id, 1, memory_order_relaxed);
+	record(CAPTURE_OPEN, id, NULL, 0);
+	return id;
+}
+
+void capture_data(const uint32_t id, const void *buf, const size_t n) {
+	record(CAPTURE_DATA, id, buf, n);
+}
+
+void capture_response(const uint32_t id) {
+	record(CAPTURE_RESPONSE, id, NULL, 0);
+}
+
+void capture_close(const uint32_t id) {
+	record(CAPTURE_CLOSE, id, NULL, 0);
+}
+
+void capture_flush(void) {
+	if (fd == -1)
+		return;
+	// buffers are only ever pushed in front, the ones behind the head taken here stay put
+	pthread_mutex_lock(&mutex);
+	struct capture_buffer *head = buffers;
+	pthread_mutex_unlock(&mutex);
+	for (struct capture_buffer *b = head; b != NULL; b = b->next) {
+		pthread_mutex_lock(&b->lock);
+		flush(b, NULL, 0, NULL, 0);
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+void capture_stop(void) {
+	if (fd == -1)
+		return;
+	capture_flush();
+	// a connection closing late records nothing instead of into a freed buffer
+	atomic_store(&full, true);
+	for (struct capture_buffer *b = buffers; b != NULL;) {
+		struct capture_buffer *next = b->next;
+		pthread_mutex_destroy(&b->lock);
+		free(b);
+		b = next;
+	}
+	buffers = NULL;
+	pthread_mutex_lock(&mutex);
+	close(fd);
+	fd = -1;
+	pthread_mutex_unlock(&mutex);
+	lprintf(LOG, "capture closed, %zu bytes", written);
+}
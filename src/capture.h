@@ -0,0 +1,70 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* traffic capture for bench/chinook_replay.c. a sampled connection records what its client sent and when, when
+ * the server started answering it and when it closed. records go into a per-thread buffer and the file gets a
+ * whole buffer per write(), so a captured read costs a memcpy and the rest of the connections nothing
+ *
+ * the file is CAPTURE_MAGIC and then records: a type byte, the connection id and the microseconds since the
+ * capture started as varints, CAPTURE_DATA adds a varint length and the bytes. records are in order per
+ * connection, threads flush their buffers independently so the file as a whole isn't
+ */
+
+#define CAPTURE_MAGIC "CHNKCAP1"
+#define CAPTURE_MAGIC_LEN 8
+#define CAPTURE_BUFFER_BYTES (64 * 1024)
+#define CAPTURE_FLUSH_MS 100 // a thread that keeps capturing doesn't hold records longer than this
+#define CAPTURE_VARINT_MAX 10
+
+enum capture_record {
+	CAPTURE_OPEN = 1,
+	CAPTURE_DATA, // bytes received
+	CAPTURE_RESPONSE, // the server's first write after data, what the client's next data waited for
+	CAPTURE_CLOSE
+};
+
+struct capture_options {
+	const char *path; // NULL captures nothing
+	unsigned int sample; // one in this many connections, 1 is every one
+	size_t max_bytes; // the capture stops once the file is this big, 0 is no limit
+};
+
+// creates path, -1 if it can't
+int capture_start(const struct capture_options *opt);
+// an id for a sampled connection and its open record, 0 for one that isn't captured
+uint32_t capture_open(void);
+void capture_data(uint32_t id, const void *buf, size_t n);
+void capture_response(uint32_t id);
+void capture_close(uint32_t id);
+// writes out every thread's buffer and keeps capturing, for a process that exits with connections still open
+void capture_flush(void);
+// writes out every thread's buffer and closes the file, once the threads that capture are done
+void capture_stop(void);
+
+static inline size_t capture_varint_put(uint8_t *p, uint64_t v) {
+	size_t n = 0;
+	while (v >= 0x80) {
+		p[n++] = (uint8_t) (v | 0x80);
+		v >>= 7;
+	}
+	p[n++] = (uint8_t) v;
+	return n;
+}
+
+// bytes used, 0 if p ends in the middle of one
+static inline size_t capture_varint_get(const uint8_t *p, const size_t len, uint64_t *v) {
+	uint64_t x = 0;
+	for (size_t i = 0; i < len && i < CAPTURE_VARINT_MAX; i++) {
+		x |= (uint64_t) (p[i] & 0x7f) << (7 * i);
+		if ((p[i] & 0x80) == 0) {
+			*v = x;
+			return i + 1;
+		}
+	}
+	return 0;
+}
+
+#endif //CAPTURE_H
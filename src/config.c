@@ -0,0 +1,532 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include "config.h"
+#include "coro.h"
+#include "json_parse.h"
+#include "thread_pool.h"
+
+void config_defaults(struct chinook_config *cfg) {
+	memset(cfg, 0, sizeof(*cfg));
+	snprintf(cfg->addr, sizeof(cfg->addr), "0.0.0.0");
+	cfg->server.addr = cfg->addr;
+	cfg->server.port = 80;
+	cfg->server.protocol = IPV4;
+	cfg->server.special.backlog = 10000;
+	cfg->server.special.listener_shards = 1;
+	cfg->server.workers.pool_size = 1000;
+	cfg->server.workers.queue_size = 10000;
+	cfg->server.workers.io_model = IO_MODEL_THREADS;
+	cfg->server.admission.retry_after_sec = 1;
+	cfg->server.rate_limit.max_clients = 1024 * 1024;
+	cfg->server.rate_limit.ipv4_prefix = 32;
+	cfg->server.rate_limit.ipv6_prefix = 64;
+	cfg->server.http2.enabled = true;
+	cfg->server.http2.max_concurrent_streams = 100;
+	cfg->server.http2.initial_window_size = 65535;
+	cfg->server.websocket.loops = 1;
+	cfg->server.websocket.message_max = 1024 * 1024;
+	cfg->server.websocket.queue_max = 256;
+	cfg->server.websocket.ping_interval_sec = 30;
+	cfg->server.sse.keep_alive_sec = 15;
+	cfg->server.sse.slow_policy = SSE_SLOW_SKIP;
+	cfg->server.capture.sample = 1;
+	cfg->server.tls.session_cache_size = 20480;
+	cfg->server.tls.session_timeout_sec = 300;
+	cfg->server.tls.tickets = true;
+	cfg->server.tls.ktls = true;
+	snprintf(cfg->files_prefix, sizeof(cfg->files_prefix), "/static");
+	cfg->server.files.prefix = cfg->files_prefix;
+	// without TCP_NODELAY a head and a sendfile() body written separately wait out the client's delayed ack
+	socket_profile_named("throughput", &cfg->server.socket);
+	cfg->server.buffers.request_max = REQUEST_MAX_SIZE_BYTES;
+	cfg->server.buffers.size_classes[0] = 1024 * 4;
+	cfg->server.buffers.size_classes[1] = 1024 * 64;
+	cfg->server.buffers.size_classes[2] = REQUEST_MAX_SIZE_BYTES;
+	cfg->server.buffers.nsize_classes = 3;
+	cfg->server.timeouts.recv_sec = 10;
+	cfg->server.timeouts.keep_alive_sec = 60;
+	cfg->server.timeouts.drain_sec = 30;
+	cfg->server.cache.file_bytes = 1024 * 1024 * 64;
+	cfg->server.cache.file_entries = 4096;
+	cfg->log_level = LOG;
+}
+
+// absent keys keep the current value
+static int config_get_size(const json_value *obj, const char *key, size_t *out, const size_t min, const size_t max) {
+	const json_value *v = json_object_get(obj, key);
+	if (v == NULL)
+		return 0;
+	int64_t n;
+	if (json_get_int(v, &n) == -1 || n < 0 || (uint64_t) n < min || (uint64_t) n > max) {
+		lprintf(ERROR, "config: \"%s\" must be an integer in range %zu - %zu", key, min, max);
+		return -1;
+	}
+	*out = (size_t) n;
+	return 0;
+}
+
+static int config_get_uint(const json_value *obj, const char *key, unsigned int *out, const unsigned int min,
+                           const unsigned int max) {
+	size_t tmp = *out;
+	if (config_get_size(obj, key, &tmp, min, max) == -1)
+		return -1;
+	*out = (unsigned int) tmp;
+	return 0;
+}
+
+static int config_get_bool(const json_value *obj, const char *key, bool *out) {
+	const json_value *v = json_object_get(obj, key);
+	if (v == NULL)
+		return 0;
+	if (json_get_bool(v, out) == -1) {
+		lprintf(ERROR, "config: \"%s\" must be true or false", key);
+		return -1;
+	}
+	return 0;
+}
+
+static int config_get_string(const json_value *obj, const char *key, const char **out) {
+	const json_value *v = json_object_get(obj, key);
+	if (v == NULL)
+		return 0;
+	*out = json_get_string(v);
+	if (*out == NULL) {
+		lprintf(ERROR, "config: \"%s\" must be a string", key);
+		return -1;
+	}
+	return 0;
+}
+
+static int config_apply_server(const json_value *server, struct chinook_config *cfg) {
+	if (server == NULL)
+		return 0;
+	struct server_options *opt = &cfg->server;
+	const char *addr = NULL;
+	const char *protocol = NULL;
+	unsigned int port = opt->port;
+	size_t backlog = (size_t) opt->special.backlog;
+	if (config_get_string(server, "address", &addr) == -1 ||
+	    config_get_string(server, "protocol", &protocol) == -1 ||
+	    config_get_uint(server, "port", &port, 1, 65535) == -1 ||
+	    config_get_size(server, "backlog", &backlog, 1, 1 << 20) == -1 ||
+	    config_get_uint(server, "listener-shards", &opt->special.listener_shards, 1, LISTENER_SHARDS_MAX) == -1)
+		return -1;
+	if (addr != NULL) {
+		if (strlen(addr) >= sizeof(cfg->addr)) {
+			lprintf(ERROR, "config: \"address\" too long");
+			return -1;
+		}
+		snprintf(cfg->addr, sizeof(cfg->addr), "%s", addr);
+	}
+	if (protocol != NULL) {
+		if (STR_EQ(protocol, "ipv4")) {
+			opt->protocol = IPV4;
+		} else if (STR_EQ(protocol, "ipv6")) {
+			opt->protocol = IPV6;
+		} else {
+			lprintf(ERROR, "config: unknown protocol \"%s\"", protocol);
+			return -1;
+		}
+	}
+	opt->port = (unsigned short) port;
+	opt->special.backlog = (int) backlog;
+	return 0;
+}
+
+static int config_apply_workers(const json_value *workers, struct server_options *opt) {
+	if (workers == NULL)
+		return 0;
+	const char *io_model = NULL;
+	if (config_get_size(workers, "pool-size", &opt->workers.pool_size, 1, 100000) == -1 ||
+	    config_get_size(workers, "queue-size", &opt->workers.queue_size, 2, 10000000) == -1 ||
+	    config_get_string(workers, "io-model", &io_model) == -1 ||
+	    config_get_bool(workers, "pin", &opt->workers.pin) == -1 ||
+	    config_get_size(workers, "loops", &opt->workers.loops, 0, CORO_LOOPS_MAX) == -1 ||
+	    config_get_size(workers, "stack-size", &opt->workers.stack_size, 0, 64 * 1024 * 1024) == -1)
+		return -1;
+	const size_t stack_min = MAX(THREAD_POOL_STACK_MIN, CORO_STACK_MIN);
+	if (opt->workers.stack_size != 0 && opt->workers.stack_size < stack_min) {
+		lprintf(ERROR, "config: \"stack-size\" must be 0 or at least %zu bytes", stack_min);
+		return -1;
+	}
+	const json_value *cpus = json_object_get(workers, "cpus");
+	const size_t ncpus = json_array_len(cpus);
+	if (ncpus > AFFINITY_CPUS_MAX) {
+		lprintf(ERROR, "config: \"cpus\" can list at most %d cpus", AFFINITY_CPUS_MAX);
+		return -1;
+	}
+	for (size_t i = 0; i < ncpus; i++) {
+		int64_t cpu;
+		if (json_get_int(json_array_get(cpus, i), &cpu) == -1 || cpu < 0 || cpu >= 65536) {
+			lprintf(ERROR, "config: \"cpus\" must be cpu numbers");
+			return -1;
+		}
+		opt->workers.cpus[i] = (int) cpu;
+	}
+	opt->workers.ncpus = ncpus;
+	if (io_model != NULL) {
+		if (STR_EQ(io_model, "threads")) {
+			opt->workers.io_model = IO_MODEL_THREADS;
+		} else if (STR_EQ(io_model, "coroutines")) {
+			opt->workers.io_model = IO_MODEL_COROUTINES;
+		} else {
+			lprintf(ERROR, "config: unknown io-model \"%s\"", io_model);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+// runs after the workers section, the depths are checked against the queue size (open coroutines with those)
+static int config_apply_admission(const json_value *admission, struct server_options *opt) {
+	if (admission == NULL)
+		return 0;
+	const size_t capacity = (opt->workers.io_model == IO_MODEL_COROUTINES
+		                         ? opt->workers.pool_size
+		                         : opt->workers.queue_size) - 1;
+	if (config_get_size(admission, "shed-queue-depth", &opt->admission.shed_queue_depth, 0, capacity) == -1 ||
+	    config_get_size(admission, "pause-queue-depth", &opt->admission.pause_queue_depth, 0, capacity) == -1 ||
+	    config_get_uint(admission, "retry-after", &opt->admission.retry_after_sec, 0, 86400) == -1)
+		return -1;
+	if (opt->admission.shed_queue_depth != 0 && opt->admission.pause_queue_depth != 0 &&
+	    opt->admission.shed_queue_depth >= opt->admission.pause_queue_depth) {
+		lprintf(ERROR, "config: \"shed-queue-depth\" must be below \"pause-queue-depth\"");
+		return -1;
+	}
+	return 0;
+}
+
+static int config_apply_rate_limit(const json_value *rate_limit, struct server_options *opt) {
+	if (rate_limit == NULL)
+		return 0;
+	if (config_get_uint(rate_limit, "requests-per-second", &opt->rate_limit.rate, 0, 1000000) == -1 ||
+	    config_get_uint(rate_limit, "burst", &opt->rate_limit.burst, 0, 1000000) == -1 ||
+	    config_get_size(rate_limit, "max-clients", &opt->rate_limit.max_clients, 1, 1ull << 30) == -1 ||
+	    config_get_uint(rate_limit, "ipv4-prefix", &opt->rate_limit.ipv4_prefix, 0, 32) == -1 ||
+	    config_get_uint(rate_limit, "ipv6-prefix", &opt->rate_limit.ipv6_prefix, 0, 128) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_http2(const json_value *http2, struct server_options *opt) {
+	if (http2 == NULL)
+		return 0;
+	if (config_get_bool(http2, "enabled", &opt->http2.enabled) == -1 ||
+	    config_get_uint(http2, "max-concurrent-streams", &opt->http2.max_concurrent_streams, 1, 100000) == -1 ||
+	    config_get_uint(http2, "initial-window-size", &opt->http2.initial_window_size, 65535, 0x7fffffff) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_websocket(const json_value *websocket, struct server_options *opt) {
+	if (websocket == NULL)
+		return 0;
+	if (config_get_size(websocket, "loops", &opt->websocket.loops, 1, CORO_LOOPS_MAX) == -1 ||
+	    config_get_size(websocket, "message-max", &opt->websocket.message_max, 125, 1ull << 30) == -1 ||
+	    config_get_size(websocket, "queue-max", &opt->websocket.queue_max, 1, 1 << 20) == -1 ||
+	    config_get_uint(websocket, "ping-interval", &opt->websocket.ping_interval_sec, 1, 86400) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_sse(const json_value *sse, struct server_options *opt) {
+	if (sse == NULL)
+		return 0;
+	const char *slow_policy = NULL;
+	if (config_get_uint(sse, "keep-alive", &opt->sse.keep_alive_sec, 1, 3600) == -1 ||
+	    config_get_string(sse, "slow-policy", &slow_policy) == -1)
+		return -1;
+	if (slow_policy != NULL) {
+		if (STR_EQ(slow_policy, "skip")) {
+			opt->sse.slow_policy = SSE_SLOW_SKIP;
+		} else if (STR_EQ(slow_policy, "disconnect")) {
+			opt->sse.slow_policy = SSE_SLOW_DISCONNECT;
+		} else {
+			lprintf(ERROR, "config: unknown slow-policy \"%s\"", slow_policy);
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int config_get_path(const json_value *obj, const char *key, char *out, const size_t outn) {
+	const char *path = NULL;
+	if (config_get_string(obj, key, &path) == -1)
+		return -1;
+	if (path == NULL)
+		return 0;
+	if (strlen(path) >= outn) {
+		lprintf(ERROR, "config: \"%s\" too long", key);
+		return -1;
+	}
+	snprintf(out, outn, "%s", path);
+	return 0;
+}
+
+static int config_apply_tls(const json_value *tls, struct chinook_config *cfg) {
+	if (tls == NULL)
+		return 0;
+	struct tls_options *opt = &cfg->server.tls;
+	if (config_get_bool(tls, "enabled", &opt->enabled) == -1 ||
+	    config_get_path(tls, "certificate", cfg->tls_certificate, sizeof(cfg->tls_certificate)) == -1 ||
+	    config_get_path(tls, "private-key", cfg->tls_private_key, sizeof(cfg->tls_private_key)) == -1 ||
+	    config_get_size(tls, "session-cache-size", &opt->session_cache_size, 0, 10000000) == -1 ||
+	    config_get_uint(tls, "session-timeout", &opt->session_timeout_sec, 1, 86400 * 7) == -1 ||
+	    config_get_bool(tls, "tickets", &opt->tickets) == -1 ||
+	    config_get_bool(tls, "ktls", &opt->ktls) == -1)
+		return -1;
+	if (opt->enabled && (cfg->tls_certificate[0] == '\0' || cfg->tls_private_key[0] == '\0')) {
+		lprintf(ERROR, "config: tls needs \"certificate\" and \"private-key\"");
+		return -1;
+	}
+	return 0;
+}
+
+static int config_apply_files(const json_value *files, struct chinook_config *cfg) {
+	if (files == NULL)
+		return 0;
+	if (config_get_path(files, "root", cfg->files_root, sizeof(cfg->files_root)) == -1 ||
+	    config_get_path(files, "path", cfg->files_prefix, sizeof(cfg->files_prefix)) == -1 ||
+	    config_get_uint(files, "max-age", &cfg->server.files.max_age_sec, 0, 86400 * 365) == -1)
+		return -1;
+	if (cfg->files_prefix[0] != '/') {
+		lprintf(ERROR, "config: files \"path\" has to start with /");
+		return -1;
+	}
+	return 0;
+}
+
+static int config_apply_capture(const json_value *capture, struct chinook_config *cfg) {
+	if (capture == NULL)
+		return 0;
+	if (config_get_path(capture, "path", cfg->capture_path, sizeof(cfg->capture_path)) == -1 ||
+	    config_get_uint(capture, "sample", &cfg->server.capture.sample, 1, 1000000) == -1 ||
+	    config_get_size(capture, "max-bytes", &cfg->server.capture.max_bytes, 0, 1ull << 40) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_proxy_route(const json_value *route, struct proxy_route_options *opt) {
+	const char *balance = NULL;
+	opt->health_interval_sec = 5;
+	opt->idle_per_worker = 16;
+	opt->timeout_sec = 30;
+	if (config_get_path(route, "path", opt->pattern, sizeof(opt->pattern)) == -1 ||
+	    config_get_string(route, "balance", &balance) == -1 ||
+	    config_get_path(route, "health-check", opt->health_path, sizeof(opt->health_path)) == -1 ||
+	    config_get_uint(route, "health-interval", &opt->health_interval_sec, 1, 3600) == -1 ||
+	    config_get_uint(route, "idle-connections", &opt->idle_per_worker, 0, 1024) == -1 ||
+	    config_get_uint(route, "timeout", &opt->timeout_sec, 1, 3600) == -1)
+		return -1;
+	if (opt->pattern[0] != '/') {
+		lprintf(ERROR, "config: proxy routes need a \"path\" starting with /");
+		return -1;
+	}
+	if (balance == NULL || STR_EQ(balance, "round-robin")) {
+		opt->balance = PROXY_ROUND_ROBIN;
+	} else if (STR_EQ(balance, "least-connections")) {
+		opt->balance = PROXY_LEAST_CONNECTIONS;
+	} else {
+		lprintf(ERROR, "config: \"balance\" must be \"round-robin\" or \"least-connections\"");
+		return -1;
+	}
+	const json_value *upstreams = json_object_get(route, "upstreams");
+	const size_t n = json_array_len(upstreams);
+	if (n == 0 || n > PROXY_UPSTREAMS_MAX) {
+		lprintf(ERROR, "config: \"upstreams\" must be an array of 1 - %d addresses", PROXY_UPSTREAMS_MAX);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		const char *addr = json_get_string(json_array_get(upstreams, i));
+		if (addr == NULL || strlen(addr) >= PROXY_ADDRESS_MAX) {
+			lprintf(ERROR, "config: upstreams must be strings shorter than %d bytes", PROXY_ADDRESS_MAX);
+			return -1;
+		}
+		snprintf(opt->upstreams[i], sizeof(opt->upstreams[i]), "%s", addr);
+	}
+	opt->nupstreams = n;
+	return 0;
+}
+
+static int config_apply_proxy(const json_value *proxy, struct server_options *opt) {
+	if (proxy == NULL)
+		return 0;
+	const size_t n = json_array_len(proxy);
+	if (n > PROXY_ROUTES_MAX) {
+		lprintf(ERROR, "config: \"proxy\" must be an array of at most %d routes", PROXY_ROUTES_MAX);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		if (config_apply_proxy_route(json_array_get(proxy, i), &opt->proxy.routes[i]) == -1)
+			return -1;
+	}
+	opt->proxy.nroutes = n;
+	return 0;
+}
+
+static int config_apply_buffers(const json_value *buffers, struct server_options *opt) {
+	if (buffers == NULL)
+		return 0;
+	if (config_get_size(buffers, "request-max", &opt->buffers.request_max, 1024, REQUEST_MAX_SIZE_BYTES) == -1)
+		return -1;
+	const json_value *classes = json_object_get(buffers, "size-classes");
+	if (classes == NULL)
+		return 0;
+	const size_t n = json_array_len(classes);
+	if (n == 0 || n > BUFFER_SIZE_CLASSES_MAX) {
+		lprintf(ERROR, "config: \"size-classes\" must be an array of 1 - %d sizes", BUFFER_SIZE_CLASSES_MAX);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		int64_t size;
+		if (json_get_int(json_array_get(classes, i), &size) == -1 || size < 256 ||
+		    (i > 0 && (size_t) size <= opt->buffers.size_classes[i - 1])) {
+			lprintf(ERROR, "config: \"size-classes\" must be ascending sizes of at least 256 bytes");
+			return -1;
+		}
+		opt->buffers.size_classes[i] = (size_t) size;
+	}
+	opt->buffers.nsize_classes = n;
+	return 0;
+}
+
+// a named profile first, the other keys override single options of it
+static int config_apply_socket(const json_value *socket, struct server_options *opt) {
+	if (socket == NULL)
+		return 0;
+	const char *profile = NULL;
+	if (config_get_string(socket, "profile", &profile) == -1)
+		return -1;
+	if (profile != NULL && socket_profile_named(profile, &opt->socket) == -1) {
+		lprintf(ERROR, "config: unknown socket profile \"%s\"", profile);
+		return -1;
+	}
+	struct socket_profile *p = &opt->socket;
+	if (config_get_bool(socket, "nodelay", &p->nodelay) == -1 ||
+	    config_get_uint(socket, "defer-accept", &p->defer_accept_sec, 0, 3600) == -1 ||
+	    config_get_uint(socket, "fastopen", &p->fastopen_queue, 0, 1 << 20) == -1 ||
+	    config_get_bool(socket, "cork", &p->cork) == -1 ||
+	    config_get_uint(socket, "send-buffer", &p->send_buffer, 0, 1 << 30) == -1 ||
+	    config_get_uint(socket, "receive-buffer", &p->receive_buffer, 0, 1 << 30) == -1 ||
+	    config_get_uint(socket, "busy-poll", &p->busy_poll_us, 0, 1000000) == -1 ||
+	    config_get_uint(socket, "notsent-lowat", &p->notsent_lowat, 0, 1 << 30) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_timeouts(const json_value *timeouts, struct server_options *opt) {
+	if (timeouts == NULL)
+		return 0;
+	if (config_get_uint(timeouts, "recv", &opt->timeouts.recv_sec, 1, 3600) == -1 ||
+	    config_get_uint(timeouts, "keep-alive", &opt->timeouts.keep_alive_sec, 1, 3600) == -1 ||
+	    config_get_uint(timeouts, "drain", &opt->timeouts.drain_sec, 0, 3600) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_cache(const json_value *cache, struct server_options *opt) {
+	if (cache == NULL)
+		return 0;
+	if (config_get_size(cache, "file-bytes", &opt->cache.file_bytes, 0, (size_t) 1 << 40) == -1 ||
+	    config_get_size(cache, "file-entries", &opt->cache.file_entries, 0, 10000000) == -1)
+		return -1;
+	return 0;
+}
+
+static int config_apply_log(const json_value *log, struct chinook_config *cfg) {
+	if (log == NULL)
+		return 0;
+	const char *level = NULL;
+	if (config_get_string(log, "level", &level) == -1)
+		return -1;
+	if (level != NULL && log_level_from_str(level, &cfg->log_level) == -1) {
+		lprintf(ERROR, "config: unknown log level \"%s\"", level);
+		return -1;
+	}
+	return 0;
+}
+
+static char *config_read_file(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		if (errno != ENOENT)
+			sys_error_printf("fopen failed");
+		return NULL;
+	}
+	char *buf = malloc(CONFIG_FILE_MAX_SIZE_BYTES);
+	if (buf == NULL) {
+		sys_error_printf("malloc failed");
+		fclose(fp);
+		return NULL;
+	}
+	const size_t len = fread(buf, 1, CONFIG_FILE_MAX_SIZE_BYTES - 1, fp);
+	if (ferror(fp)) {
+		sys_error_printf("fread failed");
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+	if (!feof(fp)) {
+		lprintf(ERROR, "config file larger than %d bytes", CONFIG_FILE_MAX_SIZE_BYTES);
+		fclose(fp);
+		free(buf);
+		errno = EFBIG;
+		return NULL;
+	}
+	buf[len] = '\0';
+	if (fclose(fp) == EOF) {
+		sys_error_printf("fclose failed");
+	}
+	return buf;
+}
+
+int config_load(const char *path, struct chinook_config *cfg) {
+	if (path == NULL || cfg == NULL) {
+		lprintf(ERROR, "null ptr arg");
+		return -1;
+	}
+	char *text = config_read_file(path);
+	if (text == NULL) {
+		if (errno == ENOENT) {
+			lprintf(LOG, "no config at %s, using defaults", path);
+			return 0;
+		}
+		return -1;
+	}
+	json_value *root = json_parse(text);
+	free(text);
+	if (root == NULL) {
+		lprintf(ERROR, "config: %s is not valid json", path);
+		return -1;
+	}
+	int retval = 0;
+	if (config_apply_server(json_object_get(root, "server"), cfg) == -1 ||
+	    config_apply_workers(json_object_get(root, "workers"), &cfg->server) == -1 ||
+	    config_apply_admission(json_object_get(root, "admission"), &cfg->server) == -1 ||
+	    config_apply_rate_limit(json_object_get(root, "rate-limit"), &cfg->server) == -1 ||
+	    config_apply_http2(json_object_get(root, "http2"), &cfg->server) == -1 ||
+	    config_apply_websocket(json_object_get(root, "websocket"), &cfg->server) == -1 ||
+	    config_apply_sse(json_object_get(root, "sse"), &cfg->server) == -1 ||
+	    config_apply_tls(json_object_get(root, "tls"), cfg) == -1 ||
+	    config_apply_files(json_object_get(root, "files"), cfg) == -1 ||
+	    config_apply_capture(json_object_get(root, "capture"), cfg) == -1 ||
+	    config_apply_proxy(json_object_get(root, "proxy"), &cfg->server) == -1 ||
+	    config_apply_socket(json_object_get(root, "socket"), &cfg->server) == -1 ||
+	    config_apply_buffers(json_object_get(root, "buffers"), &cfg->server) == -1 ||
+	    config_apply_timeouts(json_object_get(root, "timeouts"), &cfg->server) == -1 ||
+	    config_apply_cache(json_object_get(root, "cache"), &cfg->server) == -1 ||
+	    config_apply_log(json_object_get(root, "log"), cfg) == -1) {
+		retval = -1;
+	}
+	json_free(root);
+	cfg->server.addr = cfg->addr;
+	cfg->server.tls.certificate = cfg->tls_certificate[0] ? cfg->tls_certificate : NULL;
+	cfg->server.tls.private_key = cfg->tls_private_key[0] ? cfg->tls_private_key : NULL;
+	cfg->server.files.root = cfg->files_root[0] ? cfg->files_root : NULL;
+	cfg->server.files.prefix = cfg->files_prefix;
+	cfg->server.capture.path = cfg->capture_path[0] ? cfg->capture_path : NULL;
+	return retval;
+}
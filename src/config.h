@@ -0,0 +1,26 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "server.h"
+#include "log.h"
+
+#define CONFIG_FILE_NAME "chinook_config.json"
+#define CONFIG_FILE_MAX_SIZE_BYTES (1000 * 64) // 64kb
+#define CONFIG_PATH_MAX 1024
+
+struct chinook_config {
+	struct server_options server;
+	enum LogLevel log_level;
+	char addr[64]; // server.addr points here
+	char tls_certificate[CONFIG_PATH_MAX]; // server.tls.certificate points here once set
+	char tls_private_key[CONFIG_PATH_MAX];
+	char files_root[CONFIG_PATH_MAX]; // server.files.root points here once set
+	char files_prefix[FILES_PATH_MAX];
+	char capture_path[CONFIG_PATH_MAX]; // server.capture.path points here once set
+};
+
+void config_defaults(struct chinook_config *cfg);
+// missing file keeps the defaults, a malformed file or out of range value is an error
+int config_load(const char *path, struct chinook_config *cfg);
+
+#endif //CONFIG_H
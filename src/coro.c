@@ -0,0 +1,683 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+
+#include "coro.h"
+#include "affinity.h"
+#include "log.h"
+
+#define CORO_EVENTS_MAX 256
+#define CORO_CACHE_LINE 128
+
+#if defined(__x86_64__) || defined(__aarch64__)
+#define CORO_HAVE_SWITCH 1
+#endif
+
+struct coro {
+	void *sp; // saved stack pointer while switched out
+	struct coro_loop *loop;
+	struct coro *next; // ready queue or the loop's cached stacks
+	void (*fn)(void *);
+	char *map; // guard page first, this struct at the very top
+	size_t map_size;
+	uint64_t deadline_ns; // 0 without a timer
+	size_t timer_index;
+	unsigned int woke; // events that ended the wait, 0 is the timer running out
+	bool waiting;
+	bool done;
+	alignas(16) unsigned char arg[CORO_ARG_MAX];
+};
+
+struct inbox_item {
+	void (*fn)(void *);
+	alignas(16) unsigned char arg[CORO_ARG_MAX];
+};
+
+struct coro_loop {
+	alignas(CORO_CACHE_LINE) struct coro_loops *group;
+	pthread_t thread;
+	poller_t *poller;
+	int wake_fds[2];
+	void *sp; // the loop's own stack pointer while a coroutine runs
+	struct coro *current;
+	struct coro *ready_head;
+	struct coro *ready_tail;
+	struct coro **timers; // min heap on deadline_ns
+	size_t ntimers;
+	size_t timers_cap;
+	struct coro *cached; // stacks of finished coroutines
+	size_t ncached;
+	_Atomic size_t live;
+	_Atomic size_t stacks;
+	_Atomic uint64_t switches;
+	pthread_mutex_t inbox_mutex;
+	struct inbox_item *inbox;
+	size_t inbox_head;
+	size_t inbox_len;
+};
+
+struct coro_loops {
+	size_t map_size;
+	size_t stacks_cached;
+	atomic_bool stopping;
+	_Atomic size_t next;
+	size_t n;
+	struct coro_loop loops[];
+};
+
+static thread_local struct coro_loop *current_loop;
+
+static uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+#ifdef CORO_HAVE_SWITCH
+
+// saves the callee saved registers on the running stack and its pointer in *from, then continues on to, which
+// was left the same way. fpu control words aren't switched, nothing here changes rounding modes
+void coro_switch(void **from, void *to);
+
+#ifdef __APPLE__
+#define CORO_SYM(name) "_" #name
+#else
+#define CORO_SYM(name) #name
+#endif
+
+#if defined(__x86_64__)
+__asm__(
+	".text\n"
+	".globl " CORO_SYM(coro_switch) "\n"
+	".p2align 4\n"
+	CORO_SYM(coro_switch) ":\n"
+	"	pushq %rbp\n"
+	"	pushq %rbx\n"
+	"	pushq %r12\n"
+	"	pushq %r13\n"
+	"	pushq %r14\n"
+	"	pushq %r15\n"
+	"	movq %rsp, (%rdi)\n"
+	"	movq %rsi, %rsp\n"
+	"	popq %r15\n"
+	"	popq %r14\n"
+	"	popq %r13\n"
+	"	popq %r12\n"
+	"	popq %rbx\n"
+	"	popq %rbp\n"
+	"	ret\n"
+);
+#define CORO_FRAME_WORDS 6
+#elif defined(__aarch64__)
+__asm__(
+	".text\n"
+	".globl " CORO_SYM(coro_switch) "\n"
+	".p2align 2\n"
+	CORO_SYM(coro_switch) ":\n"
+	"	sub sp, sp, #160\n"
+	"	stp x19, x20, [sp, #0]\n"
+	"	stp x21, x22, [sp, #16]\n"
+	"	stp x23, x24, [sp, #32]\n"
+	"	stp x25, x26, [sp, #48]\n"
+	"	stp x27, x28, [sp, #64]\n"
+	"	stp x29, x30, [sp, #80]\n"
+	"	stp d8, d9, [sp, #96]\n"
+	"	stp d10, d11, [sp, #112]\n"
+	"	stp d12, d13, [sp, #128]\n"
+	"	stp d14, d15, [sp, #144]\n"
+	"	mov x9, sp\n"
+	"	str x9, [x0]\n"
+	"	mov sp, x1\n"
+	"	ldp x19, x20, [sp, #0]\n"
+	"	ldp x21, x22, [sp, #16]\n"
+	"	ldp x23, x24, [sp, #32]\n"
+	"	ldp x25, x26, [sp, #48]\n"
+	"	ldp x27, x28, [sp, #64]\n"
+	"	ldp x29, x30, [sp, #80]\n"
+	"	ldp d8, d9, [sp, #96]\n"
+	"	ldp d10, d11, [sp, #112]\n"
+	"	ldp d12, d13, [sp, #128]\n"
+	"	ldp d14, d15, [sp, #144]\n"
+	"	add sp, sp, #160\n"
+	"	ret\n"
+);
+#define CORO_FRAME_WORDS 20
+#endif
+
+static void coro_trampoline(void) {
+	struct coro_loop *l = current_loop;
+	struct coro *c = l->current;
+	c->fn(c->arg);
+	c->done = true;
+	coro_switch(&c->sp, l->sp);
+	// a finished coroutine is never switched to again
+	abort();
+}
+
+// the first switch to c "returns" into coro_trampoline with an aligned stack and zeroed registers
+static void coro_prepare(struct coro *c) {
+	void **sp = (void **) ((uintptr_t) c & ~(uintptr_t) 15);
+#if defined(__x86_64__)
+	// rsp is 8 off 16 byte alignment on entry, like after a call, with a null return address
+	*--sp = NULL;
+	*--sp = (void *) coro_trampoline;
+	for (int i = 0; i < CORO_FRAME_WORDS; i++)
+		*--sp = NULL;
+#elif defined(__aarch64__)
+	sp -= CORO_FRAME_WORDS;
+	memset(sp, 0, CORO_FRAME_WORDS * sizeof(void *));
+	sp[11] = (void *) coro_trampoline; // x30, ret jumps there
+#endif
+	c->sp = sp;
+}
+
+#endif
+
+static struct coro *stack_take(struct coro_loop *l) {
+	if (l->cached != NULL) {
+		struct coro *c = l->cached;
+		l->cached = c->next;
+		l->ncached--;
+		return c;
+	}
+	const size_t map_size = l->group->map_size;
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (map == MAP_FAILED) {
+		sys_error_printf("mmap failed");
+		return NULL;
+	}
+	// an overflow faults on the guard page instead of running into the neighbouring mapping
+	if (mprotect(map, (size_t) sysconf(_SC_PAGESIZE), PROT_NONE) == -1) {
+		sys_error_printf("mprotect failed");
+		munmap(map, map_size);
+		return NULL;
+	}
+	struct coro *c = (struct coro *) (map + map_size - sizeof(struct coro));
+	c->map = map;
+	c->map_size = map_size;
+	c->loop = l;
+	atomic_fetch_add_explicit(&l->stacks, 1, memory_order_relaxed);
+	return c;
+}
+
+static void stack_put(struct coro_loop *l, struct coro *c) {
+	if (l->ncached < l->group->stacks_cached) {
+		c->next = l->cached;
+		l->cached = c;
+		l->ncached++;
+		return;
+	}
+	munmap(c->map, c->map_size);
+	atomic_fetch_sub_explicit(&l->stacks, 1, memory_order_relaxed);
+}
+
+static void ready_push(struct coro_loop *l, struct coro *c) {
+	c->next = NULL;
+	if (l->ready_tail != NULL)
+		l->ready_tail->next = c;
+	else
+		l->ready_head = c;
+	l->ready_tail = c;
+}
+
+static void timer_swap(struct coro_loop *l, const size_t a, const size_t b) {
+	struct coro *t = l->timers[a];
+	l->timers[a] = l->timers[b];
+	l->timers[b] = t;
+	l->timers[a]->timer_index = a;
+	l->timers[b]->timer_index = b;
+}
+
+static void timer_up(struct coro_loop *l, size_t i) {
+	while (i > 0 && l->timers[(i - 1) / 2]->deadline_ns > l->timers[i]->deadline_ns) {
+		timer_swap(l, i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void timer_down(struct coro_loop *l, size_t i) {
+	while (1) {
+		size_t min = i;
+		const size_t left = 2 * i + 1;
+		if (left < l->ntimers && l->timers[left]->deadline_ns < l->timers[min]->deadline_ns)
+			min = left;
+		if (left + 1 < l->ntimers && l->timers[left + 1]->deadline_ns < l->timers[min]->deadline_ns)
+			min = left + 1;
+		if (min == i)
+			return;
+		timer_swap(l, i, min);
+		i = min;
+	}
+}
+
+static int timer_add(struct coro_loop *l, struct coro *c, const uint64_t deadline_ns) {
+	if (l->ntimers == l->timers_cap) {
+		const size_t cap = l->timers_cap ? l->timers_cap * 2 : 64;
+		struct coro **timers = realloc(l->timers, sizeof(*timers) * cap);
+		if (timers == NULL) {
+			sys_error_printf("realloc failed");
+			return -1;
+		}
+		l->timers = timers;
+		l->timers_cap = cap;
+	}
+	c->deadline_ns = deadline_ns;
+	c->timer_index = l->ntimers;
+	l->timers[l->ntimers++] = c;
+	timer_up(l, c->timer_index);
+	return 0;
+}
+
+static void timer_remove(struct coro_loop *l, struct coro *c) {
+	if (c->deadline_ns == 0)
+		return;
+	const size_t i = c->timer_index;
+	c->deadline_ns = 0;
+	if (i != --l->ntimers) {
+		l->timers[i] = l->timers[l->ntimers];
+		l->timers[i]->timer_index = i;
+		timer_down(l, i);
+		timer_up(l, i);
+	}
+}
+
+// until the nearest deadline, rounded up so the wait doesn't end a moment early and spin
+static int timer_timeout_ms(const struct coro_loop *l) {
+	if (l->ntimers == 0)
+		return -1;
+	const uint64_t now = now_ns();
+	const uint64_t deadline = l->timers[0]->deadline_ns;
+	if (deadline <= now)
+		return 0;
+	return (int) ((deadline - now + 999999) / 1000000);
+}
+
+static void wake(struct coro_loop *l, struct coro *c, const unsigned int events) {
+	if (!c->waiting)
+		return;
+	c->waiting = false;
+	c->woke = events;
+	timer_remove(l, c);
+	ready_push(l, c);
+}
+
+static void expire_timers(struct coro_loop *l) {
+	const uint64_t now = now_ns();
+	while (l->ntimers > 0 && l->timers[0]->deadline_ns <= now)
+		wake(l, l->timers[0], 0);
+}
+
+#ifdef CORO_HAVE_SWITCH
+
+static void resume(struct coro_loop *l, struct coro *c) {
+	l->current = c;
+	atomic_fetch_add_explicit(&l->switches, 1, memory_order_relaxed);
+	coro_switch(&l->sp, c->sp);
+	l->current = NULL;
+	if (c->done) {
+		stack_put(l, c);
+		atomic_fetch_sub_explicit(&l->live, 1, memory_order_relaxed);
+	}
+}
+
+static void park(struct coro *c) {
+	coro_switch(&c->sp, c->loop->sp);
+}
+
+static void spawn(struct coro_loop *l, const struct inbox_item *it) {
+	struct coro *c = stack_take(l);
+	if (c == NULL) {
+		// the connection it carried is lost, only the loop's memory is at fault
+		lprintf(ERROR, "no stack for a coroutine");
+		return;
+	}
+	c->fn = it->fn;
+	memcpy(c->arg, it->arg, CORO_ARG_MAX);
+	c->deadline_ns = 0;
+	c->waiting = false;
+	c->done = false;
+	coro_prepare(c);
+	atomic_fetch_add_explicit(&l->live, 1, memory_order_relaxed);
+	ready_push(l, c);
+}
+
+// one at a time, so the accept thread never waits on a stack being mapped
+static void take_submitted(struct coro_loop *l) {
+	char drain[64];
+	while (read(l->wake_fds[0], drain, sizeof(drain)) > 0) {
+	}
+	while (1) {
+		struct inbox_item it;
+		pthread_mutex_lock(&l->inbox_mutex);
+		if (l->inbox_len == 0) {
+			pthread_mutex_unlock(&l->inbox_mutex);
+			return;
+		}
+		it = l->inbox[l->inbox_head];
+		l->inbox_head = (l->inbox_head + 1) % CORO_INBOX_SIZE;
+		l->inbox_len--;
+		pthread_mutex_unlock(&l->inbox_mutex);
+		spawn(l, &it);
+	}
+}
+
+// only the coroutines ready when it starts, one that keeps yielding can't starve the poller
+static void run_ready(struct coro_loop *l) {
+	struct coro *c = l->ready_head;
+	l->ready_head = NULL;
+	l->ready_tail = NULL;
+	while (c != NULL) {
+		struct coro *next = c->next;
+		resume(l, c);
+		c = next;
+	}
+}
+
+static void *loop_main(void *vl) {
+	struct coro_loop *l = vl;
+	current_loop = l;
+	struct poller_event events[CORO_EVENTS_MAX];
+	while (1) {
+		run_ready(l);
+		if (atomic_load(&l->group->stopping) && atomic_load_explicit(&l->live, memory_order_relaxed) == 0)
+			break;
+		const int timeout = l->ready_head != NULL ? 0 : timer_timeout_ms(l);
+		const int n = poller_wait(l->poller, events, CORO_EVENTS_MAX, timeout);
+		if (n == -1) {
+			lprintf(CRITICAL_ERROR, "event loop stopped, its connections are stuck");
+			break;
+		}
+		for (int i = 0; i < n; i++) {
+			if (events[i].data == NULL)
+				take_submitted(l);
+			else
+				wake(l, events[i].data, events[i].events);
+		}
+		expire_timers(l);
+	}
+	current_loop = NULL;
+	return NULL;
+}
+
+#endif
+
+static int loop_init(struct coro_loop *l, coro_loops_t *g) {
+	l->group = g;
+	l->wake_fds[0] = -1;
+	l->wake_fds[1] = -1;
+	pthread_mutex_init(&l->inbox_mutex, NULL);
+	l->inbox = malloc(sizeof(*l->inbox) * CORO_INBOX_SIZE);
+	if (l->inbox == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	l->poller = poller_create();
+	if (l->poller == NULL)
+		return -1;
+	if (pipe(l->wake_fds) == -1) {
+		sys_error_printf("pipe failed");
+		l->wake_fds[0] = -1;
+		return -1;
+	}
+	for (int i = 0; i < 2; i++) {
+		if (fcntl(l->wake_fds[i], F_SETFL, O_NONBLOCK) == -1 || fcntl(l->wake_fds[i], F_SETFD, FD_CLOEXEC) == -1) {
+			sys_error_printf("fcntl failed");
+			return -1;
+		}
+	}
+	// the only registration without a coroutine behind it
+	return poller_add(l->poller, l->wake_fds[0], POLLER_READ, NULL);
+}
+
+static void loop_free(struct coro_loop *l) {
+	while (l->cached != NULL) {
+		struct coro *c = l->cached;
+		l->cached = c->next;
+		munmap(c->map, c->map_size);
+	}
+	free(l->timers);
+	free(l->inbox);
+	poller_destroy(l->poller);
+	if (l->wake_fds[0] != -1) {
+		close(l->wake_fds[0]);
+		close(l->wake_fds[1]);
+	}
+	pthread_mutex_destroy(&l->inbox_mutex);
+}
+
+coro_loops_t *coro_loops_create(const size_t nloops, const struct coro_attr *attr) {
+#ifndef CORO_HAVE_SWITCH
+	(void) nloops;
+	(void) attr;
+	lprintf(ERROR, "coroutines aren't supported on this architecture");
+	return NULL;
+#else
+	// the loops are cache line aligned, so the group is too
+	const size_t size = (sizeof(coro_loops_t) + sizeof(struct coro_loop) * nloops + CORO_CACHE_LINE - 1) /
+	                    CORO_CACHE_LINE * CORO_CACHE_LINE;
+	coro_loops_t *g = aligned_alloc(CORO_CACHE_LINE, size);
+	if (g == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		return NULL;
+	}
+	memset(g, 0, size);
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t stack = attr->stack_size ? attr->stack_size : CORO_STACK_DEFAULT;
+	if (stack < CORO_STACK_MIN)
+		stack = CORO_STACK_MIN;
+	g->map_size = page + (stack + sizeof(struct coro) + page - 1) / page * page;
+	g->stacks_cached = attr->stacks_cached;
+	atomic_init(&g->stopping, false);
+	atomic_init(&g->next, 0);
+	size_t started = 0;
+	for (size_t i = 0; i < nloops; i++) {
+		// counted first, loop_free() copes with a half initialised loop
+		g->n++;
+		if (loop_init(&g->loops[i], g) == -1)
+			goto error_cleanup;
+	}
+	for (; started < nloops; started++) {
+		pthread_attr_t thread_attr;
+		pthread_attr_init(&thread_attr);
+		if (attr->ncpus > 0)
+			affinity_attr_set(&thread_attr, attr->cpus[started % attr->ncpus]);
+		const int stat = pthread_create(&g->loops[started].thread, &thread_attr, loop_main, &g->loops[started]);
+		pthread_attr_destroy(&thread_attr);
+		if (stat != 0) {
+			errno = stat;
+			sys_error_printf("pthread_create failed");
+			goto error_cleanup;
+		}
+	}
+	return g;
+error_cleanup:
+	atomic_store(&g->stopping, true);
+	for (size_t i = 0; i < started; i++) {
+		write(g->loops[i].wake_fds[1], "", 1);
+		pthread_join(g->loops[i].thread, NULL);
+	}
+	for (size_t i = 0; i < g->n; i++)
+		loop_free(&g->loops[i]);
+	free(g);
+	return NULL;
+#endif
+}
+
+int coro_submit(coro_loops_t *g, void (*fn)(void *), const void *arg, const size_t argn) {
+	return coro_submit_to(g, atomic_fetch_add_explicit(&g->next, 1, memory_order_relaxed) % g->n, fn, arg, argn);
+}
+
+int coro_submit_to(coro_loops_t *g, const size_t i, void (*fn)(void *), const void *arg, const size_t argn) {
+	if (argn > CORO_ARG_MAX) {
+		lprintf(ERROR, "coroutine argument of %zu bytes, at most %d fit", argn, CORO_ARG_MAX);
+		return -1;
+	}
+	struct coro_loop *l = &g->loops[i];
+	pthread_mutex_lock(&l->inbox_mutex);
+	if (l->inbox_len == CORO_INBOX_SIZE) {
+		pthread_mutex_unlock(&l->inbox_mutex);
+		return -1;
+	}
+	struct inbox_item *it = &l->inbox[(l->inbox_head + l->inbox_len) % CORO_INBOX_SIZE];
+	it->fn = fn;
+	if (argn > 0)
+		memcpy(it->arg, arg, argn);
+	// a non-empty inbox was signalled already and the loop hasn't emptied it yet
+	const bool signal = l->inbox_len++ == 0;
+	pthread_mutex_unlock(&l->inbox_mutex);
+	if (signal && write(l->wake_fds[1], "", 1) == -1 && errno != EAGAIN)
+		sys_error_printf("write failed");
+	return 0;
+}
+
+size_t coro_loops_live(coro_loops_t *g) {
+	size_t live = 0;
+	for (size_t i = 0; i < g->n; i++)
+		live += atomic_load_explicit(&g->loops[i].live, memory_order_relaxed);
+	return live;
+}
+
+void coro_loops_stats(coro_loops_t *g, struct coro_stats *st) {
+	*st = (struct coro_stats) {.loops = g->n};
+	for (size_t i = 0; i < g->n; i++) {
+		st->live += atomic_load_explicit(&g->loops[i].live, memory_order_relaxed);
+		st->stacks += atomic_load_explicit(&g->loops[i].stacks, memory_order_relaxed);
+		st->switches += atomic_load_explicit(&g->loops[i].switches, memory_order_relaxed);
+	}
+	st->stack_bytes = st->stacks * g->map_size;
+}
+
+void coro_loops_destroy(coro_loops_t *g) {
+	if (g == NULL)
+		return;
+	atomic_store(&g->stopping, true);
+	for (size_t i = 0; i < g->n; i++) {
+		write(g->loops[i].wake_fds[1], "", 1);
+		pthread_join(g->loops[i].thread, NULL);
+		loop_free(&g->loops[i]);
+	}
+	free(g);
+}
+
+bool co_running(void) {
+	return current_loop != NULL && current_loop->current != NULL;
+}
+
+struct coro *co_self(void) {
+	return current_loop != NULL ? current_loop->current : NULL;
+}
+
+size_t co_loop_index(void) {
+	return current_loop != NULL ? (size_t) (current_loop - current_loop->group->loops) : 0;
+}
+
+void co_wake(struct coro *c) {
+	// any events but 0, which co_wait() takes for its timer running out
+	wake(c->loop, c, POLLER_READ | POLLER_WRITE);
+}
+
+int co_wait(const int fd, const unsigned int events, const int timeout_ms) {
+	struct coro_loop *l = current_loop;
+	struct coro *c = l != NULL ? l->current : NULL;
+	if (c == NULL) {
+		struct pollfd pfd = {
+			.fd = fd, .events = (short) ((events & POLLER_READ ? POLLIN : 0) | (events & POLLER_WRITE ? POLLOUT : 0))
+		};
+		const int ready = poll(&pfd, 1, timeout_ms > 0 ? timeout_ms : -1);
+		if (ready == 0)
+			errno = ETIMEDOUT;
+		return ready > 0 ? 0 : -1;
+	}
+#ifdef CORO_HAVE_SWITCH
+	// registered for this wait only, an fd left registered could wake whoever has it next
+	if (poller_add(l->poller, fd, events, c) == -1)
+		return -1;
+	if (timeout_ms > 0 && timer_add(l, c, now_ns() + (uint64_t) timeout_ms * 1000000) == -1) {
+		poller_del(l->poller, fd);
+		return -1;
+	}
+	c->waiting = true;
+	park(c);
+	poller_del(l->poller, fd);
+	if (c->woke == 0) {
+		errno = ETIMEDOUT;
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+ssize_t co_recv(const int fd, void *buf, const size_t n, const int timeout_ms) {
+	while (1) {
+		const ssize_t got = recv(fd, buf, n, 0);
+		// on a blocking fd EAGAIN is its own receive timeout
+		if (got != -1 || (errno != EAGAIN && errno != EWOULDBLOCK) || !co_running())
+			return got;
+		if (co_wait(fd, POLLER_READ, timeout_ms) == -1) {
+			if (errno == ETIMEDOUT)
+				errno = EAGAIN;
+			return -1;
+		}
+	}
+}
+
+ssize_t co_send(const int fd, const void *buf, const size_t n, const int timeout_ms) {
+	size_t sent = 0;
+	while (sent < n) {
+		const ssize_t m = send(fd, (const char *) buf + sent, n - sent, 0);
+		if (m >= 0) {
+			sent += (size_t) m;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_running())
+			return -1;
+		if (co_wait(fd, POLLER_WRITE, timeout_ms) == -1) {
+			if (errno == ETIMEDOUT)
+				errno = EAGAIN;
+			return -1;
+		}
+	}
+	return (ssize_t) n;
+}
+
+void co_sleep(const unsigned int ms) {
+	struct coro_loop *l = current_loop;
+	struct coro *c = l != NULL ? l->current : NULL;
+	if (c == NULL || ms == 0 || timer_add(l, c, now_ns() + (uint64_t) ms * 1000000) == -1) {
+		const struct timespec t = {.tv_sec = ms / 1000, .tv_nsec = (long) (ms % 1000) * 1000000};
+		nanosleep(&t, NULL);
+		return;
+	}
+#ifdef CORO_HAVE_SWITCH
+	c->waiting = true;
+	park(c);
+#endif
+}
+
+void co_yield(void) {
+	struct coro_loop *l = current_loop;
+	struct coro *c = l != NULL ? l->current : NULL;
+	if (c == NULL) {
+		sched_yield();
+		return;
+	}
+#ifdef CORO_HAVE_SWITCH
+	ready_push(l, c);
+	park(c);
+#endif
+}
@@ -0,0 +1,71 @@
+#ifndef CORO_H
+#define CORO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "poller.h"
+
+/* stackful coroutines on a few event loop threads. a coroutine is straight-line code like a pool thread's,
+ * but where a socket would block it parks on its loop's poller and the loop runs another one. the stacks are
+ * small mmap()ed regions with a guard page below, only the pages a coroutine touches are ever resident, and
+ * finished ones are kept for the next coroutine. the context switch saves the callee saved registers on
+ * the stack and swaps stack pointers (x86_64 and aarch64), a coroutine never moves to another thread
+ */
+
+#define CORO_ARG_MAX 192 // bytes of argument copied into a coroutine
+#define CORO_STACK_DEFAULT (128 * 1024) // tls handshakes and the userspace record buffer need about half
+#define CORO_STACK_MIN (64 * 1024) // smaller ones are raised, tls writes and proxy copies use 16kb of stack
+#define CORO_INBOX_SIZE 1024 // per loop, submitted coroutines the loop hasn't picked up yet
+#define CORO_LOOPS_MAX 256
+
+struct coro_attr {
+	size_t stack_size; // usable bytes, rounded up to pages, 0 is CORO_STACK_DEFAULT
+	size_t stacks_cached; // per loop, stacks kept for reuse after their coroutine finished
+	const int *cpus; // loop i is pinned to cpus[i % ncpus], NULL pins nothing
+	size_t ncpus;
+};
+
+struct coro_stats {
+	size_t loops;
+	size_t live; // running, ready or waiting
+	size_t stacks; // mapped, live ones and cached ones
+	size_t stack_bytes; // mapped for those, guard pages included
+	uint64_t switches; // into a coroutine, over all loops
+};
+
+typedef struct coro_loops coro_loops_t;
+struct coro;
+
+// starts nloops threads, NULL on failure or where there's no context switch for the architecture
+coro_loops_t *coro_loops_create(size_t nloops, const struct coro_attr *attr);
+// runs fn(arg) as a coroutine on one of the loops, argn bytes of arg are copied. -1 if that loop's inbox is full
+int coro_submit(coro_loops_t *g, void (*fn)(void *), const void *arg, size_t argn);
+// the same on loop i, i below coro_stats.loops
+int coro_submit_to(coro_loops_t *g, size_t i, void (*fn)(void *), const void *arg, size_t argn);
+size_t coro_loops_live(coro_loops_t *g);
+void coro_loops_stats(coro_loops_t *g, struct coro_stats *st);
+// waits for every coroutine to return, then joins the loops
+void coro_loops_destroy(coro_loops_t *g);
+
+// the calls below park only the calling coroutine. outside a coroutine they block the thread like the plain calls,
+// so code shared with the thread pool can use them unconditionally. timeout_ms 0 waits forever
+
+bool co_running(void);
+// the running coroutine and the index of its loop in the group, NULL and 0 outside one
+struct coro *co_self(void);
+size_t co_loop_index(void);
+// ends c's co_wait() or co_sleep() as if it were ready, nothing if c isn't waiting. only from a coroutine on c's loop
+void co_wake(struct coro *c);
+// POLLER_READ or POLLER_WRITE on fd, 0 once ready, -1 with errno ETIMEDOUT after timeout_ms
+int co_wait(int fd, unsigned int events, int timeout_ms);
+// recv() semantics on a non-blocking fd, running out of time is -1 with EAGAIN like SO_RCVTIMEO
+ssize_t co_recv(int fd, void *buf, size_t n, int timeout_ms);
+// all of buf or -1
+ssize_t co_send(int fd, const void *buf, size_t n, int timeout_ms);
+void co_sleep(unsigned int ms);
+// to the back of the loop's ready coroutines
+void co_yield(void);
+
+#endif //CORO_H
@@ -0,0 +1,710 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "files.h"
+#include "log.h"
+#include "metrics.h"
+#include "serialize_http.h"
+#include "tls.h"
+
+#define FILES_CACHE_LINE 128
+#define FILES_ETAG_MAX 64
+#define FILES_DATE_MAX 32 // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define FILES_INDEX "index.html"
+
+#ifdef __APPLE__
+#define FILES_MTIME(st) ((st)->st_mtimespec)
+#else
+#define FILES_MTIME(st) ((st)->st_mtim)
+#endif
+
+// what identifies one version of a file, and everything derived from it
+struct file_entry {
+	uint64_t hash; // of path, 0 is an empty slot
+	uint64_t checked_ns; // last stat
+	uint64_t used_ns;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	int64_t mtime_ns;
+	char path[FILES_PATH_MAX];
+	char etag[FILES_ETAG_MAX];
+	char last_modified[FILES_DATE_MAX];
+	char not_modified[FILES_NOT_MODIFIED_MAX];
+	size_t not_modified_len;
+};
+
+struct files_shard {
+	alignas(FILES_CACHE_LINE) pthread_mutex_t lock;
+	struct file_entry *entries;
+	size_t mask;
+};
+
+struct files {
+	struct files_shard shards[FILES_SHARDS];
+	bool cached;
+	int root_fd;
+	char prefix[FILES_PATH_MAX]; // without a trailing slash, "" for the whole site
+	char pattern[FILES_PATH_MAX + 8];
+	char cache_control[32];
+	uint64_t seed;
+};
+
+// a piece of a response body, multipart/byteranges alternates part heads and file ranges
+struct body_segment {
+	char *mem; // NULL for bytes of the file
+	off_t offset; // into the file
+	size_t len;
+};
+
+// a response body read from an open file, closed with the response
+struct file_body {
+	struct HttpBodyStream st;
+	int fd;
+	struct body_segment *segs;
+	size_t nsegs;
+	size_t seg; // the first one not sent entirely
+	size_t pos; // bytes of it sent
+};
+
+struct byte_range {
+	off_t first;
+	off_t last; // inclusive
+};
+
+static const struct {
+	const char *ext;
+	const char *type;
+} content_types[] = {
+	{"html", "text/html; charset=utf-8"},
+	{"htm", "text/html; charset=utf-8"},
+	{"css", "text/css; charset=utf-8"},
+	{"js", "text/javascript; charset=utf-8"},
+	{"mjs", "text/javascript; charset=utf-8"},
+	{"json", "application/json"},
+	{"txt", "text/plain; charset=utf-8"},
+	{"csv", "text/csv; charset=utf-8"},
+	{"xml", "application/xml"},
+	{"svg", "image/svg+xml"},
+	{"png", "image/png"},
+	{"jpg", "image/jpeg"},
+	{"jpeg", "image/jpeg"},
+	{"gif", "image/gif"},
+	{"webp", "image/webp"},
+	{"avif", "image/avif"},
+	{"ico", "image/x-icon"},
+	{"woff", "font/woff"},
+	{"woff2", "font/woff2"},
+	{"wasm", "application/wasm"},
+	{"pdf", "application/pdf"},
+	{"zip", "application/zip"},
+	{"gz", "application/gzip"},
+	{"mp3", "audio/mpeg"},
+	{"mp4", "video/mp4"},
+	{"webm", "video/webm"},
+};
+
+static const char *const months[] = {
+	"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t hash_path(const files_t *f, const char *path) {
+	uint64_t h = 0xcbf29ce484222325ull ^ f->seed;
+	for (const unsigned char *p = (const unsigned char *) path; *p != '\0'; p++)
+		h = (h ^ *p) * 0x100000001b3ull;
+	h = mix64(h);
+	return h == 0 ? 1 : h;
+}
+
+static const char *content_type(const char *path) {
+	const char *dot = strrchr(path, '.');
+	if (dot != NULL && strchr(dot, '/') == NULL) {
+		for (size_t i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++) {
+			if (strcasecmp(dot + 1, content_types[i].ext) == 0)
+				return content_types[i].type;
+		}
+	}
+	return "application/octet-stream";
+}
+
+// the path below the prefix into out, directories get their index. false for anything that could leave
+// the root or reach a hidden file
+static bool relative_path(const char *path, const size_t len, char *out, const size_t outn) {
+	if (len + sizeof(FILES_INDEX) > outn)
+		return false;
+	memcpy(out, path, len);
+	out[len] = '\0';
+	if (len == 0 || out[len - 1] == '/')
+		memcpy(out + len, FILES_INDEX, sizeof(FILES_INDEX));
+	// each segment has to be non-empty and can't start with a dot, that rules out "." and ".."
+	for (const char *seg = out; *seg != '\0';) {
+		if (*seg == '/' || *seg == '.')
+			return false;
+		const char *slash = strchr(seg, '/');
+		if (slash == NULL)
+			break;
+		seg = slash + 1;
+	}
+	return true;
+}
+
+static void format_http_date(const time_t t, char buf[FILES_DATE_MAX]) {
+	static const char *const days[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	snprintf(buf, FILES_DATE_MAX, "%s, %02d %s %04d %02d:%02d:%02d GMT", days[tm.tm_wday], tm.tm_mday,
+	         months[tm.tm_mon], tm.tm_year + 1900, tm.tm_hour, tm.tm_min, tm.tm_sec);
+}
+
+// IMF-fixdate only, the obsolete formats give -1 and the request is answered in full
+static time_t parse_http_date(const struct str_view v) {
+	char s[FILES_DATE_MAX];
+	if (v.len >= sizeof(s))
+		return -1;
+	memcpy(s, v.ptr, v.len);
+	s[v.len] = '\0';
+	char month[4];
+	struct tm tm = {0};
+	if (sscanf(s, "%*3s, %2d %3s %4d %2d:%2d:%2d GMT", &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min,
+	           &tm.tm_sec) != 6)
+		return -1;
+	tm.tm_mon = -1;
+	for (int i = 0; i < 12; i++) {
+		if (strcmp(month, months[i]) == 0)
+			tm.tm_mon = i;
+	}
+	if (tm.tm_mon == -1)
+		return -1;
+	tm.tm_year -= 1900;
+	return timegm(&tm);
+}
+
+static bool same_version(const struct file_entry *e, const struct stat *st) {
+	const struct timespec m = FILES_MTIME(st);
+	return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+	       e->mtime_ns == (int64_t) m.tv_sec * 1000000000 + m.tv_nsec;
+}
+
+// the validators of the file version in st. the etag changes with any of inode, mtime and size, so a replaced
+// or rewritten file never matches an old one
+static void entry_fill(const files_t *f, struct file_entry *e, const char *path, const struct stat *st) {
+	const struct timespec m = FILES_MTIME(st);
+	snprintf(e->path, sizeof(e->path), "%s", path);
+	e->hash = hash_path(f, path);
+	e->dev = st->st_dev;
+	e->ino = st->st_ino;
+	e->size = st->st_size;
+	e->mtime_ns = (int64_t) m.tv_sec * 1000000000 + m.tv_nsec;
+	snprintf(e->etag, sizeof(e->etag), "\"%llx-%llx-%llx\"", (unsigned long long) e->ino,
+	         (unsigned long long) e->mtime_ns, (unsigned long long) e->size);
+	format_http_date(m.tv_sec, e->last_modified);
+	const int n = snprintf(e->not_modified, sizeof(e->not_modified),
+	                       "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nLast-Modified: %s\r\n%s%s%s", e->etag,
+	                       e->last_modified, f->cache_control[0] ? "Cache-Control: " : "", f->cache_control,
+	                       f->cache_control[0] ? "\r\n" : "");
+	e->not_modified_len = n > 0 && (size_t) n < sizeof(e->not_modified) ? (size_t) n : 0;
+}
+
+static bool cache_get(files_t *f, const char *path, const uint64_t hash, struct file_entry *out) {
+	struct files_shard *s = &f->shards[hash >> (64 - FILES_SHARD_BITS)];
+	bool found = false;
+	pthread_mutex_lock(&s->lock);
+	for (size_t i = 0; i < FILES_PROBE_MAX; i++) {
+		struct file_entry *e = &s->entries[(hash + i) & s->mask];
+		if (e->hash == 0)
+			break;
+		if (e->hash == hash && strcmp(e->path, path) == 0) {
+			e->used_ns = metrics_now_ns();
+			*out = *e;
+			found = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&s->lock);
+	return found;
+}
+
+// replaces the entry of the same path, an empty slot or the least recently used one in the probe window
+static void cache_put(files_t *f, const struct file_entry *e) {
+	struct files_shard *s = &f->shards[e->hash >> (64 - FILES_SHARD_BITS)];
+	pthread_mutex_lock(&s->lock);
+	struct file_entry *slot = NULL;
+	for (size_t i = 0; i < FILES_PROBE_MAX; i++) {
+		struct file_entry *cur = &s->entries[(e->hash + i) & s->mask];
+		if (cur->hash == 0 || (cur->hash == e->hash && strcmp(cur->path, e->path) == 0)) {
+			slot = cur;
+			break;
+		}
+		if (slot == NULL || cur->used_ns < slot->used_ns)
+			slot = cur;
+	}
+	*slot = *e;
+	slot->used_ns = metrics_now_ns();
+	pthread_mutex_unlock(&s->lock);
+}
+
+static bool etag_listed(const struct str_view list, const char *etag) {
+	// weak comparison, W/"x" matches "x"
+	const char *tag = etag[0] == 'W' ? etag + 2 : etag;
+	const size_t tag_len = strlen(tag);
+	const char *p = list.ptr;
+	const char *list_end = list.ptr + list.len;
+	while (p < list_end) {
+		while (p < list_end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		if (p == list_end)
+			break;
+		if (*p == '*')
+			return true;
+		if (list_end - p >= 2 && p[0] == 'W' && p[1] == '/')
+			p += 2;
+		const char *end = p;
+		if (end < list_end && *end == '"') {
+			const char *close = memchr(end + 1, '"', (size_t) (list_end - end - 1));
+			end = close != NULL ? close + 1 : list_end;
+		}
+		while (end < list_end && *end != ',')
+			end++;
+		size_t len = (size_t) (end - p);
+		while (len > 0 && (p[len - 1] == ' ' || p[len - 1] == '\t'))
+			len--;
+		if (len == tag_len && memcmp(p, tag, len) == 0)
+			return true;
+		p = end;
+	}
+	return false;
+}
+
+// If-None-Match wins over If-Modified-Since when both are sent
+static bool not_modified(const struct HttpRequest *req, const char *etag, const time_t mtime) {
+	const enum HttpMethod m = req->request_line.method;
+	if (m != HTTP_METHOD_GET && m != HTTP_METHOD_HEAD)
+		return false;
+	const struct str_view inm = get_http_header("If-None-Match", &req->headers);
+	if (inm.ptr != NULL)
+		return etag_listed(inm, etag);
+	const struct str_view ims = get_http_header("If-Modified-Since", &req->headers);
+	if (ims.ptr == NULL)
+		return false;
+	const time_t since = parse_http_date(ims);
+	return since != -1 && mtime <= since;
+}
+
+// RFC 9110 14.1.1, "bytes=0-99, 200-, -50". the satisfiable ranges sorted with overlapping and adjacent ones
+// merged, 0 if none is satisfiable and -1 for a header to ignore (malformed or more than FILES_RANGES_MAX)
+static ssize_t parse_ranges(const char *h, const off_t size, struct byte_range *out) {
+	if (strncasecmp(h, "bytes=", 6) != 0)
+		return -1;
+	const char *p = h + 6;
+	size_t n = 0;
+	size_t specs = 0;
+	while (1) {
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (++specs > FILES_RANGES_MAX)
+			return -1;
+		struct byte_range r;
+		char *end;
+		if (*p == '-') {
+			// the last n bytes
+			if (p[1] < '0' || p[1] > '9')
+				return -1;
+			const long long suffix = strtoll(p + 1, &end, 10);
+			p = end;
+			r.first = suffix >= size ? 0 : size - (off_t) suffix;
+			r.last = size - 1;
+			if (suffix == 0 || size == 0)
+				r.first = -1;
+		} else {
+			if (*p < '0' || *p > '9')
+				return -1;
+			r.first = (off_t) strtoll(p, &end, 10);
+			if (*end != '-')
+				return -1;
+			p = end + 1;
+			r.last = size - 1;
+			if (*p >= '0' && *p <= '9') {
+				const long long last = strtoll(p, &end, 10);
+				p = end;
+				if (last < r.first)
+					return -1;
+				if (last < size)
+					r.last = (off_t) last;
+			}
+			if (r.first >= size)
+				r.first = -1;
+		}
+		if (r.first != -1)
+			out[n++] = r;
+		while (*p == ' ' || *p == '\t')
+			p++;
+		if (*p == '\0')
+			break;
+		if (*p++ != ',')
+			return -1;
+	}
+	// few ranges, insertion sort
+	for (size_t i = 1; i < n; i++) {
+		const struct byte_range r = out[i];
+		size_t j = i;
+		for (; j > 0 && out[j - 1].first > r.first; j--)
+			out[j] = out[j - 1];
+		out[j] = r;
+	}
+	size_t merged = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (merged > 0 && out[i].first <= out[merged - 1].last + 1) {
+			if (out[i].last > out[merged - 1].last)
+				out[merged - 1].last = out[i].last;
+		} else {
+			out[merged++] = out[i];
+		}
+	}
+	return (ssize_t) merged;
+}
+
+// a strong etag or the exact Last-Modified date, anything else sends the whole file
+static bool if_range_matches(const struct str_view if_range, const char *etag, const time_t mtime) {
+	if (if_range.len > 0 && if_range.ptr[0] == '"')
+		return str_view_eq(if_range, etag);
+	if (if_range.len >= 2 && if_range.ptr[0] == 'W' && if_range.ptr[1] == '/')
+		return false;
+	return parse_http_date(if_range) == mtime;
+}
+
+static ssize_t file_read(void *ctx, void *buf, const size_t n) {
+	struct file_body *b = ctx;
+	while (b->seg < b->nsegs) {
+		const struct body_segment *s = &b->segs[b->seg];
+		const size_t left = s->len - b->pos;
+		if (left == 0) {
+			b->seg++;
+			b->pos = 0;
+			continue;
+		}
+		const size_t want = n < left ? n : left;
+		if (s->mem != NULL) {
+			memcpy(buf, s->mem + b->pos, want);
+			b->pos += want;
+			return (ssize_t) want;
+		}
+		const ssize_t got = pread(b->fd, buf, want, s->offset + (off_t) b->pos);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1)
+			sys_error_printf("pread failed");
+		if (got == 0)
+			lprintf(ERROR, "file shrank while it was sent");
+		if (got <= 0)
+			return -1;
+		b->pos += (size_t) got;
+		return got;
+	}
+	return 0;
+}
+
+static ssize_t file_send(void *ctx, conn_io_t *io) {
+	struct file_body *b = ctx;
+	size_t total = 0;
+	for (; b->seg < b->nsegs; b->seg++, b->pos = 0) {
+		const struct body_segment *s = &b->segs[b->seg];
+		ssize_t sent;
+		if (s->mem != NULL) {
+			struct iovec iov = {.iov_base = s->mem + b->pos, .iov_len = s->len - b->pos};
+			sent = conn_io_writev(io, &iov, 1);
+		} else {
+			sent = conn_io_sendfile(io, b->fd, s->offset + (off_t) b->pos, s->len - b->pos);
+		}
+		if (sent == -1)
+			return -1;
+		total += (size_t) sent;
+	}
+	return (ssize_t) total;
+}
+
+static void file_close(void *ctx, [[maybe_unused]] const bool complete) {
+	struct file_body *b = ctx;
+	close(b->fd);
+}
+
+static int not_found(struct HttpResponse *res) {
+	static char body[] = "not found";
+	res->status_line.status_code = 404;
+	set_http_field("Content-Type", "text/plain", &res->headers);
+	res->body.ptr = body;
+	res->body.len = sizeof(body) - 1;
+	return 0;
+}
+
+static int files_handler(const struct HttpRequest *req, const struct route_params *params, struct HttpResponse *res,
+                         void *user) {
+	files_t *f = user;
+	const struct str_view rel = route_param(params, "path");
+	char path[FILES_PATH_MAX];
+	if (!relative_path(rel.ptr != NULL ? rel.ptr : "", rel.len, path, sizeof(path)))
+		return not_found(res);
+	const int fd = openat(f->root_fd, path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno != ENOENT && errno != ENOTDIR && errno != EACCES && errno != ELOOP)
+			sys_error_printf("openat failed");
+		return not_found(res);
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return not_found(res);
+	}
+	struct file_entry *e = arena_alloc(req->arena, sizeof(*e));
+	struct file_body *b = arena_alloc(req->arena, sizeof(*b));
+	if (e == NULL || b == NULL) {
+		close(fd);
+		return -1;
+	}
+	entry_fill(f, e, path, &st);
+	e->checked_ns = metrics_now_ns();
+	if (f->cached)
+		cache_put(f, e);
+	set_http_field("ETag", e->etag, &res->headers);
+	set_http_field("Last-Modified", e->last_modified, &res->headers);
+	if (f->cache_control[0])
+		set_http_field("Cache-Control", f->cache_control, &res->headers);
+	if (not_modified(req, e->etag, FILES_MTIME(&st).tv_sec)) {
+		close(fd);
+		res->status_line.status_code = 304;
+		return 0;
+	}
+	set_http_field("Accept-Ranges", "bytes", &res->headers);
+	char *type = (char *) content_type(path);
+	// the range parser works on a c string, ranges are rare enough to copy the header
+	const char *range = dup_http_header("Range", &req->headers, req->arena);
+	const struct str_view if_range = get_http_header("If-Range", &req->headers);
+	struct byte_range ranges[FILES_RANGES_MAX];
+	const ssize_t nranges = range != NULL && (if_range.ptr == NULL ||
+	                                          if_range_matches(if_range, e->etag, FILES_MTIME(&st).tv_sec))
+		                        ? parse_ranges(range, st.st_size, ranges)
+		                        : -1;
+	if (nranges == 0) {
+		close(fd);
+		char *content_range = arena_alloc(req->arena, 32);
+		if (content_range == NULL)
+			return -1;
+		snprintf(content_range, 32, "bytes */%lld", (long long) st.st_size);
+		res->status_line.status_code = 416;
+		set_http_field("Content-Range", content_range, &res->headers);
+		return 0;
+	}
+	// the whole file, one range or every range as a part with its own head plus the closing delimiter
+	const size_t nsegs = nranges <= 1 ? 1 : (size_t) nranges * 2 + 1;
+	struct body_segment *segs = arena_alloc(req->arena, sizeof(*segs) * nsegs);
+	if (segs == NULL) {
+		close(fd);
+		return -1;
+	}
+	size_t length = 0;
+	if (nranges == -1) {
+		segs[0] = (struct body_segment) {.offset = 0, .len = (size_t) st.st_size};
+		length = (size_t) st.st_size;
+		set_http_field("Content-Type", type, &res->headers);
+	} else if (nranges == 1) {
+		char *content_range = arena_alloc(req->arena, 64);
+		if (content_range == NULL) {
+			close(fd);
+			return -1;
+		}
+		snprintf(content_range, 64, "bytes %lld-%lld/%lld", (long long) ranges[0].first, (long long) ranges[0].last,
+		         (long long) st.st_size);
+		segs[0] = (struct body_segment) {
+			.offset = ranges[0].first, .len = (size_t) (ranges[0].last - ranges[0].first + 1)
+		};
+		length = segs[0].len;
+		res->status_line.status_code = 206;
+		set_http_field("Content-Type", type, &res->headers);
+		set_http_field("Content-Range", content_range, &res->headers);
+	} else {
+		char boundary[24];
+		snprintf(boundary, sizeof(boundary), "%016llx",
+		         (unsigned long long) mix64(metrics_now_ns() ^ f->seed ^ (uint64_t) (uintptr_t) b));
+		for (size_t i = 0; i < (size_t) nranges; i++) {
+			const size_t part_max = FILES_PART_HEAD_MAX + strlen(type);
+			char *head = arena_alloc(req->arena, part_max);
+			if (head == NULL) {
+				close(fd);
+				return -1;
+			}
+			const int n = snprintf(head, part_max, "%s--%s\r\nContent-Type: %s\r\nContent-Range: bytes %lld-%lld/%lld\r\n\r\n",
+			                       i == 0 ? "" : "\r\n", boundary, type, (long long) ranges[i].first,
+			                       (long long) ranges[i].last, (long long) st.st_size);
+			segs[i * 2] = (struct body_segment) {.mem = head, .len = (size_t) n};
+			segs[i * 2 + 1] = (struct body_segment) {
+				.offset = ranges[i].first, .len = (size_t) (ranges[i].last - ranges[i].first + 1)
+			};
+			length += segs[i * 2].len + segs[i * 2 + 1].len;
+		}
+		char *tail = arena_alloc(req->arena, 32);
+		char *content_type_value = arena_alloc(req->arena, 64);
+		if (tail == NULL || content_type_value == NULL) {
+			close(fd);
+			return -1;
+		}
+		const int n = snprintf(tail, 32, "\r\n--%s--\r\n", boundary);
+		segs[nsegs - 1] = (struct body_segment) {.mem = tail, .len = (size_t) n};
+		length += (size_t) n;
+		snprintf(content_type_value, 64, "multipart/byteranges; boundary=%s", boundary);
+		res->status_line.status_code = 206;
+		set_http_field("Content-Type", content_type_value, &res->headers);
+	}
+	*b = (struct file_body) {
+		.st = {.length = (ssize_t) length, .read = file_read, .send = file_send, .close = file_close, .ctx = b},
+		.fd = fd,
+		.segs = segs,
+		.nsegs = nsegs
+	};
+	res->stream = &b->st;
+	return 0;
+}
+
+size_t files_not_modified(files_t *f, const struct HttpRequest *req, char *buf, const size_t bufn) {
+	if (!f->cached || (!HEADER_EXISTS("If-None-Match", &req->headers) &&
+	                   !HEADER_EXISTS("If-Modified-Since", &req->headers)))
+		return 0;
+	const struct str_view target = req->request_line.path;
+	const size_t prefix_len = strlen(f->prefix);
+	if (target.len <= prefix_len || memcmp(target.ptr, f->prefix, prefix_len) != 0 || target.ptr[prefix_len] != '/')
+		return 0;
+	char path[FILES_PATH_MAX];
+	if (!relative_path(target.ptr + prefix_len + 1, target.len - prefix_len - 1, path, sizeof(path)))
+		return 0;
+	struct file_entry e;
+	if (!cache_get(f, path, hash_path(f, path), &e))
+		return 0;
+	const uint64_t now = metrics_now_ns();
+	if (now - e.checked_ns > FILES_STAT_INTERVAL_MS * 1000000ull) {
+		struct stat st;
+		if (fstatat(f->root_fd, path, &st, 0) == -1 || !S_ISREG(st.st_mode))
+			return 0;
+		if (!same_version(&e, &st))
+			entry_fill(f, &e, path, &st);
+		e.checked_ns = now;
+		cache_put(f, &e);
+	}
+	const time_t mtime = (time_t) (e.mtime_ns / 1000000000);
+	if (e.not_modified_len == 0 || e.not_modified_len > bufn || !not_modified(req, e.etag, mtime))
+		return 0;
+	memcpy(buf, e.not_modified, e.not_modified_len);
+	metrics_add(METRIC_NOT_MODIFIED_CACHED, 1);
+	return e.not_modified_len;
+}
+
+files_t *files_create(const struct files_options *opt) {
+	if (opt->root == NULL || opt->prefix == NULL || (opt->prefix[0] != '/' && opt->prefix[0] != '\0')) {
+		lprintf(ERROR, "files need a root directory and a prefix starting with /");
+		return NULL;
+	}
+	files_t *f = aligned_alloc(FILES_CACHE_LINE, sizeof(*f));
+	if (f == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		return NULL;
+	}
+	memset(f, 0, sizeof(*f));
+	size_t prefix_len = strlen(opt->prefix);
+	while (prefix_len > 0 && opt->prefix[prefix_len - 1] == '/')
+		prefix_len--;
+	if (prefix_len >= sizeof(f->prefix)) {
+		lprintf(ERROR, "files prefix too long");
+		free(f);
+		return NULL;
+	}
+	memcpy(f->prefix, opt->prefix, prefix_len);
+	snprintf(f->pattern, sizeof(f->pattern), "%s/*path", f->prefix);
+	if (opt->max_age_sec > 0)
+		snprintf(f->cache_control, sizeof(f->cache_control), "max-age=%u", opt->max_age_sec);
+	f->root_fd = open(opt->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (f->root_fd == -1) {
+		sys_error_printf("can't open files root %s", opt->root);
+		free(f);
+		return NULL;
+	}
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	f->seed = mix64((uint64_t) ts.tv_nsec ^ (uint64_t) (uintptr_t) f);
+	f->cached = opt->cache_entries > 0;
+	if (!f->cached)
+		return f;
+	size_t per_shard = FILES_PROBE_MAX;
+	while (per_shard * FILES_SHARDS < opt->cache_entries)
+		per_shard *= 2;
+	const size_t row_bytes = FILES_SHARDS * sizeof(struct file_entry); // one entry in every shard
+	if (opt->cache_bytes > 0) {
+		while (per_shard > FILES_PROBE_MAX && per_shard * row_bytes > opt->cache_bytes)
+			per_shard /= 2;
+		if (per_shard * row_bytes > opt->cache_bytes) {
+			lprintf(WARN, "cache.file-bytes %zu can't hold the smallest validator table (%zu bytes), 304 fast path off",
+			        opt->cache_bytes, per_shard * row_bytes);
+			f->cached = false;
+			return f;
+		}
+	}
+	size_t i = 0;
+	for (; i < FILES_SHARDS; i++) {
+		struct files_shard *s = &f->shards[i];
+		s->entries = calloc(per_shard, sizeof(*s->entries));
+		if (s->entries == NULL) {
+			sys_error_printf("calloc failed");
+			goto error_cleanup;
+		}
+		s->mask = per_shard - 1;
+		pthread_mutex_init(&s->lock, NULL);
+	}
+	lprintf(DEBUG, "file validator table: %zu entries, %zu bytes", per_shard * FILES_SHARDS,
+	        per_shard * FILES_SHARDS * sizeof(struct file_entry));
+	return f;
+error_cleanup:
+	while (i-- > 0) {
+		free(f->shards[i].entries);
+		pthread_mutex_destroy(&f->shards[i].lock);
+	}
+	close(f->root_fd);
+	free(f);
+	return NULL;
+}
+
+void files_destroy(files_t *f) {
+	if (f == NULL)
+		return;
+	if (f->cached) {
+		for (size_t i = 0; i < FILES_SHARDS; i++) {
+			free(f->shards[i].entries);
+			pthread_mutex_destroy(&f->shards[i].lock);
+		}
+	}
+	close(f->root_fd);
+	free(f);
+}
+
+size_t files_cache_bytes(const files_t *f) {
+	if (f == NULL || !f->cached)
+		return 0;
+	return (f->shards[0].mask + 1) * FILES_SHARDS * sizeof(struct file_entry);
+}
+
+int files_register(files_t *f, router_t *r) {
+	return router_add(r, HTTP_METHOD_GET, f->pattern, files_handler, f);
+}
@@ -0,0 +1,43 @@
+#ifndef FILES_H
+#define FILES_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "router.h"
+
+// static files from a directory mounted under a url prefix. every file served gets a validator entry
+// (etag, last modified and its whole 304 head) in a fixed size table, so a revalidation of a known file
+// is answered with a stat at most and without opening it. range requests get single ranges with sendfile()
+// from the offset and several as multipart/byteranges
+
+#define FILES_SHARD_BITS 4 // each shard has its own lock
+#define FILES_SHARDS (1 << FILES_SHARD_BITS)
+#define FILES_PROBE_MAX 4 // slots checked per lookup
+#define FILES_PATH_MAX 256 // relative to the root
+#define FILES_STAT_INTERVAL_MS 1000 // a cached validator is trusted this long before the file is stat()ed again
+#define FILES_NOT_MODIFIED_MAX 256
+#define FILES_RANGES_MAX 16 // ranges in one request, a longer Range header is ignored and the file sent whole
+#define FILES_PART_HEAD_MAX 128 // multipart/byteranges part head without the content type
+
+struct files_options {
+	const char *root; // directory served, NULL serves no files
+	const char *prefix; // url path the root is mounted at, "/static"
+	unsigned int max_age_sec; // Cache-Control max-age, 0 leaves it out
+	size_t cache_entries; // validator entries kept, 0 turns the 304 fast path off
+	size_t cache_bytes; // the table gets fewer entries to stay below this, 0 is no limit
+};
+
+typedef struct files files_t;
+
+files_t *files_create(const struct files_options *opt);
+void files_destroy(files_t *f);
+// GET (and with it HEAD) on prefix/*path
+int files_register(files_t *f, router_t *r);
+// copies the stored 304 head into buf if req revalidates a cached file that didn't change, the status line and
+// headers without Connection and the closing blank line. returns its length, 0 if the handler has to answer
+size_t files_not_modified(files_t *f, const struct HttpRequest *req, char *buf, size_t bufn);
+// the validator table, allocated once at create
+size_t files_cache_bytes(const files_t *f);
+
+#endif //FILES_H
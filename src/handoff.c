@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/errno.h>
+
+#include "handoff.h"
+#include "server.h"
+#include "log.h"
+
+#define HANDOFF_FDS_BYTE 'l'
+#define HANDOFF_ACK_BYTE 'k'
+
+static int set_timeout(const int fd) {
+	const struct timeval t = {.tv_sec = HANDOFF_TIMEOUT_SEC, .tv_usec = 0};
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t)) == -1) {
+		sys_error_printf("setsockopt failed");
+		return -1;
+	}
+	return 0;
+}
+
+static int unix_sockaddr(struct sockaddr_un *addr, const char *path) {
+	memset(addr, 0, sizeof(*addr));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		lprintf(ERROR, "unix socket path too long: %s", path);
+		return -1;
+	}
+	strcpy(addr->sun_path, path);
+	return 0;
+}
+
+int handoff_listen(const char *path) {
+	struct sockaddr_un addr;
+	if (unix_sockaddr(&addr, path) == -1)
+		return -1;
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		sys_error_printf("socket failed");
+		return -1;
+	}
+	// a previous server may still hold the old inode open, unlinking only detaches the path
+	if (unlink(path) == -1 && errno != ENOENT) {
+		sys_error_printf("unlink failed");
+		goto cleanup_fail;
+	}
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		sys_error_printf("bind failed");
+		goto cleanup_fail;
+	}
+	if (listen(fd, 1) == -1) {
+		sys_error_printf("listen failed");
+		goto cleanup_fail;
+	}
+	return fd;
+cleanup_fail:
+	close(fd);
+	return -1;
+}
+
+int handoff_send(const int ctl_fd, const int fds[], const size_t n) {
+	if (n == 0 || n > LISTENER_SHARDS_MAX) {
+		lprintf(ERROR, "can't hand off %zu fds", n);
+		return -1;
+	}
+	const int conn_fd = accept(ctl_fd, NULL, NULL);
+	if (conn_fd == -1) {
+		sys_error_printf("accept failed");
+		return -1;
+	}
+	if (set_timeout(conn_fd) == -1)
+		goto cleanup_fail;
+	char data = HANDOFF_FDS_BYTE;
+	struct iovec iov = {.iov_base = &data, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * LISTENER_SHARDS_MAX)];
+	} ctl;
+	memset(&ctl, 0, sizeof(ctl));
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+	if (sendmsg(conn_fd, &msg, 0) == -1) {
+		sys_error_printf("sendmsg failed");
+		goto cleanup_fail;
+	}
+	// the new server owns the sockets only once it says so, until then keep accepting
+	char ack;
+	const ssize_t len = recv(conn_fd, &ack, 1, 0);
+	if (len != 1 || ack != HANDOFF_ACK_BYTE) {
+		lprintf(ERROR, "handoff not acknowledged, continuing to serve");
+		goto cleanup_fail;
+	}
+	close(conn_fd);
+	lprintf(LOG, "handed off %zu listen sockets", n);
+	return 0;
+cleanup_fail:
+	close(conn_fd);
+	return -1;
+}
+
+ssize_t handoff_receive(const char *path, int fds[], const size_t max) {
+	struct sockaddr_un addr;
+	if (unix_sockaddr(&addr, path) == -1)
+		return -1;
+	const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1) {
+		sys_error_printf("socket failed");
+		return -1;
+	}
+	if (set_timeout(fd) == -1)
+		goto cleanup_fail;
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == -1) {
+		sys_error_printf("connect failed");
+		goto cleanup_fail;
+	}
+	char data;
+	struct iovec iov = {.iov_base = &data, .iov_len = 1};
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int) * LISTENER_SHARDS_MAX)];
+	} ctl;
+	struct msghdr msg = {0};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	if (recvmsg(fd, &msg, 0) != 1 || data != HANDOFF_FDS_BYTE) {
+		sys_error_printf("recvmsg failed");
+		goto cleanup_fail;
+	}
+	const struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		lprintf(ERROR, "handoff message has no fds");
+		goto cleanup_fail;
+	}
+	const size_t n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+	if (n == 0 || n > max || (msg.msg_flags & MSG_CTRUNC)) {
+		lprintf(ERROR, "handoff sent %zu fds, expected 1 - %zu", n, max);
+		goto cleanup_fail;
+	}
+	memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * n);
+	const char ack = HANDOFF_ACK_BYTE;
+	if (send(fd, &ack, 1, 0) != 1) {
+		sys_error_printf("send failed");
+		for (size_t i = 0; i < n; i++)
+			close(fds[i]);
+		goto cleanup_fail;
+	}
+	close(fd);
+	return (ssize_t) n;
+cleanup_fail:
+	close(fd);
+	return -1;
+}
@@ -0,0 +1,22 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define HANDOFF_SOCKET_PATH "/tmp/chinook_handoff.sock"
+#define HANDOFF_TIMEOUT_SEC 5
+
+/* listening socket handoff for zero-downtime restarts.
+ * the running server listens on a unix socket, a new server connects to it and gets the
+ * already bound listen fds (SCM_RIGHTS). once the new server acks, the old one stops accepting and drains
+ */
+
+// unlinks any stale socket at path, returns the listening unix socket
+int handoff_listen(const char *path);
+// accepts one connection on ctl_fd and sends fds, returns 0 once the receiver acked
+int handoff_send(const int ctl_fd, const int fds[], const size_t n);
+// connects to path and receives up to max fds, returns the amount received or -1
+ssize_t handoff_receive(const char *path, int fds[], const size_t max);
+
+#endif //HANDOFF_H
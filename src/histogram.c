@@ -0,0 +1,113 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "log.h"
+
+static size_t bucket_index(const unsigned int sub_bits, const uint64_t v) {
+	if (v < (1ull << sub_bits))
+		return v;
+	const unsigned int msb = 63u - (unsigned int) __builtin_clzll(v);
+	const unsigned int group = msb - sub_bits + 1;
+	const uint64_t half = 1ull << (sub_bits - 1);
+	return (1ull << sub_bits) + (group - 1) * half + ((v >> group) - half);
+}
+
+uint64_t histogram_bucket_upper(const struct histogram *h, const size_t i) {
+	const size_t first = 1ull << h->sub_bits;
+	if (i < first)
+		return i;
+	const size_t half = first / 2;
+	const unsigned int group = (unsigned int) ((i - first) / half + 1);
+	const uint64_t sub = (i - first) % half + half;
+	return (sub << group) + (1ull << group) - 1;
+}
+
+int histogram_init(struct histogram *h, const unsigned int sub_bits, const uint64_t max_value) {
+	memset(h, 0, sizeof(*h));
+	if (sub_bits < 1 || sub_bits > 16) {
+		lprintf(ERROR, "histogram sub bucket bits must be 1 - 16, got %u", sub_bits);
+		return -1;
+	}
+	h->sub_bits = sub_bits;
+	h->max_value = max_value;
+	h->nbuckets = bucket_index(sub_bits, max_value) + 1;
+	h->counts = calloc(h->nbuckets, sizeof(*h->counts));
+	if (h->counts == NULL) {
+		sys_error_printf("calloc failed");
+		return -1;
+	}
+	return 0;
+}
+
+void histogram_free(struct histogram *h) {
+	free(h->counts);
+	h->counts = NULL;
+}
+
+void histogram_reset(struct histogram *h) {
+	for (size_t i = 0; i < h->nbuckets; i++)
+		atomic_store_explicit(&h->counts[i], 0, memory_order_relaxed);
+	atomic_store_explicit(&h->total, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->sum, 0, memory_order_relaxed);
+	atomic_store_explicit(&h->max, 0, memory_order_relaxed);
+}
+
+// single writer, so a relaxed load + store is enough and avoids a locked add
+static inline void add_relaxed(_Atomic uint64_t *c, const uint64_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+void histogram_record(struct histogram *h, uint64_t value) {
+	if (value > h->max_value)
+		value = h->max_value;
+	add_relaxed(&h->counts[bucket_index(h->sub_bits, value)], 1);
+	add_relaxed(&h->total, 1);
+	add_relaxed(&h->sum, value);
+	if (value > atomic_load_explicit(&h->max, memory_order_relaxed))
+		atomic_store_explicit(&h->max, value, memory_order_relaxed);
+}
+
+int histogram_merge(struct histogram *dst, const struct histogram *src) {
+	if (dst->sub_bits != src->sub_bits || dst->nbuckets != src->nbuckets) {
+		lprintf(ERROR, "can't merge histograms with different buckets");
+		return -1;
+	}
+	for (size_t i = 0; i < src->nbuckets; i++)
+		add_relaxed(&dst->counts[i], atomic_load_explicit(&src->counts[i], memory_order_relaxed));
+	add_relaxed(&dst->total, atomic_load_explicit(&src->total, memory_order_relaxed));
+	add_relaxed(&dst->sum, atomic_load_explicit(&src->sum, memory_order_relaxed));
+	const uint64_t max = atomic_load_explicit(&src->max, memory_order_relaxed);
+	if (max > atomic_load_explicit(&dst->max, memory_order_relaxed))
+		atomic_store_explicit(&dst->max, max, memory_order_relaxed);
+	return 0;
+}
+
+uint64_t histogram_percentile(const struct histogram *h, const double p) {
+	const uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+	if (total == 0)
+		return 0;
+	uint64_t rank = (uint64_t) (p / 100.0 * (double) total + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank > total)
+		rank = total;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < h->nbuckets; i++) {
+		seen += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+		if (seen >= rank) {
+			// the bucket bound can overshoot what was actually recorded
+			const uint64_t upper = histogram_bucket_upper(h, i);
+			const uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+			return upper < max ? upper : max;
+		}
+	}
+	return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+double histogram_mean(const struct histogram *h) {
+	const uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+	if (total == 0)
+		return 0;
+	return (double) atomic_load_explicit(&h->sum, memory_order_relaxed) / (double) total;
+}
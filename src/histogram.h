@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+
+/* log-linear (hdr style) histogram of unsigned values.
+ * values below 2^sub_bits get exact buckets, above that every power of two range is split into
+ * 2^(sub_bits - 1) linear buckets, so the relative error stays below 2^-(sub_bits - 1).
+ * recording is meant for a single writer, counts are atomics so other threads can read them while it runs
+ */
+
+struct histogram {
+	unsigned int sub_bits;
+	size_t nbuckets;
+	uint64_t max_value;
+	_Atomic uint64_t *counts;
+	_Atomic uint64_t total;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t max;
+};
+
+// values above max_value are clamped into the last bucket
+int histogram_init(struct histogram *h, unsigned int sub_bits, uint64_t max_value);
+void histogram_free(struct histogram *h);
+void histogram_reset(struct histogram *h);
+void histogram_record(struct histogram *h, uint64_t value);
+// both histograms must have been initialised with the same parameters
+int histogram_merge(struct histogram *dst, const struct histogram *src);
+// p in [0, 100], returns the upper bound of the bucket holding that percentile
+uint64_t histogram_percentile(const struct histogram *h, double p);
+double histogram_mean(const struct histogram *h);
+// the largest value that falls into bucket i
+uint64_t histogram_bucket_upper(const struct histogram *h, size_t i);
+
+#endif //HISTOGRAM_H
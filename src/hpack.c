@@ -0,0 +1,444 @@
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "hpack.h"
+#include "log.h"
+
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_INT_MAX (1u << 28) // nothing legitimate comes close, guards the shifts
+#define HPACK_HUFFMAN_EOS 256
+
+static const struct {
+	const char *name;
+	const char *value;
+} static_table[HPACK_STATIC_TABLE_LEN] = {
+	{":authority", ""},
+	{":method", "GET"},
+	{":method", "POST"},
+	{":path", "/"},
+	{":path", "/index.html"},
+	{":scheme", "http"},
+	{":scheme", "https"},
+	{":status", "200"},
+	{":status", "204"},
+	{":status", "206"},
+	{":status", "304"},
+	{":status", "400"},
+	{":status", "404"},
+	{":status", "500"},
+	{"accept-charset", ""},
+	{"accept-encoding", "gzip, deflate"},
+	{"accept-language", ""},
+	{"accept-ranges", ""},
+	{"accept", ""},
+	{"access-control-allow-origin", ""},
+	{"age", ""},
+	{"allow", ""},
+	{"authorization", ""},
+	{"cache-control", ""},
+	{"content-disposition", ""},
+	{"content-encoding", ""},
+	{"content-language", ""},
+	{"content-length", ""},
+	{"content-location", ""},
+	{"content-range", ""},
+	{"content-type", ""},
+	{"cookie", ""},
+	{"date", ""},
+	{"etag", ""},
+	{"expect", ""},
+	{"expires", ""},
+	{"from", ""},
+	{"host", ""},
+	{"if-match", ""},
+	{"if-modified-since", ""},
+	{"if-none-match", ""},
+	{"if-range", ""},
+	{"if-unmodified-since", ""},
+	{"last-modified", ""},
+	{"link", ""},
+	{"location", ""},
+	{"max-forwards", ""},
+	{"proxy-authenticate", ""},
+	{"proxy-authorization", ""},
+	{"range", ""},
+	{"referer", ""},
+	{"refresh", ""},
+	{"retry-after", ""},
+	{"server", ""},
+	{"set-cookie", ""},
+	{"strict-transport-security", ""},
+	{"transfer-encoding", ""},
+	{"user-agent", ""},
+	{"vary", ""},
+	{"via", ""},
+	{"www-authenticate", ""}
+};
+
+// code, bit length. index 256 is EOS
+static const struct {
+	uint32_t code;
+	uint8_t bits;
+} huffman_codes[257] = {
+	{0x1ff8, 13}, {0x7fffd8, 23}, {0xfffffe2, 28}, {0xfffffe3, 28}, {0xfffffe4, 28}, {0xfffffe5, 28},
+	{0xfffffe6, 28}, {0xfffffe7, 28}, {0xfffffe8, 28}, {0xffffea, 24}, {0x3ffffffc, 30}, {0xfffffe9, 28},
+	{0xfffffea, 28}, {0x3ffffffd, 30}, {0xfffffeb, 28}, {0xfffffec, 28}, {0xfffffed, 28}, {0xfffffee, 28},
+	{0xfffffef, 28}, {0xffffff0, 28}, {0xffffff1, 28}, {0xffffff2, 28}, {0x3ffffffe, 30}, {0xffffff3, 28},
+	{0xffffff4, 28}, {0xffffff5, 28}, {0xffffff6, 28}, {0xffffff7, 28}, {0xffffff8, 28}, {0xffffff9, 28},
+	{0xffffffa, 28}, {0xffffffb, 28}, {0x14, 6}, {0x3f8, 10}, {0x3f9, 10}, {0xffa, 12},
+	{0x1ff9, 13}, {0x15, 6}, {0xf8, 8}, {0x7fa, 11}, {0x3fa, 10}, {0x3fb, 10},
+	{0xf9, 8}, {0x7fb, 11}, {0xfa, 8}, {0x16, 6}, {0x17, 6}, {0x18, 6},
+	{0x0, 5}, {0x1, 5}, {0x2, 5}, {0x19, 6}, {0x1a, 6}, {0x1b, 6},
+	{0x1c, 6}, {0x1d, 6}, {0x1e, 6}, {0x1f, 6}, {0x5c, 7}, {0xfb, 8},
+	{0x7ffc, 15}, {0x20, 6}, {0xffb, 12}, {0x3fc, 10}, {0x1ffa, 13}, {0x21, 6},
+	{0x5d, 7}, {0x5e, 7}, {0x5f, 7}, {0x60, 7}, {0x61, 7}, {0x62, 7},
+	{0x63, 7}, {0x64, 7}, {0x65, 7}, {0x66, 7}, {0x67, 7}, {0x68, 7},
+	{0x69, 7}, {0x6a, 7}, {0x6b, 7}, {0x6c, 7}, {0x6d, 7}, {0x6e, 7},
+	{0x6f, 7}, {0x70, 7}, {0x71, 7}, {0x72, 7}, {0xfc, 8}, {0x73, 7},
+	{0xfd, 8}, {0x1ffb, 13}, {0x7fff0, 19}, {0x1ffc, 13}, {0x3ffc, 14}, {0x22, 6},
+	{0x7ffd, 15}, {0x3, 5}, {0x23, 6}, {0x4, 5}, {0x24, 6}, {0x5, 5},
+	{0x25, 6}, {0x26, 6}, {0x27, 6}, {0x6, 5}, {0x74, 7}, {0x75, 7},
+	{0x28, 6}, {0x29, 6}, {0x2a, 6}, {0x7, 5}, {0x2b, 6}, {0x76, 7},
+	{0x2c, 6}, {0x8, 5}, {0x9, 5}, {0x2d, 6}, {0x77, 7}, {0x78, 7},
+	{0x79, 7}, {0x7a, 7}, {0x7b, 7}, {0x7ffe, 15}, {0x7fc, 11}, {0x3ffd, 14},
+	{0x1ffd, 13}, {0xffffffc, 28}, {0xfffe6, 20}, {0x3fffd2, 22}, {0xfffe7, 20}, {0xfffe8, 20},
+	{0x3fffd3, 22}, {0x3fffd4, 22}, {0x3fffd5, 22}, {0x7fffd9, 23}, {0x3fffd6, 22}, {0x7fffda, 23},
+	{0x7fffdb, 23}, {0x7fffdc, 23}, {0x7fffdd, 23}, {0x7fffde, 23}, {0xffffeb, 24}, {0x7fffdf, 23},
+	{0xffffec, 24}, {0xffffed, 24}, {0x3fffd7, 22}, {0x7fffe0, 23}, {0xffffee, 24}, {0x7fffe1, 23},
+	{0x7fffe2, 23}, {0x7fffe3, 23}, {0x7fffe4, 23}, {0x1fffdc, 21}, {0x3fffd8, 22}, {0x7fffe5, 23},
+	{0x3fffd9, 22}, {0x7fffe6, 23}, {0x7fffe7, 23}, {0xffffef, 24}, {0x3fffda, 22}, {0x1fffdd, 21},
+	{0xfffe9, 20}, {0x3fffdb, 22}, {0x3fffdc, 22}, {0x7fffe8, 23}, {0x7fffe9, 23}, {0x1fffde, 21},
+	{0x7fffea, 23}, {0x3fffdd, 22}, {0x3fffde, 22}, {0xfffff0, 24}, {0x1fffdf, 21}, {0x3fffdf, 22},
+	{0x7fffeb, 23}, {0x7fffec, 23}, {0x1fffe0, 21}, {0x1fffe1, 21}, {0x3fffe0, 22}, {0x1fffe2, 21},
+	{0x7fffed, 23}, {0x3fffe1, 22}, {0x7fffee, 23}, {0x7fffef, 23}, {0xfffea, 20}, {0x3fffe2, 22},
+	{0x3fffe3, 22}, {0x3fffe4, 22}, {0x7ffff0, 23}, {0x3fffe5, 22}, {0x3fffe6, 22}, {0x7ffff1, 23},
+	{0x3ffffe0, 26}, {0x3ffffe1, 26}, {0xfffeb, 20}, {0x7fff1, 19}, {0x3fffe7, 22}, {0x7ffff2, 23},
+	{0x3fffe8, 22}, {0x1ffffec, 25}, {0x3ffffe2, 26}, {0x3ffffe3, 26}, {0x3ffffe4, 26}, {0x7ffffde, 27},
+	{0x7ffffdf, 27}, {0x3ffffe5, 26}, {0xfffff1, 24}, {0x1ffffed, 25}, {0x7fff2, 19}, {0x1fffe3, 21},
+	{0x3ffffe6, 26}, {0x7ffffe0, 27}, {0x7ffffe1, 27}, {0x3ffffe7, 26}, {0x7ffffe2, 27}, {0xfffff2, 24},
+	{0x1fffe4, 21}, {0x1fffe5, 21}, {0x3ffffe8, 26}, {0x3ffffe9, 26}, {0xffffffd, 28}, {0x7ffffe3, 27},
+	{0x7ffffe4, 27}, {0x7ffffe5, 27}, {0xfffec, 20}, {0xfffff3, 24}, {0xfffed, 20}, {0x1fffe6, 21},
+	{0x3fffe9, 22}, {0x1fffe7, 21}, {0x1fffe8, 21}, {0x7ffff3, 23}, {0x3fffea, 22}, {0x3fffeb, 22},
+	{0x1ffffee, 25}, {0x1ffffef, 25}, {0xfffff4, 24}, {0xfffff5, 24}, {0x3ffffea, 26}, {0x7ffff4, 23},
+	{0x3ffffeb, 26}, {0x7ffffe6, 27}, {0x3ffffec, 26}, {0x3ffffed, 26}, {0x7ffffe7, 27}, {0x7ffffe8, 27},
+	{0x7ffffe9, 27}, {0x7ffffea, 27}, {0x7ffffeb, 27}, {0xffffffe, 28}, {0x7ffffec, 27}, {0x7ffffed, 27},
+	{0x7ffffee, 27}, {0x7ffffef, 27}, {0x7fffff0, 27}, {0x3ffffee, 26}, {0x3fffffff, 30},
+};
+
+// binary decode tree built once from huffman_codes, a negative child is a leaf holding -(symbol + 1)
+static int16_t huffman_tree[512][2];
+static pthread_once_t huffman_once = PTHREAD_ONCE_INIT;
+
+static void huffman_build(void) {
+	int16_t nodes = 1;
+	for (int16_t sym = 0; sym <= HPACK_HUFFMAN_EOS; sym++) {
+		int16_t node = 0;
+		for (int bit = huffman_codes[sym].bits - 1; bit >= 0; bit--) {
+			const int b = (huffman_codes[sym].code >> bit) & 1;
+			if (bit == 0) {
+				huffman_tree[node][b] = (int16_t) -(sym + 1);
+			} else {
+				if (huffman_tree[node][b] == 0)
+					huffman_tree[node][b] = nodes++;
+				node = huffman_tree[node][b];
+			}
+		}
+	}
+}
+
+// out needs len * 8 / 5 bytes, the shortest code is 5 bits
+static ssize_t huffman_decode(const uint8_t *in, const size_t len, char *out) {
+	pthread_once(&huffman_once, huffman_build);
+	size_t n = 0;
+	int16_t node = 0;
+	unsigned int depth = 0; // bits since the last symbol
+	bool all_ones = true;
+	for (size_t i = 0; i < len; i++) {
+		for (int bit = 7; bit >= 0; bit--) {
+			const int b = (in[i] >> bit) & 1;
+			const int16_t next = huffman_tree[node][b];
+			depth++;
+			all_ones = all_ones && b;
+			if (next < 0) {
+				if (-next - 1 == HPACK_HUFFMAN_EOS)
+					return -1;
+				out[n++] = (char) (-next - 1);
+				node = 0;
+				depth = 0;
+				all_ones = true;
+			} else {
+				node = next;
+			}
+		}
+	}
+	// padding is the most significant bits of EOS, shorter than a byte
+	if (depth > 7 || !all_ones)
+		return -1;
+	return (ssize_t) n;
+}
+
+static int decode_int(const uint8_t **p, const uint8_t *end, const unsigned int prefix_bits, size_t *out) {
+	if (*p >= end)
+		return -1;
+	const unsigned int mask = (1u << prefix_bits) - 1;
+	size_t v = **p & mask;
+	(*p)++;
+	if (v < mask) {
+		*out = v;
+		return 0;
+	}
+	unsigned int shift = 0;
+	while (1) {
+		if (*p >= end || shift > 21)
+			return -1;
+		const uint8_t b = **p;
+		(*p)++;
+		v += (size_t) (b & 0x7f) << shift;
+		shift += 7;
+		if ((b & 0x80) == 0)
+			break;
+	}
+	if (v > HPACK_INT_MAX)
+		return -1;
+	*out = v;
+	return 0;
+}
+
+static int decode_string(const uint8_t **p, const uint8_t *end, arena_t *a, char **out, size_t *out_len) {
+	if (*p >= end)
+		return -1;
+	const bool huffman = **p & 0x80;
+	size_t len;
+	if (decode_int(p, end, 7, &len) == -1 || len > (size_t) (end - *p))
+		return -1;
+	if (huffman) {
+		char *s = arena_alloc(a, len * 8 / 5 + 1);
+		if (s == NULL)
+			return -1;
+		const ssize_t n = huffman_decode(*p, len, s);
+		if (n == -1)
+			return -1;
+		s[n] = '\0';
+		*out = s;
+		*out_len = (size_t) n;
+	} else {
+		*out = arena_strndup(a, (const char *) *p, len);
+		if (*out == NULL)
+			return -1;
+		*out_len = len;
+	}
+	*p += len;
+	return 0;
+}
+
+int hpack_decoder_init(hpack_decoder_t *d, const size_t settings_max) {
+	memset(d, 0, sizeof(*d));
+	d->cap = settings_max / HPACK_ENTRY_OVERHEAD + 1;
+	d->entries = calloc(d->cap, sizeof(*d->entries));
+	if (d->entries == NULL) {
+		sys_error_printf("calloc failed");
+		return -1;
+	}
+	d->max_size = settings_max;
+	d->settings_max = settings_max;
+	return 0;
+}
+
+void hpack_decoder_free(hpack_decoder_t *d) {
+	for (size_t i = 0; i < d->n; i++)
+		free(d->entries[(d->head + i) % d->cap].name);
+	free(d->entries);
+	d->entries = NULL;
+	d->n = 0;
+}
+
+static void evict_to(hpack_decoder_t *d, const size_t max) {
+	while (d->n > 0 && d->size > max) {
+		struct hpack_entry *e = &d->entries[(d->head + d->n - 1) % d->cap];
+		d->size -= e->name_len + e->value_len + HPACK_ENTRY_OVERHEAD;
+		free(e->name);
+		d->n--;
+	}
+}
+
+static int table_insert(hpack_decoder_t *d, const char *name, const size_t name_len, const char *value,
+                        const size_t value_len) {
+	const size_t size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+	if (size > d->max_size) {
+		// not an error, the table just ends up empty
+		evict_to(d, 0);
+		return 0;
+	}
+	evict_to(d, d->max_size - size);
+	// name and value share one allocation
+	char *mem = malloc(name_len + value_len + 2);
+	if (mem == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	memcpy(mem, name, name_len);
+	mem[name_len] = '\0';
+	memcpy(mem + name_len + 1, value, value_len);
+	mem[name_len + 1 + value_len] = '\0';
+	d->head = (d->head + d->cap - 1) % d->cap;
+	d->entries[d->head] = (struct hpack_entry) {
+		.name = mem, .name_len = name_len, .value = mem + name_len + 1, .value_len = value_len
+	};
+	d->n++;
+	d->size += size;
+	return 0;
+}
+
+// static entries have no lengths stored, fills a temporary entry for those
+static int table_get(const hpack_decoder_t *d, const size_t index, struct hpack_entry *out) {
+	if (index == 0)
+		return -1;
+	if (index <= HPACK_STATIC_TABLE_LEN) {
+		out->name = (char *) static_table[index - 1].name;
+		out->name_len = strlen(out->name);
+		out->value = (char *) static_table[index - 1].value;
+		out->value_len = strlen(out->value);
+		return 0;
+	}
+	const size_t i = index - HPACK_STATIC_TABLE_LEN - 1;
+	if (i >= d->n)
+		return -1;
+	*out = d->entries[(d->head + i) % d->cap];
+	return 0;
+}
+
+int hpack_decode(hpack_decoder_t *d, const uint8_t *block, const size_t len, arena_t *a, hpack_header_cb cb,
+                 void *user) {
+	const uint8_t *p = block;
+	const uint8_t *end = block + len;
+	bool fields_seen = false;
+	while (p < end) {
+		const uint8_t b = *p;
+		size_t index;
+		if (b & 0x80) {
+			// indexed field
+			struct hpack_entry e;
+			if (decode_int(&p, end, 7, &index) == -1 || table_get(d, index, &e) == -1)
+				return -1;
+			char *name = arena_strndup(a, e.name, e.name_len);
+			char *value = arena_strndup(a, e.value, e.value_len);
+			if (name == NULL || value == NULL || cb(user, name, e.name_len, value, e.value_len) == -1)
+				return -1;
+			fields_seen = true;
+			continue;
+		}
+		if ((b & 0xe0) == 0x20) {
+			// table size update, only allowed before the first field
+			if (fields_seen || decode_int(&p, end, 5, &index) == -1 || index > d->settings_max)
+				return -1;
+			d->max_size = index;
+			evict_to(d, d->max_size);
+			continue;
+		}
+		// literal: 01 incremental indexing, 0000 without indexing, 0001 never indexed
+		const bool indexing = (b & 0xc0) == 0x40;
+		if (decode_int(&p, end, indexing ? 6 : 4, &index) == -1)
+			return -1;
+		char *name;
+		size_t name_len;
+		if (index == 0) {
+			if (decode_string(&p, end, a, &name, &name_len) == -1)
+				return -1;
+		} else {
+			struct hpack_entry e;
+			if (table_get(d, index, &e) == -1)
+				return -1;
+			name = arena_strndup(a, e.name, e.name_len);
+			name_len = e.name_len;
+			if (name == NULL)
+				return -1;
+		}
+		char *value;
+		size_t value_len;
+		if (decode_string(&p, end, a, &value, &value_len) == -1)
+			return -1;
+		if (indexing && table_insert(d, name, name_len, value, value_len) == -1)
+			return -1;
+		if (cb(user, name, name_len, value, value_len) == -1)
+			return -1;
+		fields_seen = true;
+	}
+	return 0;
+}
+
+static ssize_t encode_int(uint8_t *buf, const size_t bufn, const uint8_t first, const unsigned int prefix_bits,
+                          size_t v) {
+	const size_t mask = (1u << prefix_bits) - 1;
+	if (bufn == 0)
+		return -1;
+	if (v < mask) {
+		buf[0] = (uint8_t) (first | v);
+		return 1;
+	}
+	buf[0] = (uint8_t) (first | mask);
+	v -= mask;
+	size_t n = 1;
+	while (v >= 0x80) {
+		if (n >= bufn)
+			return -1;
+		buf[n++] = (uint8_t) ((v & 0x7f) | 0x80);
+		v >>= 7;
+	}
+	if (n >= bufn)
+		return -1;
+	buf[n++] = (uint8_t) v;
+	return (ssize_t) n;
+}
+
+static ssize_t encode_string(uint8_t *buf, const size_t bufn, const char *s, const size_t len, const bool lower) {
+	const ssize_t n = encode_int(buf, bufn, 0, 7, len);
+	if (n == -1 || (size_t) n + len > bufn)
+		return -1;
+	for (size_t i = 0; i < len; i++)
+		buf[(size_t) n + i] = lower ? (uint8_t) tolower((unsigned char) s[i]) : (uint8_t) s[i];
+	return n + (ssize_t) len;
+}
+
+static size_t static_name_index(const char *name, const size_t len) {
+	// pseudo headers are only ever the status, which has its own encoder
+	for (size_t i = 14; i < HPACK_STATIC_TABLE_LEN; i++) {
+		if (strncasecmp(static_table[i].name, name, len) == 0 && static_table[i].name[len] == '\0')
+			return i + 1;
+	}
+	return 0;
+}
+
+ssize_t hpack_encode_status(uint8_t *buf, const size_t bufn, const int status) {
+	for (size_t i = 7; i < 14; i++) {
+		if (atoi(static_table[i].value) == status)
+			return encode_int(buf, bufn, 0x80, 7, i + 1);
+	}
+	const unsigned int code = (unsigned int) status % 1000u;
+	const char digits[3] = {(char) ('0' + code / 100), (char) ('0' + code / 10 % 10), (char) ('0' + code % 10)};
+	// literal without indexing, name is :status (index 8)
+	const ssize_t n = encode_int(buf, bufn, 0x00, 4, 8);
+	if (n == -1)
+		return -1;
+	const ssize_t m = encode_string(buf + n, bufn - (size_t) n, digits, 3, false);
+	return m == -1 ? -1 : n + m;
+}
+
+ssize_t hpack_encode_field(uint8_t *buf, const size_t bufn, const char *name, const size_t name_len,
+                           const char *value, const size_t value_len) {
+	const size_t index = static_name_index(name, name_len);
+	ssize_t n = encode_int(buf, bufn, 0x00, 4, index);
+	if (n == -1)
+		return -1;
+	if (index == 0) {
+		const ssize_t m = encode_string(buf + n, bufn - (size_t) n, name, name_len, true);
+		if (m == -1)
+			return -1;
+		n += m;
+	}
+	const ssize_t m = encode_string(buf + n, bufn - (size_t) n, value, value_len, false);
+	return m == -1 ? -1 : n + m;
+}
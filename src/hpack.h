@@ -0,0 +1,47 @@
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
+// header compression for http/2 (rfc 7541)
+
+#define HPACK_TABLE_SIZE_DEFAULT 4096
+#define HPACK_STATIC_TABLE_LEN 61
+
+struct hpack_entry {
+	char *name;
+	size_t name_len;
+	char *value;
+	size_t value_len;
+};
+
+typedef struct hpack_decoder {
+	struct hpack_entry *entries; // ring, head is the newest entry
+	size_t cap;
+	size_t head;
+	size_t n;
+	size_t size; // rfc size, 32 bytes overhead per entry
+	size_t max_size; // set by the peer with table size updates
+	size_t settings_max; // our SETTINGS_HEADER_TABLE_SIZE, upper bound for max_size
+} hpack_decoder_t;
+
+// name and value are NUL terminated copies in the arena
+typedef int (*hpack_header_cb)(void *user, char *name, size_t name_len, char *value, size_t value_len);
+
+int hpack_decoder_init(hpack_decoder_t *d, size_t settings_max);
+void hpack_decoder_free(hpack_decoder_t *d);
+// one complete header block, the callback returning -1 stops decoding. -1 is a compression error,
+// the decoder state is undefined after it and the connection has to go
+int hpack_decode(hpack_decoder_t *d, const uint8_t *block, size_t len, arena_t *a, hpack_header_cb cb, void *user);
+
+// the encoder keeps no dynamic table, fields go out as literals without indexing (static names are indexed)
+// returns the bytes written or -1 if bufn is too small. names are lowercased
+ssize_t hpack_encode_status(uint8_t *buf, size_t bufn, int status);
+ssize_t hpack_encode_field(uint8_t *buf, size_t bufn, const char *name, size_t name_len, const char *value,
+                           size_t value_len);
+
+#endif //HPACK_H
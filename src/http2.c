@@ -0,0 +1,1146 @@
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "http2.h"
+#include "hpack.h"
+#include "log.h"
+#include "metrics.h"
+#include "serialize_http.h"
+
+#define H2_FRAME_HEADER_LEN 9
+#define H2_WINDOW_MAX 0x7fffffff
+#define H2_FRAME_SIZE_MAX 0xffffff
+#define H2_HEADER_FIELD_OVERHEAD 32 // counted per field against request_max, like SETTINGS_MAX_HEADER_LIST_SIZE
+
+enum h2_frame_type {
+	FRAME_DATA = 0x0,
+	FRAME_HEADERS = 0x1,
+	FRAME_PRIORITY = 0x2,
+	FRAME_RST_STREAM = 0x3,
+	FRAME_SETTINGS = 0x4,
+	FRAME_PUSH_PROMISE = 0x5,
+	FRAME_PING = 0x6,
+	FRAME_GOAWAY = 0x7,
+	FRAME_WINDOW_UPDATE = 0x8,
+	FRAME_CONTINUATION = 0x9
+};
+
+enum h2_flag {
+	FLAG_END_STREAM = 0x1,
+	FLAG_ACK = 0x1,
+	FLAG_END_HEADERS = 0x4,
+	FLAG_PADDED = 0x8,
+	FLAG_PRIORITY = 0x20
+};
+
+enum h2_setting {
+	SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	SETTINGS_ENABLE_PUSH = 0x2,
+	SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	SETTINGS_MAX_FRAME_SIZE = 0x5,
+	SETTINGS_MAX_HEADER_LIST_SIZE = 0x6
+};
+
+enum h2_error {
+	H2_NO_ERROR = 0x0,
+	H2_PROTOCOL_ERROR = 0x1,
+	H2_INTERNAL_ERROR = 0x2,
+	H2_FLOW_CONTROL_ERROR = 0x3,
+	H2_STREAM_CLOSED = 0x5,
+	H2_FRAME_SIZE_ERROR = 0x6,
+	H2_REFUSED_STREAM = 0x7,
+	H2_CANCEL = 0x8,
+	H2_COMPRESSION_ERROR = 0x9,
+	H2_ENHANCE_YOUR_CALM = 0xb
+};
+
+enum h2_stream_state {
+	STREAM_OPEN, // receiving headers or body
+	STREAM_READY, // request complete, waiting for a thread to claim it
+	STREAM_RUNNING
+};
+
+struct h2_stream {
+	uint32_t id;
+	enum h2_stream_state state;
+	bool reset; // by the peer, the response is dropped
+	bool malformed;
+	bool fields_seen; // pseudo headers must come first
+	bool upgraded; // stream 1 of an h2c upgrade, already counted as an http/1.1 request
+	int64_t send_window;
+	int64_t recv_window;
+	size_t recv_unacked;
+	size_t bytes; // header list and body, against request_max
+	size_t body_cap;
+	uint64_t received_ns;
+	arena_t arena; // the request, the handler and the response live here
+	struct HttpRequest req;
+	struct h2_stream *next;
+};
+
+struct h2_conn {
+	const struct http2_server *srv;
+	int fd;
+	void *ctx;
+	atomic_uint refs; // the connection thread and every queued stream task
+	atomic_bool dead; // writing failed or a connection error, writers give up
+
+	pthread_mutex_t lock; // streams, send windows and settings below
+	pthread_cond_t cond; // window updates, resets and finished streams
+	struct h2_stream *streams;
+	size_t nstreams;
+	size_t running;
+	int64_t send_window;
+	int64_t peer_initial_window;
+	uint32_t peer_max_frame;
+
+	pthread_mutex_t write_lock; // frames go out whole, header blocks without interleaving
+
+	// only touched by the connection thread
+	hpack_decoder_t hpack;
+	arena_t scratch; // header blocks of refused streams are still decoded, hpack state depends on it
+	uint8_t *rbuf;
+	size_t rlen;
+	size_t rcap;
+	uint8_t *hblock; // header block being reassembled from CONTINUATION frames
+	size_t hblock_len;
+	size_t hblock_cap;
+	uint32_t hblock_stream; // 0 when no block is open
+	bool hblock_end_stream;
+	int64_t recv_window;
+	size_t recv_unacked;
+	uint32_t last_stream_id;
+	bool goaway_sent;
+	bool goaway_received;
+};
+
+struct h2_task_args {
+	struct h2_conn *c;
+	uint32_t stream_id;
+};
+
+static void put32(uint8_t *p, const uint32_t v) {
+	p[0] = (uint8_t) (v >> 24);
+	p[1] = (uint8_t) (v >> 16);
+	p[2] = (uint8_t) (v >> 8);
+	p[3] = (uint8_t) v;
+}
+
+static uint32_t get32(const uint8_t *p) {
+	return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 | (uint32_t) p[2] << 8 | p[3];
+}
+
+bool http2_is_preface(const char *buf, const size_t len) {
+	// a partial preface still counts, the rest is read by http2_serve()
+	return len >= 3 && memcmp(buf, HTTP2_PREFACE, len < HTTP2_PREFACE_LEN ? len : HTTP2_PREFACE_LEN) == 0;
+}
+
+bool http2_is_upgrade(const struct HttpRequest *req) {
+	return str_view_case_eq(get_http_header("Upgrade", &req->headers), "h2c") &&
+	       HEADER_EXISTS("HTTP2-Settings", &req->headers) && req->body.len == 0;
+}
+
+// caller holds write_lock
+static int write_all(struct h2_conn *c, struct iovec *iov, int iovcnt) {
+	while (iovcnt > 0) {
+		ssize_t sent = writev(c->fd, iov, iovcnt);
+		if (sent == -1) {
+			if (errno == EINTR)
+				continue;
+			if (!atomic_exchange(&c->dead, true))
+				sys_error_printf("writev failed");
+			return -1;
+		}
+		metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+		while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+			sent -= (ssize_t) iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + sent;
+			iov->iov_len -= (size_t) sent;
+		}
+	}
+	return 0;
+}
+
+static void frame_header(uint8_t h[H2_FRAME_HEADER_LEN], const size_t len, const enum h2_frame_type type,
+                         const uint8_t flags, const uint32_t stream_id) {
+	h[0] = (uint8_t) (len >> 16);
+	h[1] = (uint8_t) (len >> 8);
+	h[2] = (uint8_t) len;
+	h[3] = (uint8_t) type;
+	h[4] = flags;
+	put32(h + 5, stream_id & 0x7fffffff);
+}
+
+static int write_frame(struct h2_conn *c, const enum h2_frame_type type, const uint8_t flags,
+                       const uint32_t stream_id, const void *payload, const size_t len) {
+	uint8_t h[H2_FRAME_HEADER_LEN];
+	frame_header(h, len, type, flags, stream_id);
+	struct iovec iov[2] = {
+		{.iov_base = h, .iov_len = sizeof(h)},
+		{.iov_base = (void *) payload, .iov_len = len}
+	};
+	pthread_mutex_lock(&c->write_lock);
+	const int retval = atomic_load(&c->dead) ? -1 : write_all(c, iov, len ? 2 : 1);
+	pthread_mutex_unlock(&c->write_lock);
+	return retval;
+}
+
+// bytes that aren't a frame, the 101 of an upgrade
+static int write_frame_raw(struct h2_conn *c, const void *buf, const size_t len) {
+	struct iovec iov = {.iov_base = (void *) buf, .iov_len = len};
+	pthread_mutex_lock(&c->write_lock);
+	const int retval = write_all(c, &iov, 1);
+	pthread_mutex_unlock(&c->write_lock);
+	return retval;
+}
+
+static int write_u32_frame(struct h2_conn *c, const enum h2_frame_type type, const uint32_t stream_id,
+                           const uint32_t v) {
+	uint8_t p[4];
+	put32(p, v);
+	return write_frame(c, type, 0, stream_id, p, sizeof(p));
+}
+
+static int write_goaway(struct h2_conn *c, const enum h2_error err) {
+	uint8_t p[8];
+	put32(p, c->last_stream_id);
+	put32(p + 4, err);
+	c->goaway_sent = true;
+	return write_frame(c, FRAME_GOAWAY, 0, 0, p, sizeof(p));
+}
+
+// a header block has to reach the peer in one piece, CONTINUATION frames can't interleave with other streams
+static int write_header_block(struct h2_conn *c, const uint32_t stream_id, const uint8_t *block, size_t len,
+                              const bool end_stream) {
+	pthread_mutex_lock(&c->lock);
+	const size_t max_frame = c->peer_max_frame;
+	pthread_mutex_unlock(&c->lock);
+	pthread_mutex_lock(&c->write_lock);
+	enum h2_frame_type type = FRAME_HEADERS;
+	uint8_t flags = end_stream ? FLAG_END_STREAM : 0;
+	int retval = atomic_load(&c->dead) ? -1 : 0;
+	while (retval == 0) {
+		const size_t n = len < max_frame ? len : max_frame;
+		uint8_t h[H2_FRAME_HEADER_LEN];
+		frame_header(h, n, type, (uint8_t) (flags | (n == len ? FLAG_END_HEADERS : 0)), stream_id);
+		struct iovec iov[2] = {
+			{.iov_base = h, .iov_len = sizeof(h)},
+			{.iov_base = (void *) block, .iov_len = n}
+		};
+		retval = write_all(c, iov, 2);
+		block += n;
+		len -= n;
+		if (len == 0)
+			break;
+		type = FRAME_CONTINUATION;
+		flags = 0;
+	}
+	pthread_mutex_unlock(&c->write_lock);
+	return retval;
+}
+
+static struct h2_stream *stream_find(const struct h2_conn *c, const uint32_t id) {
+	for (struct h2_stream *s = c->streams; s != NULL; s = s->next) {
+		if (s->id == id)
+			return s;
+	}
+	return NULL;
+}
+
+// for the connection thread, which is the only one freeing open streams: the result stays valid
+// after unlocking. *known tells whether the stream exists in any state
+static struct h2_stream *stream_find_open(struct h2_conn *c, const uint32_t id, bool *known) {
+	pthread_mutex_lock(&c->lock);
+	struct h2_stream *s = stream_find(c, id);
+	*known = s != NULL;
+	if (s != NULL && s->state != STREAM_OPEN)
+		s = NULL;
+	pthread_mutex_unlock(&c->lock);
+	return s;
+}
+
+static struct h2_stream *stream_create(struct h2_conn *c, const uint32_t id) {
+	struct h2_stream *s = calloc(1, sizeof(*s));
+	if (s == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	s->id = id;
+	s->state = STREAM_OPEN;
+	s->recv_window = c->srv->initial_window_size;
+	arena_init(&s->arena);
+	s->req.arena = &s->arena;
+	http_headers_init(&s->req.headers, &s->arena);
+	s->req.request_line.method = HTTP_METHOD_UNKNOWN;
+	s->req.request_line.version = HTTP_VERSION_2;
+	pthread_mutex_lock(&c->lock);
+	s->send_window = c->peer_initial_window;
+	s->next = c->streams;
+	c->streams = s;
+	c->nstreams++;
+	pthread_mutex_unlock(&c->lock);
+	return s;
+}
+
+// caller holds lock
+static void stream_unlink(struct h2_conn *c, const struct h2_stream *s) {
+	for (struct h2_stream **p = &c->streams; *p != NULL; p = &(*p)->next) {
+		if (*p == s) {
+			*p = s->next;
+			c->nstreams--;
+			pthread_cond_broadcast(&c->cond);
+			return;
+		}
+	}
+}
+
+static void stream_free(struct h2_stream *s) {
+	arena_destroy(&s->arena);
+	free(s);
+}
+
+static void stream_remove(struct h2_conn *c, struct h2_stream *s) {
+	pthread_mutex_lock(&c->lock);
+	stream_unlink(c, s);
+	pthread_mutex_unlock(&c->lock);
+	stream_free(s);
+}
+
+static size_t stream_count(struct h2_conn *c) {
+	pthread_mutex_lock(&c->lock);
+	const size_t n = c->nstreams;
+	pthread_mutex_unlock(&c->lock);
+	return n;
+}
+
+static void conn_unref(struct h2_conn *c) {
+	if (atomic_fetch_sub(&c->refs, 1) != 1)
+		return;
+	pthread_mutex_destroy(&c->lock);
+	pthread_cond_destroy(&c->cond);
+	pthread_mutex_destroy(&c->write_lock);
+	free(c);
+}
+
+// blocks until both windows are open, returns how much of want may be sent now
+static ssize_t reserve_window(struct h2_conn *c, struct h2_stream *s, const size_t want) {
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += c->srv->send_timeout_sec;
+	pthread_mutex_lock(&c->lock);
+	while (!atomic_load(&c->dead) && !s->reset && (c->send_window <= 0 || s->send_window <= 0)) {
+		if (pthread_cond_timedwait(&c->cond, &c->lock, &deadline) == ETIMEDOUT) {
+			pthread_mutex_unlock(&c->lock);
+			lprintf(WARN, "http2 stream %u: peer kept the window closed", s->id);
+			return -1;
+		}
+	}
+	if (atomic_load(&c->dead) || s->reset) {
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	size_t n = want;
+	if ((int64_t) n > c->send_window)
+		n = (size_t) c->send_window;
+	if ((int64_t) n > s->send_window)
+		n = (size_t) s->send_window;
+	if (n > c->peer_max_frame)
+		n = c->peer_max_frame;
+	c->send_window -= (int64_t) n;
+	s->send_window -= (int64_t) n;
+	pthread_mutex_unlock(&c->lock);
+	return (ssize_t) n;
+}
+
+static bool connection_specific(const struct str_view name) {
+	static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding",
+	                                    "Upgrade", "Content-Length"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (str_view_case_eq(name, names[i]))
+			return true;
+	}
+	return false;
+}
+
+// DATA frames are only as large as what the stream had ready, the end goes out as an empty DATA frame
+static int send_stream_body(struct h2_conn *c, struct h2_stream *s, const struct HttpBodyStream *st,
+                            const uint8_t *block, const size_t block_len, const bool head_only) {
+	if (write_header_block(c, s->id, block, block_len, head_only) == -1) {
+		st->close(st->ctx, false);
+		return -1;
+	}
+	if (head_only) {
+		st->close(st->ctx, false);
+		return 0;
+	}
+	char *buf = arena_alloc(&s->arena, HTTP2_FRAME_SIZE_DEFAULT);
+	if (buf == NULL) {
+		st->close(st->ctx, false);
+		// HEADERS went out without END_STREAM, the stream has to be ended here. reset keeps run_stream from
+		// sending a second RST_STREAM
+		write_u32_frame(c, FRAME_RST_STREAM, s->id, H2_INTERNAL_ERROR);
+		pthread_mutex_lock(&c->lock);
+		s->reset = true;
+		pthread_mutex_unlock(&c->lock);
+		return -1;
+	}
+	while (1) {
+		const ssize_t got = st->read(st->ctx, buf, HTTP2_FRAME_SIZE_DEFAULT);
+		if (got == -1)
+			break;
+		if (got == 0) {
+			const int retval = write_frame(c, FRAME_DATA, FLAG_END_STREAM, s->id, NULL, 0);
+			st->close(st->ctx, retval == 0);
+			return retval;
+		}
+		const char *p = buf;
+		size_t left = (size_t) got;
+		while (left > 0) {
+			const ssize_t chunk = reserve_window(c, s, left);
+			if (chunk == -1 || write_frame(c, FRAME_DATA, 0, s->id, p, (size_t) chunk) == -1)
+				goto error;
+			p += chunk;
+			left -= (size_t) chunk;
+		}
+	}
+error:
+	st->close(st->ctx, false);
+	return -1;
+}
+
+static int send_stream_response(struct h2_conn *c, struct h2_stream *s, const struct HttpResponse *res,
+                                const bool head_only) {
+	uint8_t *block = arena_alloc(&s->arena, RESPONSE_HEAD_MAX_SIZE_BYTES);
+	if (block == NULL)
+		return -1;
+	const size_t bufn = RESPONSE_HEAD_MAX_SIZE_BYTES;
+	ssize_t n = hpack_encode_status(block, bufn, res->status_line.status_code);
+	// connection management is per frame in http/2, the length is always ours
+	for (size_t i = 0; n != -1 && i < res->headers.nfields; i++) {
+		const struct HttpField *f = &res->headers.fields[i];
+		if (connection_specific(f->key))
+			continue;
+		const ssize_t m = hpack_encode_field(block + n, bufn - (size_t) n, f->key.ptr, f->key.len, f->value.ptr,
+		                                     f->value.len);
+		n = m == -1 ? -1 : n + m;
+	}
+	char content_length[24];
+	const size_t body_len = res->stream != NULL ? (size_t) res->stream->length : res->body.len;
+	const int cl_len = snprintf(content_length, sizeof(content_length), "%zu", body_len);
+	const int status = res->status_line.status_code;
+	if (n != -1 && (res->stream == NULL || res->stream->length != -1) && status != 204 && status != 304) {
+		const ssize_t m = hpack_encode_field(block + n, bufn - (size_t) n, "content-length", 14, content_length,
+		                                     (size_t) cl_len);
+		n = m == -1 ? -1 : n + m;
+	}
+	if (n == -1) {
+		lprintf(ERROR, "http2 response headers larger than %zu bytes", bufn);
+		return -1;
+	}
+	if (res->stream != NULL)
+		return send_stream_body(c, s, res->stream, block, (size_t) n, head_only);
+	const bool has_body = !head_only && res->body.len > 0;
+	if (write_header_block(c, s->id, block, (size_t) n, !has_body) == -1)
+		return -1;
+	const char *body = res->body.ptr;
+	size_t left = has_body ? res->body.len : 0;
+	while (left > 0) {
+		const ssize_t chunk = reserve_window(c, s, left);
+		if (chunk == -1)
+			return -1;
+		left -= (size_t) chunk;
+		if (write_frame(c, FRAME_DATA, left == 0 ? FLAG_END_STREAM : 0, s->id, body, (size_t) chunk) == -1)
+			return -1;
+		body += chunk;
+	}
+	return 0;
+}
+
+// the stream was claimed by this thread, frees it when done
+static void run_stream(struct h2_conn *c, struct h2_stream *s) {
+	if (!s->reset) {
+		if (!s->upgraded)
+			metrics_add(METRIC_REQUESTS, 1);
+		lprintf(LOG, "%.*s", (int) s->req.request_line.uri.len, s->req.request_line.uri.ptr);
+		struct HttpResponse res;
+		http_response_init(&res, &s->arena);
+		const uint64_t handler_ns = metrics_now_ns();
+		c->srv->handler(&s->req, &res);
+		metrics_time(METRIC_HANDLER, handler_ns);
+		const uint64_t send_ns = metrics_now_ns();
+		if (send_stream_response(c, s, &res, s->req.request_line.method == HTTP_METHOD_HEAD) == -1 &&
+		    !atomic_load(&c->dead) && !s->reset)
+			write_u32_frame(c, FRAME_RST_STREAM, s->id, H2_INTERNAL_ERROR);
+		metrics_time(METRIC_SEND, send_ns);
+		metrics_time(METRIC_REQUEST_TOTAL, s->received_ns);
+		metrics_count_status(res.status_line.status_code);
+	}
+	pthread_mutex_lock(&c->lock);
+	stream_unlink(c, s);
+	c->running--;
+	pthread_mutex_unlock(&c->lock);
+	stream_free(s);
+}
+
+static void *stream_task(void *vargp) {
+	const struct h2_task_args *args = vargp;
+	struct h2_conn *c = args->c;
+	pthread_mutex_lock(&c->lock);
+	struct h2_stream *s = stream_find(c, args->stream_id);
+	// the connection thread may have run it already while draining
+	if (s != NULL && s->state == STREAM_READY) {
+		s->state = STREAM_RUNNING;
+		c->running++;
+	} else {
+		s = NULL;
+	}
+	pthread_mutex_unlock(&c->lock);
+	if (s != NULL)
+		run_stream(c, s);
+	conn_unref(c);
+	return NULL;
+}
+
+static enum h2_error stream_error(struct h2_conn *c, struct h2_stream *s, const uint32_t id,
+                                  const enum h2_error err) {
+	if (s != NULL)
+		stream_remove(c, s);
+	write_u32_frame(c, FRAME_RST_STREAM, id, err);
+	return H2_NO_ERROR;
+}
+
+static void dispatch(struct h2_conn *c, struct h2_stream *s) {
+	s->received_ns = metrics_now_ns();
+	if (c->srv->admit != NULL && !c->srv->admit(c->ctx)) {
+		// no body, so no flow control that could stall the connection thread
+		uint8_t block[64];
+		const ssize_t n = hpack_encode_status(block, sizeof(block), 429);
+		const ssize_t m = hpack_encode_field(block + n, sizeof(block) - (size_t) n, "retry-after", 11, "1", 1);
+		write_header_block(c, s->id, block, (size_t) (n + m), true);
+		metrics_count_status(429);
+		stream_remove(c, s);
+		return;
+	}
+	pthread_mutex_lock(&c->lock);
+	s->state = STREAM_READY;
+	pthread_mutex_unlock(&c->lock);
+	if (c->srv->pool != NULL) {
+		atomic_fetch_add(&c->refs, 1);
+		const struct h2_task_args args = {.c = c, .stream_id = s->id};
+		if (thread_pool_add_task_copy(c->srv->pool, stream_task, &args, sizeof(args)) == 0)
+			return;
+		atomic_fetch_sub(&c->refs, 1);
+		// queue full. running it here would stop reading WINDOW_UPDATEs, the peer may retry a refused stream
+		stream_error(c, s, s->id, H2_REFUSED_STREAM);
+		return;
+	}
+	// frames aren't read meanwhile, a body larger than the peer's window waits for send_timeout_sec
+	pthread_mutex_lock(&c->lock);
+	s->state = STREAM_RUNNING;
+	c->running++;
+	pthread_mutex_unlock(&c->lock);
+	run_stream(c, s);
+}
+
+// handlers look headers up by their http/1.1 spelling, content-type becomes Content-Type
+static void title_case(char *name) {
+	bool upper = true;
+	for (char *p = name; *p != '\0'; p++) {
+		if (upper)
+			*p = (char) toupper((unsigned char) *p);
+		upper = *p == '-';
+	}
+}
+
+static int stream_field(void *user, char *name, const size_t name_len, char *value, const size_t value_len) {
+	struct h2_stream *s = user;
+	s->bytes += name_len + value_len + H2_HEADER_FIELD_OVERHEAD;
+	if (s->malformed)
+		return 0;
+	if (name[0] == ':') {
+		if (s->fields_seen) {
+			s->malformed = true;
+		} else if (strcmp(name, ":method") == 0) {
+			s->req.request_line.method = parse_http_method((struct str_view) {value, value_len});
+		} else if (strcmp(name, ":path") == 0) {
+			s->req.request_line.uri = (struct str_view) {value, value_len};
+		} else if (strcmp(name, ":authority") == 0) {
+			set_http_field("Host", value, &s->req.headers);
+		} else if (strcmp(name, ":scheme") != 0) {
+			s->malformed = true;
+		}
+		return 0;
+	}
+	s->fields_seen = true;
+	for (size_t i = 0; i < name_len; i++) {
+		if (isupper((unsigned char) name[i]))
+			s->malformed = true;
+	}
+	if (s->malformed || (connection_specific((struct str_view) {name, name_len}) &&
+	                     strcmp(name, "content-length") != 0) ||
+	    (strcmp(name, "te") == 0 && strcmp(value, "trailers") != 0)) {
+		s->malformed = true;
+		return 0;
+	}
+	title_case(name);
+	// cookies may be split into one field per crumb
+	const struct str_view cookie = strcmp(name, "Cookie") == 0 ? get_http_header(name, &s->req.headers)
+		                               : (struct str_view) {NULL, 0};
+	if (cookie.ptr != NULL) {
+		char *joined = arena_alloc(&s->arena, cookie.len + 2 + value_len + 1);
+		if (joined == NULL)
+			return -1;
+		memcpy(joined, cookie.ptr, cookie.len);
+		memcpy(joined + cookie.len, "; ", 2);
+		memcpy(joined + cookie.len + 2, value, value_len + 1);
+		value = joined;
+	} else if (!HEADER_EXISTS(name, &s->req.headers) &&
+	           s->req.headers.nfields >= REQUEST_HEADER_FIELDS_LIMIT) {
+		s->malformed = true;
+		return 0;
+	}
+	return set_http_field(name, value, &s->req.headers);
+}
+
+static int discard_field([[maybe_unused]] void *user, [[maybe_unused]] char *name,
+                         [[maybe_unused]] size_t name_len, [[maybe_unused]] char *value,
+                         [[maybe_unused]] size_t value_len) {
+	return 0;
+}
+
+static enum h2_error end_headers(struct h2_conn *c) {
+	const uint32_t id = c->hblock_stream;
+	const bool end_stream = c->hblock_end_stream;
+	c->hblock_stream = 0;
+	bool known;
+	struct h2_stream *s = stream_find_open(c, id, &known);
+	if (known) {
+		// trailers, only valid as the end of an open stream
+		if (s == NULL || !end_stream)
+			return H2_PROTOCOL_ERROR;
+		// decoded for the hpack state only, handlers don't see trailers
+		if (hpack_decode(&c->hpack, c->hblock, c->hblock_len, &c->scratch, discard_field, NULL) == -1)
+			return H2_COMPRESSION_ERROR;
+		arena_reset(&c->scratch);
+		dispatch(c, s);
+		return H2_NO_ERROR;
+	}
+	if (id <= c->last_stream_id)
+		return H2_PROTOCOL_ERROR;
+	c->last_stream_id = id;
+	if (c->goaway_sent || stream_count(c) >= c->srv->max_concurrent_streams) {
+		const int stat = hpack_decode(&c->hpack, c->hblock, c->hblock_len, &c->scratch, discard_field, NULL);
+		arena_reset(&c->scratch);
+		if (stat == -1)
+			return H2_COMPRESSION_ERROR;
+		return c->goaway_sent ? H2_NO_ERROR : stream_error(c, NULL, id, H2_REFUSED_STREAM);
+	}
+	s = stream_create(c, id);
+	if (s == NULL)
+		return H2_INTERNAL_ERROR;
+	if (hpack_decode(&c->hpack, c->hblock, c->hblock_len, &s->arena, stream_field, s) == -1) {
+		stream_remove(c, s);
+		return H2_COMPRESSION_ERROR;
+	}
+	if (s->bytes > c->srv->request_max)
+		return stream_error(c, s, id, H2_ENHANCE_YOUR_CALM);
+	if (s->malformed || s->req.request_line.uri.ptr == NULL || s->req.request_line.method == HTTP_METHOD_UNKNOWN ||
+	    parse_http_target(&s->req) == -1)
+		return stream_error(c, s, id, H2_PROTOCOL_ERROR);
+	if (end_stream)
+		dispatch(c, s);
+	return H2_NO_ERROR;
+}
+
+static enum h2_error append_header_block(struct h2_conn *c, const uint8_t *p, const size_t len) {
+	if (c->hblock_len + len > c->srv->request_max)
+		return H2_ENHANCE_YOUR_CALM;
+	if (c->hblock_len + len > c->hblock_cap) {
+		size_t cap = c->hblock_cap ? c->hblock_cap * 2 : HTTP2_FRAME_SIZE_DEFAULT;
+		while (cap < c->hblock_len + len)
+			cap *= 2;
+		uint8_t *tmp = realloc(c->hblock, cap);
+		if (tmp == NULL) {
+			sys_error_printf("realloc failed");
+			return H2_INTERNAL_ERROR;
+		}
+		c->hblock = tmp;
+		c->hblock_cap = cap;
+	}
+	memcpy(c->hblock + c->hblock_len, p, len);
+	c->hblock_len += len;
+	return H2_NO_ERROR;
+}
+
+// strips the pad length byte and the padding, -1 when the padding doesn't fit
+static int strip_padding(const uint8_t flags, const uint8_t **p, size_t *len) {
+	if (!(flags & FLAG_PADDED))
+		return 0;
+	if (*len < 1 || (*p)[0] >= *len)
+		return -1;
+	*len -= 1 + (*p)[0];
+	(*p)++;
+	return 0;
+}
+
+static enum h2_error on_headers(struct h2_conn *c, const uint8_t flags, const uint32_t id, const uint8_t *p,
+                                size_t len) {
+	if (id == 0 || id % 2 == 0 || strip_padding(flags, &p, &len) == -1)
+		return H2_PROTOCOL_ERROR;
+	if (flags & FLAG_PRIORITY) {
+		if (len < 5)
+			return H2_PROTOCOL_ERROR;
+		p += 5;
+		len -= 5;
+	}
+	c->hblock_stream = id;
+	c->hblock_end_stream = flags & FLAG_END_STREAM;
+	c->hblock_len = 0;
+	const enum h2_error err = append_header_block(c, p, len);
+	if (err != H2_NO_ERROR || !(flags & FLAG_END_HEADERS))
+		return err;
+	return end_headers(c);
+}
+
+static enum h2_error on_data(struct h2_conn *c, const uint8_t flags, const uint32_t id, const uint8_t *p,
+                             size_t len) {
+	if (id == 0)
+		return H2_PROTOCOL_ERROR;
+	// padding counts against the windows too
+	c->recv_window -= (int64_t) len;
+	if (c->recv_window < 0)
+		return H2_FLOW_CONTROL_ERROR;
+	c->recv_unacked += len;
+	if (c->recv_unacked >= HTTP2_WINDOW_DEFAULT / 2) {
+		write_u32_frame(c, FRAME_WINDOW_UPDATE, 0, (uint32_t) c->recv_unacked);
+		c->recv_window += (int64_t) c->recv_unacked;
+		c->recv_unacked = 0;
+	}
+	const size_t frame_len = len;
+	if (strip_padding(flags, &p, &len) == -1)
+		return H2_PROTOCOL_ERROR;
+	bool known;
+	struct h2_stream *s = stream_find_open(c, id, &known);
+	if (s == NULL)
+		return id > c->last_stream_id ? H2_PROTOCOL_ERROR : stream_error(c, NULL, id, H2_STREAM_CLOSED);
+	s->recv_window -= (int64_t) frame_len;
+	if (s->recv_window < 0)
+		return stream_error(c, s, id, H2_FLOW_CONTROL_ERROR);
+	s->bytes += len;
+	if (s->bytes > c->srv->request_max)
+		return stream_error(c, s, id, H2_ENHANCE_YOUR_CALM);
+	if (s->req.body.len + len + 1 > s->body_cap) {
+		// the body is the last allocation in the stream's arena, it mostly grows in place
+		size_t cap = s->body_cap ? s->body_cap * 2 : len + 1;
+		while (cap < s->req.body.len + len + 1)
+			cap *= 2;
+		char *body = arena_realloc(&s->arena, s->req.body.ptr, s->body_cap, cap);
+		if (body == NULL)
+			return stream_error(c, s, id, H2_INTERNAL_ERROR);
+		s->req.body.ptr = body;
+		s->body_cap = cap;
+	}
+	if (len > 0) {
+		char *body = s->req.body.ptr;
+		memcpy(body + s->req.body.len, p, len);
+		s->req.body.len += len;
+		body[s->req.body.len] = '\0';
+	}
+	if (flags & FLAG_END_STREAM) {
+		dispatch(c, s);
+		return H2_NO_ERROR;
+	}
+	s->recv_unacked += frame_len;
+	if (s->recv_unacked >= c->srv->initial_window_size / 2) {
+		write_u32_frame(c, FRAME_WINDOW_UPDATE, id, (uint32_t) s->recv_unacked);
+		s->recv_window += (int64_t) s->recv_unacked;
+		s->recv_unacked = 0;
+	}
+	return H2_NO_ERROR;
+}
+
+static enum h2_error apply_settings(struct h2_conn *c, const uint8_t *p, const size_t len) {
+	if (len % 6 != 0)
+		return H2_FRAME_SIZE_ERROR;
+	enum h2_error err = H2_NO_ERROR;
+	pthread_mutex_lock(&c->lock);
+	for (size_t i = 0; i < len && err == H2_NO_ERROR; i += 6) {
+		const uint16_t id = (uint16_t) (p[i] << 8 | p[i + 1]);
+		const uint32_t v = get32(p + i + 2);
+		switch (id) {
+			case SETTINGS_ENABLE_PUSH:
+				if (v > 1)
+					err = H2_PROTOCOL_ERROR;
+				break;
+			case SETTINGS_INITIAL_WINDOW_SIZE:
+				if (v > H2_WINDOW_MAX) {
+					err = H2_FLOW_CONTROL_ERROR;
+					break;
+				}
+				// applies to open streams as a delta
+				for (struct h2_stream *s = c->streams; s != NULL; s = s->next)
+					s->send_window += (int64_t) v - c->peer_initial_window;
+				c->peer_initial_window = v;
+				pthread_cond_broadcast(&c->cond);
+				break;
+			case SETTINGS_MAX_FRAME_SIZE:
+				if (v < HTTP2_FRAME_SIZE_DEFAULT || v > H2_FRAME_SIZE_MAX)
+					err = H2_PROTOCOL_ERROR;
+				else
+					c->peer_max_frame = v;
+				break;
+			default:
+				// the encoder keeps no dynamic table, the table size doesn't matter to it
+				break;
+		}
+	}
+	pthread_mutex_unlock(&c->lock);
+	return err;
+}
+
+static enum h2_error on_frame(struct h2_conn *c, const enum h2_frame_type type, const uint8_t flags,
+                              const uint32_t id, const uint8_t *p, const size_t len) {
+	if (c->hblock_stream != 0) {
+		if (type != FRAME_CONTINUATION || id != c->hblock_stream)
+			return H2_PROTOCOL_ERROR;
+		const enum h2_error err = append_header_block(c, p, len);
+		if (err != H2_NO_ERROR || !(flags & FLAG_END_HEADERS))
+			return err;
+		return end_headers(c);
+	}
+	switch (type) {
+		case FRAME_DATA:
+			return on_data(c, flags, id, p, len);
+		case FRAME_HEADERS:
+			return on_headers(c, flags, id, p, len);
+		case FRAME_PRIORITY:
+			return id == 0 ? H2_PROTOCOL_ERROR : H2_NO_ERROR;
+		case FRAME_RST_STREAM: {
+			if (id == 0 || id > c->last_stream_id)
+				return H2_PROTOCOL_ERROR;
+			if (len != 4)
+				return H2_FRAME_SIZE_ERROR;
+			pthread_mutex_lock(&c->lock);
+			struct h2_stream *s = stream_find(c, id);
+			const bool open = s != NULL && s->state == STREAM_OPEN;
+			// a claimed stream is freed by whoever runs it
+			if (s != NULL && !open) {
+				s->reset = true;
+				pthread_cond_broadcast(&c->cond);
+			}
+			pthread_mutex_unlock(&c->lock);
+			if (open)
+				stream_remove(c, s);
+			return H2_NO_ERROR;
+		}
+		case FRAME_SETTINGS: {
+			if (id != 0)
+				return H2_PROTOCOL_ERROR;
+			if (flags & FLAG_ACK)
+				return len == 0 ? H2_NO_ERROR : H2_FRAME_SIZE_ERROR;
+			const enum h2_error err = apply_settings(c, p, len);
+			if (err == H2_NO_ERROR)
+				write_frame(c, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+			return err;
+		}
+		case FRAME_PING:
+			if (id != 0)
+				return H2_PROTOCOL_ERROR;
+			if (len != 8)
+				return H2_FRAME_SIZE_ERROR;
+			if (!(flags & FLAG_ACK))
+				write_frame(c, FRAME_PING, FLAG_ACK, 0, p, len);
+			return H2_NO_ERROR;
+		case FRAME_GOAWAY:
+			if (id != 0)
+				return H2_PROTOCOL_ERROR;
+			c->goaway_received = true;
+			return H2_NO_ERROR;
+		case FRAME_WINDOW_UPDATE: {
+			if (len != 4)
+				return H2_FRAME_SIZE_ERROR;
+			const uint32_t inc = get32(p) & 0x7fffffff;
+			enum h2_error err = H2_NO_ERROR;
+			pthread_mutex_lock(&c->lock);
+			struct h2_stream *s = id ? stream_find(c, id) : NULL;
+			int64_t *window = id ? (s ? &s->send_window : NULL) : &c->send_window;
+			if (inc == 0)
+				err = id ? H2_NO_ERROR : H2_PROTOCOL_ERROR;
+			else if (window != NULL && *window + inc > H2_WINDOW_MAX)
+				err = H2_FLOW_CONTROL_ERROR;
+			else if (window != NULL)
+				*window += inc;
+			const bool stream_error = id != 0 && (inc == 0 || err != H2_NO_ERROR);
+			// s is freed by the worker finishing it once the lock is dropped
+			if (stream_error && s != NULL)
+				s->reset = true;
+			pthread_cond_broadcast(&c->cond);
+			pthread_mutex_unlock(&c->lock);
+			if (stream_error) {
+				write_u32_frame(c, FRAME_RST_STREAM, id, inc ? H2_FLOW_CONTROL_ERROR : H2_PROTOCOL_ERROR);
+				return H2_NO_ERROR;
+			}
+			return err;
+		}
+		case FRAME_PUSH_PROMISE:
+		case FRAME_CONTINUATION:
+			return H2_PROTOCOL_ERROR;
+	}
+	// unknown frame types are ignored
+	return H2_NO_ERROR;
+}
+
+// reads until rlen >= n. -1 on EOF, errors, a drain or a timeout with nothing in flight
+static int fill(struct h2_conn *c, const size_t n) {
+	const struct http2_server *srv = c->srv;
+	while (c->rlen < n) {
+		const bool idle = c->rlen == 0 && stream_count(c) == 0;
+		// idle must be visible before checking for a drain, same as the http/1.1 loop
+		if (idle && srv->set_idle != NULL)
+			srv->set_idle(c->ctx, true);
+		if (idle && srv->draining != NULL && srv->draining())
+			return -1;
+		const ssize_t r = recv(c->fd, c->rbuf + c->rlen, c->rcap - c->rlen, 0);
+		if (idle && srv->set_idle != NULL)
+			srv->set_idle(c->ctx, false);
+		if (r == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				if (stream_count(c) == 0)
+					return -1;
+				continue;
+			}
+			sys_error_printf("recv failed");
+			return -1;
+		}
+		if (r == 0)
+			return -1;
+		c->rlen += (size_t) r;
+		metrics_add(METRIC_BYTES_RECEIVED, (uint64_t) r);
+	}
+	return 0;
+}
+
+static void consume(struct h2_conn *c, const size_t n) {
+	memmove(c->rbuf, c->rbuf + n, c->rlen - n);
+	c->rlen -= n;
+}
+
+static int base64url_decode(const struct str_view in, uint8_t *out, const size_t outn) {
+	uint32_t acc = 0;
+	unsigned int bits = 0;
+	size_t n = 0;
+	const char *end = in.ptr + in.len;
+	for (const char *s = in.ptr; s < end && *s != '='; s++) {
+		int v;
+		if (*s >= 'A' && *s <= 'Z') v = *s - 'A';
+		else if (*s >= 'a' && *s <= 'z') v = *s - 'a' + 26;
+		else if (*s >= '0' && *s <= '9') v = *s - '0' + 52;
+		else if (*s == '-' || *s == '+') v = 62;
+		else if (*s == '_' || *s == '/') v = 63;
+		else return -1;
+		acc = acc << 6 | (uint32_t) v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			if (n >= outn)
+				return -1;
+			out[n++] = (uint8_t) (acc >> bits);
+		}
+	}
+	return (int) n;
+}
+
+// the http/1.1 request becomes stream 1, half closed since its body (none) is complete
+static enum h2_error upgrade_stream(struct h2_conn *c, const struct HttpRequest *req) {
+	static const char switching[] = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+	uint8_t settings[256];
+	const int n = base64url_decode(get_http_header("HTTP2-Settings", &req->headers), settings, sizeof(settings));
+	if (n == -1)
+		return H2_PROTOCOL_ERROR;
+	if (write_frame_raw(c, switching, sizeof(switching) - 1) == -1)
+		return H2_INTERNAL_ERROR;
+	const enum h2_error err = apply_settings(c, settings, (size_t) n);
+	if (err != H2_NO_ERROR)
+		return err;
+	struct h2_stream *s = stream_create(c, 1);
+	if (s == NULL)
+		return H2_INTERNAL_ERROR;
+	s->upgraded = true;
+	s->req.request_line.method = req->request_line.method;
+	// the views point into the connection's receive buffer, the stream outlives it
+	const struct str_view uri = req->request_line.uri;
+	s->req.request_line.uri = (struct str_view) {arena_strndup(&s->arena, uri.ptr, uri.len), uri.len};
+	if (s->req.request_line.uri.ptr == NULL || parse_http_target(&s->req) == -1)
+		return H2_INTERNAL_ERROR;
+	for (size_t i = 0; i < req->headers.nfields; i++) {
+		const struct HttpField *f = &req->headers.fields[i];
+		if (connection_specific(f->key) || str_view_case_eq(f->key, "HTTP2-Settings"))
+			continue;
+		char *key = arena_strndup(&s->arena, f->key.ptr, f->key.len);
+		char *value = arena_strndup(&s->arena, f->value.ptr, f->value.len);
+		if (key == NULL || value == NULL ||
+		    add_http_field((struct str_view) {key, f->key.len}, (struct str_view) {value, f->value.len},
+		                   &s->req.headers) == -1)
+			break;
+	}
+	c->last_stream_id = 1;
+	return H2_NO_ERROR;
+}
+
+static struct h2_conn *conn_create(const struct http2_server *srv, const int fd, void *ctx) {
+	struct h2_conn *c = calloc(1, sizeof(*c));
+	if (c == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	c->srv = srv;
+	c->fd = fd;
+	c->ctx = ctx;
+	atomic_init(&c->refs, 1);
+	atomic_init(&c->dead, false);
+	c->send_window = HTTP2_WINDOW_DEFAULT;
+	c->peer_initial_window = HTTP2_WINDOW_DEFAULT;
+	c->peer_max_frame = HTTP2_FRAME_SIZE_DEFAULT;
+	c->recv_window = HTTP2_WINDOW_DEFAULT;
+	c->rcap = H2_FRAME_HEADER_LEN + HTTP2_FRAME_SIZE_DEFAULT;
+	c->rbuf = malloc(c->rcap);
+	if (c->rbuf == NULL || hpack_decoder_init(&c->hpack, HPACK_TABLE_SIZE_DEFAULT) == -1) {
+		sys_error_printf("malloc failed");
+		free(c->rbuf);
+		free(c);
+		return NULL;
+	}
+	arena_init(&c->scratch);
+	pthread_mutex_init(&c->lock, NULL);
+	pthread_cond_init(&c->cond, NULL);
+	pthread_mutex_init(&c->write_lock, NULL);
+	return c;
+}
+
+// runs what no worker picked up yet and waits for the rest, after this nothing touches fd
+static void conn_finish(struct h2_conn *c) {
+	pthread_mutex_lock(&c->lock);
+	while (1) {
+		struct h2_stream *ready = NULL;
+		for (struct h2_stream *s = c->streams; s != NULL; s = s->next) {
+			if (s->state == STREAM_READY) {
+				ready = s;
+				break;
+			}
+		}
+		if (ready != NULL) {
+			ready->state = STREAM_RUNNING;
+			c->running++;
+			pthread_mutex_unlock(&c->lock);
+			run_stream(c, ready);
+			pthread_mutex_lock(&c->lock);
+			continue;
+		}
+		if (c->running == 0)
+			break;
+		pthread_cond_wait(&c->cond, &c->lock);
+	}
+	// whatever is left never finished its request
+	while (c->streams != NULL) {
+		struct h2_stream *s = c->streams;
+		stream_unlink(c, s);
+		stream_free(s);
+	}
+	pthread_mutex_unlock(&c->lock);
+	hpack_decoder_free(&c->hpack);
+	arena_destroy(&c->scratch);
+	free(c->rbuf);
+	free(c->hblock);
+	// queued tasks still hold references, they only look for their stream
+	conn_unref(c);
+}
+
+int http2_serve(const struct http2_server *srv, const int fd, const char *initial, const size_t initial_len,
+                const struct HttpRequest *upgrade, void *ctx) {
+	struct h2_conn *c = conn_create(srv, fd, ctx);
+	if (c == NULL)
+		return -1;
+	if (initial_len > c->rcap) {
+		lprintf(ERROR, "http2: %zu bytes before the first frame", initial_len);
+		conn_finish(c);
+		return -1;
+	}
+	// on the upgrade path it's what the client sent right behind the request, often nothing
+	if (initial_len > 0)
+		memcpy(c->rbuf, initial, initial_len);
+	c->rlen = initial_len;
+	enum h2_error err = H2_NO_ERROR;
+	if (upgrade != NULL && upgrade_stream(c, upgrade) != H2_NO_ERROR) {
+		lprintf(DEBUG, "http2: h2c upgrade failed");
+		goto finish;
+	}
+	// our preface, the client's may only be checked after sending it
+	uint8_t settings[3 * 6];
+	const uint16_t ids[3] = {SETTINGS_MAX_CONCURRENT_STREAMS, SETTINGS_INITIAL_WINDOW_SIZE,
+	                         SETTINGS_MAX_HEADER_LIST_SIZE};
+	const uint32_t values[3] = {srv->max_concurrent_streams, srv->initial_window_size,
+	                            (uint32_t) (srv->request_max < UINT32_MAX ? srv->request_max : UINT32_MAX)};
+	for (size_t i = 0; i < 3; i++) {
+		settings[i * 6] = (uint8_t) (ids[i] >> 8);
+		settings[i * 6 + 1] = (uint8_t) ids[i];
+		put32(settings + i * 6 + 2, values[i]);
+	}
+	if (write_frame(c, FRAME_SETTINGS, 0, 0, settings, sizeof(settings)) == -1)
+		goto finish;
+	if (fill(c, HTTP2_PREFACE_LEN) == -1 || memcmp(c->rbuf, HTTP2_PREFACE, HTTP2_PREFACE_LEN) != 0) {
+		lprintf(DEBUG, "http2: bad or missing client preface");
+		goto finish;
+	}
+	consume(c, HTTP2_PREFACE_LEN);
+	if (upgrade != NULL)
+		dispatch(c, c->streams);
+	while (err == H2_NO_ERROR) {
+		if (!c->goaway_sent && srv->draining != NULL && srv->draining())
+			write_goaway(c, H2_NO_ERROR);
+		if ((c->goaway_sent || c->goaway_received) && stream_count(c) == 0)
+			break;
+		if (fill(c, H2_FRAME_HEADER_LEN) == -1)
+			break;
+		const size_t len = (size_t) c->rbuf[0] << 16 | (size_t) c->rbuf[1] << 8 | c->rbuf[2];
+		if (len > HTTP2_FRAME_SIZE_DEFAULT) {
+			err = H2_FRAME_SIZE_ERROR;
+			break;
+		}
+		if (fill(c, H2_FRAME_HEADER_LEN + len) == -1)
+			break;
+		err = on_frame(c, (enum h2_frame_type) c->rbuf[3], c->rbuf[4], get32(c->rbuf + 5) & 0x7fffffff,
+		               c->rbuf + H2_FRAME_HEADER_LEN, len);
+		consume(c, H2_FRAME_HEADER_LEN + len);
+	}
+	if (err != H2_NO_ERROR) {
+		lprintf(DEBUG, "http2: connection error %d", err);
+		write_goaway(c, err);
+		atomic_store(&c->dead, true);
+		pthread_mutex_lock(&c->lock);
+		pthread_cond_broadcast(&c->cond);
+		pthread_mutex_unlock(&c->lock);
+	} else if (!c->goaway_sent && !atomic_load(&c->dead)) {
+		write_goaway(c, H2_NO_ERROR);
+	}
+	conn_finish(c);
+	return err == H2_NO_ERROR ? 0 : -1;
+finish:
+	conn_finish(c);
+	return -1;
+}
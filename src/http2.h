@@ -0,0 +1,42 @@
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <stddef.h>
+
+#include "parse_http.h"
+#include "thread_pool.h"
+
+// cleartext http/2 (rfc 9113), by prior knowledge or Upgrade: h2c
+
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_LEN 24
+#define HTTP2_WINDOW_DEFAULT 65535
+#define HTTP2_FRAME_SIZE_DEFAULT 16384
+
+// res starts as an empty 200, same contract as route_request()
+typedef int (*http2_handler)(const struct HttpRequest *req, struct HttpResponse *res);
+
+struct http2_server {
+	http2_handler handler;
+	thread_pool_t *pool; // finished streams run here as tasks, NULL runs them on the connection thread
+	unsigned int max_concurrent_streams;
+	unsigned int initial_window_size; // receive window per stream, at least HTTP2_WINDOW_DEFAULT
+	size_t request_max; // header list plus body of one stream
+	unsigned int send_timeout_sec; // how long a response waits for the peer to open its window
+	// hooks into the caller's connection bookkeeping, ctx is the one given to http2_serve()
+	void (*set_idle)(void *ctx, bool idle);
+	bool (*draining)(void);
+	bool (*admit)(void *ctx); // false answers the stream with a 429
+};
+
+// buf holds the first len bytes read from a connection
+bool http2_is_preface(const char *buf, size_t len);
+// Upgrade: h2c with HTTP2-Settings on a request without a body
+bool http2_is_upgrade(const struct HttpRequest *req);
+// runs the connection until the peer goes away, an error or a drain. initial is what was already
+// read from fd, upgrade is the http/1.1 request that asked for h2c (answered with 101, it becomes
+// stream 1). returns once no stream uses fd anymore, closing it is up to the caller
+int http2_serve(const struct http2_server *srv, int fd, const char *initial, size_t initial_len,
+                const struct HttpRequest *upgrade, void *ctx);
+
+#endif //HTTP2_H
@@ -1,50 +1,71 @@
 #include "json_parse.h"
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+// allocations go to the arena when there is one, the tree is then released with the arena
+static void *json_alloc(arena_t *a, const size_t size) {
+	return a ? arena_alloc(a, size) : malloc(size);
+}
+
+static void *json_realloc(arena_t *a, void *ptr, const size_t old_size, const size_t size) {
+	return a ? arena_realloc(a, ptr, old_size, size) : realloc(ptr, size);
+}
+
+static void json_release(arena_t *a, void *ptr) {
+	if (a == NULL)
+		free(ptr);
+}
+
 typedef struct {
 	char *ptr;
 	size_t size; // size includes null terminator
 	size_t len; // size doenst include null terminator
 	size_t capacity;
 	size_t min_size;
+	arena_t *arena;
 } dynam_str;
 
-int dynam_str_init(dynam_str *ds, const char *str) {
+static int dynam_str_init(dynam_str *ds, const char *str, arena_t *arena) {
 	if (ds == NULL || str == NULL) {
 		fprintf(stderr, "null arg ptr\n");
 		return -1;
 	}
 	ds->min_size = 16;
+	ds->arena = arena;
 	const size_t len = strlen(str);
 	const size_t len_min = (len + 1) < ds->min_size ? ds->min_size - 1 : len;
 	ds->capacity = len_min + 1;
-	ds->ptr = malloc(ds->capacity);
+	ds->ptr = json_alloc(arena, ds->capacity);
 	if (ds->ptr == NULL) {
 		perror("malloc failed");
 		return -1;
 	}
 	ds->len = len;
-	ds->size = len_min + 1;
+	ds->size = len + 1;
 	strcpy(ds->ptr, str);
 	return 0;
 }
 
-int dynam_str_resize(dynam_str *ds, const size_t size) {
-	ds->ptr = realloc(ds->ptr, size);
-	if (ds->ptr == NULL) {
+static int dynam_str_resize(dynam_str *ds, const size_t size) {
+	char *tmp = json_realloc(ds->arena, ds->ptr, ds->capacity, size);
+	if (tmp == NULL) {
+		perror("realloc failed");
 		return -1;
 	}
+	ds->ptr = tmp;
 	ds->capacity = size;
 	return 0;
 }
 
-int dynam_str_append_char(dynam_str *ds, const char c) {
+static int dynam_str_append_char(dynam_str *ds, const char c) {
 	while (ds->size + 1 >= ds->capacity) {
-		dynam_str_resize(ds, ds->size * 2);
+		if (dynam_str_resize(ds, ds->capacity * 2) == -1)
+			return -1;
 	}
 	ds->ptr[ds->len] = c;
 	ds->ptr[ds->len + 1] = '\0';
@@ -53,19 +74,9 @@ int dynam_str_append_char(dynam_str *ds, const char c) {
 	return 0;
 }
 
-int dynam_str_append_str(dynam_str *ds, const char *str) {
-	const size_t len = strlen(str);
-	while (ds->size + len >= ds->capacity) {
-		dynam_str_resize(ds, ds->size * 2);
-	}
-	ds->len += len;
-	ds->size += len;
-	strcpy(ds->ptr + len, str);
-	return 0;
-}
-
-int dynam_str_free(dynam_str *ds) {
-	free(ds);
+static int dynam_str_free(dynam_str *ds) {
+	json_release(ds->arena, ds->ptr);
+	ds->ptr = NULL;
 	return 0;
 }
 
@@ -73,10 +84,14 @@ struct key_value;
 
 typedef struct {
 	struct key_value *pairs;
+	size_t npairs;
+	size_t capacity;
 } json_object;
 
 typedef struct {
 	json_value *elements;
+	size_t nelements;
+	size_t capacity;
 } json_array;
 
 typedef struct {
@@ -91,7 +106,7 @@ enum json_number_type {
 typedef struct {
 	enum json_number_type type ;
 	union {
-		int i;
+		int64_t i;
 		double f;
 	} val;
 } json_number;
@@ -100,7 +115,9 @@ enum value_t {
 	OBJECT,
 	ARRAY,
 	STRING,
-	NUMBER
+	NUMBER,
+	BOOL,
+	NUL
 };
 
 
@@ -111,6 +128,7 @@ struct json_value {
 		json_array value_array;
 		json_string value_string;
 		json_number value_number;
+		bool value_bool;
 	} json_value;
 };
 
@@ -119,68 +137,154 @@ struct key_value {
 	json_value value;
 };
 
-int json_parse_string(const char *str, int *i, json_value *s) {
+static int json_parse_value(const char *str, int *i, json_value *v, arena_t *a);
+static void json_value_free(json_value *v, arena_t *a);
+
+static int json_parse_hex4(const char *str, const int at, uint32_t *out) {
+	uint32_t v = 0;
+	for (int k = 0; k < 4; k++) {
+		const char c = str[at + k];
+		uint32_t d;
+		if (c >= '0' && c <= '9')
+			d = (uint32_t) (c - '0');
+		else if (c >= 'a' && c <= 'f')
+			d = (uint32_t) (c - 'a' + 10);
+		else if (c >= 'A' && c <= 'F')
+			d = (uint32_t) (c - 'A' + 10);
+		else
+			return -1;
+		v = v << 4 | d;
+	}
+	*out = v;
+	return 0;
+}
+
+/* str[*i] is the 'u' of a \uXXXX escape, left on its last hex digit. a utf-16 surrogate pair is two escapes
+ * joined into one code point, a lone surrogate and \u0000 (strings end at a nul) are errors
+ */
+static int json_parse_unicode_escape(const char *str, int *i, uint32_t *cp) {
+	if (json_parse_hex4(str, *i + 1, cp) == -1 || *cp == 0 || (*cp >= 0xdc00 && *cp <= 0xdfff))
+		return -1;
+	*i += 4;
+	if (*cp < 0xd800 || *cp > 0xdbff)
+		return 0;
+	uint32_t low;
+	if (str[*i + 1] != '\\' || str[*i + 2] != 'u' || json_parse_hex4(str, *i + 3, &low) == -1 || low < 0xdc00 ||
+	    low > 0xdfff)
+		return -1;
+	*cp = 0x10000 + ((*cp - 0xd800) << 10) + (low - 0xdc00);
+	*i += 6;
+	return 0;
+}
+
+static size_t json_utf8_encode(const uint32_t cp, char *out) {
+	if (cp < 0x80) {
+		out[0] = (char) cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = (char) (0xc0 | cp >> 6);
+		out[1] = (char) (0x80 | (cp & 0x3f));
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = (char) (0xe0 | cp >> 12);
+		out[1] = (char) (0x80 | (cp >> 6 & 0x3f));
+		out[2] = (char) (0x80 | (cp & 0x3f));
+		return 3;
+	}
+	out[0] = (char) (0xf0 | cp >> 18);
+	out[1] = (char) (0x80 | (cp >> 12 & 0x3f));
+	out[2] = (char) (0x80 | (cp >> 6 & 0x3f));
+	out[3] = (char) (0x80 | (cp & 0x3f));
+	return 4;
+}
+
+static int json_parse_string(const char *str, int *i, json_value *s, arena_t *a) {
 	if (str == NULL || i == NULL || s == NULL) {
 		fprintf(stderr, "null arg ptr\n");
 		return -1;
 	}
-	dynam_str *chars = malloc(sizeof(dynam_str));
-	dynam_str_init(chars, "");
-	size_t int_i = 0;
-	assert(str[*i] == '"');
+	dynam_str chars;
+	if (dynam_str_init(&chars, "", a) == -1)
+		return -1;
+	if (str[*i] != '"') {
+		fprintf(stderr, "expected '\"' at %d\n", *i);
+		goto fail;
+	}
 	(*i)++;
 	while (true) {
 		if (str[*i] == '"') {
 			(*i)++;
 			break;
 		}
+		int stat = 0;
 		if (str[*i] == '\\') {
 			(*i)++;
 			switch (str[*i]) {
 				case '"':
-					dynam_str_append_char(chars, '"');
+					stat = dynam_str_append_char(&chars, '"');
 					break;
 				case '\\':
-					dynam_str_append_char(chars, '\\');
+					stat = dynam_str_append_char(&chars, '\\');
 					break;
 				case '/':
-					dynam_str_append_char(chars, '/');
+					stat = dynam_str_append_char(&chars, '/');
 					break;
 				case 'b':
-					dynam_str_append_char(chars, '\b');
+					stat = dynam_str_append_char(&chars, '\b');
 					break;
 				case 'f':
-					dynam_str_append_char(chars, '\f');
+					stat = dynam_str_append_char(&chars, '\f');
 					break;
 				case 'n':
-					dynam_str_append_char(chars, '\n');
+					stat = dynam_str_append_char(&chars, '\n');
 					break;
 				case 'r':
-					dynam_str_append_char(chars, '\r');
+					stat = dynam_str_append_char(&chars, '\r');
 					break;
-				case 'u':
-					dynam_str_append_char(chars, 'u');
+				case 't':
+					stat = dynam_str_append_char(&chars, '\t');
 					break;
+				case 'u': {
+					const int start = *i - 1;
+					uint32_t cp;
+					if (json_parse_unicode_escape(str, i, &cp) == -1) {
+						fprintf(stderr, "invalid \\u escape at %d\n", start);
+						goto fail;
+					}
+					char utf8[4];
+					const size_t n = json_utf8_encode(cp, utf8);
+					for (size_t k = 0; k < n && stat == 0; k++)
+						stat = dynam_str_append_char(&chars, utf8[k]);
+					break;
+				}
 				default:
-					fprintf(stderr, "errrr brr\n");
-					return -1;
+					fprintf(stderr, "invalid escape '\\%c' at %d\n", str[*i], *i);
+					goto fail;
 			}
 		} else {
 			if (str[*i] >= 32 && str[*i] <= 126) {
-				dynam_str_append_char(chars, str[*i]);
+				stat = dynam_str_append_char(&chars, str[*i]);
 			} else {
-				return -1;
+				fprintf(stderr, "invalid string character at %d\n", *i);
+				goto fail;
 			}
 		}
+		if (stat == -1)
+			goto fail;
 		(*i)++;
-		int_i++;
 	}
-	dynam_str_append_char(chars, '\0');
-	s->json_value.value_string.str = chars->ptr;
+	s->value_t = STRING;
+	s->json_value.value_string.str = chars.ptr;
 	return 0;
+fail:
+	dynam_str_free(&chars);
+	return -1;
 }
 
-int json_parse_whitespace(const char *str, int *i) {
+// also skips // line comments, the config examples in the README use them
+static int json_parse_whitespace(const char *str, int *i) {
 	while (true) {
 		switch (str[*i]) {
 			case 9:
@@ -189,83 +293,383 @@ int json_parse_whitespace(const char *str, int *i) {
 			case 32:
 				(*i)++;
 				break;
+			case '/':
+				if (str[*i + 1] != '/')
+					return 0;
+				while (str[*i] != '\0' && str[*i] != '\n')
+					(*i)++;
+				break;
 			default:
 				return 0;
 		}
 	}
 }
 
-char *json_parse_value(const char *str, int *i) {
-	json_parse_whitespace(str, i);
-	(*i) += 1;
-	json_parse_whitespace(str, i);
-	return (char*)1;
+// the length of the json number at str, 0 when it isn't one. strtod alone would also take inf, nan, hex and 01
+static size_t json_number_span(const char *str, bool *integral) {
+	size_t n = str[0] == '-';
+	if (str[n] == '0')
+		n++;
+	else if (str[n] >= '1' && str[n] <= '9')
+		while (isdigit((unsigned char) str[n]))
+			n++;
+	else
+		return 0;
+	*integral = true;
+	if (str[n] == '.') {
+		if (!isdigit((unsigned char) str[++n]))
+			return 0;
+		while (isdigit((unsigned char) str[n]))
+			n++;
+		*integral = false;
+	}
+	if (str[n] == 'e' || str[n] == 'E') {
+		n++;
+		if (str[n] == '+' || str[n] == '-')
+			n++;
+		if (!isdigit((unsigned char) str[n]))
+			return 0;
+		while (isdigit((unsigned char) str[n]))
+			n++;
+		*integral = false;
+	}
+	return n;
+}
+
+static int json_parse_number(const char *str, int *i, json_value *v) {
+	const char *start = str + *i;
+	bool integral;
+	const size_t len = json_number_span(start, &integral);
+	if (len == 0) {
+		fprintf(stderr, "expected number at %d\n", *i);
+		return -1;
+	}
+	char *end;
+	const double f = strtod(start, &end);
+	// a leading 0 followed by x is where strtod reads further than json
+	if (end != start + len) {
+		fprintf(stderr, "invalid number at %d\n", *i);
+		return -1;
+	}
+	v->value_t = NUMBER;
+	if (integral) {
+		// integers are kept exact, one past int64 is only a double
+		char *int_end;
+		errno = 0;
+		const long long ll = strtoll(start, &int_end, 10);
+		if (int_end == end && errno == 0) {
+			v->json_value.value_number.type = INT;
+			v->json_value.value_number.val.i = ll;
+		} else {
+			v->json_value.value_number.type = FLOAT;
+			v->json_value.value_number.val.f = f;
+		}
+	} else {
+		v->json_value.value_number.type = FLOAT;
+		v->json_value.value_number.val.f = f;
+	}
+	*i += (int) len;
+	return 0;
 }
 
+static int json_parse_literal(const char *str, int *i, json_value *v) {
+	if (strncmp(str + *i, "true", 4) == 0) {
+		v->value_t = BOOL;
+		v->json_value.value_bool = true;
+		*i += 4;
+		return 0;
+	}
+	if (strncmp(str + *i, "false", 5) == 0) {
+		v->value_t = BOOL;
+		v->json_value.value_bool = false;
+		*i += 5;
+		return 0;
+	}
+	if (strncmp(str + *i, "null", 4) == 0) {
+		v->value_t = NUL;
+		*i += 4;
+		return 0;
+	}
+	fprintf(stderr, "unexpected character '%c' at %d\n", str[*i], *i);
+	return -1;
+}
 
-int json_parse_object(const char *str, int *i, json_value *v) {
+static int json_parse_object(const char *str, int *i, json_value *v, arena_t *a) {
 	assert(str[*i] == '{');
 	(*i)++;
+	v->value_t = OBJECT;
+	json_object *obj = &v->json_value.value_object;
+	obj->pairs = NULL;
+	obj->npairs = 0;
+	obj->capacity = 0;
 	json_parse_whitespace(str, i);
 	if (str[*i] == '}') {
-		printf("empty object\n");
+		(*i)++;
 		return 0;
 	}
 	while (true) {
 		json_parse_whitespace(str, i);
-		json_value sdf;
-		if (json_parse_string(str, i, &sdf) == -1) {
-			return -1;
+		if (obj->npairs == obj->capacity) {
+			const size_t capacity = obj->capacity == 0 ? 4 : obj->capacity * 2;
+			struct key_value *tmp = json_realloc(a, obj->pairs, obj->capacity * sizeof(*tmp), capacity * sizeof(*tmp));
+			if (tmp == NULL) {
+				perror("realloc failed");
+				goto fail;
+			}
+			obj->pairs = tmp;
+			obj->capacity = capacity;
 		}
+		struct key_value *kv = &obj->pairs[obj->npairs];
+		json_value key;
+		if (json_parse_string(str, i, &key, a) == -1) {
+			goto fail;
+		}
+		kv->key = key.json_value.value_string;
 		json_parse_whitespace(str, i);
-		assert(("expected ':'", str[*i] == ':'));
+		if (str[*i] != ':') {
+			fprintf(stderr, "expected ':' at %d\n", *i);
+			json_release(a, kv->key.str);
+			goto fail;
+		}
 		(*i)++;
-		if (json_parse_value(str, i) == NULL) {
-			return -1;
+		if (json_parse_value(str, i, &kv->value, a) == -1) {
+			json_release(a, kv->key.str);
+			goto fail;
 		}
+		obj->npairs++;
 		switch (str[*i]) {
 			case ',':
+				(*i)++;
 				break;
 			case '}':
-				printf("parsed successuflly!\n");
+				(*i)++;
 				return 0;
 			default:
-				fprintf(stderr, "problem brr\n");
-				return -1;
+				fprintf(stderr, "expected ',' or '}' at %d\n", *i);
+				goto fail;
 		}
 	}
+fail:
+	json_value_free(v, a);
+	return -1;
 }
 
-json_array *json_parse_array(const char *str, int *i) {
+static int json_parse_array(const char *str, int *i, json_value *v, arena_t *a) {
 	assert(str[*i] == '[');
+	(*i)++;
+	v->value_t = ARRAY;
+	json_array *arr = &v->json_value.value_array;
+	arr->elements = NULL;
+	arr->nelements = 0;
+	arr->capacity = 0;
 	json_parse_whitespace(str, i);
 	if (str[*i] == ']') {
-		printf("empty array\n");
-		return NULL;
+		(*i)++;
+		return 0;
 	}
 	while (true) {
-		json_value m;
-		json_parse_object(str, i, &m);
+		if (arr->nelements == arr->capacity) {
+			const size_t capacity = arr->capacity == 0 ? 4 : arr->capacity * 2;
+			json_value *tmp = json_realloc(a, arr->elements, arr->capacity * sizeof(*tmp), capacity * sizeof(*tmp));
+			if (tmp == NULL) {
+				perror("realloc failed");
+				goto fail;
+			}
+			arr->elements = tmp;
+			arr->capacity = capacity;
+		}
+		if (json_parse_value(str, i, &arr->elements[arr->nelements], a) == -1) {
+			goto fail;
+		}
+		arr->nelements++;
 		switch (str[*i]) {
 			case ',':
+				(*i)++;
 				break;
 			case ']':
-				return NULL;
+				(*i)++;
+				return 0;
 			default:
-				fprintf(stderr, "brr\n");
-				return NULL;
+				fprintf(stderr, "expected ',' or ']' at %d\n", *i);
+				goto fail;
 		}
 	}
+fail:
+	json_value_free(v, a);
+	return -1;
 }
 
-int main(void) {
+// parses one value and the whitespace around it
+static int json_parse_value(const char *str, int *i, json_value *v, arena_t *a) {
+	json_parse_whitespace(str, i);
+	int stat;
+	switch (str[*i]) {
+		case '{':
+			stat = json_parse_object(str, i, v, a);
+			break;
+		case '[':
+			stat = json_parse_array(str, i, v, a);
+			break;
+		case '"':
+			stat = json_parse_string(str, i, v, a);
+			break;
+		case '-':
+		case '0': case '1': case '2': case '3': case '4':
+		case '5': case '6': case '7': case '8': case '9':
+			stat = json_parse_number(str, i, v);
+			break;
+		default:
+			stat = json_parse_literal(str, i, v);
+			break;
+	}
+	if (stat == -1) {
+		return -1;
+	}
+	json_parse_whitespace(str, i);
+	return 0;
+}
+
+static void json_value_free(json_value *v, arena_t *a) {
+	if (a != NULL)
+		return;
+	switch (v->value_t) {
+		case OBJECT:
+			for (size_t i = 0; i < v->json_value.value_object.npairs; i++) {
+				free(v->json_value.value_object.pairs[i].key.str);
+				json_value_free(&v->json_value.value_object.pairs[i].value, a);
+			}
+			free(v->json_value.value_object.pairs);
+			break;
+		case ARRAY:
+			for (size_t i = 0; i < v->json_value.value_array.nelements; i++) {
+				json_value_free(&v->json_value.value_array.elements[i], a);
+			}
+			free(v->json_value.value_array.elements);
+			break;
+		case STRING:
+			free(v->json_value.value_string.str);
+			break;
+		case NUMBER:
+		case BOOL:
+		case NUL:
+			break;
+	}
+}
+
+json_value *json_parse_arena(const char *str, arena_t *a) {
+	if (str == NULL) {
+		fprintf(stderr, "null arg ptr\n");
+		return NULL;
+	}
+	json_value *v = json_alloc(a, sizeof(*v));
+	if (v == NULL) {
+		perror("malloc failed");
+		return NULL;
+	}
 	int i = 0;
-	const char *str = "{\"egg\": 1}";
+	if (json_parse_value(str, &i, v, a) == -1) {
+		json_release(a, v);
+		return NULL;
+	}
+	if (str[i] != '\0') {
+		fprintf(stderr, "trailing characters at %d\n", i);
+		json_value_free(v, a);
+		json_release(a, v);
+		return NULL;
+	}
+	return v;
+}
+
+json_value *json_parse(const char *str) {
+	return json_parse_arena(str, NULL);
+}
+
+void json_free(json_value *v) {
+	if (v == NULL)
+		return;
+	json_value_free(v, NULL);
+	free(v);
+}
+
+const json_value *json_object_get(const json_value *obj, const char *key) {
+	if (obj == NULL || key == NULL || obj->value_t != OBJECT)
+		return NULL;
+	for (size_t i = 0; i < obj->json_value.value_object.npairs; i++) {
+		if (strcmp(obj->json_value.value_object.pairs[i].key.str, key) == 0) {
+			return &obj->json_value.value_object.pairs[i].value;
+		}
+	}
+	return NULL;
+}
+
+size_t json_array_len(const json_value *arr) {
+	if (arr == NULL || arr->value_t != ARRAY)
+		return 0;
+	return arr->json_value.value_array.nelements;
+}
+
+const json_value *json_array_get(const json_value *arr, const size_t i) {
+	if (i >= json_array_len(arr))
+		return NULL;
+	return &arr->json_value.value_array.elements[i];
+}
+
+const char *json_get_string(const json_value *v) {
+	if (v == NULL || v->value_t != STRING)
+		return NULL;
+	return v->json_value.value_string.str;
+}
+
+int json_get_number(const json_value *v, double *out) {
+	if (v == NULL || v->value_t != NUMBER)
+		return -1;
+	if (v->json_value.value_number.type == INT) {
+		*out = (double) v->json_value.value_number.val.i;
+	} else {
+		*out = v->json_value.value_number.val.f;
+	}
+	return 0;
+}
+
+int json_get_int(const json_value *v, int64_t *out) {
+	if (v == NULL || v->value_t != NUMBER || v->json_value.value_number.type != INT)
+		return -1;
+	*out = v->json_value.value_number.val.i;
+	return 0;
+}
+
+int json_get_bool(const json_value *v, bool *out) {
+	if (v == NULL || v->value_t != BOOL)
+		return -1;
+	*out = v->json_value.value_bool;
+	return 0;
+}
+
+#if JSON_PARSE_TEST_MAIN
+int main(void) {
+	const char *str = "{\"egg\": 1, \"list\": [1, 2.5, \"three\", true, null], // comment\n \"obj\": {}}";
 	const char *jsonstr = "\"hello this is \\njson string\"";
 	printf("%s\n", jsonstr);
-	int j = 0;
-	json_value s;
-	json_parse_string(jsonstr, &j, &s);
-	printf("%s\n", s.json_value.value_string.str);
-	//json_parse_object(str, &i);
+	json_value *s = json_parse(jsonstr);
+	if (s == NULL)
+		return 1;
+	printf("%s\n", json_get_string(s));
+	json_free(s);
+	json_value *o = json_parse(str);
+	if (o == NULL)
+		return 1;
+	double egg;
+	json_get_number(json_object_get(o, "egg"), &egg);
+	printf("egg: %g, list len: %zu, list[2]: %s\n", egg, json_array_len(json_object_get(o, "list")),
+	       json_get_string(json_array_get(json_object_get(o, "list"), 2)));
+	json_free(o);
+	arena_t arena;
+	arena_init(&arena);
+	const json_value *ao = json_parse_arena(str, &arena);
+	if (ao == NULL)
+		return 1;
+	printf("arena list[2]: %s\n", json_get_string(json_array_get(json_object_get(ao, "list"), 2)));
+	arena_destroy(&arena);
+	return 0;
 }
+#endif
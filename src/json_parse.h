@@ -1,6 +1,27 @@
 #ifndef JSON_PARSE_H
 #define JSON_PARSE_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
 typedef struct json_value json_value;
 
+// returns a heap allocated tree, free with json_free(). NULL on a parse error
+json_value *json_parse(const char *str);
+// the tree lives in the arena until it is reset, don't json_free() it
+json_value *json_parse_arena(const char *str, arena_t *a);
+void json_free(json_value *v);
+
+// lookups return NULL / -1 when the value is missing or the wrong type
+const json_value *json_object_get(const json_value *obj, const char *key);
+size_t json_array_len(const json_value *arr);
+const json_value *json_array_get(const json_value *arr, size_t i);
+const char *json_get_string(const json_value *v);
+int json_get_number(const json_value *v, double *out);
+// -1 also for a number written with a fraction or exponent, or one outside int64
+int json_get_int(const json_value *v, int64_t *out);
+int json_get_bool(const json_value *v, bool *out);
+
 #endif //JSON_PARSE_H
@@ -12,6 +12,34 @@
 #define DEBUG_MODE 1
 #define LOG_STDOUT_MODE 1
 
+// set once at startup from the config, before any threads exist
+static enum LogLevel log_min_level = LOG;
+
+void log_set_level(const enum LogLevel level) {
+	log_min_level = level;
+}
+
+int log_level_from_str(const char *s, enum LogLevel *level) {
+	typedef struct {
+		const char *s_level;
+		const enum LogLevel enum_level;
+	} table_t;
+	const table_t table[] = {
+		{"log", LOG},
+		{"debug", DEBUG},
+		{"warn", WARN},
+		{"error", ERROR},
+		{"critical", CRITICAL_ERROR}
+	};
+	for (size_t i = 0; i < sizeof(table) / sizeof(table[0]); i++) {
+		if (strcmp(table[i].s_level, s) == 0) {
+			*level = table[i].enum_level;
+			return 0;
+		}
+	}
+	return -1;
+}
+
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-nonliteral"
 
@@ -82,11 +110,9 @@ int ltvprintf(const enum LogLevel level, const char *file, const unsigned int li
 }
 
 int ltprintf(const enum LogLevel level, const char *file, const unsigned int line, const char *func, const char *format, ...) {
-	/*
-	if (level != ERROR) {
+	if (level < log_min_level) {
 		return 0;
 	}
-	*/
 	va_list args;
 	va_start(args, format);
 	ltvprintf(level, file, line, func, format, args);
@@ -21,6 +21,8 @@ enum LogLevel {
 	CRITICAL_ERROR
 };
 
+void log_set_level(const enum LogLevel level);
+int log_level_from_str(const char *s, enum LogLevel *level);
 int ltprintf(const enum LogLevel level, const char *file, const unsigned int line, const char *func, const char *format, ...);
 int sys_error_tprintf(const char *msg, const char *file, const unsigned int line, const char *func, ...);
 
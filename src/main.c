@@ -2,11 +2,15 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/errno.h>
+#include <sys/file.h>
+#include <sys/stat.h>
 
 #include "server.h"
 #include "log.h"
+#include "config.h"
 
 enum file_exists_stat {
 	FILE_EXISTS = 1,
@@ -18,6 +22,10 @@ enum file_exists_stat file_exists(const char *path);
 
 int write_pid(const pid_t pid, const char *path);
 
+int remove_pid_if_owner(const pid_t pid, const char *path);
+
+int launch(const bool handoff);
+
 int start(void);
 
 int stop(void);
@@ -30,8 +38,6 @@ int force_stop(void);
 
 int stop_signal(const int signal);
 
-// TODO: fix restart()
-
 int main(int argc, char *argv[]) {
 	if (argc != 2) {
 		printf("usage: chinook [start|stop|restart]\n");
@@ -76,6 +82,23 @@ int start(void) {
 			case FILE_NOT_EXISTS: break;
 		}
 	}
+	return launch(false);
+}
+
+int launch(const bool handoff) {
+	// load before forking so a bad config is reported to the user, not just the log
+	struct chinook_config cfg;
+	config_defaults(&cfg);
+	{
+		char path[PATH_MAX];
+		snprintf(path, PATH_MAX, "%s/%s", getenv("HOME"), CONFIG_FILE_NAME);
+		if (config_load(path, &cfg) == -1) {
+			printf("invalid config: %s\n", path);
+			return -1;
+		}
+	}
+	log_set_level(cfg.log_level);
+	cfg.server.special.handoff = handoff;
 	const pid_t pid_monitor = fork();
 	if (pid_monitor == -1) {
 		sys_error_printf("fork failed");
@@ -112,23 +135,18 @@ int start(void) {
 			}
 			exit(EXIT_FAILURE);
 		}
-		// waiting until killed by user 'chinook stop'
+		// waiting until killed by user 'chinook stop', or drained after a restart
 		waitpid(pid_server, nullptr, 0);
-		if (remove("/tmp/chinook.pid") == -1) {
-			sys_error_printf("remove failed");
+		// after a restart the file belongs to the new server
+		if (remove_pid_if_owner(pid_server, "/tmp/chinook.pid") == -1) {
 			exit(EXIT_FAILURE);
 		}
 		exit(EXIT_SUCCESS);
 	}
 	setpgid(0, 0);
 	// server process
-	struct server_options opt;
-	opt.addr = "0.0.0.0";
-	opt.port = 80;
-	opt.protocol = IPV4;
-	opt.special.backlog = 10000;
 	lprintf(LOG, "SERVER START");
-	const int status = run_server(&opt);
+	const int status = run_server(&cfg.server);
 	lprintf(LOG, "SERVER STOP");
 	exit(status == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -184,10 +202,18 @@ int stop(void) {
 	return stop_signal(SIGTERM) == 0 ? 0 : -1;
 }
 
+/* the new server takes over the bound listen sockets from the running one (see handoff.h),
+ * the old server stops accepting and drains, so the port never refuses connections
+ */
 int restart(void) {
-	if (stop() == -1 || (sleep(1) && 0) || start() == -1)
-		return -1;
-	return 0;
+	switch (file_exists("/tmp/chinook.pid")) {
+		case FILE_ERROR: return -1;
+		case FILE_NOT_EXISTS:
+			printf("server not running, starting...\n");
+			return start();
+		case FILE_EXISTS: break;
+	}
+	return launch(true);
 }
 
 int reset_log(void) {
@@ -222,24 +248,79 @@ enum file_exists_stat file_exists(const char *path) {
 	return FILE_NOT_EXISTS;
 }
 
+/* the pid file is only written or removed under an exclusive flock, so a monitor that reads its own pid
+ * can't remove the file the monitor of a restarted server wrote in between.
+ * a holder that waited on a file that was unlinked meanwhile retries on the new one
+ */
+static int lock_pid_file(const char *path, const int flags) {
+	while (true) {
+		const int fd = open(path, flags | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			if (errno != ENOENT)
+				sys_error_printf("open failed");
+			return -1;
+		}
+		if (flock(fd, LOCK_EX) == -1) {
+			sys_error_printf("flock failed");
+			close(fd);
+			return -1;
+		}
+		struct stat locked, current;
+		if (fstat(fd, &locked) == -1) {
+			sys_error_printf("fstat failed");
+			close(fd);
+			return -1;
+		}
+		if (stat(path, &current) == -1) {
+			if (errno != ENOENT) {
+				sys_error_printf("stat failed");
+				close(fd);
+				return -1;
+			}
+		} else if (current.st_dev == locked.st_dev && current.st_ino == locked.st_ino) {
+			return fd;
+		}
+		close(fd);
+	}
+}
+
 int write_pid(const pid_t pid, const char *path) {
 	if (path == NULL) {
 		lprintf(ERROR, "path is NULL");
 		return -1;
 	}
-	FILE *fp = fopen(path, "w");
-	if (fp == NULL) {
-		sys_error_printf("fopen failed");
+	const int fd = lock_pid_file(path, O_RDWR | O_CREAT);
+	if (fd == -1)
 		return -1;
+	int retval = 0;
+	if (ftruncate(fd, 0) == -1) {
+		sys_error_printf("ftruncate failed");
+		retval = -1;
+	} else if (write(fd, &pid, sizeof(pid)) != sizeof(pid)) {
+		sys_error_printf("write failed");
+		retval = -1;
 	}
+	if (close(fd) == -1) {
+		sys_error_printf("close failed");
+		return -1;
+	}
+	return retval;
+}
+
+int remove_pid_if_owner(const pid_t pid, const char *path) {
+	const int fd = lock_pid_file(path, O_RDONLY);
+	if (fd == -1)
+		return errno == ENOENT ? 0 : -1;
+	pid_t file_pid;
+	const ssize_t bytes_read = read(fd, &file_pid, sizeof(file_pid));
 	int retval = 0;
-	const size_t bytes_written = fwrite(&pid, sizeof(pid), 1, fp);
-	if (bytes_written == 0) {
-		sys_error_printf("fwrite failed");
+	// unlinked while still holding the lock, a writer waiting on it retries on a fresh file
+	if (!(bytes_read == sizeof(file_pid) && file_pid != pid) && unlink(path) == -1) {
+		sys_error_printf("unlink failed");
 		retval = -1;
 	}
-	if (fclose(fp) == EOF) {
-		sys_error_printf("fclose failed");
+	if (close(fd) == -1) {
+		sys_error_printf("close failed");
 		return -1;
 	}
 	return retval;
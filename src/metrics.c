@@ -0,0 +1,232 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "metrics.h"
+#include "log.h"
+
+#define METRICS_SHARDS_INITIAL 64
+
+thread_local struct metrics_shard *metrics_local;
+
+static pthread_mutex_t shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard **shards;
+static size_t nshards;
+static size_t shards_cap;
+
+static const char *const counter_names[METRIC_COUNTERS_N] = {
+	[METRIC_CONNECTIONS_ACCEPTED] = "chinook_connections_accepted_total",
+	[METRIC_CONNECTIONS_CLOSED] = "chinook_connections_closed_total",
+	[METRIC_CONNECTIONS_SHED] = "chinook_connections_shed_total",
+	[METRIC_REQUESTS] = "chinook_requests_total",
+	[METRIC_RESPONSES_1XX] = "chinook_responses_total{code=\"1xx\"}",
+	[METRIC_RESPONSES_2XX] = "chinook_responses_total{code=\"2xx\"}",
+	[METRIC_RESPONSES_3XX] = "chinook_responses_total{code=\"3xx\"}",
+	[METRIC_RESPONSES_4XX] = "chinook_responses_total{code=\"4xx\"}",
+	[METRIC_RESPONSES_5XX] = "chinook_responses_total{code=\"5xx\"}",
+	[METRIC_RATE_LIMITED] = "chinook_requests_rate_limited_total",
+	[METRIC_PARSE_ERRORS] = "chinook_parse_errors_total",
+	[METRIC_BYTES_RECEIVED] = "chinook_received_bytes_total",
+	[METRIC_BYTES_SENT] = "chinook_sent_bytes_total",
+	[METRIC_TLS_HANDSHAKES] = "chinook_tls_handshakes_total",
+	[METRIC_TLS_RESUMED] = "chinook_tls_resumed_total",
+	[METRIC_TLS_HANDSHAKE_FAILURES] = "chinook_tls_handshake_failures_total",
+	[METRIC_TLS_KTLS] = "chinook_tls_ktls_total",
+	[METRIC_UPSTREAM_CONNECTS] = "chinook_upstream_connects_total",
+	[METRIC_UPSTREAM_REUSED] = "chinook_upstream_reused_total",
+	[METRIC_UPSTREAM_ERRORS] = "chinook_upstream_errors_total",
+	[METRIC_NOT_MODIFIED_CACHED] = "chinook_not_modified_cached_total",
+	[METRIC_WEBSOCKET_OPENED] = "chinook_websocket_opened_total",
+	[METRIC_WEBSOCKET_CLOSED] = "chinook_websocket_closed_total",
+	[METRIC_WEBSOCKET_MESSAGES_RECEIVED] = "chinook_websocket_messages_received_total",
+	[METRIC_WEBSOCKET_FRAMES_QUEUED] = "chinook_websocket_frames_queued_total",
+	[METRIC_WEBSOCKET_SLOW_CLOSED] = "chinook_websocket_slow_closed_total",
+	[METRIC_SSE_OPENED] = "chinook_sse_opened_total",
+	[METRIC_SSE_CLOSED] = "chinook_sse_closed_total",
+	[METRIC_SSE_EVENTS_PUBLISHED] = "chinook_sse_events_published_total",
+	[METRIC_SSE_EVENTS_SENT] = "chinook_sse_events_sent_total",
+	[METRIC_SSE_EVENTS_SKIPPED] = "chinook_sse_events_skipped_total",
+	[METRIC_SSE_SLOW_CLOSED] = "chinook_sse_slow_closed_total"
+};
+
+static const char *const timer_names[METRIC_TIMERS_N] = {
+	[METRIC_ACCEPT_TO_FIRST_BYTE] = "chinook_accept_to_first_byte_seconds",
+	[METRIC_PARSE] = "chinook_parse_seconds",
+	[METRIC_HANDLER] = "chinook_handler_seconds",
+	[METRIC_SEND] = "chinook_send_seconds",
+	[METRIC_REQUEST_TOTAL] = "chinook_request_seconds",
+	[METRIC_TLS_HANDSHAKE] = "chinook_tls_handshake_seconds"
+};
+
+// exported bucket bounds in microseconds, the fine histogram is folded into these on read
+static const uint64_t export_bounds_us[] = {
+	10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000,
+	5000000, 10000000
+};
+
+struct metrics_shard *metrics_register_thread(void) {
+	struct metrics_shard *s = aligned_alloc(METRICS_CACHE_LINE, sizeof(*s));
+	if (s == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		return NULL;
+	}
+	memset(s, 0, sizeof(*s));
+	for (size_t i = 0; i < METRIC_TIMERS_N; i++) {
+		if (histogram_init(&s->timers[i], METRICS_HIST_SUB_BITS, METRICS_HIST_MAX_US) == -1) {
+			for (size_t j = 0; j < i; j++)
+				histogram_free(&s->timers[j]);
+			free(s);
+			return NULL;
+		}
+	}
+	pthread_mutex_lock(&shards_mutex);
+	if (nshards == shards_cap) {
+		const size_t cap = shards_cap == 0 ? METRICS_SHARDS_INITIAL : shards_cap * 2;
+		struct metrics_shard **tmp = realloc(shards, sizeof(*shards) * cap);
+		if (tmp == NULL) {
+			pthread_mutex_unlock(&shards_mutex);
+			sys_error_printf("realloc failed");
+			for (size_t i = 0; i < METRIC_TIMERS_N; i++)
+				histogram_free(&s->timers[i]);
+			free(s);
+			return NULL;
+		}
+		shards = tmp;
+		shards_cap = cap;
+	}
+	// shards outlive their thread so nothing counted is lost, pool threads are long lived anyway
+	shards[nshards++] = s;
+	pthread_mutex_unlock(&shards_mutex);
+	metrics_local = s;
+	return s;
+}
+
+void metrics_count_status(const int status_code) {
+	const int class = status_code / 100;
+	if (class >= 1 && class <= 5)
+		metrics_add((enum metrics_counter) (METRIC_RESPONSES_1XX + class - 1), 1);
+}
+
+uint64_t metrics_counter_total(const enum metrics_counter c) {
+	uint64_t total = 0;
+	pthread_mutex_lock(&shards_mutex);
+	for (size_t i = 0; i < nshards; i++)
+		total += atomic_load_explicit(&shards[i]->counters[c], memory_order_relaxed);
+	pthread_mutex_unlock(&shards_mutex);
+	return total;
+}
+
+uint64_t metrics_memory_total(const enum metrics_memory m) {
+	uint64_t total = 0;
+	pthread_mutex_lock(&shards_mutex);
+	for (size_t i = 0; i < nshards; i++)
+		total += atomic_load_explicit(&shards[i]->memory[m], memory_order_relaxed);
+	pthread_mutex_unlock(&shards_mutex);
+	// a release counted before its allocation was seen
+	return total > INT64_MAX ? 0 : total;
+}
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+
+static int append(char *buf, const size_t bufn, size_t *len, const char *format, ...) {
+	if (*len >= bufn)
+		return -1;
+	va_list args;
+	va_start(args, format);
+	const int n = vsnprintf(buf + *len, bufn - *len, format, args);
+	va_end(args);
+	if (n < 0 || (size_t) n >= bufn - *len)
+		return -1;
+	*len += (size_t) n;
+	return 0;
+}
+
+#pragma GCC diagnostic pop
+
+static int render_histogram(char *buf, const size_t bufn, size_t *len, const char *name, const struct histogram *h) {
+	if (append(buf, bufn, len, "# TYPE %s histogram\n", name) == -1)
+		return -1;
+	uint64_t cumulative = 0;
+	size_t i = 0;
+	for (size_t b = 0; b < sizeof(export_bounds_us) / sizeof(export_bounds_us[0]); b++) {
+		for (; i < h->nbuckets && histogram_bucket_upper(h, i) <= export_bounds_us[b]; i++)
+			cumulative += atomic_load_explicit(&h->counts[i], memory_order_relaxed);
+		if (append(buf, bufn, len, "%s_bucket{le=\"%g\"} %llu\n", name, (double) export_bounds_us[b] / 1e6,
+		           (unsigned long long) cumulative) == -1)
+			return -1;
+	}
+	const uint64_t total = atomic_load_explicit(&h->total, memory_order_relaxed);
+	const uint64_t sum = atomic_load_explicit(&h->sum, memory_order_relaxed);
+	return append(buf, bufn, len, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.6f\n%s_count %llu\n", name,
+	              (unsigned long long) total, name, (double) sum / 1e6, name, (unsigned long long) total);
+}
+
+ssize_t metrics_render(char *buf, const size_t bufn) {
+	uint64_t counters[METRIC_COUNTERS_N] = {0};
+	struct histogram timers[METRIC_TIMERS_N];
+	for (size_t t = 0; t < METRIC_TIMERS_N; t++) {
+		if (histogram_init(&timers[t], METRICS_HIST_SUB_BITS, METRICS_HIST_MAX_US) == -1) {
+			for (size_t j = 0; j < t; j++)
+				histogram_free(&timers[j]);
+			return -1;
+		}
+	}
+	pthread_mutex_lock(&shards_mutex);
+	for (size_t i = 0; i < nshards; i++) {
+		for (size_t c = 0; c < METRIC_COUNTERS_N; c++)
+			counters[c] += atomic_load_explicit(&shards[i]->counters[c], memory_order_relaxed);
+		for (size_t t = 0; t < METRIC_TIMERS_N; t++)
+			histogram_merge(&timers[t], &shards[i]->timers[t]);
+	}
+	pthread_mutex_unlock(&shards_mutex);
+
+	ssize_t retval = -1;
+	size_t len = 0;
+	const char *last_type = NULL;
+	for (size_t c = 0; c < METRIC_COUNTERS_N; c++) {
+		// labelled series share one TYPE line
+		const char *name = counter_names[c];
+		const size_t name_len = strcspn(name, "{");
+		if (last_type == NULL || strncmp(last_type, name, name_len) != 0 || last_type[name_len] != '{') {
+			if (append(buf, bufn, &len, "# TYPE %.*s counter\n", (int) name_len, name) == -1)
+				goto cleanup;
+		}
+		last_type = name;
+		if (append(buf, bufn, &len, "%s %llu\n", name, (unsigned long long) counters[c]) == -1)
+			goto cleanup;
+	}
+	const uint64_t accepted = counters[METRIC_CONNECTIONS_ACCEPTED];
+	const uint64_t closed = counters[METRIC_CONNECTIONS_CLOSED];
+	if (append(buf, bufn, &len, "# TYPE chinook_connections_open gauge\nchinook_connections_open %llu\n",
+	           (unsigned long long) (accepted > closed ? accepted - closed : 0)) == -1)
+		goto cleanup;
+	for (size_t t = 0; t < METRIC_TIMERS_N; t++) {
+		if (render_histogram(buf, bufn, &len, timer_names[t], &timers[t]) == -1)
+			goto cleanup;
+	}
+	retval = (ssize_t) len;
+cleanup:
+	for (size_t t = 0; t < METRIC_TIMERS_N; t++)
+		histogram_free(&timers[t]);
+	if (retval == -1)
+		lprintf(ERROR, "metrics don't fit in %zu bytes", bufn);
+	return retval;
+}
+
+void metrics_destroy(void) {
+	pthread_mutex_lock(&shards_mutex);
+	for (size_t i = 0; i < nshards; i++) {
+		for (size_t t = 0; t < METRIC_TIMERS_N; t++)
+			histogram_free(&shards[i]->timers[t]);
+		free(shards[i]);
+	}
+	free(shards);
+	shards = NULL;
+	nshards = 0;
+	shards_cap = 0;
+	metrics_local = NULL;
+	pthread_mutex_unlock(&shards_mutex);
+}
@@ -0,0 +1,128 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/types.h>
+
+#include "histogram.h"
+
+#define METRICS_CACHE_LINE 128 // apple silicon lines are 128 bytes, two 64 byte lines on x86
+#define METRICS_HIST_SUB_BITS 5 // 16 buckets per power of two, ~3% error
+#define METRICS_HIST_MAX_US (60ull * 1000 * 1000)
+#define METRICS_PATH "/metrics"
+
+/* per-thread counters and latency histograms. every thread writes only its own shard, so recording is a
+ * plain load and store on a line no other thread writes. readers sum the shards, which is slower and rare
+ */
+
+enum metrics_counter {
+	METRIC_CONNECTIONS_ACCEPTED,
+	METRIC_CONNECTIONS_CLOSED,
+	METRIC_CONNECTIONS_SHED, // answered 503 from the accept path
+	METRIC_REQUESTS,
+	METRIC_RESPONSES_1XX,
+	METRIC_RESPONSES_2XX,
+	METRIC_RESPONSES_3XX,
+	METRIC_RESPONSES_4XX,
+	METRIC_RESPONSES_5XX,
+	METRIC_PARSE_ERRORS,
+	METRIC_RATE_LIMITED, // answered 429 before parsing
+	METRIC_BYTES_RECEIVED,
+	METRIC_BYTES_SENT,
+	METRIC_TLS_HANDSHAKES,
+	METRIC_TLS_RESUMED, // handshakes that reused a cached session or a ticket
+	METRIC_TLS_HANDSHAKE_FAILURES,
+	METRIC_TLS_KTLS, // handshakes that moved record encryption to the kernel
+	METRIC_UPSTREAM_CONNECTS,
+	METRIC_UPSTREAM_REUSED, // requests sent over a pooled keep-alive connection
+	METRIC_UPSTREAM_ERRORS,
+	METRIC_NOT_MODIFIED_CACHED, // 304s answered from the file validator table, no handler ran
+	METRIC_WEBSOCKET_OPENED,
+	METRIC_WEBSOCKET_CLOSED,
+	METRIC_WEBSOCKET_MESSAGES_RECEIVED,
+	METRIC_WEBSOCKET_FRAMES_QUEUED, // broadcast frames queued on a connection, one per subscriber
+	METRIC_WEBSOCKET_SLOW_CLOSED, // closed with 1008 for a full broadcast queue
+	METRIC_SSE_OPENED,
+	METRIC_SSE_CLOSED,
+	METRIC_SSE_EVENTS_PUBLISHED, // once per event, however many streams send it
+	METRIC_SSE_EVENTS_SENT,
+	METRIC_SSE_EVENTS_SKIPPED, // overwritten in the ring before a slow stream sent them
+	METRIC_SSE_SLOW_CLOSED, // streams closed by slow-policy disconnect
+	METRIC_COUNTERS_N
+};
+
+// recorded in microseconds
+enum metrics_timer {
+	METRIC_ACCEPT_TO_FIRST_BYTE,
+	METRIC_PARSE,
+	METRIC_HANDLER,
+	METRIC_SEND,
+	METRIC_REQUEST_TOTAL, // request read to response sent
+	METRIC_TLS_HANDSHAKE,
+	METRIC_TIMERS_N
+};
+
+/* bytes held right now. memory is subtracted in the shard of whichever thread releases it, so a shard alone can
+ * wrap below zero and only the sum means something
+ */
+enum metrics_memory {
+	METRIC_MEMORY_ARENA_USED, // arena blocks in use: connection receive buffers, request and response memory
+	METRIC_MEMORY_ARENA_CACHED, // blocks kept in the threads' caches for the next request
+	METRIC_MEMORY_SSE_EVENTS, // published events still in a ring or on their way out
+	METRIC_MEMORY_WEBSOCKET_FRAMES, // broadcast frames queued on connections
+	METRIC_MEMORY_N
+};
+
+struct metrics_shard {
+	alignas(METRICS_CACHE_LINE) _Atomic uint64_t counters[METRIC_COUNTERS_N];
+	_Atomic uint64_t memory[METRIC_MEMORY_N];
+	alignas(METRICS_CACHE_LINE) struct histogram timers[METRIC_TIMERS_N];
+};
+
+extern thread_local struct metrics_shard *metrics_local;
+
+// makes the calling thread's shard, NULL if out of memory (the thread then records nothing)
+struct metrics_shard *metrics_register_thread(void);
+
+static inline void metrics_add(const enum metrics_counter c, const uint64_t n) {
+	struct metrics_shard *s = metrics_local != NULL ? metrics_local : metrics_register_thread();
+	if (s == NULL)
+		return;
+	atomic_store_explicit(&s->counters[c], atomic_load_explicit(&s->counters[c], memory_order_relaxed) + n,
+	                      memory_order_relaxed);
+}
+
+static inline void metrics_memory_add(const enum metrics_memory m, const int64_t n) {
+	struct metrics_shard *s = metrics_local != NULL ? metrics_local : metrics_register_thread();
+	if (s == NULL)
+		return;
+	atomic_store_explicit(&s->memory[m], atomic_load_explicit(&s->memory[m], memory_order_relaxed) + (uint64_t) n,
+	                      memory_order_relaxed);
+}
+
+static inline uint64_t metrics_now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+// start_ns from metrics_now_ns()
+static inline void metrics_time(const enum metrics_timer t, const uint64_t start_ns) {
+	struct metrics_shard *s = metrics_local != NULL ? metrics_local : metrics_register_thread();
+	if (s == NULL)
+		return;
+	histogram_record(&s->timers[t], (metrics_now_ns() - start_ns) / 1000);
+}
+
+void metrics_count_status(int status_code);
+// sum over every thread, a read racing a writer may be one update behind
+uint64_t metrics_counter_total(enum metrics_counter c);
+uint64_t metrics_memory_total(enum metrics_memory m);
+// prometheus text format, returns the length or -1 if bufn is too small
+ssize_t metrics_render(char *buf, size_t bufn);
+void metrics_destroy(void);
+
+#endif //METRICS_H
@@ -0,0 +1,285 @@
+#define _GNU_SOURCE // memmem
+#include <stdint.h>
+#include <string.h>
+
+#include "multipart.h"
+#include "tls.h"
+#include "log.h"
+
+struct reader {
+	const struct HttpRequest *req;
+	size_t have; // body bytes that arrived with the head
+	size_t have_off; // how many of them are in the window already
+	size_t rest; // still on the connection
+	char *win;
+	size_t start; // unprocessed bytes are win[start, end)
+	size_t end;
+	char delim[4 + MULTIPART_BOUNDARY_MAX]; // "\r\n--" boundary
+	size_t delim_len;
+	uint8_t skip[256]; // Horspool shift per byte, at most delim_len
+};
+
+// "multipart/form-data; boundary=..." with the boundary plain or quoted
+static int content_type_boundary(const struct str_view ct, struct str_view *boundary) {
+	static const char type[] = "multipart/form-data";
+	if (ct.len < sizeof(type) - 1 || strncasecmp(ct.ptr, type, sizeof(type) - 1) != 0)
+		return -1;
+	const char *end = ct.ptr + ct.len;
+	for (const char *p = ct.ptr + sizeof(type) - 1; (p = memchr(p, ';', (size_t) (end - p))) != NULL;) {
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if ((size_t) (end - p) < 9 || strncasecmp(p, "boundary=", 9) != 0)
+			continue;
+		p += 9;
+		const char *b_end;
+		if (p < end && *p == '"') {
+			p++;
+			b_end = memchr(p, '"', (size_t) (end - p));
+			if (b_end == NULL)
+				return -1;
+		} else {
+			b_end = p;
+			while (b_end < end && *b_end != ';' && *b_end != ' ' && *b_end != '\t')
+				b_end++;
+		}
+		*boundary = (struct str_view) {p, (size_t) (b_end - p)};
+		return boundary->len == 0 || boundary->len > MULTIPART_BOUNDARY_MAX ? -1 : 0;
+	}
+	return -1;
+}
+
+// what of the Content-Length arrived with the head and what is still unread, an http/2 body is complete
+static int body_length(const struct HttpRequest *req, size_t *have, size_t *rest) {
+	*have = req->body.len;
+	*rest = 0;
+	if (req->conn == NULL)
+		return 0;
+	size_t n;
+	if (!HEADER_EXISTS("Content-Length", &req->headers) || http_content_length(&req->headers, &n) == -1)
+		return -1;
+	*rest = n - *have;
+	return 0;
+}
+
+// moves what's left to the front and reads behind it. the number of bytes read, 0 at the end of the body, -1 if
+// the window is full or the read failed
+static ssize_t fill(struct reader *r) {
+	memmove(r->win, r->win + r->start, r->end - r->start);
+	r->end -= r->start;
+	r->start = 0;
+	const size_t room = MULTIPART_WINDOW_BYTES - r->end;
+	if (room == 0)
+		return -1;
+	if (r->have_off < r->have) {
+		const size_t n = r->have - r->have_off < room ? r->have - r->have_off : room;
+		memcpy(r->win + r->end, (const char *) r->req->body.ptr + r->have_off, n);
+		r->have_off += n;
+		r->end += n;
+		return (ssize_t) n;
+	}
+	if (r->rest == 0)
+		return 0;
+	const ssize_t n = conn_io_recv(r->req->conn, r->win + r->end, r->rest < room ? r->rest : room);
+	if (n <= 0) {
+		lprintf(DEBUG, "upload cut short with %zu bytes to go", r->rest);
+		return -1;
+	}
+	r->rest -= (size_t) n;
+	r->end += (size_t) n;
+	return n;
+}
+
+// at least n unprocessed bytes, -1 if the body ends before
+static int need(struct reader *r, const size_t n) {
+	while (r->end - r->start < n) {
+		if (fill(r) <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static void skip_table_init(struct reader *r) {
+	const size_t m = r->delim_len;
+	memset(r->skip, (int) m, sizeof(r->skip));
+	for (size_t i = 0; i + 1 < m; i++)
+		r->skip[(unsigned char) r->delim[i]] = (uint8_t) (m - 1 - i);
+}
+
+// Boyer-Moore-Horspool, a byte that isn't in the delimiter moves the search by its whole length
+static const char *find_delim(const struct reader *r, const char *s, const size_t n) {
+	const size_t m = r->delim_len;
+	const char last = r->delim[m - 1];
+	for (size_t i = 0; i + m <= n; i += r->skip[(unsigned char) s[i + m - 1]]) {
+		if (s[i + m - 1] == last && memcmp(s + i, r->delim, m - 1) == 0)
+			return s + i;
+	}
+	return NULL;
+}
+
+// bytes before the last delim_len - 1 can't be the start of a delimiter
+static size_t safe_len(const struct reader *r) {
+	const size_t n = r->end - r->start;
+	return n >= r->delim_len ? n - (r->delim_len - 1) : 0;
+}
+
+// everything up to and including the next delimiter. the content before it goes to part_data unless skipping
+static int to_delim(struct reader *r, const struct multipart_handler *h, const bool skipping) {
+	for (;;) {
+		const char *s = r->win + r->start;
+		const char *d = find_delim(r, s, r->end - r->start);
+		const size_t n = d != NULL ? (size_t) (d - s) : safe_len(r);
+		if (n > 0 && !skipping && h->part_data(h->user, s, n) == -1)
+			return -1;
+		r->start += n;
+		if (d != NULL) {
+			r->start += r->delim_len;
+			return 0;
+		}
+		if (fill(r) <= 0) {
+			lprintf(DEBUG, "multipart body ended without its closing delimiter");
+			return -1;
+		}
+	}
+}
+
+// a quoted or plain value of name in a Content-Disposition, {NULL, 0} if it isn't there
+static struct str_view disposition_param(const struct str_view v, const char *name) {
+	const size_t name_len = strlen(name);
+	const char *end = v.ptr + v.len;
+	for (const char *p = v.ptr; (p = memchr(p, ';', (size_t) (end - p))) != NULL;) {
+		p++;
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if ((size_t) (end - p) <= name_len || strncasecmp(p, name, name_len) != 0 || p[name_len] != '=')
+			continue;
+		p += name_len + 1;
+		if (p < end && *p == '"') {
+			p++;
+			const char *q = memchr(p, '"', (size_t) (end - p));
+			return q != NULL ? (struct str_view) {p, (size_t) (q - p)} : (struct str_view) {NULL, 0};
+		}
+		const char *e = p;
+		while (e < end && *e != ';' && *e != ' ' && *e != '\t')
+			e++;
+		return (struct str_view) {p, (size_t) (e - p)};
+	}
+	return (struct str_view) {NULL, 0};
+}
+
+// the part's fields up to the blank line, they have to fit in the window. views into it, good until the next fill
+static int read_part_head(struct reader *r, struct HttpField *fields, struct multipart_part *part) {
+	size_t head_len;
+	for (;;) {
+		const char *s = r->win + r->start;
+		const size_t n = r->end - r->start;
+		// no fields at all is allowed, the blank line comes right away
+		if (n >= 2 && s[0] == '\r' && s[1] == '\n') {
+			head_len = 0;
+			break;
+		}
+		const char *blank = memmem(s, n, "\r\n\r\n", 4);
+		if (blank != NULL) {
+			head_len = (size_t) (blank - s) + 2;
+			break;
+		}
+		if (fill(r) <= 0) {
+			lprintf(DEBUG, "multipart part head cut short or larger than %d bytes", MULTIPART_WINDOW_BYTES);
+			return -1;
+		}
+	}
+	const char *s = r->win + r->start;
+	const char *end = s + head_len;
+	part->headers = (headers_t) {.fields = fields, .nfields = 0, .cap = MULTIPART_PART_FIELDS_MAX, .arena = NULL};
+	while (s < end) {
+		const char *eol = memmem(s, (size_t) (end - s), "\r\n", 2);
+		const char *colon = memchr(s, ':', (size_t) (eol - s));
+		if (colon == NULL || colon == s)
+			return -1;
+		const char *v = colon + 1;
+		const char *v_end = eol;
+		while (v < v_end && (*v == ' ' || *v == '\t'))
+			v++;
+		while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+			v_end--;
+		const struct str_view key = {s, (size_t) (colon - s)};
+		if (add_http_field(key, (struct str_view) {v, (size_t) (v_end - v)}, &part->headers) == -1)
+			return -1;
+		s = eol + 2;
+	}
+	r->start += head_len + 2;
+	const struct str_view disposition = get_http_header("Content-Disposition", &part->headers);
+	if (disposition.ptr == NULL || disposition.len < 9 || strncasecmp(disposition.ptr, "form-data", 9) != 0) {
+		lprintf(DEBUG, "multipart part without a form-data Content-Disposition");
+		return -1;
+	}
+	part->name = disposition_param(disposition, "name");
+	part->filename = disposition_param(disposition, "filename");
+	part->content_type = get_http_header("Content-Type", &part->headers);
+	if (part->content_type.ptr == NULL)
+		part->content_type = (struct str_view) {"text/plain", 10};
+	return 0;
+}
+
+int multipart_read(const struct HttpRequest *req, const struct multipart_handler *h) {
+	struct str_view boundary;
+	if (content_type_boundary(get_http_header("Content-Type", &req->headers), &boundary) == -1) {
+		lprintf(DEBUG, "not multipart/form-data or no usable boundary");
+		return -1;
+	}
+	struct reader *r = arena_alloc(req->arena, sizeof(*r));
+	if (r == NULL)
+		return -1;
+	r->req = req;
+	r->have_off = 0;
+	if (body_length(req, &r->have, &r->rest) == -1) {
+		lprintf(DEBUG, "multipart body without a usable Content-Length");
+		return -1;
+	}
+	r->win = arena_alloc(req->arena, MULTIPART_WINDOW_BYTES);
+	if (r->win == NULL)
+		return -1;
+	memcpy(r->delim, "\r\n--", 4);
+	memcpy(r->delim + 4, boundary.ptr, boundary.len);
+	r->delim_len = 4 + boundary.len;
+	skip_table_init(r);
+	// the first delimiter can be at the very start without a CRLF in front, starting the window with one
+	// lets the preamble be skipped like any other content
+	memcpy(r->win, "\r\n", 2);
+	r->start = 0;
+	r->end = 2;
+	if (to_delim(r, h, true) == -1)
+		return -1;
+	for (;;) {
+		// "--" after a delimiter closes the body, otherwise transport padding and a CRLF start the next part
+		if (need(r, 2) == -1)
+			return -1;
+		if (r->win[r->start] == '-' && r->win[r->start + 1] == '-')
+			break;
+		for (;;) {
+			while (r->start < r->end && (r->win[r->start] == ' ' || r->win[r->start] == '\t'))
+				r->start++;
+			if (need(r, 2) == -1)
+				return -1;
+			if (r->win[r->start] != ' ' && r->win[r->start] != '\t')
+				break;
+		}
+		if (r->win[r->start] != '\r' || r->win[r->start + 1] != '\n') {
+			lprintf(DEBUG, "garbage after a multipart delimiter");
+			return -1;
+		}
+		r->start += 2;
+		struct HttpField fields[MULTIPART_PART_FIELDS_MAX];
+		struct multipart_part part;
+		if (read_part_head(r, fields, &part) == -1 || h->part_begin(h->user, &part) == -1)
+			return -1;
+		if (to_delim(r, h, false) == -1 || h->part_end(h->user) == -1)
+			return -1;
+	}
+	// the epilogue is read and dropped so the connection can take the next request
+	r->start = r->end;
+	ssize_t n;
+	while ((n = fill(r)) > 0)
+		r->start = r->end;
+	return n == 0 ? 0 : -1;
+}
@@ -0,0 +1,42 @@
+#ifndef MULTIPART_H
+#define MULTIPART_H
+
+#include <stddef.h>
+
+#include "parse_http.h"
+
+/* streaming multipart/form-data (RFC 7578) for uploads larger than a request buffer. the body is read through
+ * one fixed window, what arrived with the head first and then the rest from the connection, and each part's
+ * content is handed to the handler as it comes in. the delimiter is found with a Boyer-Moore-Horspool search,
+ * the last delimiter length - 1 bytes of the window are kept back until the next read so a delimiter split
+ * between two reads is still found. memory per upload is the window, whatever the size of the body
+ */
+
+#define MULTIPART_WINDOW_BYTES (64 * 1024) // a part's head has to fit, content goes through in pieces of this
+#define MULTIPART_BOUNDARY_MAX 70 // RFC 2046
+#define MULTIPART_PART_FIELDS_MAX 16
+
+struct multipart_part {
+	struct str_view name; // Content-Disposition name
+	struct str_view filename; // {NULL, 0} for a plain field
+	struct str_view content_type; // text/plain if it wasn't sent
+	headers_t headers; // all of the part's fields
+};
+
+// returning -1 from any of these stops the upload, multipart_read() then returns -1
+struct multipart_handler {
+	// the views in part are only valid during the call
+	int (*part_begin)(void *user, const struct multipart_part *part);
+	// the next n bytes of the current part's content
+	int (*part_data)(void *user, const char *data, size_t n);
+	int (*part_end)(void *user);
+	void *user;
+};
+
+/* reads the whole body of a multipart/form-data request. 0 when every part was handed over and the body
+ * consumed, -1 for another content type, a missing Content-Length, a malformed body, a read error or a
+ * handler that stopped it. after -1 part of the body may still be unread, answer with Connection: close
+ */
+int multipart_read(const struct HttpRequest *req, const struct multipart_handler *h);
+
+#endif //MULTIPART_H
@@ -1,47 +1,16 @@
+#define _GNU_SOURCE // memmem
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/signal.h>
 
 #include "server.h"
 #include "parse_http.h"
+#include "uri.h"
 #include "log.h"
 
 #define ARR_LEN(arr) (sizeof(arr) / sizeof(arr[0]))
 
-// modifies str in place and places pointers into buf
-ssize_t str_split(char *str, const char *sep, char *buf[], const size_t bufn) {
-	if (str == NULL) {
-		lprintf(ERROR, "str argument in %s() is NULL", __func__);
-		return -1;
-	}
-	if (sep == NULL) {
-		lprintf(ERROR, "sep argument in %s() is NULL", __func__);
-		return -1;
-	}
-	if (bufn == 0) {
-		lprintf(ERROR, __func__, "buffer size 0 in %s()");
-		return -1;
-	}
-	const size_t sep_len = strlen(sep);
-	if (sep_len == 0) {
-		lprintf(ERROR, "seperator string length 0");
-		return -1;
-	}
-	buf[0] = str;
-	size_t i = 1;
-	char *ptr;
-	while ((ptr = strstr(str, sep))) {
-		*ptr = '\0';
-		if (i >= bufn) {
-			return (ssize_t) i;
-		}
-		str = ptr + sep_len;
-		buf[i] = str;
-		i++;
-	}
-	return (ssize_t) i;
-}
-
 void str_arr_print(const char *arr[], const size_t len) {
 	for (size_t i = 0; i < len; i++) {
 		printf("%s\n", arr[i]);
@@ -61,37 +30,7 @@ int strrepl(char *s, const char a, const char b) {
 	return 0;
 }
 
-int parse_http_headers(char *s, headers_t *h) {
-	char *j[REQUEST_HEADER_FIELDS_LIMIT];
-	ssize_t i = str_split(s, "\r\n", j, REQUEST_HEADER_FIELDS_LIMIT);
-	for (int r = 0; r < i; r++) {
-		char *c[2] = {0};
-		str_split(j[r], ": ", c, 2);
-		h->fields[r].key = c[0];
-		h->fields[r].value = c[1];
-		//printf("%s: %s\n", h[r].key, h[r].value);
-	}
-	h->nfields = (size_t) i;
-	return 0;
-}
-
-int parse_http_body(char *str, struct HttpBody *body) {
-	char *buf[2];
-	ssize_t n = str_split(str, "\r\n\r\n", buf, 2); // split body and headers
-	if (n != 2) {
-		lprintf(ERROR, "ill formed http request");
-		return -1;
-	}
-	if (*buf[1] == '\0') {
-		body->ptr = NULL;
-	} else {
-		body->ptr = (void *) buf[1];
-	}
-	body->len = 0;
-	return 0;
-}
-
-enum HttpMethod parse_http_method(const char *s) {
+enum HttpMethod parse_http_method(const struct str_view s) {
 	typedef struct {
 		const char *s_method;
 		const enum HttpMethod enum_method;
@@ -108,7 +47,7 @@ enum HttpMethod parse_http_method(const char *s) {
 	};
 	const size_t len = ARR_LEN(table);
 	for (size_t i = 0; i < len; i++) {
-		if (strcmp(table[i].s_method, s) == 0) {
+		if (str_view_eq(s, table[i].s_method)) {
 			return table[i].enum_method;
 		}
 	}
@@ -117,7 +56,7 @@ enum HttpMethod parse_http_method(const char *s) {
 
 // TODO: allow http binary data
 
-enum HttpVersion parse_http_version(const char *s) {
+static enum HttpVersion parse_http_version(const struct str_view s) {
 	typedef struct {
 		const char *s_version;
 		const enum HttpVersion enum_version;
@@ -128,40 +67,73 @@ enum HttpVersion parse_http_version(const char *s) {
 	};
 	size_t len = ARR_LEN(table);
 	for (size_t i = 0; i < len; i++) {
-		if (strcmp(table[i].s_version, s) == 0) {
+		if (str_view_eq(s, table[i].s_version)) {
 			return table[i].enum_version;
 		}
 	}
 	return HTTP_VERSION_UNKNOWN;
 }
 
-int parse_http_request_line(char *str, struct HttpRequestLine *request_line) {
-	char *buf[3];
-	ssize_t n = str_split(str, " ", buf, 3);
-	if (n != 3) {
+// "METHOD uri VERSION" without its \r\n
+static int parse_http_request_line(const char *s, const size_t len, struct HttpRequestLine *request_line) {
+	const char *end = s + len;
+	const char *sp1 = memchr(s, ' ', len);
+	if (sp1 == NULL)
 		return -1;
-	}
-	request_line->method = parse_http_method(buf[0]);
+	const char *sp2 = memchr(sp1 + 1, ' ', (size_t) (end - sp1 - 1));
+	if (sp2 == NULL || sp2 == sp1 + 1)
+		return -1;
+	request_line->method = parse_http_method((struct str_view) {s, (size_t) (sp1 - s)});
 	if (request_line->method == HTTP_METHOD_UNKNOWN) {
 		return -1;
 	}
-	request_line->uri = buf[1];
-	request_line->version = parse_http_version(buf[2]);
+	request_line->uri = (struct str_view) {sp1 + 1, (size_t) (sp2 - sp1 - 1)};
+	request_line->version = parse_http_version((struct str_view) {sp2 + 1, (size_t) (end - sp2 - 1)});
 	if (request_line->version == HTTP_VERSION_UNKNOWN) {
 		return -1;
 	}
 	return 0;
 }
 
+// a field name is an rfc 9110 token
+static bool is_tchar(const unsigned char c) {
+	switch (c) {
+		case '!': case '#': case '$': case '%': case '&': case '\'': case '*': case '+': case '-': case '.':
+		case '^': case '_': case '`': case '|': case '~':
+			return true;
+		default:
+			return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+	}
+}
+
+/* "name: value" without its \r\n, whitespace around the value isn't part of it. a name with whitespace before
+ * the colon would be read as another field by a proxy and as this one by its upstream, so it's refused
+ */
+static int parse_http_field(const char *s, const size_t len, struct HttpField *f) {
+	const char *colon = memchr(s, ':', len);
+	if (colon == NULL || colon == s)
+		return -1;
+	for (const char *c = s; c < colon; c++)
+		if (!is_tchar((unsigned char) *c))
+			return -1;
+	const char *v = colon + 1;
+	const char *end = s + len;
+	while (v < end && (*v == ' ' || *v == '\t'))
+		v++;
+	while (end > v && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	f->key = (struct str_view) {s, (size_t) (colon - s)};
+	f->value = (struct str_view) {v, (size_t) (end - v)};
+	return 0;
+}
+
 void print_http_request_struct(const struct HttpRequest *request) {
 	printf("method enum: \"%i\"\n", request->request_line.method);
-	printf("uri: \"%s\"\n", request->request_line.uri);
+	printf("uri: \"%.*s\"\n", (int) request->request_line.uri.len, request->request_line.uri.ptr);
 	printf("version enum: \"%i\"\n", request->request_line.version);
-	for (int i = 0; i < REQUEST_HEADER_FIELDS_LIMIT; i++) {
-		if (request->headers.fields[i].key == NULL && request->headers.fields[i].value == NULL) {
-			break;
-		}
-		printf("key: \"%s\", value: \"%s\"\n", request->headers.fields[i].key, request->headers.fields[i].value);
+	for (size_t i = 0; i < request->headers.nfields; i++) {
+		const struct HttpField *f = &request->headers.fields[i];
+		printf("key: \"%.*s\", value: \"%.*s\"\n", (int) f->key.len, f->key.ptr, (int) f->value.len, f->value.ptr);
 	}
 }
 
@@ -169,54 +141,184 @@ void print_http_response_struct(const struct HttpResponse *response) {
 	printf("version enum: \"%i\"\n", response->status_line.version);
 	printf("status code: \"%i\"\n", response->status_line.status_code);
 	printf("reason phrase: \"%s\"\n", response->status_line.reason_phrase);
-	for (int i = 0; i < REQUEST_HEADER_FIELDS_LIMIT; i++) {
-		if (response->headers.fields[i].key == NULL && response->headers.fields[i].value == NULL) {
-			break;
-		}
-		printf("key: \"%s\", value: \"%s\"\n", response->headers.fields[i].key, response->headers.fields[i].value);
+	for (size_t i = 0; i < response->headers.nfields; i++) {
+		const struct HttpField *f = &response->headers.fields[i];
+		printf("key: \"%.*s\", value: \"%.*s\"\n", (int) f->key.len, f->key.ptr, (int) f->value.len, f->value.ptr);
 	}
 }
 
-int parse_http_request(char *s, struct HttpRequest *h) {
-	const size_t len = strlen(s);
-	if (len <= 0 || len > REQUEST_MAX_SIZE_BYTES) {
-		lprintf(ERROR, "size (%lu) bytes of http request is out of range (0 - %i)", len, REQUEST_MAX_SIZE_BYTES);
+/* the \r\n ending the line at p, head_end is the one before the empty line so there always is one.
+ * NULL for a bare \n, forwarded to an upstream it could end the line there and smuggle a field in
+ */
+static const char *next_crlf(const char *p, const char *head_end) {
+	const char *lf = memchr(p + 1, '\n', (size_t) (head_end + 1 - p));
+	return lf[-1] == '\r' ? lf - 1 : NULL;
+}
+
+// field names are ascii, folding bit 5 is only a case change for letters. names often share a prefix
+// (Content-, Accept-, X-) so they're compared from the end
+static bool name_eq(const char *a, const char *b, const size_t n) {
+	for (size_t i = n; i-- > 0;) {
+		const unsigned char x = (unsigned char) a[i], y = (unsigned char) b[i];
+		if (x != y && ((x | 0x20) != (y | 0x20) || (unsigned char) ((x | 0x20) - 'a') > 'z' - 'a'))
+			return false;
+	}
+	return true;
+}
+
+int parse_http_request(const char *buf, const size_t len, struct HttpRequest *req) {
+	if (len == 0 || len > REQUEST_MAX_SIZE_BYTES) {
+		lprintf(ERROR, "size (%zu) bytes of http request is out of range (0 - %i)", len, REQUEST_MAX_SIZE_BYTES);
+		return -1;
+	}
+	const char *head_end = memmem(buf, len, "\r\n\r\n", 4);
+	if (head_end == NULL) {
+		lprintf(ERROR, "ill formed http request");
+		return -1;
+	}
+	const char *line_end = next_crlf(buf, head_end);
+	if (line_end == NULL || parse_http_request_line(buf, (size_t) (line_end - buf), &req->request_line) == -1) {
+		lprintf(ERROR, "ill formed request line");
+		return -1;
+	}
+	if (parse_http_target(req) == -1) {
+		lprintf(ERROR, "bad request target %.*s", (int) req->request_line.uri.len, req->request_line.uri.ptr);
 		return -1;
 	}
-	if (parse_http_body(s, &h->body) == -1) {
+	// counted first so the table is exactly as large as the fields received
+	size_t n = 0;
+	for (const char *p = line_end + 2; p < head_end + 2; n++) {
+		const char *end = next_crlf(p, head_end);
+		if (end == NULL) {
+			lprintf(ERROR, "bare line feed in the request head");
+			return -1;
+		}
+		p = end + 2;
+	}
+	if (n > REQUEST_HEADER_FIELDS_LIMIT) {
+		lprintf(ERROR, "more than %d header fields", REQUEST_HEADER_FIELDS_LIMIT);
 		return -1;
 	}
-	char *ptr_header_start; {
-		char *tmp_ptr = strstr(s, "\r\n");
-		*tmp_ptr = '\0';
-		ptr_header_start = tmp_ptr + 2;
+	http_headers_init(&req->headers, req->arena);
+	if (n > 0) {
+		req->headers.fields = arena_alloc(req->arena, n * sizeof(struct HttpField));
+		if (req->headers.fields == NULL)
+			return -1;
+		req->headers.cap = n;
+	}
+	for (const char *p = line_end + 2; p < head_end + 2; p = line_end + 2) {
+		line_end = next_crlf(p, head_end);
+		if (parse_http_field(p, (size_t) (line_end - p), &req->headers.fields[req->headers.nfields]) == -1) {
+			lprintf(ERROR, "ill formed header field");
+			return -1;
+		}
+		req->headers.nfields++;
 	}
-	parse_http_headers(ptr_header_start, &h->headers);
-	parse_http_request_line(s, &h->request_line);
+	size_t content_length;
+	if (http_content_length(&req->headers, &content_length) == -1) {
+		lprintf(ERROR, "invalid or repeated Content-Length");
+		return -1;
+	}
+	// no length is no body, whatever follows is the next request
+	const char *body = head_end + 4;
+	const size_t received = (size_t) (buf + len - body);
+	req->body.ptr = (void *) body;
+	req->body.len = received < content_length ? received : content_length;
 	return 0;
 }
 
-char *get_http_header(const char *key, const headers_t *headers) {
+int parse_http_target(struct HttpRequest *req) {
+	struct HttpRequestLine *line = &req->request_line;
+	req->query = NULL;
+	if (uri_split(line->uri, req->arena, &line->path, &line->query) == -1)
+		return -1;
+	if (line->query.len == 0)
+		return 0;
+	req->query = arena_alloc(req->arena, sizeof(struct query_index));
+	if (req->query == NULL)
+		return -1;
+	*req->query = (struct query_index) {.raw = line->query, .params = NULL, .n = 0};
+	return 0;
+}
+
+void http_headers_init(headers_t *headers, arena_t *arena) {
+	*headers = (headers_t) {.fields = NULL, .nfields = 0, .cap = 0, .arena = arena};
+}
+
+struct str_view get_http_header(const char *key, const headers_t *headers) {
+	const size_t key_len = strlen(key);
 	const size_t len = headers->nfields;
 	for (size_t i = 0; i < len; i++) {
-		if (strcmp(key, headers->fields[i].key) == 0) {
-			return headers->fields[i].value;
+		const struct HttpField *f = &headers->fields[i];
+		if (f->key.len == key_len && name_eq(key, f->key.ptr, key_len)) {
+			return f->value;
 		}
 	}
-	return NULL;
+	return (struct str_view) {NULL, 0};
 }
 
+char *dup_http_header(const char *key, const headers_t *headers, arena_t *arena) {
+	const struct str_view v = get_http_header(key, headers);
+	return v.ptr != NULL ? arena_strndup(arena, v.ptr, v.len) : NULL;
+}
 
-int set_http_field(char *key, char *value, headers_t *headers) {
+int http_content_length(const headers_t *headers, size_t *len) {
+	*len = 0;
+	struct str_view cl = {NULL, 0};
+	for (size_t i = 0; i < headers->nfields; i++) {
+		const struct HttpField *f = &headers->fields[i];
+		if (f->key.len != sizeof("Content-Length") - 1 || !name_eq("Content-Length", f->key.ptr, f->key.len))
+			continue;
+		// two lengths, equal or not, are framed differently by whoever reads the first or the last
+		if (cl.ptr != NULL)
+			return -1;
+		cl = f->value;
+	}
+	if (cl.ptr == NULL)
+		return 0;
+	// digits only, the view isn't terminated. 19 of them can't overflow
+	if (cl.len == 0 || cl.len > 19)
+		return -1;
+	unsigned long long n = 0;
+	for (size_t i = 0; i < cl.len; i++) {
+		if (cl.ptr[i] < '0' || cl.ptr[i] > '9')
+			return -1;
+		n = n * 10 + (unsigned long long) (cl.ptr[i] - '0');
+	}
+	if (n > SIZE_MAX)
+		return -1;
+	*len = (size_t) n;
+	return 0;
+}
+
+int set_http_field(const char *key, const char *value, headers_t *headers) {
+	const struct str_view k = str_view_of(key);
 	const size_t len = headers->nfields;
 	for (size_t i = 0; i < len; i++) {
-		if (STR_EQ(key, headers->fields[i].key)) {
-			headers->fields[i].value = value;
+		struct HttpField *f = &headers->fields[i];
+		if (f->key.len == k.len && name_eq(key, f->key.ptr, k.len)) {
+			f->value = str_view_of(value);
 			return 0;
 		}
 	}
-	headers->fields[len].key = (char *) key;
-	headers->fields[len].value = (char *) value;
-	headers->nfields++;
+	return add_http_field(k, str_view_of(value), headers);
+}
+
+int add_http_field(const struct str_view key, const struct str_view value, headers_t *headers) {
+	if (headers->nfields == headers->cap) {
+		if (headers->arena == NULL) {
+			lprintf(ERROR, "header table full at %zu fields", headers->cap);
+			return -1;
+		}
+		const size_t cap = headers->cap == 0 ? HEADERS_INITIAL_FIELDS : headers->cap * 2;
+		struct HttpField *fields = arena_realloc(headers->arena, headers->fields,
+		                                         headers->cap * sizeof(struct HttpField),
+		                                         cap * sizeof(struct HttpField));
+		if (fields == NULL)
+			return -1;
+		headers->fields = fields;
+		headers->cap = cap;
+	}
+	headers->fields[headers->nfields++] = (struct HttpField) {.key = key, .value = value};
 	return 0;
 }
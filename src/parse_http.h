@@ -1,9 +1,17 @@
 #ifndef PARSE_HTTP_H
 #define PARSE_HTTP_H
 
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+
+#include "arena.h"
+
 #define REQUEST_HEADER_FIELDS_LIMIT 100
-#define HEADER_EXISTS(key, header) (get_http_header(key, header) != NULL)
-#define HEADER_EQ(key, header, value) (HEADER_EXISTS(key, header) && STR_EQ(get_http_header(key, header), value))
+#define HEADERS_INITIAL_FIELDS 8 // first allocation of a table that's filled by set_http_field()
+#define HEADER_EXISTS(key, header) (get_http_header(key, header).ptr != NULL)
+#define HEADER_EQ(key, header, value) str_view_eq(get_http_header(key, header), value)
 
 enum HttpMethod {
 	HTTP_METHOD_OPTIONS, HTTP_METHOD_GET, HTTP_METHOD_HEAD, HTTP_METHOD_POST, HTTP_METHOD_PUT, HTTP_METHOD_DELETE,
@@ -14,20 +22,31 @@ enum HttpVersion {
 	HTTP_VERSION_1_0, HTTP_VERSION_1_1, HTTP_VERSION_2, HTTP_VERSION_3, HTTP_VERSION_UNKNOWN
 };
 
+// not null terminated, points into a buffer owned by someone else
+struct str_view {
+	const char *ptr;
+	size_t len;
+};
+
 struct HttpRequestLine {
 	enum HttpMethod method;
-	char *uri;
+	struct str_view uri; // into the received buffer, as sent
+	struct str_view path; // normalised, see uri.h
+	struct str_view query; // raw, without the ?
 	enum HttpVersion version;
 };
 
 struct HttpField {
-	char *key;
-	char *value;
+	struct str_view key;
+	struct str_view value;
 };
 
+// a parsed request's table holds exactly the fields received, a response's grows as they're set
 typedef struct HttpHeaders {
+	struct HttpField *fields;
 	size_t nfields;
-	struct HttpField fields[REQUEST_HEADER_FIELDS_LIMIT];
+	size_t cap;
+	arena_t *arena; // fields lives here and grows here, NULL for a table that can't grow
 } headers_t;
 
 struct HttpBody {
@@ -35,6 +54,24 @@ struct HttpBody {
 	size_t len;
 };
 
+struct conn_io;
+struct sockaddr_storage;
+struct query_index;
+struct websocket_handler;
+struct sse_subscription;
+
+// a response body made while it's sent instead of held in memory, replaces body when set
+struct HttpBodyStream {
+	ssize_t length; // -1 if unknown, http/1.1 then sends it chunked
+	// up to n bytes of the body into buf, 0 at its end, -1 on error
+	ssize_t (*read)(void *ctx, void *buf, size_t n);
+	// optional for a known length, moves the whole body straight to io (splice, sendfile). returns the bytes sent
+	ssize_t (*send)(void *ctx, struct conn_io *io);
+	// called once when the response is done, complete is false if the body didn't go out entirely
+	void (*close)(void *ctx, bool complete);
+	void *ctx;
+};
+
 struct HttpStatusLine {
 	enum HttpVersion version;
 	int status_code;
@@ -43,14 +80,21 @@ struct HttpStatusLine {
 
 struct HttpRequest {
 	headers_t headers;
-	struct HttpBody body;
+	struct HttpBody body; // what arrived with the head, the rest of a longer body is still unread on conn
 	struct HttpRequestLine request_line;
+	struct query_index *query; // NULL without a query, looked up through query_param()
+	arena_t *arena; // request scoped memory for the parser and handlers, reset after the response
+	struct conn_io *conn; // the client connection, NULL on http/2 where the body is always complete
+	const struct sockaddr_storage *client_addr; // NULL if unknown
 };
 
 struct HttpResponse {
 	headers_t headers;
 	struct HttpBody body;
 	struct HttpStatusLine status_line;
+	struct HttpBodyStream *stream; // NULL for a body in memory
+	const struct websocket_handler *websocket; // set with a 101 by websocket_accept(), takes the connection after it
+	const struct sse_subscription *sse; // set by sse_accept(), the event stream takes the connection after the head
 };
 
 struct HttpGeneric {
@@ -62,10 +106,39 @@ struct HttpStorage {
 	struct HttpHeaders headers;
 };
 
-int parse_http_request(char* s, struct HttpRequest* h);
+static inline struct str_view str_view_of(const char *s) {
+	return (struct str_view) {s, strlen(s)};
+}
+
+static inline bool str_view_eq(const struct str_view v, const char *s) {
+	return v.ptr != NULL && v.len == strlen(s) && memcmp(v.ptr, s, v.len) == 0;
+}
+
+static inline bool str_view_case_eq(const struct str_view v, const char *s) {
+	return v.ptr != NULL && v.len == strlen(s) && strncasecmp(v.ptr, s, v.len) == 0;
+}
+
+/* parses the head at the start of buf without writing to it, the request line and the fields point into buf.
+ * the body starts right after the head and is as much of Content-Length as buf holds, bytes past it belong to
+ * the next request. req->arena has to be set, the field table is allocated there
+ */
+int parse_http_request(const char *buf, size_t len, struct HttpRequest *req);
+// path, query and the query index from request_line.uri, -1 for a target that can't be served
+int parse_http_target(struct HttpRequest *req);
+// HTTP_METHOD_UNKNOWN if s isn't one of the methods above
+enum HttpMethod parse_http_method(struct str_view s);
 void print_http_request_struct(const struct HttpRequest *request);
 void print_http_response_struct(const struct HttpResponse *response);
-char *get_http_header(const char *key, const headers_t *headers);
-int set_http_field(char *key, char *value, headers_t *headers);
+void http_headers_init(headers_t *headers, arena_t *arena);
+// case insensitive like field names are, {NULL, 0} if it isn't there
+struct str_view get_http_header(const char *key, const headers_t *headers);
+// the value as a c string in arena, NULL if it isn't there
+char *dup_http_header(const char *key, const headers_t *headers, arena_t *arena);
+// the body length Content-Length gives, 0 without one. -1 for a value that isn't a length or a repeated field
+int http_content_length(const headers_t *headers, size_t *len);
+// replaces a field with the same name. key and value aren't copied and have to outlive the table
+int set_http_field(const char *key, const char *value, headers_t *headers);
+// appends even if the name is already there (Set-Cookie)
+int add_http_field(struct str_view key, struct str_view value, headers_t *headers);
 
 #endif //PARSE_HTTP_H
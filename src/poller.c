@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/errno.h>
+
+#include "poller.h"
+#include "server.h"
+#include "log.h"
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <sys/event.h>
+#include <time.h>
+#endif
+
+#define POLLER_BATCH_MAX 256
+
+struct poller {
+	int fd;
+};
+
+poller_t *poller_create(void) {
+	poller_t *p = malloc(sizeof(*p));
+	if (p == NULL) {
+		sys_error_printf("malloc failed");
+		return NULL;
+	}
+#ifdef __linux__
+	p->fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	p->fd = kqueue();
+#endif
+	if (p->fd == -1) {
+		sys_error_printf("poller create failed");
+		free(p);
+		return NULL;
+	}
+	return p;
+}
+
+void poller_destroy(poller_t *p) {
+	if (p == NULL)
+		return;
+	close(p->fd);
+	free(p);
+}
+
+#ifdef __linux__
+
+static int epoll_update(poller_t *p, const int op, const int fd, const unsigned int events, void *data) {
+	struct epoll_event ev = {0};
+	ev.events = (events & POLLER_READ ? EPOLLIN | EPOLLRDHUP : 0) | (events & POLLER_WRITE ? EPOLLOUT : 0);
+	ev.data.ptr = data;
+	if (epoll_ctl(p->fd, op, fd, &ev) == -1) {
+		sys_error_printf("epoll_ctl failed");
+		return -1;
+	}
+	return 0;
+}
+
+int poller_add(poller_t *p, const int fd, const unsigned int events, void *data) {
+	return epoll_update(p, EPOLL_CTL_ADD, fd, events, data);
+}
+
+int poller_mod(poller_t *p, const int fd, const unsigned int events, void *data) {
+	return epoll_update(p, EPOLL_CTL_MOD, fd, events, data);
+}
+
+int poller_del(poller_t *p, const int fd) {
+	if (epoll_ctl(p->fd, EPOLL_CTL_DEL, fd, NULL) == -1) {
+		sys_error_printf("epoll_ctl failed");
+		return -1;
+	}
+	return 0;
+}
+
+int poller_wait(poller_t *p, struct poller_event *events, int max, const int timeout_ms) {
+	struct epoll_event evs[POLLER_BATCH_MAX];
+	if (max > POLLER_BATCH_MAX)
+		max = POLLER_BATCH_MAX;
+	const int n = epoll_wait(p->fd, evs, max, timeout_ms);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		sys_error_printf("epoll_wait failed");
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		events[i].data = evs[i].data.ptr;
+		events[i].events = (evs[i].events & EPOLLIN ? POLLER_READ : 0) |
+		                   (evs[i].events & EPOLLOUT ? POLLER_WRITE : 0) |
+		                   (evs[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR) ? POLLER_HUP : 0);
+	}
+	return n;
+}
+
+#else
+
+// kqueue keeps a filter per direction, changes that don't apply (deleting an absent filter) are ignored
+static int kqueue_update(poller_t *p, const int fd, const unsigned int events, void *data, const bool adding) {
+	struct kevent changes[2];
+	int n = 0;
+	if (events & POLLER_READ) {
+		EV_SET(&changes[n++], fd, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0, data);
+	} else if (!adding) {
+		EV_SET(&changes[n++], fd, EVFILT_READ, EV_DELETE, 0, 0, data);
+	}
+	if (events & POLLER_WRITE) {
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_ADD | EV_ENABLE, 0, 0, data);
+	} else if (!adding) {
+		EV_SET(&changes[n++], fd, EVFILT_WRITE, EV_DELETE, 0, 0, data);
+	}
+	for (int i = 0; i < n; i++) {
+		if (kevent(p->fd, &changes[i], 1, NULL, 0, NULL) == -1 && errno != ENOENT) {
+			sys_error_printf("kevent failed");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+int poller_add(poller_t *p, const int fd, const unsigned int events, void *data) {
+	return kqueue_update(p, fd, events, data, true);
+}
+
+int poller_mod(poller_t *p, const int fd, const unsigned int events, void *data) {
+	return kqueue_update(p, fd, events, data, false);
+}
+
+int poller_del(poller_t *p, const int fd) {
+	return kqueue_update(p, fd, 0, NULL, false);
+}
+
+int poller_wait(poller_t *p, struct poller_event *events, int max, const int timeout_ms) {
+	struct kevent evs[POLLER_BATCH_MAX];
+	if (max > POLLER_BATCH_MAX)
+		max = POLLER_BATCH_MAX;
+	struct timespec t = {.tv_sec = timeout_ms / 1000, .tv_nsec = (long) (timeout_ms % 1000) * 1000000};
+	const int n = kevent(p->fd, NULL, 0, evs, max, timeout_ms < 0 ? NULL : &t);
+	if (n == -1) {
+		if (errno == EINTR)
+			return 0;
+		sys_error_printf("kevent failed");
+		return -1;
+	}
+	for (int i = 0; i < n; i++) {
+		events[i].data = evs[i].udata;
+		events[i].events = (evs[i].filter == EVFILT_READ ? POLLER_READ : 0) |
+		                   (evs[i].filter == EVFILT_WRITE ? POLLER_WRITE : 0) |
+		                   (evs[i].flags & (EV_EOF | EV_ERROR) ? POLLER_HUP : 0);
+	}
+	return n;
+}
+
+#endif
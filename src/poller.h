@@ -0,0 +1,27 @@
+#ifndef POLLER_H
+#define POLLER_H
+
+#include <stdint.h>
+
+// readiness notification over epoll (linux) or kqueue (macos), level triggered
+
+#define POLLER_READ 0x1u
+#define POLLER_WRITE 0x2u
+#define POLLER_HUP 0x4u // only reported, never requested
+
+struct poller_event {
+	void *data;
+	unsigned int events;
+};
+
+typedef struct poller poller_t;
+
+poller_t *poller_create(void);
+void poller_destroy(poller_t *p);
+int poller_add(poller_t *p, int fd, unsigned int events, void *data);
+int poller_mod(poller_t *p, int fd, unsigned int events, void *data);
+int poller_del(poller_t *p, int fd);
+// returns the number of events, 0 on timeout or -1. timeout_ms -1 waits forever
+int poller_wait(poller_t *p, struct poller_event *events, int max, int timeout_ms);
+
+#endif //POLLER_H
@@ -0,0 +1,1058 @@
+#define _GNU_SOURCE // splice, memmem
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include "coro.h"
+#include "log.h"
+#include "metrics.h"
+#include "proxy.h"
+#include "serialize_http.h"
+#include "tls.h"
+
+#define PROXY_CACHE_LINE 128
+#define PROXY_BUF_BYTES (1024 * 32) // upstream response head and what came with it
+#define PROXY_HEAD_MAX_BYTES (1024 * 8) // leaves the rest of the buffer for chunk size lines
+#define PROXY_COPY_BYTES (1024 * 16)
+#define PROXY_PIPE_CHUNK_BYTES (1024 * 64)
+#define PROXY_HEALTH_TIMEOUT_MS 2000
+
+struct proxy_route;
+
+struct upstream {
+	alignas(PROXY_CACHE_LINE) _Atomic unsigned int active; // requests in flight over all workers
+	atomic_bool healthy;
+	size_t index; // into a worker's idle lists
+	const struct proxy_route *route;
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	const char *name;
+	uint64_t next_check_ns; // health thread only
+};
+
+struct proxy_route {
+	struct proxy_route_options opt;
+	proxy_t *proxy;
+	struct upstream *upstreams;
+	_Atomic size_t next; // round robin position
+};
+
+struct proxy {
+	struct proxy_route routes[PROXY_ROUTES_MAX];
+	size_t nroutes;
+	struct upstream *upstreams; // every route's, in one allocation
+	size_t nupstreams;
+	pthread_key_t worker_key;
+	pthread_t health_thread;
+	pthread_mutex_t health_mutex;
+	pthread_cond_t health_cond;
+	bool health_stop;
+};
+
+// per worker thread, never shared
+struct idle_list {
+	int *fds; // most recently used last
+	size_t n;
+};
+
+struct proxy_worker {
+	int pipe_fds[2]; // splice buffer, -1 until first needed
+	size_t nupstreams;
+	struct idle_list idle[]; // by upstream index
+};
+
+static thread_local struct proxy_worker *worker;
+
+enum body_framing {
+	BODY_NONE,
+	BODY_LENGTH,
+	BODY_CHUNKED,
+	BODY_UNTIL_CLOSE
+};
+
+enum chunk_state {
+	CHUNK_SIZE,
+	CHUNK_DATA,
+	CHUNK_DATA_END,
+	CHUNK_TRAILER,
+	CHUNK_DONE
+};
+
+// one request's upstream connection, owned by the response body stream once the head is read
+struct proxy_stream {
+	struct HttpBodyStream st;
+	struct upstream *u;
+	struct proxy_worker *w;
+	conn_io_t up;
+	bool reusable;
+	bool got_bytes; // anything came back, a failed request on a reused connection can't be replayed after
+	bool done; // the whole body was read
+	enum body_framing framing;
+	enum chunk_state chunk;
+	uint64_t remaining; // body bytes left, or bytes left in the current chunk
+	char *buf; // upstream bytes read but not handed on yet are buf[pos, len)
+	size_t pos;
+	size_t len;
+	size_t cap;
+};
+
+static int append(char *buf, const size_t bufn, size_t *len, const char *format, ...) {
+	if (*len >= bufn)
+		return -1;
+	va_list args;
+	va_start(args, format);
+	const int n = vsnprintf(buf + *len, bufn - *len, format, args);
+	va_end(args);
+	if (n < 0 || (size_t) n >= bufn - *len)
+		return -1;
+	*len += (size_t) n;
+	return 0;
+}
+
+static const char *method_name(const enum HttpMethod m) {
+	switch (m) {
+		case HTTP_METHOD_OPTIONS: return "OPTIONS";
+		case HTTP_METHOD_GET: return "GET";
+		case HTTP_METHOD_HEAD: return "HEAD";
+		case HTTP_METHOD_POST: return "POST";
+		case HTTP_METHOD_PUT: return "PUT";
+		case HTTP_METHOD_DELETE: return "DELETE";
+		case HTTP_METHOD_TRACE: return "TRACE";
+		case HTTP_METHOD_CONNECT: return "CONNECT";
+		case HTTP_METHOD_UNKNOWN: break;
+	}
+	return NULL;
+}
+
+// meaningful for one connection only, never forwarded
+static bool hop_by_hop(const struct str_view name) {
+	static const char *const names[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Upgrade",
+	                                    "HTTP2-Settings"};
+	for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (str_view_case_eq(name, names[i]))
+			return true;
+	}
+	return false;
+}
+
+static int resolve(const char *address, struct sockaddr_storage *ss, socklen_t *len) {
+	memset(ss, 0, sizeof(*ss));
+	if (strncmp(address, "unix:", 5) == 0) {
+		struct sockaddr_un *sun = (struct sockaddr_un *) ss;
+		const char *path = address + 5;
+		if (strlen(path) >= sizeof(sun->sun_path)) {
+			lprintf(ERROR, "upstream socket path too long: %s", path);
+			return -1;
+		}
+		sun->sun_family = AF_UNIX;
+		memcpy(sun->sun_path, path, strlen(path) + 1);
+		*len = sizeof(*sun);
+		return 0;
+	}
+	const char *colon = strrchr(address, ':');
+	if (colon == NULL || colon == address || colon[1] == '\0') {
+		lprintf(ERROR, "upstream %s needs to be host:port or unix:/path", address);
+		return -1;
+	}
+	char host[PROXY_ADDRESS_MAX];
+	const char *h = address;
+	size_t host_len = (size_t) (colon - address);
+	if (h[0] == '[' && colon[-1] == ']') {
+		h++;
+		host_len -= 2;
+	}
+	memcpy(host, h, host_len);
+	host[host_len] = '\0';
+	const struct addrinfo hints = {.ai_socktype = SOCK_STREAM};
+	struct addrinfo *ai;
+	const int err = getaddrinfo(host, colon + 1, &hints, &ai);
+	if (err != 0) {
+		lprintf(ERROR, "can't resolve upstream %s: %s", address, gai_strerror(err));
+		return -1;
+	}
+	memcpy(ss, ai->ai_addr, ai->ai_addrlen);
+	*len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+	return 0;
+}
+
+static void set_health(struct upstream *u, const bool healthy) {
+	if (atomic_exchange(&u->healthy, healthy) != healthy) {
+		if (healthy)
+			lprintf(WARN, "upstream %s is up again", u->name);
+		else
+			lprintf(WARN, "upstream %s is down", u->name);
+	}
+}
+
+// bounded by timeout_ms, the socket is blocking again when returned unless a coroutine connected it
+static int upstream_connect(const struct upstream *u, const int timeout_ms) {
+	const int fd = socket(u->addr.ss_family, SOCK_STREAM, 0);
+	if (fd == -1) {
+		sys_error_printf("socket failed");
+		return -1;
+	}
+	const int flags = fcntl(fd, F_GETFL);
+	if (flags == -1 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		sys_error_printf("fcntl failed");
+		goto error_cleanup;
+	}
+	if (connect(fd, (const struct sockaddr *) &u->addr, u->addr_len) == -1) {
+		if (errno != EINPROGRESS)
+			goto error_cleanup;
+		if (co_wait(fd, POLLER_WRITE, timeout_ms) == -1)
+			goto error_cleanup;
+		int err;
+		socklen_t err_len = sizeof(err);
+		if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) == -1)
+			goto error_cleanup;
+		if (err != 0) {
+			errno = err;
+			goto error_cleanup;
+		}
+	}
+	if (!co_running() && fcntl(fd, F_SETFL, flags) == -1) {
+		sys_error_printf("fcntl failed");
+		goto error_cleanup;
+	}
+	if (u->addr.ss_family != AF_UNIX) {
+		const int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	}
+	const struct timeval t = {.tv_sec = timeout_ms / 1000, .tv_usec = timeout_ms % 1000 * 1000};
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == -1 ||
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t)) == -1) {
+		sys_error_printf("setsockopt failed");
+		goto error_cleanup;
+	}
+	return fd;
+error_cleanup:
+	lprintf(DEBUG, "connecting to upstream %s failed: %s", u->name, strerror(errno));
+	close(fd);
+	return -1;
+}
+
+static void worker_free(void *vw) {
+	struct proxy_worker *w = vw;
+	for (size_t i = 0; i < w->nupstreams; i++) {
+		for (size_t j = 0; j < w->idle[i].n; j++)
+			close(w->idle[i].fds[j]);
+		free(w->idle[i].fds);
+	}
+	if (w->pipe_fds[0] != -1) {
+		close(w->pipe_fds[0]);
+		close(w->pipe_fds[1]);
+	}
+	free(w);
+}
+
+static struct proxy_worker *get_worker(proxy_t *p) {
+	if (worker != NULL)
+		return worker;
+	struct proxy_worker *w = calloc(1, sizeof(*w) + sizeof(w->idle[0]) * p->nupstreams);
+	if (w == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	w->pipe_fds[0] = -1;
+	w->pipe_fds[1] = -1;
+	w->nupstreams = p->nupstreams;
+	for (size_t i = 0; i < p->nupstreams; i++) {
+		const unsigned int max = p->upstreams[i].route->opt.idle_per_worker;
+		if (max == 0)
+			continue;
+		w->idle[i].fds = malloc(sizeof(int) * max);
+		if (w->idle[i].fds == NULL) {
+			sys_error_printf("malloc failed");
+			worker_free(w);
+			return NULL;
+		}
+	}
+	// the idle connections are closed when the worker thread exits
+	pthread_setspecific(p->worker_key, w);
+	worker = w;
+	return w;
+}
+
+static int idle_take(struct proxy_worker *w, const struct upstream *u) {
+	struct idle_list *l = &w->idle[u->index];
+	while (l->n > 0) {
+		const int fd = l->fds[--l->n];
+		char c;
+		// closed by the upstream or sent something unasked for while idle, either way it's unusable
+		if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return fd;
+		close(fd);
+	}
+	return -1;
+}
+
+static void idle_put(struct proxy_worker *w, const struct upstream *u, const int fd) {
+	struct idle_list *l = &w->idle[u->index];
+	if (l->n < u->route->opt.idle_per_worker)
+		l->fds[l->n++] = fd;
+	else
+		close(fd);
+}
+
+static struct upstream *pick_upstream(struct proxy_route *r) {
+	const size_t n = r->opt.nupstreams;
+	const size_t start = atomic_fetch_add_explicit(&r->next, 1, memory_order_relaxed);
+	struct upstream *best = NULL;
+	for (size_t i = 0; i < n; i++) {
+		struct upstream *u = &r->upstreams[(start + i) % n];
+		if (!atomic_load_explicit(&u->healthy, memory_order_relaxed))
+			continue;
+		if (r->opt.balance == PROXY_ROUND_ROBIN)
+			return u;
+		if (best == NULL || atomic_load_explicit(&u->active, memory_order_relaxed) <
+		                    atomic_load_explicit(&best->active, memory_order_relaxed))
+			best = u;
+	}
+	// all marked down, the checks may lag behind a recovery so the request still gets a try
+	return best != NULL ? best : &r->upstreams[start % n];
+}
+
+// copies through userspace, for tls on either side or where splice doesn't exist
+static int copy_bytes(conn_io_t *from, conn_io_t *to, size_t n) {
+	char buf[PROXY_COPY_BYTES];
+	while (n > 0) {
+		const ssize_t got = conn_io_recv(from, buf, n < sizeof(buf) ? n : sizeof(buf));
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return -1;
+		struct iovec iov = {.iov_base = buf, .iov_len = (size_t) got};
+		if (conn_io_writev(to, &iov, 1) == -1)
+			return -1;
+		n -= (size_t) got;
+	}
+	return 0;
+}
+
+#ifdef __linux__
+// socket to pipe to socket, the bytes stay in the kernel. with ktls the kernel encrypts on the way out
+static int splice_bytes(struct proxy_worker *w, const int from, const int to, size_t n) {
+	if (w->pipe_fds[0] == -1 && pipe(w->pipe_fds) == -1) {
+		sys_error_printf("pipe failed");
+		w->pipe_fds[0] = -1;
+		return -1;
+	}
+	size_t in_pipe = 0;
+	while (n > 0 || in_pipe > 0) {
+		if (n > 0) {
+			const ssize_t got = splice(from, NULL, w->pipe_fds[1], NULL,
+			                           n < PROXY_PIPE_CHUNK_BYTES ? n : PROXY_PIPE_CHUNK_BYTES,
+			                           SPLICE_F_MOVE | SPLICE_F_MORE);
+			if (got == -1 && errno == EINTR)
+				continue;
+			if (got <= 0)
+				goto error_cleanup;
+			n -= (size_t) got;
+			in_pipe += (size_t) got;
+		}
+		while (in_pipe > 0) {
+			const ssize_t sent = splice(w->pipe_fds[0], NULL, to, NULL, in_pipe,
+			                            SPLICE_F_MOVE | (n > 0 ? SPLICE_F_MORE : 0));
+			if (sent == -1 && errno == EINTR)
+				continue;
+			if (sent <= 0)
+				goto error_cleanup;
+			in_pipe -= (size_t) sent;
+		}
+	}
+	return 0;
+error_cleanup:
+	lprintf(DEBUG, "splice failed: %s", strerror(errno));
+	// bytes may be left in the pipe, the next splice needs an empty one
+	close(w->pipe_fds[0]);
+	close(w->pipe_fds[1]);
+	w->pipe_fds[0] = -1;
+	w->pipe_fds[1] = -1;
+	return -1;
+}
+#endif
+
+static int move_bytes(struct proxy_worker *w, conn_io_t *from, conn_io_t *to, const size_t n) {
+#ifdef __linux__
+	// the pipe is the thread's, a coroutine parked halfway would leave bytes in it for the next one
+	if (from->ssl == NULL && (to->ssl == NULL || to->ktls_send) && !co_running())
+		return splice_bytes(w, from->fd, to->fd, n);
+#else
+	(void) w;
+#endif
+	return copy_bytes(from, to, n);
+}
+
+// buffered bytes first, then the socket. 0 is the upstream closing
+static ssize_t stream_fill(struct proxy_stream *s, void *buf, const size_t n) {
+	if (s->pos < s->len) {
+		const size_t m = s->len - s->pos < n ? s->len - s->pos : n;
+		memcpy(buf, s->buf + s->pos, m);
+		s->pos += m;
+		return (ssize_t) m;
+	}
+	while (1) {
+		const ssize_t got = conn_io_recv(&s->up, buf, n);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1)
+			lprintf(DEBUG, "upstream %s: recv failed: %s", s->u->name, strerror(errno));
+		return got;
+	}
+}
+
+// a chunk size or trailer line, NUL terminated without the line break
+static char *stream_line(struct proxy_stream *s) {
+	while (1) {
+		char *start = s->buf + s->pos;
+		char *nl = memchr(start, '\n', s->len - s->pos);
+		if (nl != NULL) {
+			s->pos = (size_t) (nl + 1 - s->buf);
+			if (nl > start && nl[-1] == '\r')
+				nl--;
+			*nl = '\0';
+			return start;
+		}
+		memmove(s->buf, start, s->len - s->pos);
+		s->len -= s->pos;
+		s->pos = 0;
+		if (s->len == s->cap) {
+			lprintf(ERROR, "upstream %s: chunk line longer than %zu bytes", s->u->name, s->cap);
+			return NULL;
+		}
+		const ssize_t got = conn_io_recv(&s->up, s->buf + s->len, s->cap - s->len);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			lprintf(DEBUG, "upstream %s closed in a chunked body", s->u->name);
+			return NULL;
+		}
+		s->len += (size_t) got;
+	}
+}
+
+static ssize_t chunked_read(struct proxy_stream *s, void *buf, const size_t n) {
+	while (1) {
+		switch (s->chunk) {
+			case CHUNK_SIZE: {
+				const char *line = stream_line(s);
+				if (line == NULL)
+					return -1;
+				char *end;
+				errno = 0;
+				const unsigned long long size = strtoull(line, &end, 16);
+				// chunk extensions after a ';' are ignored
+				if (end == line || errno != 0 || (*end != '\0' && *end != ';' && *end != ' ' && *end != '\t')) {
+					lprintf(ERROR, "upstream %s: bad chunk size \"%s\"", s->u->name, line);
+					return -1;
+				}
+				s->remaining = size;
+				s->chunk = size == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+				break;
+			}
+			case CHUNK_DATA: {
+				const ssize_t got = stream_fill(s, buf, s->remaining < n ? (size_t) s->remaining : n);
+				if (got <= 0)
+					return -1;
+				s->remaining -= (uint64_t) got;
+				if (s->remaining == 0)
+					s->chunk = CHUNK_DATA_END;
+				return got;
+			}
+			case CHUNK_DATA_END: {
+				const char *line = stream_line(s);
+				if (line == NULL || *line != '\0')
+					return -1;
+				s->chunk = CHUNK_SIZE;
+				break;
+			}
+			case CHUNK_TRAILER: {
+				// trailers are dropped, the client gets the body only
+				const char *line = stream_line(s);
+				if (line == NULL)
+					return -1;
+				if (*line == '\0') {
+					s->chunk = CHUNK_DONE;
+					s->done = true;
+				}
+				break;
+			}
+			case CHUNK_DONE:
+				return 0;
+		}
+	}
+}
+
+static ssize_t stream_read(void *ctx, void *buf, const size_t n) {
+	struct proxy_stream *s = ctx;
+	switch (s->framing) {
+		case BODY_NONE:
+			return 0;
+		case BODY_LENGTH: {
+			if (s->remaining == 0) {
+				s->done = true;
+				return 0;
+			}
+			const ssize_t got = stream_fill(s, buf, s->remaining < n ? (size_t) s->remaining : n);
+			if (got <= 0) {
+				lprintf(DEBUG, "upstream %s: body cut off with %llu bytes left", s->u->name,
+				        (unsigned long long) s->remaining);
+				return -1;
+			}
+			s->remaining -= (uint64_t) got;
+			return got;
+		}
+		case BODY_CHUNKED:
+			return chunked_read(s, buf, n);
+		case BODY_UNTIL_CLOSE: {
+			const ssize_t got = stream_fill(s, buf, n);
+			if (got == 0)
+				s->done = true;
+			return got;
+		}
+	}
+	return -1;
+}
+
+// only for BODY_LENGTH
+static ssize_t stream_send(void *ctx, conn_io_t *io) {
+	struct proxy_stream *s = ctx;
+	const uint64_t total = s->remaining;
+	const size_t buffered = s->len - s->pos < s->remaining ? s->len - s->pos : (size_t) s->remaining;
+	if (buffered > 0) {
+		struct iovec iov = {.iov_base = s->buf + s->pos, .iov_len = buffered};
+		if (conn_io_writev(io, &iov, 1) == -1)
+			return -1;
+		s->pos += buffered;
+		s->remaining -= buffered;
+	}
+	if (s->remaining > 0 && move_bytes(s->w, &s->up, io, (size_t) s->remaining) == -1)
+		return -1;
+	s->remaining = 0;
+	s->done = true;
+	return (ssize_t) total;
+}
+
+// the connection goes back to the worker's pool only after a complete exchange with nothing left over
+static void stream_release(struct proxy_stream *s, const bool complete) {
+	if (complete && s->reusable && s->pos == s->len)
+		idle_put(s->w, s->u, s->up.fd);
+	else
+		close(s->up.fd);
+	atomic_fetch_sub_explicit(&s->u->active, 1, memory_order_relaxed);
+}
+
+static void stream_close(void *ctx, const bool complete) {
+	struct proxy_stream *s = ctx;
+	stream_release(s, complete && s->done);
+}
+
+// Content-Length of the body part that belongs to this request, and what of it is still unread
+static int request_body(const struct HttpRequest *req, size_t *have, size_t *rest) {
+	*have = req->body.len;
+	*rest = 0;
+	if (req->conn == NULL)
+		return 0;
+	// the parser already cut the body at its length
+	size_t n;
+	if (http_content_length(&req->headers, &n) == -1)
+		return -1;
+	*rest = n - *have;
+	return 0;
+}
+
+static ssize_t build_request_head(const struct HttpRequest *req, const size_t body_len, char *buf,
+                                  const size_t bufn) {
+	size_t len = 0;
+	const char *method = method_name(req->request_line.method);
+	const struct str_view uri = req->request_line.uri;
+	if (method == NULL || append(buf, bufn, &len, "%s %.*s HTTP/1.1\r\n", method, (int) uri.len, uri.ptr) == -1)
+		return -1;
+	struct str_view forwarded_for = {NULL, 0};
+	bool has_host = false;
+	for (size_t i = 0; i < req->headers.nfields; i++) {
+		const struct HttpField *f = &req->headers.fields[i];
+		if (hop_by_hop(f->key) || str_view_case_eq(f->key, "X-Forwarded-Proto"))
+			continue;
+		if (str_view_case_eq(f->key, "X-Forwarded-For")) {
+			forwarded_for = f->value;
+			continue;
+		}
+		// the length the body was framed by is set below, the upstream can't read it any other way
+		if (str_view_case_eq(f->key, "Content-Length") || str_view_case_eq(f->key, "Transfer-Encoding"))
+			continue;
+		if (str_view_case_eq(f->key, "Host"))
+			has_host = true;
+		if (append(buf, bufn, &len, "%.*s: %.*s\r\n", (int) f->key.len, f->key.ptr, (int) f->value.len,
+		           f->value.ptr) == -1)
+			return -1;
+	}
+	if (!has_host && append(buf, bufn, &len, "Host: localhost\r\n") == -1)
+		return -1;
+	if (req->client_addr != NULL) {
+		char ip[INET6_ADDRSTRLEN] = "";
+		if (req->client_addr->ss_family == AF_INET)
+			inet_ntop(AF_INET, &((const struct sockaddr_in *) req->client_addr)->sin_addr, ip, sizeof(ip));
+		else if (req->client_addr->ss_family == AF_INET6)
+			inet_ntop(AF_INET6, &((const struct sockaddr_in6 *) req->client_addr)->sin6_addr, ip, sizeof(ip));
+		if (ip[0] != '\0' && append(buf, bufn, &len, "X-Forwarded-For: %.*s%s%s\r\n", (int) forwarded_for.len,
+		                            forwarded_for.ptr != NULL ? forwarded_for.ptr : "",
+		                            forwarded_for.ptr != NULL ? ", " : "", ip) == -1)
+			return -1;
+	}
+	const bool https = req->conn != NULL && req->conn->ssl != NULL;
+	if (append(buf, bufn, &len, "X-Forwarded-Proto: %s\r\n", https ? "https" : "http") == -1)
+		return -1;
+	if ((body_len > 0 || req->request_line.method == HTTP_METHOD_POST || req->request_line.method == HTTP_METHOD_PUT) &&
+	    append(buf, bufn, &len, "Content-Length: %zu\r\n", body_len) == -1)
+		return -1;
+	if (append(buf, bufn, &len, "\r\n") == -1)
+		return -1;
+	return (ssize_t) len;
+}
+
+static int send_request(struct proxy_stream *s, const struct HttpRequest *req, char *head, const size_t head_len,
+                        const size_t body_len, const size_t rest) {
+	struct iovec iov[2] = {
+		{.iov_base = head, .iov_len = head_len},
+		{.iov_base = req->body.ptr, .iov_len = body_len}
+	};
+	if (conn_io_writev(&s->up, iov, body_len > 0 ? 2 : 1) == -1)
+		return -1;
+	// the rest of a long body is still in the client socket, it goes through without being held
+	if (rest > 0 && move_bytes(s->w, req->conn, &s->up, rest) == -1) {
+		lprintf(DEBUG, "forwarding the request body to %s failed", s->u->name);
+		return -1;
+	}
+	return 0;
+}
+
+// reads up to the end of the head, returns its length. what came after it stays in the buffer
+static ssize_t read_head(struct proxy_stream *s) {
+	while (1) {
+		const char *end = memmem(s->buf, s->len, "\r\n\r\n", 4);
+		if (end != NULL)
+			return end + 4 - s->buf;
+		if (s->len >= PROXY_HEAD_MAX_BYTES) {
+			lprintf(ERROR, "upstream %s: response head larger than %d bytes", s->u->name, PROXY_HEAD_MAX_BYTES);
+			errno = EPROTO;
+			return -1;
+		}
+		const ssize_t got = conn_io_recv(&s->up, s->buf + s->len, s->cap - s->len);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0) {
+			if (got == 0)
+				errno = ECONNRESET;
+			lprintf(DEBUG, "upstream %s: no response: %s", s->u->name, strerror(errno));
+			return -1;
+		}
+		s->got_bytes = true;
+		s->len += (size_t) got;
+	}
+}
+
+// "HTTP/1.x nnn reason", the minor version or -1
+static int parse_status_line(const char *line, int *status) {
+	if (strncmp(line, "HTTP/1.", 7) != 0 || (line[7] != '0' && line[7] != '1') || line[8] != ' ')
+		return -1;
+	char *end;
+	const long code = strtol(line + 9, &end, 10);
+	if (end != line + 12 || code < 100 || code > 599 || (*end != ' ' && *end != '\0'))
+		return -1;
+	*status = (int) code;
+	return line[7] - '0';
+}
+
+static char *next_line(char **p, char *const end) {
+	char *nl = memchr(*p, '\n', (size_t) (end - *p));
+	if (nl == NULL)
+		return NULL;
+	char *line = *p;
+	*p = nl + 1;
+	if (nl > line && nl[-1] == '\r')
+		nl--;
+	*nl = '\0';
+	return line;
+}
+
+static void trim_value(char **value) {
+	while (**value == ' ' || **value == '\t')
+		(*value)++;
+	char *end = *value + strlen(*value);
+	while (end > *value && (end[-1] == ' ' || end[-1] == '\t'))
+		end--;
+	*end = '\0';
+}
+
+// fills res from the upstream head and sets up the body stream. the head stays in the buffer, res points into it
+static int read_response(struct proxy_stream *s, const struct HttpRequest *req, struct HttpResponse *res) {
+	ssize_t head_len;
+	int status;
+	int minor;
+	char *p;
+	while (1) {
+		head_len = read_head(s);
+		if (head_len == -1)
+			return -1;
+		p = s->buf;
+		const char *status_line = next_line(&p, s->buf + head_len);
+		minor = parse_status_line(status_line, &status);
+		if (minor == -1 || status == 101) {
+			lprintf(ERROR, "upstream %s: bad status line \"%s\"", s->u->name, status_line);
+			errno = EPROTO;
+			return -1;
+		}
+		if (status >= 200)
+			break;
+		// interim responses (100 Continue) aren't passed on, the body already went out
+		memmove(s->buf, s->buf + head_len, s->len - (size_t) head_len);
+		s->len -= (size_t) head_len;
+	}
+	char *const head_end = s->buf + head_len;
+	bool keep_alive = minor == 1;
+	bool chunked = false;
+	bool has_length = false;
+	uint64_t length = 0;
+	char *length_value = NULL;
+	res->status_line.status_code = status;
+	char *line;
+	while ((line = next_line(&p, head_end)) != NULL && *line != '\0') {
+		char *colon = strchr(line, ':');
+		if (colon == NULL || colon == line) {
+			lprintf(ERROR, "upstream %s: bad header line \"%s\"", s->u->name, line);
+			errno = EPROTO;
+			return -1;
+		}
+		*colon = '\0';
+		char *value = colon + 1;
+		trim_value(&value);
+		if (strcasecmp(line, "Connection") == 0) {
+			if (strcasecmp(value, "close") == 0)
+				keep_alive = false;
+			else if (strcasecmp(value, "keep-alive") == 0)
+				keep_alive = true;
+			continue;
+		}
+		if (strcasecmp(line, "Transfer-Encoding") == 0) {
+			// chunked has to be the last coding, anything else is delimited by the close
+			const size_t len = strlen(value);
+			chunked = len >= 7 && strcasecmp(value + len - 7, "chunked") == 0;
+			if (!chunked)
+				keep_alive = false;
+			continue;
+		}
+		if (strcasecmp(line, "Content-Length") == 0) {
+			char *end;
+			errno = 0;
+			length = strtoull(value, &end, 10);
+			if (end == value || *end != '\0' || errno != 0) {
+				lprintf(ERROR, "upstream %s: bad Content-Length \"%s\"", s->u->name, value);
+				errno = EPROTO;
+				return -1;
+			}
+			has_length = true;
+			length_value = value;
+			continue;
+		}
+		const struct str_view key = {line, (size_t) (colon - line)};
+		if (hop_by_hop(key))
+			continue;
+		if (res->headers.nfields >= REQUEST_HEADER_FIELDS_LIMIT) {
+			lprintf(ERROR, "upstream %s: more than %d response headers", s->u->name, REQUEST_HEADER_FIELDS_LIMIT);
+			errno = EPROTO;
+			return -1;
+		}
+		// appended, not set, so repeated fields like Set-Cookie all arrive
+		if (add_http_field(key, str_view_of(value), &res->headers) == -1)
+			return -1;
+	}
+	s->reusable = keep_alive;
+	// the body buffer starts after the head so the strings res points to survive chunk line reads
+	s->buf += head_len;
+	s->cap -= (size_t) head_len;
+	s->len -= (size_t) head_len;
+	s->pos = 0;
+	if (req->request_line.method == HTTP_METHOD_HEAD || status == 204 || status == 304) {
+		s->framing = BODY_NONE;
+		// a HEAD answer keeps the length of the body it stands for
+		if (req->request_line.method == HTTP_METHOD_HEAD && length_value != NULL &&
+		    add_http_field(str_view_of("Content-Length"), str_view_of(length_value), &res->headers) == -1)
+			return -1;
+	} else if (chunked) {
+		s->framing = BODY_CHUNKED;
+		s->chunk = CHUNK_SIZE;
+	} else if (has_length) {
+		s->framing = length > 0 ? BODY_LENGTH : BODY_NONE;
+		s->remaining = length;
+	} else {
+		s->framing = BODY_UNTIL_CLOSE;
+		s->reusable = false;
+	}
+	if (s->framing == BODY_NONE) {
+		s->done = true;
+		stream_release(s, true);
+		return 0;
+	}
+	s->st = (struct HttpBodyStream) {
+		.length = s->framing == BODY_LENGTH ? (ssize_t) length : -1,
+		.read = stream_read,
+		.send = s->framing == BODY_LENGTH ? stream_send : NULL,
+		.close = stream_close,
+		.ctx = s
+	};
+	res->stream = &s->st;
+	return 0;
+}
+
+static int upstream_error(struct HttpResponse *res, const int status) {
+	static char bad_gateway[] = "bad gateway";
+	static char gateway_timeout[] = "gateway timeout";
+	static char bad_request[] = "bad request";
+	http_response_init(res, res->headers.arena);
+	res->status_line.status_code = status;
+	switch (status) {
+		case 400:
+			res->body.ptr = bad_request;
+			res->body.len = sizeof(bad_request) - 1;
+			break;
+		case 504:
+			res->body.ptr = gateway_timeout;
+			res->body.len = sizeof(gateway_timeout) - 1;
+			break;
+		default:
+			res->body.ptr = bad_gateway;
+			res->body.len = sizeof(bad_gateway) - 1;
+			break;
+	}
+	return 0;
+}
+
+static int proxy_handler(const struct HttpRequest *req, [[maybe_unused]] const struct route_params *params,
+                         struct HttpResponse *res, void *user) {
+	struct proxy_route *r = user;
+	struct proxy_worker *w = get_worker(r->proxy);
+	if (w == NULL)
+		return -1;
+	size_t body_len;
+	size_t rest;
+	if (request_body(req, &body_len, &rest) == -1) {
+		upstream_error(res, 400);
+		// the body's end is unknown, the connection can't continue
+		set_http_field("Connection", "close", &res->headers);
+		return 0;
+	}
+	char *head = arena_alloc(req->arena, RESPONSE_HEAD_MAX_SIZE_BYTES);
+	struct proxy_stream *s = arena_alloc(req->arena, sizeof(*s));
+	char *buf = arena_alloc(req->arena, PROXY_BUF_BYTES);
+	if (head == NULL || s == NULL || buf == NULL)
+		return -1;
+	const ssize_t head_len = build_request_head(req, body_len + rest, head, RESPONSE_HEAD_MAX_SIZE_BYTES);
+	if (head_len == -1) {
+		lprintf(ERROR, "request head for upstream larger than %d bytes", RESPONSE_HEAD_MAX_SIZE_BYTES);
+		return -1;
+	}
+	const bool idempotent = req->request_line.method != HTTP_METHOD_POST;
+	int status = 502;
+	// a failed connect moves on to the next upstream, so does a replay of a stale keep-alive connection
+	for (size_t attempt = 0; attempt <= r->opt.nupstreams; attempt++) {
+		struct upstream *u = pick_upstream(r);
+		int fd = idle_take(w, u);
+		const bool reused = fd != -1;
+		if (!reused) {
+			fd = upstream_connect(u, (int) r->opt.timeout_sec * 1000);
+			if (fd == -1) {
+				set_health(u, false);
+				metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+				status = errno == ETIMEDOUT ? 504 : 502;
+				continue;
+			}
+			metrics_add(METRIC_UPSTREAM_CONNECTS, 1);
+		} else {
+			metrics_add(METRIC_UPSTREAM_REUSED, 1);
+		}
+		atomic_fetch_add_explicit(&u->active, 1, memory_order_relaxed);
+		*s = (struct proxy_stream) {.u = u, .w = w, .buf = buf, .cap = PROXY_BUF_BYTES};
+		conn_io_init(&s->up, fd);
+		s->up.timeout_ms = (int) r->opt.timeout_sec * 1000;
+		if (send_request(s, req, head, (size_t) head_len, body_len, rest) == 0 && read_response(s, req, res) == 0) {
+			return 0;
+		}
+		status = errno == EAGAIN || errno == EWOULDBLOCK ? 504 : 502;
+		stream_release(s, false);
+		metrics_add(METRIC_UPSTREAM_ERRORS, 1);
+		http_response_init(res, res->headers.arena);
+		// the upstream closed a kept-alive connection before the request got there, it never saw it
+		if (!(reused && !s->got_bytes && rest == 0 && idempotent))
+			break;
+	}
+	lprintf(WARN, "proxying %.*s failed with %d", (int) req->request_line.uri.len, req->request_line.uri.ptr,
+	        status);
+	upstream_error(res, status);
+	if (rest > 0)
+		set_http_field("Connection", "close", &res->headers);
+	return 0;
+}
+
+static bool health_check(const struct upstream *u) {
+	const int fd = upstream_connect(u, PROXY_HEALTH_TIMEOUT_MS);
+	if (fd == -1)
+		return false;
+	const char *path = u->route->opt.health_path;
+	if (path[0] == '\0') {
+		close(fd);
+		return true;
+	}
+	char buf[PROXY_PATH_MAX + 128];
+	const int n = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+	                       "User-Agent: chinook-health-check\r\n\r\n", path);
+	bool healthy = false;
+	if (n > 0 && (size_t) n < sizeof(buf) && send(fd, buf, (size_t) n, 0) == n) {
+		size_t len = 0;
+		while (len < 13) {
+			const ssize_t got = recv(fd, buf + len, sizeof(buf) - 1 - len, 0);
+			if (got <= 0)
+				break;
+			len += (size_t) got;
+		}
+		buf[len] = '\0';
+		int status;
+		char *nl = strchr(buf, '\r');
+		if (nl != NULL)
+			*nl = '\0';
+		healthy = parse_status_line(buf, &status) != -1 && status >= 200 && status < 400;
+	}
+	close(fd);
+	return healthy;
+}
+
+static void *health_loop(void *vargp) {
+	proxy_t *p = vargp;
+	pthread_mutex_lock(&p->health_mutex);
+	while (!p->health_stop) {
+		pthread_mutex_unlock(&p->health_mutex);
+		for (size_t i = 0; i < p->nupstreams; i++) {
+			struct upstream *u = &p->upstreams[i];
+			const uint64_t now = metrics_now_ns();
+			if (now < u->next_check_ns)
+				continue;
+			set_health(u, health_check(u));
+			u->next_check_ns = now + (uint64_t) u->route->opt.health_interval_sec * 1000000000ull;
+		}
+		pthread_mutex_lock(&p->health_mutex);
+		if (p->health_stop)
+			break;
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += 1;
+		pthread_cond_timedwait(&p->health_cond, &p->health_mutex, &deadline);
+	}
+	pthread_mutex_unlock(&p->health_mutex);
+	return NULL;
+}
+
+proxy_t *proxy_create(const struct proxy_route_options *routes, const size_t nroutes) {
+	if (nroutes > PROXY_ROUTES_MAX) {
+		lprintf(ERROR, "at most %d proxy routes", PROXY_ROUTES_MAX);
+		return NULL;
+	}
+	proxy_t *p = calloc(1, sizeof(*p));
+	if (p == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	for (size_t i = 0; i < nroutes; i++)
+		p->nupstreams += routes[i].nupstreams;
+	p->upstreams = aligned_alloc(PROXY_CACHE_LINE, sizeof(*p->upstreams) * p->nupstreams);
+	if (p->upstreams == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		free(p);
+		return NULL;
+	}
+	memset(p->upstreams, 0, sizeof(*p->upstreams) * p->nupstreams);
+	size_t index = 0;
+	for (size_t i = 0; i < nroutes; i++) {
+		struct proxy_route *r = &p->routes[i];
+		r->opt = routes[i];
+		r->proxy = p;
+		r->upstreams = &p->upstreams[index];
+		atomic_init(&r->next, 0);
+		if (r->opt.nupstreams == 0) {
+			lprintf(ERROR, "proxy route %s has no upstreams", r->opt.pattern);
+			goto error_cleanup;
+		}
+		for (size_t j = 0; j < r->opt.nupstreams; j++, index++) {
+			struct upstream *u = &p->upstreams[index];
+			u->index = index;
+			u->route = r;
+			u->name = r->opt.upstreams[j];
+			atomic_init(&u->active, 0);
+			atomic_init(&u->healthy, true);
+			if (resolve(u->name, &u->addr, &u->addr_len) == -1)
+				goto error_cleanup;
+		}
+	}
+	p->nroutes = nroutes;
+	if (pthread_key_create(&p->worker_key, worker_free) != 0) {
+		lprintf(ERROR, "pthread_key_create failed");
+		goto error_cleanup;
+	}
+	pthread_mutex_init(&p->health_mutex, NULL);
+	pthread_cond_init(&p->health_cond, NULL);
+	if (pthread_create(&p->health_thread, NULL, health_loop, p) != 0) {
+		lprintf(ERROR, "pthread_create failed");
+		pthread_key_delete(p->worker_key);
+		goto error_cleanup;
+	}
+	return p;
+error_cleanup:
+	free(p->upstreams);
+	free(p);
+	return NULL;
+}
+
+int proxy_register(proxy_t *p, router_t *r) {
+	static const enum HttpMethod methods[] = {
+		HTTP_METHOD_GET, HTTP_METHOD_POST, HTTP_METHOD_PUT, HTTP_METHOD_DELETE, HTTP_METHOD_OPTIONS
+	};
+	for (size_t i = 0; i < p->nroutes; i++) {
+		for (size_t j = 0; j < sizeof(methods) / sizeof(methods[0]); j++) {
+			if (router_add(r, methods[j], p->routes[i].opt.pattern, proxy_handler, &p->routes[i]) == -1)
+				return -1;
+		}
+	}
+	return 0;
+}
+
+void proxy_destroy(proxy_t *p) {
+	if (p == NULL)
+		return;
+	pthread_mutex_lock(&p->health_mutex);
+	p->health_stop = true;
+	pthread_cond_signal(&p->health_cond);
+	pthread_mutex_unlock(&p->health_mutex);
+	pthread_join(p->health_thread, NULL);
+	pthread_mutex_destroy(&p->health_mutex);
+	pthread_cond_destroy(&p->health_cond);
+	// pool threads have exited by now, their workers went with them
+	pthread_key_delete(p->worker_key);
+	free(p->upstreams);
+	free(p);
+}
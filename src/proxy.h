@@ -0,0 +1,41 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+
+#include "router.h"
+
+// reverse proxy: matched routes are forwarded to http/1.1 upstreams over keep-alive connections pooled per
+// worker thread. bodies are streamed in both directions, spliced when neither side needs userspace tls
+
+#define PROXY_ROUTES_MAX 8
+#define PROXY_UPSTREAMS_MAX 16 // per route
+#define PROXY_ADDRESS_MAX 128
+#define PROXY_PATH_MAX 256
+
+enum proxy_balance {
+	PROXY_ROUND_ROBIN,
+	PROXY_LEAST_CONNECTIONS // fewest requests in flight over all workers
+};
+
+struct proxy_route_options {
+	char pattern[PROXY_PATH_MAX]; // router pattern, the request uri is forwarded unchanged
+	char upstreams[PROXY_UPSTREAMS_MAX][PROXY_ADDRESS_MAX]; // "host:port", "[v6addr]:port" or "unix:/path"
+	size_t nupstreams;
+	enum proxy_balance balance;
+	char health_path[PROXY_PATH_MAX]; // GET that has to answer 2xx or 3xx, empty only checks connecting
+	unsigned int health_interval_sec;
+	unsigned int idle_per_worker; // idle keep-alive connections kept per worker and upstream
+	unsigned int timeout_sec; // connecting, sending and each wait for upstream bytes
+};
+
+typedef struct proxy proxy_t;
+
+// resolves the upstreams and starts the health checks
+proxy_t *proxy_create(const struct proxy_route_options *routes, size_t nroutes);
+// adds every route for all methods but TRACE and CONNECT
+int proxy_register(proxy_t *p, router_t *r);
+// stops the health checks, no request may still be running
+void proxy_destroy(proxy_t *p);
+
+#endif //PROXY_H
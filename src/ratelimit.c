@@ -0,0 +1,191 @@
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "ratelimit.h"
+
+#define RATELIMIT_CACHE_LINE 128
+
+#ifdef CLOCK_MONOTONIC_COARSE
+#define RATELIMIT_CLOCK CLOCK_MONOTONIC_COARSE // a few ms of resolution, no vdso fallback to a syscall
+#else
+#define RATELIMIT_CLOCK CLOCK_MONOTONIC
+#endif
+
+struct ratelimit_entry {
+	uint64_t key[2]; // the masked address, ipv4 as ::ffff:a.b.c.d
+	float tokens;
+	uint32_t stamp; // coarse ms of the last refill, 0 is an empty slot
+};
+
+struct ratelimit_shard {
+	alignas(RATELIMIT_CACHE_LINE) pthread_mutex_t lock;
+	struct ratelimit_entry *entries;
+	size_t mask;
+};
+
+struct ratelimit {
+	struct ratelimit_shard shards[RATELIMIT_SHARDS];
+	float rate_per_ms;
+	float burst;
+	unsigned int ipv4_prefix;
+	unsigned int ipv6_prefix;
+	uint64_t seed;
+	struct timespec epoch;
+};
+
+static uint64_t mix64(uint64_t x) {
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+// wraps after 49 days, only differences between stamps are used
+static uint32_t coarse_ms(const ratelimit_t *rl) {
+	struct timespec ts;
+	clock_gettime(RATELIMIT_CLOCK, &ts);
+	const int64_t ms = (ts.tv_sec - rl->epoch.tv_sec) * 1000 + (ts.tv_nsec - rl->epoch.tv_nsec) / 1000000;
+	const uint32_t now = (uint32_t) ms;
+	return now == 0 ? 1 : now;
+}
+
+static void mask_prefix(unsigned char addr[16], unsigned int keep) {
+	for (size_t i = 0; i < 16; i++) {
+		const unsigned int bits = keep >= 8 ? 8 : keep;
+		addr[i] &= (unsigned char) (0xff00u >> bits);
+		keep -= bits;
+	}
+}
+
+static int make_key(const ratelimit_t *rl, const struct sockaddr_storage *addr, uint64_t key[2]) {
+	unsigned char a[16] = {[10] = 0xff, [11] = 0xff};
+	unsigned int prefix;
+	switch (addr->ss_family) {
+		case AF_INET:
+			memcpy(a + 12, &((const struct sockaddr_in *) addr)->sin_addr, 4);
+			prefix = 96 + rl->ipv4_prefix;
+			break;
+		case AF_INET6: {
+			const struct in6_addr *in6 = &((const struct sockaddr_in6 *) addr)->sin6_addr;
+			memcpy(a, in6, 16);
+			// dual stack listeners see ipv4 clients as mapped addresses
+			prefix = IN6_IS_ADDR_V4MAPPED(in6) ? 96 + rl->ipv4_prefix : rl->ipv6_prefix;
+			break;
+		}
+		default:
+			return -1;
+	}
+	mask_prefix(a, prefix);
+	memcpy(key, a, 16);
+	return 0;
+}
+
+ratelimit_t *ratelimit_create(const struct ratelimit_attr *attr) {
+	if (attr->rate <= 0 || attr->burst < 1 || attr->ipv4_prefix > 32 || attr->ipv6_prefix > 128) {
+		lprintf(ERROR, "rate limit needs a positive rate, a burst of at least 1 and valid prefixes");
+		return NULL;
+	}
+	ratelimit_t *rl = aligned_alloc(RATELIMIT_CACHE_LINE, sizeof(*rl));
+	if (rl == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		return NULL;
+	}
+	memset(rl, 0, sizeof(*rl));
+	rl->rate_per_ms = (float) (attr->rate / 1000);
+	rl->burst = (float) attr->burst;
+	rl->ipv4_prefix = attr->ipv4_prefix;
+	rl->ipv6_prefix = attr->ipv6_prefix;
+	clock_gettime(RATELIMIT_CLOCK, &rl->epoch);
+	// keeps the slot of an address unpredictable between runs
+	rl->seed = mix64((uint64_t) rl->epoch.tv_nsec ^ (uint64_t) (uintptr_t) rl);
+	size_t per_shard = RATELIMIT_PROBE_MAX;
+	while (per_shard * RATELIMIT_SHARDS < attr->max_clients)
+		per_shard *= 2;
+	size_t i = 0;
+	for (; i < RATELIMIT_SHARDS; i++) {
+		struct ratelimit_shard *s = &rl->shards[i];
+		s->entries = calloc(per_shard, sizeof(*s->entries));
+		if (s->entries == NULL) {
+			sys_error_printf("calloc failed");
+			goto error_cleanup;
+		}
+		s->mask = per_shard - 1;
+		pthread_mutex_init(&s->lock, NULL);
+	}
+	lprintf(DEBUG, "rate limit table: %zu buckets, %zu bytes", per_shard * RATELIMIT_SHARDS,
+	        per_shard * RATELIMIT_SHARDS * sizeof(struct ratelimit_entry));
+	return rl;
+error_cleanup:
+	while (i-- > 0) {
+		free(rl->shards[i].entries);
+		pthread_mutex_destroy(&rl->shards[i].lock);
+	}
+	free(rl);
+	return NULL;
+}
+
+void ratelimit_destroy(ratelimit_t *rl) {
+	if (rl == NULL)
+		return;
+	for (size_t i = 0; i < RATELIMIT_SHARDS; i++) {
+		free(rl->shards[i].entries);
+		pthread_mutex_destroy(&rl->shards[i].lock);
+	}
+	free(rl);
+}
+
+size_t ratelimit_table_bytes(const ratelimit_t *rl) {
+	if (rl == NULL)
+		return 0;
+	return (rl->shards[0].mask + 1) * RATELIMIT_SHARDS * sizeof(struct ratelimit_entry);
+}
+
+bool ratelimit_allow(ratelimit_t *rl, const struct sockaddr_storage *addr) {
+	uint64_t key[2];
+	if (make_key(rl, addr, key) == -1)
+		return true;
+	const uint64_t h = mix64(key[0] ^ rl->seed) ^ mix64(key[1] + rl->seed);
+	// top bits pick the shard, low bits the slot
+	struct ratelimit_shard *s = &rl->shards[h >> (64 - RATELIMIT_SHARD_BITS)];
+	const uint32_t now = coarse_ms(rl);
+	pthread_mutex_lock(&s->lock);
+	struct ratelimit_entry *e = NULL;
+	struct ratelimit_entry *oldest = NULL;
+	// slots are never emptied, so an empty one ends the probe
+	for (size_t i = 0; i < RATELIMIT_PROBE_MAX; i++) {
+		struct ratelimit_entry *cur = &s->entries[(h + i) & s->mask];
+		if (cur->stamp == 0) {
+			oldest = cur;
+			break;
+		}
+		if (cur->key[0] == key[0] && cur->key[1] == key[1]) {
+			e = cur;
+			break;
+		}
+		if (oldest == NULL || now - cur->stamp > now - oldest->stamp)
+			oldest = cur;
+	}
+	if (e == NULL) {
+		// the evicted client most likely had a full bucket again, it starts over full
+		e = oldest;
+		e->key[0] = key[0];
+		e->key[1] = key[1];
+		e->tokens = rl->burst;
+	} else if (now != e->stamp) {
+		const float tokens = e->tokens + (float) (now - e->stamp) * rl->rate_per_ms;
+		e->tokens = tokens < rl->burst ? tokens : rl->burst;
+	}
+	e->stamp = now;
+	const bool allowed = e->tokens >= 1;
+	if (allowed)
+		e->tokens -= 1;
+	pthread_mutex_unlock(&s->lock);
+	return allowed;
+}
@@ -0,0 +1,32 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <sys/socket.h>
+
+// token buckets keyed by client address. the table is sized once at create, when it's full
+// the least recently refilled bucket in the probe window is reused, so memory stays fixed
+// no matter how many distinct clients show up
+
+#define RATELIMIT_SHARD_BITS 6 // each shard has its own lock
+#define RATELIMIT_SHARDS (1 << RATELIMIT_SHARD_BITS)
+#define RATELIMIT_PROBE_MAX 8 // slots checked per lookup
+
+struct ratelimit_attr {
+	double rate; // tokens per second
+	double burst; // bucket size, a new client starts full
+	size_t max_clients; // rounded up to a power of two per shard
+	unsigned int ipv4_prefix; // 0 - 32, clients in the same prefix share a bucket
+	unsigned int ipv6_prefix; // 0 - 128
+};
+
+typedef struct ratelimit ratelimit_t;
+
+ratelimit_t *ratelimit_create(const struct ratelimit_attr *attr);
+void ratelimit_destroy(ratelimit_t *rl);
+// takes one token, false when the bucket is empty. unknown address families are always allowed
+bool ratelimit_allow(ratelimit_t *rl, const struct sockaddr_storage *addr);
+// the bucket table, allocated once at create
+size_t ratelimit_table_bytes(const ratelimit_t *rl);
+
+#endif //RATELIMIT_H
@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/errno.h>
+
+#include "router.h"
+#include "log.h"
+
+#define ROUTE_NONE UINT32_MAX
+#define METHODS_N HTTP_METHOD_UNKNOWN
+
+// builder tree, only lives until router_compile()
+struct build_node {
+	const char *prefix; // points into one of router.patterns
+	size_t prefix_len;
+	struct build_node **children; // static children, first bytes are distinct
+	size_t nchildren;
+	struct build_node *param;
+	struct build_node *wildcard;
+	const char *name; // param / wildcard name
+	size_t name_len;
+	route_handler handlers[METHODS_N];
+	void *users[METHODS_N];
+	uint32_t index;
+};
+
+struct route_entry {
+	route_handler handler;
+	void *user;
+};
+
+// compiled node, static children of a node are contiguous in the node array
+struct route_node {
+	uint32_t prefix_off;
+	uint32_t prefix_len;
+	uint32_t first_child;
+	uint32_t nchildren;
+	uint32_t firsts_off; // first byte of every static child, searched with memchr
+	uint32_t param;
+	uint32_t wildcard;
+	uint32_t name_off;
+	uint32_t name_len;
+	uint32_t methods; // bit per enum HttpMethod with a handler
+	uint32_t entries; // first handler entry, one entry per set bit in methods
+};
+
+struct router {
+	struct build_node *root;
+	char **patterns;
+	size_t npatterns;
+	size_t nnodes;
+	// compiled, one allocation: entries, nodes, then bytes
+	void *mem;
+	const struct route_entry *entries;
+	const struct route_node *nodes;
+	const char *bytes;
+};
+
+static struct build_node *build_node_create(void) {
+	struct build_node *n = calloc(1, sizeof(*n));
+	if (n == NULL) {
+		sys_error_printf("calloc failed");
+	}
+	return n;
+}
+
+static void build_node_free(struct build_node *n) {
+	if (n == NULL)
+		return;
+	for (size_t i = 0; i < n->nchildren; i++)
+		build_node_free(n->children[i]);
+	free(n->children);
+	build_node_free(n->param);
+	build_node_free(n->wildcard);
+	free(n);
+}
+
+router_t *router_create(void) {
+	router_t *r = calloc(1, sizeof(*r));
+	if (r == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	r->root = build_node_create();
+	if (r->root == NULL) {
+		free(r);
+		return NULL;
+	}
+	r->nnodes = 1;
+	return r;
+}
+
+void router_destroy(router_t *r) {
+	if (r == NULL)
+		return;
+	build_node_free(r->root);
+	for (size_t i = 0; i < r->npatterns; i++)
+		free(r->patterns[i]);
+	free(r->patterns);
+	free(r->mem);
+	free(r);
+}
+
+static int add_child(struct build_node *n, struct build_node *child) {
+	struct build_node **tmp = realloc(n->children, sizeof(*tmp) * (n->nchildren + 1));
+	if (tmp == NULL) {
+		sys_error_printf("realloc failed");
+		return -1;
+	}
+	n->children = tmp;
+	n->children[n->nchildren++] = child;
+	return 0;
+}
+
+// walks / splits the radix edges for s, returns the node where s ends
+static struct build_node *insert_static(router_t *r, struct build_node *n, const char *s, size_t len) {
+	while (len > 0) {
+		struct build_node *c = NULL;
+		size_t ci = 0;
+		for (; ci < n->nchildren; ci++) {
+			if (n->children[ci]->prefix[0] == s[0]) {
+				c = n->children[ci];
+				break;
+			}
+		}
+		if (c == NULL) {
+			c = build_node_create();
+			if (c == NULL || add_child(n, c) == -1) {
+				free(c);
+				return NULL;
+			}
+			r->nnodes++;
+			c->prefix = s;
+			c->prefix_len = len;
+			return c;
+		}
+		size_t common = 0;
+		while (common < len && common < c->prefix_len && c->prefix[common] == s[common])
+			common++;
+		if (common < c->prefix_len) {
+			// split c, the new node keeps the shared part and c keeps the rest
+			struct build_node *mid = build_node_create();
+			if (mid == NULL || add_child(mid, c) == -1) {
+				free(mid);
+				return NULL;
+			}
+			r->nnodes++;
+			mid->prefix = c->prefix;
+			mid->prefix_len = common;
+			c->prefix += common;
+			c->prefix_len -= common;
+			n->children[ci] = mid;
+			c = mid;
+		}
+		n = c;
+		s += common;
+		len -= common;
+	}
+	return n;
+}
+
+static struct build_node *insert_capture(router_t *r, struct build_node **slot, const char *name, const size_t name_len) {
+	if (*slot == NULL) {
+		*slot = build_node_create();
+		if (*slot == NULL)
+			return NULL;
+		r->nnodes++;
+		(*slot)->name = name;
+		(*slot)->name_len = name_len;
+		(*slot)->prefix = name;
+		return *slot;
+	}
+	if ((*slot)->name_len != name_len || memcmp((*slot)->name, name, name_len) != 0) {
+		lprintf(ERROR, "conflicting capture names at the same position");
+		return NULL;
+	}
+	return *slot;
+}
+
+int router_add(router_t *r, const enum HttpMethod method, const char *pattern, const route_handler handler,
+               void *user) {
+	if (r == NULL || pattern == NULL || handler == NULL || method >= METHODS_N) {
+		lprintf(ERROR, "invalid arg");
+		return -1;
+	}
+	if (r->mem != NULL) {
+		lprintf(ERROR, "router already compiled");
+		return -1;
+	}
+	if (pattern[0] != '/') {
+		lprintf(ERROR, "route \"%s\" must start with '/'", pattern);
+		return -1;
+	}
+	char **tmp = realloc(r->patterns, sizeof(*tmp) * (r->npatterns + 1));
+	if (tmp == NULL) {
+		sys_error_printf("realloc failed");
+		return -1;
+	}
+	r->patterns = tmp;
+	char *p = strdup(pattern);
+	if (p == NULL) {
+		sys_error_printf("strdup failed");
+		return -1;
+	}
+	r->patterns[r->npatterns++] = p;
+	struct build_node *n = r->root;
+	while (*p) {
+		if (*p == ':' || *p == '*') {
+			if (p[-1] != '/') {
+				lprintf(ERROR, "route \"%s\": captures must start a segment", pattern);
+				return -1;
+			}
+			const size_t name_len = strcspn(p + 1, "/");
+			if (name_len == 0) {
+				lprintf(ERROR, "route \"%s\": capture without a name", pattern);
+				return -1;
+			}
+			if (*p == '*' && p[1 + name_len] != '\0') {
+				lprintf(ERROR, "route \"%s\": wildcard must be last", pattern);
+				return -1;
+			}
+			n = insert_capture(r, *p == ':' ? &n->param : &n->wildcard, p + 1, name_len);
+			p += 1 + name_len;
+		} else {
+			const size_t len = strcspn(p, ":*");
+			n = insert_static(r, n, p, len);
+			p += len;
+		}
+		if (n == NULL)
+			return -1;
+	}
+	if (n->handlers[method] != NULL) {
+		lprintf(ERROR, "route \"%s\" registered twice for the same method", pattern);
+		return -1;
+	}
+	n->handlers[method] = handler;
+	n->users[method] = user;
+	return 0;
+}
+
+struct compile_state {
+	struct route_entry *entries;
+	struct route_node *nodes;
+	char *bytes;
+	size_t nentries;
+	size_t nbytes;
+};
+
+static size_t count_bytes(const struct build_node *n, size_t *nentries) {
+	size_t bytes = n->prefix_len + n->nchildren + n->name_len;
+	for (size_t m = 0; m < METHODS_N; m++)
+		*nentries += n->handlers[m] != NULL;
+	for (size_t i = 0; i < n->nchildren; i++)
+		bytes += count_bytes(n->children[i], nentries);
+	if (n->param)
+		bytes += count_bytes(n->param, nentries);
+	if (n->wildcard)
+		bytes += count_bytes(n->wildcard, nentries);
+	return bytes;
+}
+
+static uint32_t copy_bytes(struct compile_state *cs, const char *s, const size_t len) {
+	const uint32_t off = (uint32_t) cs->nbytes;
+	if (len == 0)
+		return off;
+	memcpy(cs->bytes + cs->nbytes, s, len);
+	cs->nbytes += len;
+	return off;
+}
+
+// indices are handed out breadth first so each node's static children are contiguous
+static int assign_indices(router_t *r) {
+	struct build_node **queue = malloc(sizeof(*queue) * r->nnodes);
+	if (queue == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	size_t head = 0;
+	size_t tail = 0;
+	uint32_t next = 0;
+	r->root->index = next++;
+	queue[tail++] = r->root;
+	while (head < tail) {
+		struct build_node *n = queue[head++];
+		for (size_t i = 0; i < n->nchildren; i++) {
+			n->children[i]->index = next++;
+			queue[tail++] = n->children[i];
+		}
+		if (n->param) {
+			n->param->index = next++;
+			queue[tail++] = n->param;
+		}
+		if (n->wildcard) {
+			n->wildcard->index = next++;
+			queue[tail++] = n->wildcard;
+		}
+	}
+	free(queue);
+	return 0;
+}
+
+static void flatten(struct compile_state *cs, const struct build_node *n) {
+	struct route_node *cn = &cs->nodes[n->index];
+	cn->prefix_len = (uint32_t) n->prefix_len;
+	cn->prefix_off = copy_bytes(cs, n->prefix, n->prefix_len);
+	cn->nchildren = (uint32_t) n->nchildren;
+	cn->first_child = n->nchildren ? n->children[0]->index : ROUTE_NONE;
+	cn->firsts_off = (uint32_t) cs->nbytes;
+	for (size_t i = 0; i < n->nchildren; i++)
+		cs->bytes[cs->nbytes++] = n->children[i]->prefix[0];
+	cn->param = n->param ? n->param->index : ROUTE_NONE;
+	cn->wildcard = n->wildcard ? n->wildcard->index : ROUTE_NONE;
+	cn->name_len = (uint32_t) n->name_len;
+	cn->name_off = copy_bytes(cs, n->name, n->name_len);
+	cn->methods = 0;
+	cn->entries = (uint32_t) cs->nentries;
+	for (size_t m = 0; m < METHODS_N; m++) {
+		if (n->handlers[m] == NULL)
+			continue;
+		cs->entries[cs->nentries].handler = n->handlers[m];
+		cs->entries[cs->nentries].user = n->users[m];
+		cs->nentries++;
+		cn->methods |= 1u << m;
+	}
+	for (size_t i = 0; i < n->nchildren; i++)
+		flatten(cs, n->children[i]);
+	if (n->param)
+		flatten(cs, n->param);
+	if (n->wildcard)
+		flatten(cs, n->wildcard);
+}
+
+int router_compile(router_t *r) {
+	if (r == NULL || r->mem != NULL) {
+		lprintf(ERROR, "router null or already compiled");
+		return -1;
+	}
+	size_t nentries = 0;
+	const size_t nbytes = count_bytes(r->root, &nentries);
+	if (r->nnodes >= ROUTE_NONE || nbytes >= ROUTE_NONE) {
+		lprintf(ERROR, "too many routes");
+		return -1;
+	}
+	if (assign_indices(r) == -1)
+		return -1;
+	const size_t entries_size = sizeof(struct route_entry) * nentries;
+	const size_t nodes_size = sizeof(struct route_node) * r->nnodes;
+	r->mem = malloc(entries_size + nodes_size + nbytes + 1);
+	if (r->mem == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	struct compile_state cs = {
+		.entries = r->mem,
+		.nodes = (struct route_node *) ((char *) r->mem + entries_size),
+		.bytes = (char *) r->mem + entries_size + nodes_size,
+	};
+	flatten(&cs, r->root);
+	r->entries = cs.entries;
+	r->nodes = cs.nodes;
+	r->bytes = cs.bytes;
+	build_node_free(r->root);
+	r->root = NULL;
+	lprintf(DEBUG, "router compiled: %zu nodes, %zu handlers, %zu bytes", r->nnodes, nentries,
+	        entries_size + nodes_size + nbytes);
+	return 0;
+}
+
+static bool match_node(const router_t *r, const uint32_t ni, const char *path, const size_t len,
+                       struct route_params *params, uint32_t *found) {
+	const struct route_node *n = &r->nodes[ni];
+	if (len == 0 && n->methods != 0) {
+		*found = ni;
+		return true;
+	}
+	if (len > 0 && n->nchildren > 0) {
+		const char *first = memchr(r->bytes + n->firsts_off, path[0], n->nchildren);
+		if (first != NULL) {
+			const uint32_t ci = n->first_child + (uint32_t) (first - (r->bytes + n->firsts_off));
+			const struct route_node *c = &r->nodes[ci];
+			if (c->prefix_len <= len && memcmp(r->bytes + c->prefix_off, path, c->prefix_len) == 0 &&
+			    match_node(r, ci, path + c->prefix_len, len - c->prefix_len, params, found))
+				return true;
+		}
+	}
+	if (len > 0 && n->param != ROUTE_NONE && params->n < ROUTER_PARAMS_MAX) {
+		const char *slash = memchr(path, '/', len);
+		const size_t seg_len = slash ? (size_t) (slash - path) : len;
+		if (seg_len > 0) {
+			const struct route_node *p = &r->nodes[n->param];
+			params->names[params->n] = (struct str_view){r->bytes + p->name_off, p->name_len};
+			params->values[params->n] = (struct str_view){path, seg_len};
+			params->n++;
+			if (match_node(r, n->param, path + seg_len, len - seg_len, params, found))
+				return true;
+			params->n--;
+		}
+	}
+	if (n->wildcard != ROUTE_NONE && params->n < ROUTER_PARAMS_MAX) {
+		const struct route_node *w = &r->nodes[n->wildcard];
+		if (w->methods != 0) {
+			params->names[params->n] = (struct str_view){r->bytes + w->name_off, w->name_len};
+			params->values[params->n] = (struct str_view){path, len};
+			params->n++;
+			*found = n->wildcard;
+			return true;
+		}
+	}
+	return false;
+}
+
+enum route_status router_match(const router_t *r, enum HttpMethod method, const char *path, const size_t len,
+                               struct route_match *m) {
+	m->params.n = 0;
+	uint32_t ni;
+	if (r->nodes == NULL || !match_node(r, 0, path, len, &m->params, &ni))
+		return ROUTE_NOT_FOUND;
+	const struct route_node *n = &r->nodes[ni];
+	if (method == HTTP_METHOD_HEAD && !(n->methods & (1u << HTTP_METHOD_HEAD)))
+		method = HTTP_METHOD_GET;
+	if (method >= METHODS_N || !(n->methods & (1u << method)))
+		return ROUTE_METHOD_NOT_ALLOWED;
+	const uint32_t entry = n->entries + (uint32_t) __builtin_popcount(n->methods & ((1u << method) - 1));
+	m->handler = r->entries[entry].handler;
+	m->user = r->entries[entry].user;
+	return ROUTE_FOUND;
+}
+
+struct str_view route_param(const struct route_params *params, const char *name) {
+	const size_t name_len = strlen(name);
+	for (size_t i = 0; i < params->n; i++) {
+		if (params->names[i].len == name_len && memcmp(params->names[i].ptr, name, name_len) == 0)
+			return params->values[i];
+	}
+	return (struct str_view){NULL, 0};
+}
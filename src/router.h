@@ -0,0 +1,52 @@
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include <stdint.h>
+
+#include "parse_http.h"
+
+#define ROUTER_PARAMS_MAX 16
+
+// patterns are made of static text, ":name" captures (one non-empty path segment)
+// and a trailing "*name" wildcard (the rest of the path, may be empty), e.g.
+//   /users/:id/posts
+//   /static/*path
+// static text wins over a capture, a capture wins over a wildcard.
+
+struct route_params {
+	size_t n;
+	struct str_view names[ROUTER_PARAMS_MAX];
+	struct str_view values[ROUTER_PARAMS_MAX]; // point into the matched path
+};
+
+// res starts as an empty 200, returning -1 sends a 500 instead. a handler that sets res->stream has to
+// return 0, the stream's close is how it gets its resources back
+typedef int (*route_handler)(const struct HttpRequest *req, const struct route_params *params,
+                             struct HttpResponse *res, void *user);
+
+struct route_match {
+	route_handler handler;
+	void *user;
+	struct route_params params;
+};
+
+enum route_status {
+	ROUTE_FOUND,
+	ROUTE_NOT_FOUND,
+	ROUTE_METHOD_NOT_ALLOWED
+};
+
+typedef struct router router_t;
+
+router_t *router_create(void);
+void router_destroy(router_t *r);
+// routes can only be added before router_compile()
+int router_add(router_t *r, enum HttpMethod method, const char *pattern, route_handler handler, void *user);
+// flattens the tree into one allocation, the builder nodes are freed
+int router_compile(router_t *r);
+// path excludes the query string. doesn't allocate, HEAD falls back to GET
+enum route_status router_match(const router_t *r, enum HttpMethod method, const char *path, size_t len,
+                               struct route_match *m);
+struct str_view route_param(const struct route_params *params, const char *name);
+
+#endif //ROUTER_H
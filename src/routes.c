@@ -0,0 +1,19 @@
+#include "routes.h"
+#include "server.h"
+#include "parse_http.h"
+
+static int hello_handler([[maybe_unused]] const struct HttpRequest *req,
+                         [[maybe_unused]] const struct route_params *params, struct HttpResponse *res,
+                         [[maybe_unused]] void *user) {
+	static char body[] = "hello!";
+	set_http_field("Content-Type", "text/plain", &res->headers);
+	res->body.ptr = body;
+	res->body.len = sizeof(body) - 1;
+	return 0;
+}
+
+int routes_register(router_t *r) {
+	if (router_add(r, HTTP_METHOD_GET, "/", hello_handler, NULL) == -1)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,9 @@
+#ifndef ROUTES_H
+#define ROUTES_H
+
+#include "router.h"
+
+// the handlers chinook serves, called once before the router is compiled
+int routes_register(router_t *r);
+
+#endif //ROUTES_H
@@ -1,9 +1,96 @@
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 
-int serialize_http_response() {
+#include "serialize_http.h"
+#include "server.h"
+#include "log.h"
 
+void http_response_init(struct HttpResponse *res, arena_t *arena) {
+	res->status_line.version = HTTP_VERSION_1_1;
+	res->status_line.status_code = 200;
+	res->status_line.reason_phrase = NULL;
+	http_headers_init(&res->headers, arena);
+	res->body.ptr = NULL;
+	res->body.len = 0;
+	res->stream = NULL;
+	res->websocket = NULL;
+	res->sse = NULL;
 }
 
-int main(void) {
+const char *http_reason_phrase(const int status_code) {
+	switch (status_code) {
+		case 100: return "Continue";
+		case 101: return "Switching Protocols";
+		case 200: return "OK";
+		case 201: return "Created";
+		case 204: return "No Content";
+		case 206: return "Partial Content";
+		case 301: return "Moved Permanently";
+		case 302: return "Found";
+		case 304: return "Not Modified";
+		case 400: return "Bad Request";
+		case 403: return "Forbidden";
+		case 404: return "Not Found";
+		case 405: return "Method Not Allowed";
+		case 408: return "Request Timeout";
+		case 411: return "Length Required";
+		case 412: return "Precondition Failed";
+		case 413: return "Content Too Large";
+		case 416: return "Range Not Satisfiable";
+		case 429: return "Too Many Requests";
+		case 500: return "Internal Server Error";
+		case 502: return "Bad Gateway";
+		case 503: return "Service Unavailable";
+		case 504: return "Gateway Timeout";
+		default: return "Unknown";
+	}
+}
 
-}
\ No newline at end of file
+ssize_t serialize_http_response_head(const struct HttpResponse *res, char *buf, const size_t bufn) {
+	const char *version = res->status_line.version == HTTP_VERSION_1_0 ? "HTTP/1.0" : "HTTP/1.1";
+	const char *reason = res->status_line.reason_phrase
+		                     ? res->status_line.reason_phrase
+		                     : http_reason_phrase(res->status_line.status_code);
+	size_t len = 0;
+	int n = snprintf(buf, bufn, "%s %d %s\r\n", version, res->status_line.status_code, reason);
+	if (n < 0 || (size_t) n >= bufn)
+		goto too_small;
+	len += (size_t) n;
+	// a handler that set Transfer-Encoding frames the body itself
+	bool has_length = false;
+	for (size_t i = 0; i < res->headers.nfields; i++) {
+		const struct HttpField *f = &res->headers.fields[i];
+		if (str_view_case_eq(f->key, "Content-Length") || str_view_case_eq(f->key, "Transfer-Encoding"))
+			has_length = true;
+		const size_t field_len = f->key.len + 2 + f->value.len + 2;
+		if (field_len >= bufn - len)
+			goto too_small;
+		memcpy(buf + len, f->key.ptr, f->key.len);
+		memcpy(buf + len + f->key.len, ": ", 2);
+		memcpy(buf + len + f->key.len + 2, f->value.ptr, f->value.len);
+		memcpy(buf + len + field_len - 2, "\r\n", 2);
+		len += field_len;
+	}
+	if (!has_length && res->stream != NULL && res->stream->length == -1) {
+		n = snprintf(buf + len, bufn - len, "Transfer-Encoding: chunked\r\n");
+		if (n < 0 || (size_t) n >= bufn - len)
+			goto too_small;
+		len += (size_t) n;
+	} else if (!has_length && res->status_line.status_code != 204 && res->status_line.status_code != 304 &&
+	           res->status_line.status_code >= 200) {
+		const size_t body_len = res->stream != NULL ? (size_t) res->stream->length : res->body.len;
+		n = snprintf(buf + len, bufn - len, "Content-Length: %zu\r\n", body_len);
+		if (n < 0 || (size_t) n >= bufn - len)
+			goto too_small;
+		len += (size_t) n;
+	}
+	if (bufn - len < 3)
+		goto too_small;
+	memcpy(buf + len, "\r\n", 2);
+	len += 2;
+	return (ssize_t) len;
+too_small:
+	lprintf(ERROR, "response head larger than %zu bytes", bufn);
+	return -1;
+}
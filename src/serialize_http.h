@@ -0,0 +1,17 @@
+#ifndef SERIALIZE_HTTP_H
+#define SERIALIZE_HTTP_H
+
+#include <sys/types.h>
+
+#include "parse_http.h"
+
+#define RESPONSE_HEAD_MAX_SIZE_BYTES (1024 * 8)
+
+// 200 OK, HTTP/1.1, no headers, no body. the header table grows in arena
+void http_response_init(struct HttpResponse *res, arena_t *arena);
+const char *http_reason_phrase(int status_code);
+// status line, headers, Content-Length (unless set or the status has no body) and the blank line. a stream of unknown length gets
+// Transfer-Encoding: chunked instead. -1 if bufn is too small
+ssize_t serialize_http_response_head(const struct HttpResponse *res, char *buf, size_t bufn);
+
+#endif //SERIALIZE_HTTP_H
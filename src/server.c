@@ -7,7 +7,9 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <sys/errno.h>
@@ -16,28 +18,93 @@
 #include "parse_http.h"
 #include "log.h"
 #include "thread_pool.h"
+#include "handoff.h"
+#include "router.h"
+#include "routes.h"
+#include "serialize_http.h"
+#include "arena.h"
+#include "metrics.h"
+#include "ratelimit.h"
+#include "http2.h"
+#include "tls.h"
+#include "proxy.h"
+#include "files.h"
+#include "coro.h"
+#include "websocket.h"
+#include "sse.h"
+#include "capture.h"
 
 // TODO: cache
 // TODO: compression
-// TODO: https
 
 #define GOTO_ERR (-1)
 #define CONTINUE (-2)
 #define TIMEOUT (-3)
 #define CLOSED (-4)
 
+#define ADMISSION_PAUSE_POLL_MS 10
+#define ACCEPT_RETRY_MS 100 // out of descriptors, listeners are left alone this long before accepting again
+#define SHED_DRAIN_MAX_BYTES (1024 * 64) // request bytes read and dropped before a shed connection is closed
+#define BODY_STREAM_CHUNK_BYTES (1024 * 16)
+#define METRICS_TEXT_MAX_BYTES 65536
+
 static int signal_pipe_fds[2];
 static int thread_error_pipe_fds[2];
 static atomic_bool thread_error;
 static volatile sig_atomic_t sig;
 static atomic_bool shutdown_requested;
-static atomic_uint open_connections;
+static const struct server_options *server_opt;
+static router_t *router;
+static thread_pool_t *pool; // NULL with io-model coroutines
+static coro_loops_t *loops; // NULL with io-model threads
+// queue depths from server_options.admission with the defaults filled in
+static size_t shed_depth;
+static size_t pause_depth;
+static char shed_response[512];
+static size_t shed_response_len;
+static ratelimit_t *limiter; // NULL when rate limiting is off
+static struct http2_server h2_server;
+static bool h2c; // cleartext h2 is served, its streams need the pool
+static tls_server_t *tls_server; // NULL when tls is off
+static proxy_t *proxy; // NULL without proxy routes
+static files_t *files; // NULL without a files root
+static struct websocket_server ws_server;
+static struct sse_server sse_server;
+static coro_loops_t *stream_loops; // threads: where websockets and event streams go, NULL with coroutines
+// workers.pin resolved against the cpus the process may use, empty when not pinning
+static int worker_cpus[AFFINITY_CPUS_MAX];
+static size_t nworker_cpus;
+
+// per connection state the http2 hooks get back
+struct h2_conn_ctx {
+	ssize_t slot;
+	const struct sockaddr_storage *client_addr;
+};
+
+struct listeners {
+	int fds[LISTENER_SHARDS_MAX];
+	size_t n;
+};
+
+/* every running connection has a slot so a drain can wake the ones idling in recv() on keep-alive.
+ * conn_mutex also guards the drain wakeup, so the last connection closing can't be missed
+ */
+struct conn_slot {
+	int fd;
+	atomic_bool idle;
+};
+
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t conn_drained_cond = PTHREAD_COND_INITIALIZER;
+static struct conn_slot *conn_slots;
+static size_t *conn_free_slots;
+static size_t conn_nfree;
 
 void signal_handler(const int signum);
 
 int setup_sig_handler();
 
-int cleanup(const int fd);
+int cleanup(const struct listeners *l);
 
 void setup_atomic(void);
 
@@ -49,30 +116,95 @@ socklen_t ip_sockaddr(struct sockaddr_storage *sockaddr, const struct server_opt
 
 int listen_socket(const struct server_options *opt);
 
+int open_listeners(const struct server_options *opt, struct listeners *l);
+
+int inherit_listeners(const struct server_options *opt, struct listeners *l);
+
+int setup_conn_slots(size_t n);
+
+ssize_t conn_register(const int fd);
+
+void conn_set_idle(const ssize_t slot, const bool idle);
+
+void conn_release(const ssize_t slot);
+
+void conn_close(const ssize_t slot, const int fd);
+
+int drain_connections(const unsigned int deadline_sec);
+
+uint64_t open_connections(void);
+
 enum wait_request_status {
 	WAIT_SUCCESS = 0,
 	WAIT_SIGNAL_INTERRUPTED = -1,
 	WAIT_THREAD_ERROR = -2,
-	WAIT_FAILED = -3
+	WAIT_FAILED = -3,
+	WAIT_HANDOFF = -4,
+	WAIT_TIMEOUT = -5
 };
 
-enum wait_request_status wait_request(const int listen_fd, const int signal[2], const int thread_err[2]);
+// listeners are left out while paused, the wait then times out to recheck the queue
+enum wait_request_status wait_request(const struct listeners *l, const int signal[2], const int thread_err[2],
+                                      const int handoff_fd, const bool accepting, int *ready_fd);
 
 int connect_client(const int listen_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len);
 
 char *sockaddr_get_ip_str(const struct sockaddr_storage *socka, char buf[], const socklen_t bufn);
 
-ssize_t get_response(const int conn_fd, char buf[], const size_t bufn);
+ssize_t get_response(conn_io_t *io, char buf[], const size_t bufn);
 
 void print_str_no_cr(const char *str);
 
 void *handle_connection(void *vargp);
 
+int route_request(const struct HttpRequest *req, struct HttpResponse *res);
+
+int send_response(conn_io_t *io, const struct HttpResponse *res, const bool head_only, arena_t *arena);
+
+int setup_router(void);
+
+int setup_admission(size_t queue_capacity);
+
+void shed_connection(const int client_fd);
+
+int setup_rate_limit(void);
+
+int setup_tls(void);
+
+int setup_proxy(void);
+
+int setup_files(void);
+
+int setup_affinity(void);
+
+void steer_listeners(const struct listeners *l);
+
+void report_placement(const struct listeners *l);
+
+int send_cached_head(conn_io_t *io, char *head, size_t head_len, bool keep_alive);
+
+int send_rate_limited(conn_io_t *io, arena_t *arena);
+
+int send_bad_request(conn_io_t *io, arena_t *arena);
+
+int send_length_required(conn_io_t *io, arena_t *arena);
+
+void setup_http2(thread_pool_t *tp);
+
+void setup_streams(void);
+
+int setup_workers(void);
+
+size_t backlog_depth(void);
+
+void serve_coroutine(void *vargp);
+
 struct __attribute__((__packed__)) thread_args {
 	int listen_fd;
 	int client_fd;
 	struct sockaddr_storage client_addr;
 	socklen_t client_addr_len;
+	uint64_t accepted_ns;
 };
 
 static int setup(void);
@@ -80,40 +212,105 @@ static int setup(void);
 // TODO: fix accept error with O_NONBLOCK
 
 int run_server(const struct server_options *opt) {
-	if (setup() == -1)
+	server_opt = opt;
+	if (setup() == -1 || setup_workers() == -1)
 		return -1;
-	const struct thread_pool_attr attr = {.pool_size = 1000, .queue_size = 10000};
-	thread_pool_t *tp = thread_pool_create(&attr);
-	if (tp == NULL) {
+	// a coroutine per connection, pool_size of them at most
+	if (setup_admission(pool != NULL ? thread_pool_queue_capacity(pool) : opt->workers.pool_size) == -1)
 		return -1;
+	setup_http2(pool);
+	setup_streams();
+	struct listeners listeners;
+	if (!opt->special.handoff || inherit_listeners(opt, &listeners) == -1) {
+		if (opt->special.handoff)
+			lprintf(WARN, "listen socket handoff failed, binding new sockets");
+		if (open_listeners(opt, &listeners) == -1)
+			return -1;
 	}
-	const int listen_fd = listen_socket(opt);
-	if (listen_fd == -1)
-		return -1;
+	steer_listeners(&listeners);
+	report_placement(&listeners);
+	// only after inheriting, the old server is still listening on this path until then
+	int handoff_fd = handoff_listen(HANDOFF_SOCKET_PATH);
+	if (handoff_fd == -1)
+		lprintf(WARN, "zero-downtime restart unavailable");
+	int retval = 0;
+	bool accepting = true;
+	uint64_t accept_retry_ns = 0;
 	while (1) {
-		const enum wait_request_status stat = wait_request(listen_fd, signal_pipe_fds, thread_error_pipe_fds);
+		// past the pause depth new clients wait in the kernel backlog instead of the queue
+		if (accepting != (backlog_depth() < pause_depth)) {
+			accepting = !accepting;
+			if (accepting)
+				lprintf(WARN, "queue below %zu, accepting again", pause_depth);
+			else
+				lprintf(WARN, "queue at %zu, pausing accept", pause_depth);
+		}
+		// without descriptors accept fails at once, waiting on the listeners would spin
+		if (accept_retry_ns != 0 && metrics_now_ns() >= accept_retry_ns)
+			accept_retry_ns = 0;
+		int listen_fd;
+		const enum wait_request_status stat = wait_request(&listeners, signal_pipe_fds, thread_error_pipe_fds,
+		                                                   handoff_fd, accepting && accept_retry_ns == 0, &listen_fd);
 		switch (stat) {
 			case WAIT_SUCCESS: break;
+			case WAIT_TIMEOUT: continue;
 			case WAIT_SIGNAL_INTERRUPTED: goto signal_interrupt_cleanup;
 			case WAIT_THREAD_ERROR: goto error_cleanup;
 			case WAIT_FAILED: goto error_cleanup;
+			case WAIT_HANDOFF:
+				if (handoff_send(handoff_fd, listeners.fds, listeners.n) == 0)
+					goto handoff_cleanup;
+				continue;
 		}
 		struct sockaddr_storage client_addr;
 		socklen_t client_addr_len = sizeof(client_addr);
 		const int client_fd = connect_client(listen_fd, &client_addr, &client_addr_len);
-		if (client_fd == -1)
-			goto error_cleanup;
-		struct thread_args *targs = malloc(sizeof(*targs));
-		if (targs == NULL) {
-			sys_error_printf("malloc failed");
-			goto error_cleanup;
+		if (client_fd == -1) {
+			switch (errno) {
+				// overload, not a broken server. clients wait in the backlog until descriptors are closed
+				case EMFILE:
+				case ENFILE:
+				case ENOBUFS:
+				case ENOMEM:
+					lprintf(WARN, "accept failed: %s, pausing accept for %d ms", strerror(errno), ACCEPT_RETRY_MS);
+					accept_retry_ns = metrics_now_ns() + ACCEPT_RETRY_MS * 1000000ull;
+					continue;
+				// the client is gone before it was accepted, or an error of its connection surfaced here
+				case ECONNABORTED:
+				case EPROTO:
+				case ENETDOWN:
+				case ENETUNREACH:
+				case EHOSTUNREACH:
+				case EINTR:
+				case EAGAIN:
+					continue;
+				default:
+					sys_error_printf("accept failed");
+					goto error_cleanup;
+			}
+		}
+		if (backlog_depth() >= shed_depth) {
+			shed_connection(client_fd);
+			close(client_fd);
+			continue;
 		}
-		targs->listen_fd = listen_fd;
-		targs->client_addr = client_addr;
-		targs->client_addr_len = client_addr_len;
-		targs->client_fd = client_fd;
+		const struct thread_args targs = {
+			.listen_fd = listen_fd,
+			.client_addr = client_addr,
+			.client_addr_len = client_addr_len,
+			.client_fd = client_fd,
+			.accepted_ns = metrics_now_ns()
+		};
 
-		thread_pool_add_task(tp, handle_connection, targs);
+		// counted from accept so queued connections are drained too
+		metrics_add(METRIC_CONNECTIONS_ACCEPTED, 1);
+		// copied into the queue slot (or the loop's inbox), no allocation per connection
+		if ((pool != NULL
+			     ? thread_pool_add_task_copy(pool, handle_connection, &targs, sizeof(targs))
+			     : coro_submit(loops, serve_coroutine, &targs, sizeof(targs))) == -1) {
+			shed_connection(client_fd);
+			conn_close(-1, client_fd);
+		}
 		/*
 		pthread_t thread_id;
 		pthread_create(&thread_id, nullptr, handle_connection, targs);
@@ -122,97 +319,825 @@ int run_server(const struct server_options *opt) {
 	}
 error_cleanup:
 	lprintf(LOG, "an error occurred, cleaning up...");
-	thread_pool_shutdown_graceful(tp);
-	thread_pool_destroy(tp);
-	atomic_store(&shutdown_requested, true);
-	while (atomic_load(&open_connections) != 0) {
-		usleep(10'000); // 10ms
-	}
-	if (cleanup(listen_fd) == -1)
-		return -1;
-	return -1;
+	retval = -1;
+	goto drain;
+handoff_cleanup:
+	lprintf(LOG, "listen sockets handed off, draining...");
+	// the new server owns the path now, only drop our end
+	close(handoff_fd);
+	handoff_fd = -1;
+	goto drain;
 signal_interrupt_cleanup:
 	lprintf(LOG, "a signal interrupted, cleaning up...");
-	thread_pool_shutdown_graceful(tp);
-	thread_pool_destroy(tp);
-	atomic_store(&shutdown_requested, true);
-	while (atomic_load(&open_connections) != 0) {
-		usleep(10'000); // 10ms
+drain:
+	// stop accepting first, connections in the kernel backlog belong to the new server after a handoff
+	if (cleanup(&listeners) == -1)
+		retval = -1;
+	if (handoff_fd != -1) {
+		close(handoff_fd);
+		unlink(HANDOFF_SOCKET_PATH);
 	}
-	if (cleanup(listen_fd) == -1)
-		return -1;
-	return 0;
+	// websockets and event streams have no idle point between requests, they're asked to close instead
+	websocket_drain(&ws_server);
+	sse_drain(&sse_server);
+	if (drain_connections(opt->timeouts.drain_sec) == -1) {
+		// workers are stuck on connections, joining them would block past the deadline
+		lprintf(WARN, "drain deadline passed with %llu connections open", (unsigned long long) open_connections());
+		capture_flush();
+		return retval;
+	}
+	if (pool != NULL) {
+		thread_pool_shutdown_graceful(pool);
+		thread_pool_destroy(pool);
+	}
+	coro_loops_destroy(loops);
+	coro_loops_destroy(stream_loops);
+	// every thread that captured is gone
+	capture_stop();
+	tls_server_destroy(tls_server);
+	proxy_destroy(proxy);
+	files_destroy(files);
+	return retval;
+}
+
+static_assert(sizeof(struct thread_args) <= THREAD_POOL_TASK_ARGS_MAX, "thread_args must fit in a task slot");
+static_assert(sizeof(struct thread_args) <= CORO_ARG_MAX, "thread_args must fit in a coroutine");
+
+int setup_workers(void) {
+	if (server_opt->workers.io_model == IO_MODEL_COROUTINES) {
+		const long online = sysconf(_SC_NPROCESSORS_ONLN);
+		const size_t n = server_opt->workers.loops ? server_opt->workers.loops : online > 0 ? (size_t) online : 1;
+		const struct coro_attr attr = {
+			.stack_size = server_opt->workers.stack_size,
+			// a burst of new connections after a quiet spell maps few new stacks
+			.stacks_cached = server_opt->workers.pool_size / n / 4,
+			.cpus = worker_cpus,
+			.ncpus = nworker_cpus
+		};
+		loops = coro_loops_create(n, &attr);
+		if (loops == NULL)
+			return -1;
+		lprintf(LOG, "%zu event loops, a coroutine per connection", n);
+		return 0;
+	}
+	const struct thread_pool_attr attr = {
+		.pool_size = server_opt->workers.pool_size,
+		.queue_size = server_opt->workers.queue_size,
+		.cpus = worker_cpus,
+		.ncpus = nworker_cpus,
+		.stack_size = server_opt->workers.stack_size
+	};
+	pool = thread_pool_create(&attr);
+	return pool != NULL ? 0 : -1;
+}
+
+// queued connections for the pool, open ones for the loops, admission sheds and pauses on it
+size_t backlog_depth(void) {
+	return pool != NULL ? thread_pool_queue_depth(pool) : coro_loops_live(loops);
+}
+
+void serve_coroutine(void *vargp) {
+	handle_connection(vargp);
 }
 
 static int setup(void) {
 	setup_atomic();
-	if (setup_pipe() == -1 || setup_sig_handler() == -1)
+	arena_set_size_classes(server_opt->buffers.size_classes, server_opt->buffers.nsize_classes);
+	if (setup_pipe() == -1 ||
+	    setup_sig_handler() == -1 ||
+	    setup_conn_slots(server_opt->workers.pool_size) == -1 ||
+	    setup_affinity() == -1 ||
+	    setup_proxy() == -1 ||
+	    setup_files() == -1 ||
+	    setup_router() == -1 ||
+	    setup_rate_limit() == -1 ||
+	    setup_tls() == -1 ||
+	    capture_start(&server_opt->capture) == -1)
+		return -1;
+	return 0;
+}
+
+int setup_rate_limit(void) {
+	const unsigned int rate = server_opt->rate_limit.rate;
+	if (rate == 0)
+		return 0;
+	const unsigned int burst = server_opt->rate_limit.burst ? server_opt->rate_limit.burst : rate;
+	const struct ratelimit_attr attr = {
+		.rate = rate,
+		.burst = burst,
+		.max_clients = server_opt->rate_limit.max_clients,
+		.ipv4_prefix = server_opt->rate_limit.ipv4_prefix,
+		.ipv6_prefix = server_opt->rate_limit.ipv6_prefix
+	};
+	limiter = ratelimit_create(&attr);
+	if (limiter == NULL)
+		return -1;
+	return 0;
+}
+
+int setup_tls(void) {
+	if (!server_opt->tls.enabled)
+		return 0;
+	tls_server = tls_server_create(&server_opt->tls);
+	if (tls_server == NULL)
+		return -1;
+	return 0;
+}
+
+int setup_proxy(void) {
+	if (server_opt->proxy.nroutes == 0)
+		return 0;
+	proxy = proxy_create(server_opt->proxy.routes, server_opt->proxy.nroutes);
+	if (proxy == NULL)
+		return -1;
+	return 0;
+}
+
+int setup_affinity(void) {
+	if (!server_opt->workers.pin)
+		return 0;
+	nworker_cpus = affinity_cpus(server_opt->workers.cpus, server_opt->workers.ncpus, worker_cpus,
+	                             AFFINITY_CPUS_MAX);
+	if (nworker_cpus == 0)
+		lprintf(WARN, "cpu pinning isn't available, workers aren't pinned");
+	return 0;
+}
+
+// shard i prefers connections whose packets the kernel handles on cpu i, the softirq, the accept and the
+// connection's first touches of its socket stay on one core when the nic steers flows there (rss/rps)
+void steer_listeners(const struct listeners *l) {
+#ifdef SO_INCOMING_CPU
+	if (nworker_cpus == 0 || l->n < 2)
+		return;
+	for (size_t i = 0; i < l->n; i++) {
+		const int cpu = worker_cpus[i % nworker_cpus];
+		if (setsockopt(l->fds[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) == -1)
+			sys_error_printf("setsockopt SO_INCOMING_CPU failed");
+	}
+#else
+	(void) l;
+#endif
+}
+
+void report_placement(const struct listeners *l) {
+	if (nworker_cpus == 0)
+		return;
+	struct coro_stats cst = {0};
+	if (loops != NULL)
+		coro_loops_stats(loops, &cst);
+	for (size_t c = 0; c < nworker_cpus; c++) {
+		size_t workers = 0;
+		// loop i is on cpu i % ncpus
+		for (size_t i = c; i < cst.loops; i += nworker_cpus)
+			workers++;
+		for (size_t i = 0; pool != NULL && i < server_opt->workers.pool_size; i++) {
+			struct thread_pool_worker_stats st;
+			if (thread_pool_get_worker_stats(pool, i, &st) == 0 && st.cpu == worker_cpus[c])
+				workers++;
+		}
+		char shards[128] = "";
+		size_t len = 0;
+#ifdef SO_INCOMING_CPU
+		for (size_t i = c; l->n > 1 && i < l->n && len < sizeof(shards); i += nworker_cpus) {
+			const int n = snprintf(shards + len, sizeof(shards) - len, "%s%zu", len ? "," : ", listener shard ", i);
+			if (n > 0)
+				len += (size_t) n;
+		}
+#else
+		(void) l;
+		(void) len;
+#endif
+		lprintf(LOG, "cpu %d (node %d): %zu %s%s", worker_cpus[c], affinity_node(worker_cpus[c]), workers,
+		        loops != NULL ? "event loops" : "workers", shards);
+	}
+}
+
+int setup_files(void) {
+	if (server_opt->files.root == NULL)
+		return 0;
+	struct files_options opt = server_opt->files;
+	opt.cache_entries = server_opt->cache.file_entries;
+	opt.cache_bytes = server_opt->cache.file_bytes;
+	files = files_create(&opt);
+	if (files == NULL)
+		return -1;
+	return 0;
+}
+
+static void h2_set_idle(void *ctx, const bool idle) {
+	conn_set_idle(((struct h2_conn_ctx *) ctx)->slot, idle);
+}
+
+static bool h2_draining(void) {
+	return atomic_load(&shutdown_requested);
+}
+
+static bool h2_admit(void *ctx) {
+	if (limiter == NULL || ratelimit_allow(limiter, ((struct h2_conn_ctx *) ctx)->client_addr))
+		return true;
+	metrics_add(METRIC_RATE_LIMITED, 1);
+	return false;
+}
+
+void setup_http2(thread_pool_t *tp) {
+	h2c = server_opt->http2.enabled && tp != NULL;
+	if (server_opt->http2.enabled && tp == NULL)
+		lprintf(LOG, "h2c is only served with io-model threads");
+	h2_server = (struct http2_server) {
+		.handler = route_request,
+		.pool = tp,
+		.max_concurrent_streams = server_opt->http2.max_concurrent_streams,
+		.initial_window_size = server_opt->http2.initial_window_size,
+		.request_max = server_opt->buffers.request_max,
+		.send_timeout_sec = server_opt->timeouts.keep_alive_sec,
+		.set_idle = h2_set_idle,
+		.draining = h2_draining,
+		.admit = h2_admit
+	};
+}
+
+static void stream_closed(const int fd) {
+	conn_close(-1, fd);
+}
+
+/* with threads a websocket or event stream leaves its worker for one of the stream loops, with coroutines it
+ * stays where it is
+ */
+void setup_streams(void) {
+	ws_server = (struct websocket_server) {
+		.loops = loops,
+		.message_max = server_opt->websocket.message_max,
+		.queue_max = server_opt->websocket.queue_max,
+		.ping_interval_sec = server_opt->websocket.ping_interval_sec,
+		.send_timeout_sec = server_opt->timeouts.keep_alive_sec,
+		.closed = stream_closed
+	};
+	sse_server = (struct sse_server) {
+		.loops = loops,
+		.keep_alive_sec = server_opt->sse.keep_alive_sec,
+		.send_timeout_sec = server_opt->timeouts.keep_alive_sec,
+		.slow_policy = server_opt->sse.slow_policy,
+		.closed = stream_closed
+	};
+	if (loops != NULL)
+		return;
+	const struct coro_attr attr = {
+		.stack_size = server_opt->workers.stack_size,
+		.stacks_cached = server_opt->workers.pool_size / server_opt->websocket.loops / 4,
+		.cpus = worker_cpus,
+		.ncpus = nworker_cpus
+	};
+	stream_loops = coro_loops_create(server_opt->websocket.loops, &attr);
+	if (stream_loops == NULL) {
+		lprintf(WARN, "no stream event loops, websockets and event streams are closed after their head");
+		return;
+	}
+	ws_server.loops = stream_loops;
+	sse_server.loops = stream_loops;
+}
+
+int send_rate_limited(conn_io_t *io, arena_t *arena) {
+	static char body[] = "too many requests";
+	struct HttpResponse res;
+	http_response_init(&res, arena);
+	res.status_line.status_code = 429;
+	// rates are whole requests per second, a token is back within a second
+	set_http_field("Retry-After", "1", &res.headers);
+	set_http_field("Connection", "close", &res.headers);
+	res.body.ptr = body;
+	res.body.len = sizeof(body) - 1;
+	metrics_add(METRIC_RATE_LIMITED, 1);
+	metrics_count_status(429);
+	return send_response(io, &res, false, arena);
+}
+
+int send_bad_request(conn_io_t *io, arena_t *arena) {
+	static char body[] = "bad request";
+	struct HttpResponse res;
+	http_response_init(&res, arena);
+	res.status_line.status_code = 400;
+	set_http_field("Connection", "close", &res.headers);
+	res.body.ptr = body;
+	res.body.len = sizeof(body) - 1;
+	metrics_count_status(400);
+	return send_response(io, &res, false, arena);
+}
+
+int send_length_required(conn_io_t *io, arena_t *arena) {
+	static char body[] = "length required";
+	struct HttpResponse res;
+	http_response_init(&res, arena);
+	res.status_line.status_code = 411;
+	set_http_field("Connection", "close", &res.headers);
+	res.body.ptr = body;
+	res.body.len = sizeof(body) - 1;
+	metrics_count_status(411);
+	return send_response(io, &res, false, arena);
+}
+
+int setup_admission(const size_t queue_capacity) {
+	static char body[] = "service unavailable";
+	static char retry_after[16];
+	pause_depth = server_opt->admission.pause_queue_depth;
+	if (pause_depth == 0)
+		pause_depth = queue_capacity;
+	shed_depth = server_opt->admission.shed_queue_depth;
+	if (shed_depth == 0) {
+		// at 0 every connection would be shed, a queue too short to shed before it pauses only pauses
+		shed_depth = MAX(queue_capacity * 3 / 4, (size_t) 1);
+		if (shed_depth >= pause_depth) {
+			lprintf(LOG, "queue of %zu is too short to shed connections, accepting pauses at %zu", queue_capacity,
+			        pause_depth);
+			shed_depth = SIZE_MAX;
+		}
+	} else if (shed_depth >= pause_depth) {
+		lprintf(ERROR, "shed queue depth %zu must be below the pause depth %zu", shed_depth, pause_depth);
+		return -1;
+	}
+	arena_t arena;
+	arena_init(&arena);
+	struct HttpResponse res;
+	http_response_init(&res, &arena);
+	res.status_line.status_code = 503;
+	snprintf(retry_after, sizeof(retry_after), "%u", server_opt->admission.retry_after_sec);
+	set_http_field("Retry-After", retry_after, &res.headers);
+	set_http_field("Connection", "close", &res.headers);
+	res.body.ptr = body;
+	res.body.len = sizeof(body) - 1;
+	const ssize_t head_len = serialize_http_response_head(&res, shed_response, sizeof(shed_response));
+	arena_destroy(&arena);
+	if (head_len == -1 || (size_t) head_len + res.body.len > sizeof(shed_response)) {
+		lprintf(ERROR, "503 response doesn't fit in %zu bytes", sizeof(shed_response));
+		return -1;
+	}
+	memcpy(shed_response + head_len, body, res.body.len);
+	shed_response_len = (size_t) head_len + res.body.len;
+	return 0;
+}
+
+/* runs on the accept thread, one non-blocking send and no parsing. a full socket buffer drops the 503. closing
+ * with unread request bytes makes the kernel answer with a reset that can overtake the 503, so what already
+ * arrived is read and dropped first
+ */
+void shed_connection(const int client_fd) {
+	static char drain[4096]; // accept thread only
+	const ssize_t sent = send(client_fd, shed_response, shed_response_len, MSG_DONTWAIT);
+	if (sent > 0)
+		metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	shutdown(client_fd, SHUT_WR);
+	size_t drained = 0;
+	while (drained < SHED_DRAIN_MAX_BYTES) {
+		const ssize_t n = recv(client_fd, drain, sizeof(drain), MSG_DONTWAIT);
+		if (n <= 0)
+			break;
+		drained += (size_t) n;
+	}
+	metrics_add(METRIC_CONNECTIONS_SHED, 1);
+	metrics_count_status(503);
+}
+
+static ssize_t render_loop_stats(char *buf, const size_t bufn) {
+	struct coro_stats st;
+	coro_loops_stats(loops, &st);
+	const int n = snprintf(buf, bufn,
+	                       "# TYPE chinook_event_loops gauge\nchinook_event_loops %zu\n"
+	                       "# TYPE chinook_coroutines gauge\nchinook_coroutines %zu\n"
+	                       "# TYPE chinook_coroutine_stacks gauge\nchinook_coroutine_stacks %zu\n"
+	                       "# TYPE chinook_coroutine_switches_total counter\nchinook_coroutine_switches_total %llu\n",
+	                       st.loops, st.live, st.stacks, (unsigned long long) st.switches);
+	if (n < 0 || (size_t) n >= bufn)
+		return -1;
+	return n;
+}
+
+static ssize_t render_pool_stats(char *buf, const size_t bufn) {
+	if (pool == NULL)
+		return render_loop_stats(buf, bufn);
+	struct thread_pool_stats st;
+	if (thread_pool_get_stats(pool, &st) == -1)
+		return -1;
+	const int n = snprintf(buf, bufn,
+	                       "# TYPE chinook_pool_workers gauge\nchinook_pool_workers %zu\n"
+	                       "# TYPE chinook_pool_queue_depth gauge\nchinook_pool_queue_depth %zu\n"
+	                       "# TYPE chinook_pool_queue_high_water gauge\nchinook_pool_queue_high_water %zu\n"
+	                       "# TYPE chinook_pool_tasks_total counter\nchinook_pool_tasks_total %llu\n"
+	                       "# TYPE chinook_pool_rejected_total counter\nchinook_pool_rejected_total %llu\n"
+	                       "# TYPE chinook_pool_busy_seconds_total counter\nchinook_pool_busy_seconds_total %.6f\n"
+	                       "# TYPE chinook_pool_idle_seconds_total counter\nchinook_pool_idle_seconds_total %.6f\n"
+	                       "# TYPE chinook_pool_wait_seconds summary\n"
+	                       "chinook_pool_wait_seconds{quantile=\"0.5\"} %.6f\n"
+	                       "chinook_pool_wait_seconds{quantile=\"0.99\"} %.6f\n"
+	                       "chinook_pool_wait_seconds{quantile=\"1\"} %.6f\n"
+	                       "chinook_pool_wait_seconds_sum %.6f\nchinook_pool_wait_seconds_count %llu\n",
+	                       st.workers, st.queue_depth, st.queue_high_water, (unsigned long long) st.tasks_executed,
+	                       (unsigned long long) st.rejected, (double) st.busy_ns / 1e9, (double) st.idle_ns / 1e9,
+	                       (double) st.wait_p50_us / 1e6, (double) st.wait_p99_us / 1e6,
+	                       (double) st.wait_max_us / 1e6, (double) st.wait_sum_us / 1e6,
+	                       (unsigned long long) st.wait_count);
+	if (n < 0 || (size_t) n >= bufn)
+		return -1;
+	return n;
+}
+
+// 0 where it can't be read
+static size_t process_resident_bytes(void) {
+#ifdef __linux__
+	FILE *fp = fopen("/proc/self/statm", "r");
+	if (fp == NULL)
+		return 0;
+	unsigned long long size, resident;
+	const int n = fscanf(fp, "%llu %llu", &size, &resident);
+	fclose(fp);
+	if (n == 2)
+		return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+#endif
+	return 0;
+}
+
+/* memory by what holds it. heap kinds count what's allocated, thread stacks the pages actually resident, so the
+ * process' resident bytes minus their sum is the allocator's slack, libraries and whatever isn't attributed yet
+ */
+static ssize_t render_memory_stats(char *buf, const size_t bufn) {
+	size_t stacks_mapped = 0;
+	size_t stacks_resident = 0;
+	if (pool != NULL && thread_pool_stack_usage(pool, &stacks_mapped, &stacks_resident) == -1)
+		return -1;
+	size_t coro_mapped = 0;
+	coro_loops_t *const all_loops[] = {loops, stream_loops};
+	for (size_t i = 0; i < sizeof(all_loops) / sizeof(all_loops[0]); i++) {
+		if (all_loops[i] == NULL)
+			continue;
+		struct coro_stats st;
+		coro_loops_stats(all_loops[i], &st);
+		coro_mapped += st.stack_bytes;
+	}
+	int n = snprintf(buf, bufn,
+	                 "# TYPE chinook_memory_bytes gauge\n"
+	                 "chinook_memory_bytes{kind=\"thread_stacks\"} %zu\n"
+	                 "chinook_memory_bytes{kind=\"arena_used\"} %llu\n"
+	                 "chinook_memory_bytes{kind=\"arena_cached\"} %llu\n"
+	                 "chinook_memory_bytes{kind=\"file_cache\"} %zu\n"
+	                 "chinook_memory_bytes{kind=\"rate_limit\"} %zu\n"
+	                 "chinook_memory_bytes{kind=\"sse_events\"} %llu\n"
+	                 "chinook_memory_bytes{kind=\"websocket_frames\"} %llu\n"
+	                 "# TYPE chinook_memory_mapped_bytes gauge\n"
+	                 "chinook_memory_mapped_bytes{kind=\"thread_stacks\"} %zu\n"
+	                 "chinook_memory_mapped_bytes{kind=\"coroutine_stacks\"} %zu\n",
+	                 stacks_resident, (unsigned long long) metrics_memory_total(METRIC_MEMORY_ARENA_USED),
+	                 (unsigned long long) metrics_memory_total(METRIC_MEMORY_ARENA_CACHED), files_cache_bytes(files),
+	                 ratelimit_table_bytes(limiter),
+	                 (unsigned long long) metrics_memory_total(METRIC_MEMORY_SSE_EVENTS),
+	                 (unsigned long long) metrics_memory_total(METRIC_MEMORY_WEBSOCKET_FRAMES), stacks_mapped,
+	                 coro_mapped);
+	if (n < 0 || (size_t) n >= bufn)
+		return -1;
+	const size_t resident = process_resident_bytes();
+	if (resident > 0) {
+		const int m = snprintf(buf + n, bufn - (size_t) n,
+		                       "# TYPE chinook_process_resident_bytes gauge\nchinook_process_resident_bytes %zu\n",
+		                       resident);
+		if (m < 0 || (size_t) m >= bufn - (size_t) n)
+			return -1;
+		n += m;
+	}
+	return n;
+}
+
+static int metrics_handler(const struct HttpRequest *req, [[maybe_unused]] const struct route_params *params,
+                           struct HttpResponse *res, [[maybe_unused]] void *user) {
+	char *buf = arena_alloc(req->arena, METRICS_TEXT_MAX_BYTES);
+	if (buf == NULL)
+		return -1;
+	const ssize_t len = metrics_render(buf, METRICS_TEXT_MAX_BYTES);
+	if (len == -1)
+		return -1;
+	const ssize_t pool_len = render_pool_stats(buf + len, METRICS_TEXT_MAX_BYTES - (size_t) len);
+	if (pool_len == -1)
+		return -1;
+	const ssize_t memory_len = render_memory_stats(buf + len + pool_len,
+	                                               METRICS_TEXT_MAX_BYTES - (size_t) (len + pool_len));
+	if (memory_len == -1)
+		return -1;
+	set_http_field("Content-Type", "text/plain; version=0.0.4", &res->headers);
+	res->body.ptr = buf;
+	res->body.len = (size_t) (len + pool_len + memory_len);
+	return 0;
+}
+
+int setup_router(void) {
+	router = router_create();
+	if (router == NULL)
+		return -1;
+	// reserved, added first so a site route can't take the path
+	if (router_add(router, HTTP_METHOD_GET, METRICS_PATH, metrics_handler, NULL) == -1 ||
+	    (proxy != NULL && proxy_register(proxy, router) == -1) ||
+	    (files != NULL && files_register(files, router) == -1) || routes_register(router) == -1 ||
+	    router_compile(router) == -1) {
+		router_destroy(router);
+		router = NULL;
 		return -1;
+	}
+	return 0;
+}
+
+// at most one connection per pool thread runs at a time, so pool_size slots always suffice
+int setup_conn_slots(const size_t n) {
+	conn_slots = malloc(sizeof(*conn_slots) * n);
+	conn_free_slots = malloc(sizeof(*conn_free_slots) * n);
+	if (conn_slots == NULL || conn_free_slots == NULL) {
+		sys_error_printf("malloc failed");
+		free(conn_slots);
+		free(conn_free_slots);
+		return -1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		conn_slots[i].fd = -1;
+		atomic_init(&conn_slots[i].idle, false);
+		conn_free_slots[i] = n - 1 - i;
+	}
+	conn_nfree = n;
 	return 0;
 }
 
+ssize_t conn_register(const int fd) {
+	pthread_mutex_lock(&conn_mutex);
+	if (conn_nfree == 0) {
+		pthread_mutex_unlock(&conn_mutex);
+		lprintf(WARN, "no connection slot free, connection can't be woken on drain");
+		return -1;
+	}
+	const size_t slot = conn_free_slots[--conn_nfree];
+	conn_slots[slot].fd = fd;
+	atomic_store(&conn_slots[slot].idle, false);
+	pthread_mutex_unlock(&conn_mutex);
+	return (ssize_t) slot;
+}
+
+void conn_set_idle(const ssize_t slot, const bool idle) {
+	if (slot != -1)
+		atomic_store(&conn_slots[slot].idle, idle);
+}
+
+// releases the slot before the fd is closed so a drain never shuts down a reused fd
+void conn_release(const ssize_t slot) {
+	if (slot == -1)
+		return;
+	pthread_mutex_lock(&conn_mutex);
+	conn_slots[slot].fd = -1;
+	conn_free_slots[conn_nfree++] = (size_t) slot;
+	pthread_mutex_unlock(&conn_mutex);
+}
+
+void conn_close(const ssize_t slot, const int fd) {
+	conn_release(slot);
+	close(fd);
+	metrics_add(METRIC_CONNECTIONS_CLOSED, 1);
+	// pairs with the fence in drain_connections(), either the drain sees this close or this sees the drain
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load(&shutdown_requested)) {
+		pthread_mutex_lock(&conn_mutex);
+		pthread_cond_broadcast(&conn_drained_cond);
+		pthread_mutex_unlock(&conn_mutex);
+	}
+}
+
+// per-thread counters instead of one shared atomic, summing them is only done on drain
+uint64_t open_connections(void) {
+	const uint64_t accepted = metrics_counter_total(METRIC_CONNECTIONS_ACCEPTED);
+	const uint64_t closed = metrics_counter_total(METRIC_CONNECTIONS_CLOSED);
+	return accepted > closed ? accepted - closed : 0;
+}
+
+// returns -1 if connections are still open at the deadline
+int drain_connections(const unsigned int deadline_sec) {
+	atomic_store(&shutdown_requested, true);
+	atomic_thread_fence(memory_order_seq_cst);
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += deadline_sec;
+	pthread_mutex_lock(&conn_mutex);
+	// idle keep-alive connections would otherwise sit in recv() until their timeout
+	for (size_t i = 0; i < server_opt->workers.pool_size; i++) {
+		if (conn_slots[i].fd != -1 && atomic_load(&conn_slots[i].idle))
+			shutdown(conn_slots[i].fd, SHUT_RD);
+	}
+	int retval = 0;
+	while (open_connections() != 0) {
+		const int stat = pthread_cond_timedwait(&conn_drained_cond, &conn_mutex, &deadline);
+		if (stat == ETIMEDOUT) {
+			retval = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&conn_mutex);
+	return retval;
+}
+
 void *handle_connection(void *vargp) {
-	atomic_fetch_add(&open_connections, 1);
 	struct thread_args *args = vargp;
 	const int client_fd = args->client_fd;
 	const struct sockaddr_storage client_addr = args->client_addr;
 	const socklen_t client_addr_len = args->client_addr_len;
 	const int listen_fd = args->listen_fd;
+	const uint64_t accepted_ns = args->accepted_ns;
 	lprintf(DEBUG, "TCP CONNECTED"); {
-		char ip_str_buf[1000];
+		char ip_str_buf[INET6_ADDRSTRLEN];
 		lprintf(DEBUG, "client ip: %s", sockaddr_get_ip_str(&client_addr, ip_str_buf, sizeof(ip_str_buf)));
 	}
+	const ssize_t slot = conn_register(client_fd);
+	// blocks are recycled through the thread's cache, a warm connection doesn't malloc per request
+	arena_t arena;
+	arena_init(&arena);
+	conn_io_t io;
+	conn_io_init(&io, client_fd);
+	io.capture_id = capture_open();
+	// pipelined bytes read with the previous request, kept outside the arena since that's reset in between
+	char *carry = NULL;
+	size_t carry_len = 0;
+	// a coroutine parks on its loop where the fd would block, the receive timeout moves into conn_io
+	if (co_running()) {
+		if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1) {
+			sys_error_printf("fcntl failed");
+			goto next;
+		}
+		io.timeout_ms = (int) server_opt->timeouts.recv_sec * 1000;
+	}
+	// on the worker, a slow handshake holds up one thread instead of the accept loop
+	if (tls_server != NULL && conn_io_accept(&io, tls_server) == -1)
+		goto next;
 	int keep_alive = 1;
+	const size_t request_max = server_opt->buffers.request_max;
+	bool first_request = true;
 	while (keep_alive) {
-		char *buf = malloc(REQUEST_MAX_SIZE_BYTES);
-		const ssize_t len = get_response(client_fd, buf, REQUEST_MAX_SIZE_BYTES);
-		if (len < 0) {
-			free(buf);
-			switch (len) {
-				case GOTO_ERR: goto error_cleanup;
-				case CONTINUE:
-				case CLOSED:
-				case TIMEOUT: goto next;
-				default: lprintf(ERROR, "return code fall through case at %s");
+		// idle must be visible before checking for a drain, see drain_connections()
+		conn_set_idle(slot, true);
+		if (!first_request && atomic_load(&shutdown_requested))
+			goto next;
+		char *buf = arena_alloc(&arena, request_max);
+		if (buf == NULL) {
+			goto error_cleanup;
+		}
+		size_t len = carry_len;
+		if (carry_len > 0)
+			memcpy(buf, carry, carry_len);
+		carry_len = 0;
+		ssize_t received = 0;
+		// a whole head that came with the previous request is served without waiting on the socket
+		if (len == 0 || memmem(buf, len, "\r\n\r\n", 4) == NULL) {
+			received = get_response(&io, buf + len, request_max - len);
+			if (received < 0) {
+				conn_set_idle(slot, false);
+				switch (received) {
+					case GOTO_ERR: goto error_cleanup;
+					case CONTINUE:
+					case CLOSED:
+					case TIMEOUT: goto next;
+					default: lprintf(ERROR, "return code fall through case at %s");
+				}
 			}
+			len += (size_t) received;
+		}
+		conn_set_idle(slot, false);
+		const uint64_t received_ns = metrics_now_ns();
+		if (first_request)
+			metrics_time(METRIC_ACCEPT_TO_FIRST_BYTE, accepted_ns);
+		// streams run as pool tasks, this thread only reads frames from here on. h2 is cleartext only
+		if (first_request && h2c && io.ssl == NULL && http2_is_preface(buf, len)) {
+			struct h2_conn_ctx ctx = {.slot = slot, .client_addr = &client_addr};
+			http2_serve(&h2_server, client_fd, buf, len, NULL, &ctx);
+			goto next;
+		}
+		metrics_add(METRIC_REQUESTS, 1);
+		metrics_add(METRIC_BYTES_RECEIVED, (uint64_t) received);
+		// checked before parsing so a flood costs a table lookup per request
+		if (limiter != NULL && !ratelimit_allow(limiter, &client_addr)) {
+			send_rate_limited(&io, &arena);
+			goto next;
 		}
 		struct HttpRequest req;
-		if (parse_http_request(buf, &req) == -1) {
-			free(buf);
-			goto error_cleanup;
+		req.arena = &arena;
+		req.conn = &io;
+		req.client_addr = &client_addr;
+		// buf isn't written to, the views in req stay valid until the arena is reset
+		if (parse_http_request(buf, len, &req) == -1) {
+			metrics_add(METRIC_PARSE_ERRORS, 1);
+			send_bad_request(&io, &arena);
+			goto next;
+		}
+		metrics_time(METRIC_PARSE, received_ns);
+		// a chunked body ends where its last chunk says, read as requests its chunks would desync the connection
+		if (HEADER_EXISTS("Transfer-Encoding", &req.headers)) {
+			send_length_required(&io, &arena);
+			goto next;
 		}
-		if (get_http_header("Connection", &req.headers) && (
-			    strcmp(get_http_header("Connection", &req.headers), "close") == 0)) {
+		// the head and its body by Content-Length, what follows is the next request
+		const size_t consumed = (size_t) ((const char *) req.body.ptr + req.body.len - buf);
+		const char *after = buf + consumed;
+		const size_t after_len = len - consumed;
+		if (h2c && io.ssl == NULL && http2_is_upgrade(&req)) {
+			struct h2_conn_ctx ctx = {.slot = slot, .client_addr = &client_addr};
+			http2_serve(&h2_server, client_fd, after, after_len, &req, &ctx);
+			goto next;
+		}
+		if (str_view_case_eq(get_http_header("Connection", &req.headers), "close")) {
 			lprintf(DEBUG, "client sent Connection: close");
 			keep_alive = 0;
 		}
-		lprintf(LOG, "%s", req.request_line.uri);
-		char *data;
-		if (keep_alive) {
-			data = "HTTP/1.1 200 Ok\r\nContent-Type: application/json\r\nContent-Length:6\r\nConnection: keep-alive\r\n\r\nhello!";
-		} else {
-			data = "HTTP/1.1 200 Ok\r\nContent-Type: application/json\r\nContent-Length:6\r\nConnection: close\r\n\r\nhello!";
+		if (atomic_load(&shutdown_requested)) {
+			keep_alive = 0;
 		}
-		free(buf);
-		if (send(client_fd, data, strlen(data), 0) == -1) {
-			sys_error_printf("send failed");
+		if (keep_alive && after_len > 0 && carry == NULL) {
+			carry = malloc(request_max);
+			if (carry == NULL)
+				keep_alive = 0;
+		}
+		lprintf(LOG, "%.*s", (int) req.request_line.uri.len, req.request_line.uri.ptr);
+		struct HttpResponse res;
+		http_response_init(&res, &arena);
+		const uint64_t handler_ns = metrics_now_ns();
+		// revalidating a known file gets its stored 304 head, neither the router nor the handler run
+		char not_modified[FILES_NOT_MODIFIED_MAX];
+		const size_t not_modified_len = files != NULL
+			                                ? files_not_modified(files, &req, not_modified, sizeof(not_modified))
+			                                : 0;
+		if (not_modified_len > 0)
+			res.status_line.status_code = 304;
+		else
+			route_request(&req, &res);
+		metrics_time(METRIC_HANDLER, handler_ns);
+		// a handler that left part of the request unread can't keep the connection
+		if (HEADER_EQ("Connection", &res.headers, "close"))
+			keep_alive = 0;
+		// the rest of the body was still on the socket, there's no telling whether the handler read it
+		size_t content_length;
+		if (http_content_length(&req.headers, &content_length) == 0 && content_length > req.body.len)
+			keep_alive = 0;
+		// a 101 already says Connection: Upgrade
+		if (res.websocket == NULL)
+			set_http_field("Connection", keep_alive ? "keep-alive" : "close", &res.headers);
+		const uint64_t send_ns = metrics_now_ns();
+		const int send_stat = not_modified_len > 0
+			                      ? send_cached_head(&io, not_modified, not_modified_len, keep_alive)
+			                      : send_response(&io, &res, req.request_line.method == HTTP_METHOD_HEAD, &arena);
+		metrics_time(METRIC_SEND, send_ns);
+		metrics_time(METRIC_REQUEST_TOTAL, received_ns);
+		metrics_count_status(res.status_line.status_code);
+		if ((res.websocket != NULL || res.sse != NULL) && send_stat == 0) {
+			// frames the client sent right behind the upgrade are read along, they're copied before the arena goes
+			const int stream_stat = res.websocket != NULL
+				                        ? websocket_start(&ws_server, &io, res.websocket, after, after_len)
+				                        : sse_start(&sse_server, &io, res.sse);
+			if (stream_stat == 1) {
+				// the loop owns the connection and closes it through stream_closed()
+				arena_destroy(&arena);
+				free(carry);
+				conn_release(slot);
+				return NULL;
+			}
+			goto next;
+		}
+		if (keep_alive && after_len > 0) {
+			memcpy(carry, after, after_len);
+			carry_len = after_len;
+		}
+		// releases buf, the parsed request and whatever the handler allocated
+		arena_reset(&arena);
+		if (send_stat == -1) {
 			goto error_cleanup;
 		}
+		if (send_stat == CLOSED)
+			goto next;
+		if (first_request && keep_alive && server_opt->timeouts.keep_alive_sec != server_opt->timeouts.recv_sec) {
+			// idle keep-alive connections wait longer (or shorter) than the first request
+			const struct timeval t = {.tv_sec = server_opt->timeouts.keep_alive_sec, .tv_usec = 0};
+			if (co_running())
+				io.timeout_ms = (int) server_opt->timeouts.keep_alive_sec * 1000;
+			else if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == -1) {
+				sys_error_printf("setsockopt failed");
+			}
+		}
+		first_request = false;
 	}
 	// TODO: buffer for logging,
 	// TODO: thread for printing the buffer
 next:
+	arena_destroy(&arena);
+	free(carry);
+	conn_io_shutdown(&io);
 	shutdown(client_fd, SHUT_WR);
-	free(args);
-	usleep(100);
-	close(client_fd);
+	if (co_running())
+		co_yield();
+	else
+		usleep(100);
+	conn_close(slot, client_fd);
 	lprintf(DEBUG, "TCP DISCONNECTED");
-	atomic_fetch_sub(&open_connections, 1);
 	return NULL;
 error_cleanup:
+	arena_destroy(&arena);
+	free(carry);
+	conn_io_shutdown(&io);
 	shutdown(client_fd, SHUT_WR);
-	free(args);
-	close(client_fd);
+	conn_close(slot, client_fd);
 	lprintf(DEBUG, "TCP DISCONNECTED");
 	if (atomic_load(&thread_error) == true) {
 		return NULL;
@@ -220,10 +1145,152 @@ error_cleanup:
 	atomic_store(&thread_error, true);
 	char data = 'a';
 	write(thread_error_pipe_fds[1], &data, 1);
-	atomic_fetch_sub(&open_connections, 1);
 	return NULL;
 }
 
+int route_request(const struct HttpRequest *req, struct HttpResponse *res) {
+	static char not_found[] = "not found";
+	static char method_not_allowed[] = "method not allowed";
+	static char internal_error[] = "internal server error";
+	const struct str_view uri = req->request_line.uri;
+	const struct str_view path = req->request_line.path;
+	struct route_match m;
+	switch (router_match(router, req->request_line.method, path.ptr, path.len, &m)) {
+		case ROUTE_FOUND:
+			if (m.handler(req, &m.params, res, m.user) == 0)
+				return 0;
+			lprintf(ERROR, "handler failed for %.*s", (int) uri.len, uri.ptr);
+			http_response_init(res, res->headers.arena);
+			res->status_line.status_code = 500;
+			res->body.ptr = internal_error;
+			res->body.len = sizeof(internal_error) - 1;
+			return -1;
+		case ROUTE_NOT_FOUND:
+			res->status_line.status_code = 404;
+			res->body.ptr = not_found;
+			res->body.len = sizeof(not_found) - 1;
+			return 0;
+		case ROUTE_METHOD_NOT_ALLOWED:
+			res->status_line.status_code = 405;
+			res->body.ptr = method_not_allowed;
+			res->body.len = sizeof(method_not_allowed) - 1;
+			return 0;
+	}
+	return -1;
+}
+
+// chunked when the length isn't known up front, returns the body bytes sent
+static ssize_t copy_body_stream(conn_io_t *io, const struct HttpBodyStream *st, arena_t *arena) {
+	static char crlf[] = "\r\n";
+	static char last_chunk[] = "0\r\n\r\n";
+	char *buf = arena_alloc(arena, BODY_STREAM_CHUNK_BYTES);
+	if (buf == NULL)
+		return -1;
+	const bool chunked = st->length == -1;
+	size_t total = 0;
+	while (1) {
+		const ssize_t n = st->read(st->ctx, buf, BODY_STREAM_CHUNK_BYTES);
+		if (n == -1)
+			return -1;
+		if (n == 0)
+			break;
+		char size_line[24];
+		struct iovec iov[3];
+		int iovcnt = 0;
+		if (chunked) {
+			const int len = snprintf(size_line, sizeof(size_line), "%zx\r\n", (size_t) n);
+			iov[iovcnt++] = (struct iovec) {.iov_base = size_line, .iov_len = (size_t) len};
+		}
+		iov[iovcnt++] = (struct iovec) {.iov_base = buf, .iov_len = (size_t) n};
+		if (chunked)
+			iov[iovcnt++] = (struct iovec) {.iov_base = crlf, .iov_len = sizeof(crlf) - 1};
+		const ssize_t sent = conn_io_writev(io, iov, iovcnt);
+		if (sent == -1)
+			return -1;
+		total += (size_t) sent;
+	}
+	if (chunked) {
+		struct iovec iov = {.iov_base = last_chunk, .iov_len = sizeof(last_chunk) - 1};
+		if (conn_io_writev(io, &iov, 1) == -1)
+			return -1;
+		total += iov.iov_len;
+	} else if (total != (size_t) st->length) {
+		lprintf(ERROR, "streamed body ended after %zu of %zd bytes", total, st->length);
+		return -1;
+	}
+	return (ssize_t) total;
+}
+
+// the head goes out first, the stream is closed whatever happens. CLOSED if the connection broke.
+// corked, the head and the start of the body leave in full segments instead of a short one for the head
+static int send_body_stream(conn_io_t *io, const struct HttpBodyStream *st, char *head, const size_t head_len,
+                            const bool head_only, arena_t *arena) {
+	const bool cork = server_opt->socket.cork && !head_only;
+	if (cork)
+		socket_cork(io->fd, true);
+	struct iovec iov = {.iov_base = head, .iov_len = head_len};
+	if (conn_io_writev(io, &iov, 1) == -1) {
+		st->close(st->ctx, false);
+		return CLOSED;
+	}
+	metrics_add(METRIC_BYTES_SENT, head_len);
+	if (head_only) {
+		st->close(st->ctx, false);
+		return 0;
+	}
+	const ssize_t sent = st->length >= 0 && st->send != NULL
+		                     ? st->send(st->ctx, io)
+		                     : copy_body_stream(io, st, arena);
+	if (cork && sent != -1)
+		socket_cork(io->fd, false);
+	st->close(st->ctx, sent != -1);
+	if (sent == -1)
+		return CLOSED;
+	metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	return 0;
+}
+
+// head and body go out in one writev, HEAD responses keep the Content-Length but drop the body
+int send_response(conn_io_t *io, const struct HttpResponse *res, const bool head_only, arena_t *arena) {
+	char *head = arena_alloc(arena, RESPONSE_HEAD_MAX_SIZE_BYTES);
+	if (head == NULL)
+		return -1;
+	const ssize_t head_len = serialize_http_response_head(res, head, RESPONSE_HEAD_MAX_SIZE_BYTES);
+	if (head_len == -1) {
+		if (res->stream != NULL)
+			res->stream->close(res->stream->ctx, false);
+		return -1;
+	}
+	if (res->stream != NULL)
+		return send_body_stream(io, res->stream, head, (size_t) head_len, head_only, arena);
+	struct iovec iov[2] = {
+		{.iov_base = head, .iov_len = (size_t) head_len},
+		{.iov_base = res->body.ptr, .iov_len = head_only ? 0 : res->body.len}
+	};
+	// the client reset or stopped reading, which ends its connection and nothing else
+	const ssize_t sent = conn_io_writev(io, iov, iov[1].iov_len ? 2 : 1);
+	if (sent == -1)
+		return CLOSED;
+	metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	return 0;
+}
+
+// a head serialized ahead of time, only the Connection header is added
+int send_cached_head(conn_io_t *io, char *head, const size_t head_len, const bool keep_alive) {
+	static char keep_alive_end[] = "Connection: keep-alive\r\n\r\n";
+	static char close_end[] = "Connection: close\r\n\r\n";
+	struct iovec iov[2] = {
+		{.iov_base = head, .iov_len = head_len},
+		keep_alive
+			? (struct iovec) {.iov_base = keep_alive_end, .iov_len = sizeof(keep_alive_end) - 1}
+			: (struct iovec) {.iov_base = close_end, .iov_len = sizeof(close_end) - 1}
+	};
+	const ssize_t sent = conn_io_writev(io, iov, 2);
+	if (sent == -1)
+		return CLOSED;
+	metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	return 0;
+}
 
 void signal_handler(const int signum) {
 	constexpr char buf = 'a';
@@ -245,12 +1312,17 @@ int setup_sig_handler() {
 		sys_error_printf("sigaction failed");
 		return -1;
 	}
+	// a client that went away turns writes into EPIPE instead of killing the server
+	sa.__sigaction_u.__sa_handler = SIG_IGN;
+	if (sigaction(SIGPIPE, &sa, nullptr) == -1) {
+		sys_error_printf("sigaction failed");
+		return -1;
+	}
 	return 0;
 }
 
 void setup_atomic(void) {
 	atomic_init(&thread_error, false);
-	atomic_init(&open_connections, 0);
 	atomic_init(&shutdown_requested, false);
 }
 
@@ -262,12 +1334,15 @@ int setup_pipe(void) {
 	return 0;
 }
 
-int cleanup(const int fd) {
-	if (close(fd) == -1) {
-		sys_error_printf("close failed");
-		return -1;
+int cleanup(const struct listeners *l) {
+	int retval = 0;
+	for (size_t i = 0; i < l->n; i++) {
+		if (close(l->fds[i]) == -1) {
+			sys_error_printf("close failed");
+			retval = -1;
+		}
 	}
-	return 0;
+	return retval;
 }
 
 
@@ -350,6 +1425,13 @@ int listen_socket(const struct server_options *opt) {
 		sys_error_printf("setsockopt failed");
 		goto cleanup_fail;
 	}
+	// shards share the port, the kernel spreads incoming connections between them
+	if (opt->special.listener_shards > 1 &&
+	    setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val)) == -1) {
+		sys_error_printf("setsockopt failed");
+		goto cleanup_fail;
+	}
+	socket_profile_listen(socket_fd, &opt->socket);
 	/*
 	if (fcntl(socket_fd, F_SETFD, O_NONBLOCK) == -1) {
 		sys_error_printf("fcntl failed");
@@ -373,13 +1455,93 @@ cleanup_fail:
 	return -1;
 }
 
-enum wait_request_status wait_request(const int listen_fd, const int signal[2], const int thread_err[2]) {
+int open_listeners(const struct server_options *opt, struct listeners *l) {
+	l->n = 0;
+	const size_t shards = opt->special.listener_shards == 0 ? 1 : opt->special.listener_shards;
+	for (size_t i = 0; i < shards; i++) {
+		const int fd = listen_socket(opt);
+		if (fd == -1) {
+			cleanup(l);
+			return -1;
+		}
+		l->fds[l->n++] = fd;
+	}
+	return 0;
+}
+
+// whether fd is bound to the address and port opt asks for
+static bool listener_matches(const int fd, const struct server_options *opt) {
+	struct sockaddr_storage want, bound;
+	socklen_t bound_len = sizeof(bound);
+	if (ip_sockaddr(&want, opt) == 0)
+		return false;
+	if (getsockname(fd, (struct sockaddr *) &bound, &bound_len) == -1) {
+		sys_error_printf("getsockname failed");
+		return false;
+	}
+	if (bound.ss_family != want.ss_family)
+		return false;
+	if (bound.ss_family == AF_INET) {
+		const struct sockaddr_in *a = (struct sockaddr_in *) &bound, *b = (struct sockaddr_in *) &want;
+		return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+	}
+	const struct sockaddr_in6 *a = (struct sockaddr_in6 *) &bound, *b = (struct sockaddr_in6 *) &want;
+	return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+}
+
+/* the sockets keep the old config's address and shard count, a restart can change both.
+ * another address or port gets fresh sockets (returns -1, the caller binds them),
+ * another shard count closes the surplus or adds SO_REUSEPORT shards next to the inherited ones
+ */
+int inherit_listeners(const struct server_options *opt, struct listeners *l) {
+	const ssize_t n = handoff_receive(HANDOFF_SOCKET_PATH, l->fds, LISTENER_SHARDS_MAX);
+	if (n == -1)
+		return -1;
+	l->n = (size_t) n;
+	lprintf(LOG, "inherited %zd listen sockets", n);
+	for (size_t i = 0; i < l->n; i++) {
+		if (!listener_matches(l->fds[i], opt)) {
+			lprintf(WARN, "inherited listen sockets aren't bound to %s:%hu", opt->addr, opt->port);
+			cleanup(l);
+			return -1;
+		}
+	}
+	const size_t shards = opt->special.listener_shards == 0 ? 1 : opt->special.listener_shards;
+	if (l->n == shards)
+		return 0;
+	lprintf(WARN, "inherited %zu listen sockets, listener-shards is %zu", l->n, shards);
+	while (l->n > shards) {
+		if (close(l->fds[--l->n]) == -1)
+			sys_error_printf("close failed");
+	}
+	while (l->n < shards) {
+		// fails when the inherited sockets were bound without SO_REUSEPORT, serving on fewer shards then
+		const int fd = listen_socket(opt);
+		if (fd == -1) {
+			lprintf(WARN, "serving on %zu inherited listen sockets", l->n);
+			break;
+		}
+		l->fds[l->n++] = fd;
+	}
+	return 0;
+}
+
+enum wait_request_status wait_request(const struct listeners *l, const int signal[2], const int thread_err[2],
+                                      const int handoff_fd, const bool accepting, int *ready_fd) {
 	fd_set fd_set;
 	FD_ZERO(&fd_set);
-	FD_SET(listen_fd, &fd_set);
+	int max_fd = MAX(signal[0], thread_err[0], handoff_fd);
+	if (handoff_fd != -1)
+		FD_SET(handoff_fd, &fd_set);
+	for (size_t i = 0; accepting && i < l->n; i++) {
+		FD_SET(l->fds[i], &fd_set);
+		max_fd = MAX(max_fd, l->fds[i]);
+	}
 	FD_SET(signal[0], &fd_set);
 	FD_SET(thread_err[0], &fd_set);
-	if (select(MAX(listen_fd, signal[0], thread_err[0]) + 1, &fd_set, NULL, NULL, NULL) == -1) {
+	struct timeval pause_poll = {.tv_sec = 0, .tv_usec = ADMISSION_PAUSE_POLL_MS * 1000};
+	const int nready = select(max_fd + 1, &fd_set, NULL, NULL, accepting ? NULL : &pause_poll);
+	if (nready == -1) {
 		if (errno == EINTR) {
 			lprintf(DEBUG, "signal interrupted during select");
 			return WAIT_SIGNAL_INTERRUPTED;
@@ -387,28 +1549,40 @@ enum wait_request_status wait_request(const int listen_fd, const int signal[2],
 		sys_error_printf("select failed");
 		return WAIT_FAILED;
 	}
+	if (nready == 0)
+		return WAIT_TIMEOUT;
 	if (FD_ISSET(signal[0], &fd_set)) {
 		return WAIT_SIGNAL_INTERRUPTED;
 	}
 	if (FD_ISSET(thread_err[0], &fd_set)) {
 		return WAIT_THREAD_ERROR;
 	}
+	if (handoff_fd != -1 && FD_ISSET(handoff_fd, &fd_set)) {
+		return WAIT_HANDOFF;
+	}
 	// listen fd ready
-	return WAIT_SUCCESS;
+	for (size_t i = 0; i < l->n; i++) {
+		if (FD_ISSET(l->fds[i], &fd_set)) {
+			*ready_fd = l->fds[i];
+			return WAIT_SUCCESS;
+		}
+	}
+	return WAIT_FAILED;
 }
 
 int connect_client(const int listen_fd, struct sockaddr_storage *client_addr, socklen_t *client_addr_len) {
+	// errno is left to the caller, most failures are about one client or a passing shortage
 	int client_fd = accept(listen_fd, (struct sockaddr *) client_addr, client_addr_len);
-	if (client_fd == -1) {
-		sys_error_printf("accept failed");
+	if (client_fd == -1)
 		return -1;
-	}
 	struct timeval t;
-	t.tv_sec = 10;
+	t.tv_sec = server_opt->timeouts.recv_sec;
 	t.tv_usec = 0;
-	if (setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == -1) {
+	// a coroutine's fd is non-blocking, conn_io times its waits out
+	if (pool != NULL && setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == -1) {
 		sys_error_printf("setsockopt failed");
 	}
+	socket_profile_accepted(client_fd, &server_opt->socket);
 	return client_fd;
 }
 
@@ -431,14 +1605,19 @@ char *sockaddr_get_ip_str(const struct sockaddr_storage *socka, char buf[], cons
 	return buf;
 }
 
-ssize_t get_response(const int conn_fd, char buf[], const size_t bufn) {
-	const ssize_t msglen = recv(conn_fd, buf, bufn, 0);
+ssize_t get_response(conn_io_t *io, char buf[], const size_t bufn) {
+	const ssize_t msglen = conn_io_recv(io, buf, bufn);
 	if (msglen == -1) {
 		if (errno == EAGAIN) {
 			// connection timeout
 			lprintf(LOG, "connection timeout");
 			return TIMEOUT;
 		}
+		// the client reset or went away, only its connection ends
+		if (errno == ECONNRESET || errno == EPIPE || errno == ENOTCONN || errno == ETIMEDOUT) {
+			lprintf(DEBUG, "recv failed: %s", strerror(errno));
+			return CLOSED;
+		}
 		sys_error_printf("recv failed");
 		return GOTO_ERR;
 	}
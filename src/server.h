@@ -1,14 +1,30 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include "affinity.h"
+#include "capture.h"
+#include "files.h"
+#include "proxy.h"
+#include "sockopt.h"
+#include "sse.h"
+#include "tls.h"
+
 #define REQUEST_MAX_SIZE_BYTES (1000000 * 1) // 1mb
 #define STR_EQ(a, b) (strcmp(a, b) == 0)
 #define LOGGING_ENABLED 1
 
+#define LISTENER_SHARDS_MAX 64
+#define BUFFER_SIZE_CLASSES_MAX 8
+
 enum ip_protocol {
 	IPV4, IPV6
 };
 
+enum io_model {
+	IO_MODEL_THREADS, // one pool thread per connection
+	IO_MODEL_COROUTINES // a coroutine per connection on a few event loop threads
+};
+
 struct server_options {
 	enum ip_protocol protocol;
 	char *addr;
@@ -16,7 +32,82 @@ struct server_options {
 
 	struct {
 		int backlog;
+		unsigned int listener_shards; // SO_REUSEPORT listen sockets on the same port
+		bool handoff; // take the listen sockets over from a running server
 	} special;
+
+	struct {
+		size_t pool_size; // with coroutines the connections served at once
+		size_t queue_size;
+		enum io_model io_model;
+		size_t loops; // coroutines: event loop threads, 0 is one per online cpu
+		size_t stack_size; // usable stack of a worker thread or coroutine, 0 is THREAD_POOL_STACK_DEFAULT or CORO_STACK_DEFAULT
+		bool pin; // each worker stays on one cpu, round robin over cpus
+		int cpus[AFFINITY_CPUS_MAX]; // empty is every cpu the process may use
+		size_t ncpus;
+	} workers;
+
+	struct {
+		size_t shed_queue_depth; // queued connections at which new ones get a 503, 0 is 3/4 of the queue
+		size_t pause_queue_depth; // queued connections at which accepting stops, 0 is a full queue
+		unsigned int retry_after_sec;
+	} admission;
+
+	struct {
+		unsigned int rate; // requests per second per client, 0 turns the limiter off
+		unsigned int burst; // 0 is the same as rate
+		size_t max_clients; // buckets kept, fixed memory of about 24 bytes each
+		unsigned int ipv4_prefix;
+		unsigned int ipv6_prefix;
+	} rate_limit;
+
+	struct {
+		bool enabled; // h2c by prior knowledge or Upgrade: h2c
+		unsigned int max_concurrent_streams;
+		unsigned int initial_window_size; // bytes a client may send per stream before we ack
+	} http2;
+
+	struct {
+		size_t loops; // threads: event loops websocket connections move to after the upgrade
+		size_t message_max; // in bytes, after joining fragments
+		size_t queue_max; // broadcast frames a connection may fall behind before it's closed
+		unsigned int ping_interval_sec;
+	} websocket;
+
+	struct {
+		unsigned int keep_alive_sec; // a comment on a quiet stream this often
+		enum sse_slow_policy slow_policy;
+	} sse;
+
+	struct tls_options tls; // every listener speaks tls when enabled
+
+	struct files_options files; // cache_entries and cache_bytes come from cache.file_entries and file-bytes
+
+	struct capture_options capture; // traffic for chinook_replay
+
+	struct {
+		struct proxy_route_options routes[PROXY_ROUTES_MAX];
+		size_t nroutes;
+	} proxy;
+
+	struct socket_profile socket; // listen sockets and accepted connections
+
+	struct {
+		size_t request_max; // largest request accepted, in bytes
+		size_t size_classes[BUFFER_SIZE_CLASSES_MAX]; // ascending
+		size_t nsize_classes;
+	} buffers;
+
+	struct {
+		unsigned int recv_sec;
+		unsigned int keep_alive_sec;
+		unsigned int drain_sec;
+	} timeouts;
+
+	struct {
+		size_t file_bytes;
+		size_t file_entries;
+	} cache;
 };
 
 int run_server(const struct server_options *opt);
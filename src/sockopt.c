@@ -0,0 +1,91 @@
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "sockopt.h"
+#include "log.h"
+
+static const struct {
+	const char *name;
+	struct socket_profile profile;
+} profiles[] = {
+	{"none", {0}},
+	// small responses out right away, spinning on the nic instead of sleeping in recv() where allowed
+	{
+		"latency", {
+			.nodelay = true, .fastopen_queue = 256, .busy_poll_us = 50, .notsent_lowat = 16 * 1024
+		}
+	},
+	// many requests per second: no wakeup for connections that didn't send anything yet, heads and bodies
+	// coalesced into full segments
+	{
+		"throughput", {
+			.nodelay = true, .defer_accept_sec = 1, .fastopen_queue = 256, .cork = true
+		}
+	},
+	// large bodies: buffers big enough to keep a fast link busy, no small segments at all
+	{
+		"bulk", {
+			.defer_accept_sec = 1, .cork = true, .send_buffer = 4 * 1024 * 1024, .receive_buffer = 1024 * 1024
+		}
+	},
+};
+
+int socket_profile_named(const char *name, struct socket_profile *out) {
+	for (size_t i = 0; i < sizeof(profiles) / sizeof(profiles[0]); i++) {
+		if (strcmp(profiles[i].name, name) == 0) {
+			*out = profiles[i].profile;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+static void set_int(const int fd, const int level, const int opt, const char *name, const unsigned int value) {
+	const int v = (int) value;
+	if (setsockopt(fd, level, opt, &v, sizeof(v)) == -1)
+		sys_error_printf("setsockopt %s failed", name);
+}
+
+void socket_profile_listen(const int fd, const struct socket_profile *p) {
+	// before listen() so the window scale offered in the handshake fits the buffer
+	if (p->send_buffer > 0)
+		set_int(fd, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", p->send_buffer);
+	if (p->receive_buffer > 0)
+		set_int(fd, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", p->receive_buffer);
+#ifdef TCP_DEFER_ACCEPT
+	if (p->defer_accept_sec > 0)
+		set_int(fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, "TCP_DEFER_ACCEPT", p->defer_accept_sec);
+#endif
+#ifdef TCP_FASTOPEN
+	if (p->fastopen_queue > 0)
+		set_int(fd, IPPROTO_TCP, TCP_FASTOPEN, "TCP_FASTOPEN", p->fastopen_queue);
+#endif
+#ifdef SO_BUSY_POLL
+	// above net.core.busy_read this needs CAP_NET_ADMIN
+	if (p->busy_poll_us > 0)
+		set_int(fd, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", p->busy_poll_us);
+#endif
+}
+
+void socket_profile_accepted(const int fd, const struct socket_profile *p) {
+	if (p->nodelay)
+		set_int(fd, IPPROTO_TCP, TCP_NODELAY, "TCP_NODELAY", 1);
+#ifdef TCP_NOTSENT_LOWAT
+	if (p->notsent_lowat > 0)
+		set_int(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", p->notsent_lowat);
+#endif
+}
+
+// uncorking sends whatever is left right away, even with TCP_NODELAY off
+void socket_cork(const int fd, const bool on) {
+#if defined(TCP_CORK)
+	set_int(fd, IPPROTO_TCP, TCP_CORK, "TCP_CORK", on);
+#elif defined(TCP_NOPUSH)
+	set_int(fd, IPPROTO_TCP, TCP_NOPUSH, "TCP_NOPUSH", on);
+#else
+	(void) fd;
+	(void) on;
+#endif
+}
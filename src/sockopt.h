@@ -0,0 +1,28 @@
+#ifndef SOCKOPT_H
+#define SOCKOPT_H
+
+#include <stdbool.h>
+
+// named sets of tcp options for the listen sockets and the connections accepted from them. what the kernel
+// copies from a listener to its accepted sockets (buffers, busy polling) is set once before listen(), the
+// rest on every accepted connection. options the platform lacks are skipped, ones it refuses are logged
+
+struct socket_profile {
+	bool nodelay; // TCP_NODELAY, small responses aren't held back waiting for an ack
+	unsigned int defer_accept_sec; // TCP_DEFER_ACCEPT, accept() only returns once the request arrived, 0 off
+	unsigned int fastopen_queue; // TCP_FASTOPEN pending handshakes, a returning client sends its request in the syn
+	bool cork; // TCP_CORK (TCP_NOPUSH) while a streamed head and body go out, so the head shares the first segment
+	unsigned int send_buffer; // SO_SNDBUF bytes, 0 leaves the kernel autotuning it
+	unsigned int receive_buffer; // SO_RCVBUF bytes, 0 leaves the kernel autotuning it
+	unsigned int busy_poll_us; // SO_BUSY_POLL, blocking reads spin on the nic queue this long, 0 off
+	unsigned int notsent_lowat; // TCP_NOTSENT_LOWAT bytes unsent before writes block, 0 is the kernel default
+};
+
+// "none" (the kernel's defaults), "latency", "throughput" or "bulk". -1 if there's no such profile
+int socket_profile_named(const char *name, struct socket_profile *out);
+// between socket() and listen()
+void socket_profile_listen(int fd, const struct socket_profile *p);
+void socket_profile_accepted(int fd, const struct socket_profile *p);
+void socket_cork(int fd, bool on);
+
+#endif //SOCKOPT_H
@@ -0,0 +1,398 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "sse.h"
+#include "stream.h"
+#include "serialize_http.h"
+#include "metrics.h"
+#include "log.h"
+
+#define SSE_BATCH_EVENTS 62 // per writev, with the chunk size line and the chunk end 64 iovecs
+#define SSE_ID_MAX 25 // "id: " and 20 digits and a line break
+#define SSE_DISCARD_BYTES 512
+
+// one formatted event, the ring and every stream writing it hold a reference
+struct event {
+	_Atomic size_t refs;
+	size_t size; // allocated
+	size_t off; // the id line is written in front of the rest once the id is known
+	size_t len;
+	char data[];
+};
+
+struct sse_stream;
+
+struct sse_channel {
+	pthread_mutex_t mutex; // the ring and next_id, held for a slot swap or taking references
+	struct event **ring; // the event with id k is in ring[k % cap]
+	size_t cap;
+	_Atomic uint64_t next_id; // written under mutex, starts at 1
+	_Atomic(coro_loops_t *) loops; // of the first stream, every stream runs on the same group
+	struct sse_stream *streams[CORO_LOOPS_MAX]; // list i is only touched on loop i
+	_Atomic size_t nstreams[CORO_LOOPS_MAX];
+	atomic_bool wake_pending[CORO_LOOPS_MAX]; // a wake is queued on loop i, later publishes ride along
+};
+
+struct sse_stream {
+	const struct sse_server *srv;
+	sse_channel_t *ch;
+	conn_io_t io;
+	struct stream_conn conn; // every stream on this loop, for a drain
+	struct sse_stream *prev; // the channel's streams on this loop
+	struct sse_stream *next;
+	uint64_t cursor; // the next event id to send
+	uint64_t keep_alive_ns; // when a comment is due
+	bool writing; // parked in a writev
+};
+
+// copied along with a handed over stream
+struct handover {
+	const struct sse_server *srv;
+	struct sse_subscription sub;
+};
+
+static struct stream_group streams = {.name = "sse"};
+
+static void event_unref(struct event *e) {
+	if (e != NULL && atomic_fetch_sub_explicit(&e->refs, 1, memory_order_acq_rel) == 1) {
+		metrics_memory_add(METRIC_MEMORY_SSE_EVENTS, -(int64_t) e->size);
+		free(e);
+	}
+}
+
+sse_channel_t *sse_channel_create(size_t events) {
+	if (events == 0)
+		events = SSE_RING_EVENTS_DEFAULT;
+	sse_channel_t *ch = calloc(1, sizeof(*ch));
+	struct event **ring = calloc(events, sizeof(*ring));
+	if (ch == NULL || ring == NULL) {
+		sys_error_printf("calloc failed");
+		free(ch);
+		free(ring);
+		return NULL;
+	}
+	pthread_mutex_init(&ch->mutex, NULL);
+	ch->ring = ring;
+	ch->cap = events;
+	atomic_init(&ch->next_id, 1);
+	return ch;
+}
+
+void sse_channel_destroy(sse_channel_t *ch) {
+	if (ch == NULL)
+		return;
+	for (size_t i = 0; i < ch->cap; i++)
+		event_unref(ch->ring[i]);
+	pthread_mutex_destroy(&ch->mutex);
+	free(ch->ring);
+	free(ch);
+}
+
+size_t sse_channel_streams(sse_channel_t *ch) {
+	size_t n = 0;
+	for (size_t i = 0; i < CORO_LOOPS_MAX; i++)
+		n += atomic_load_explicit(&ch->nstreams[i], memory_order_relaxed);
+	return n;
+}
+
+// oldest is the first id still in the ring
+static uint64_t oldest_id(const sse_channel_t *ch, const uint64_t next_id) {
+	return next_id > ch->cap ? next_id - ch->cap : 1;
+}
+
+// runs on loop i for any number of publishes since the last one, wakes that loop's streams of the channel
+static void wake_loop(void *arg) {
+	sse_channel_t *ch = *(sse_channel_t **) arg;
+	const size_t loop = co_loop_index();
+	atomic_store(&ch->wake_pending[loop], false);
+	const uint64_t next_id = atomic_load_explicit(&ch->next_id, memory_order_relaxed);
+	for (struct sse_stream *s = ch->streams[loop]; s != NULL; s = s->next) {
+		// a stream stuck in a write the ring overtook won't catch up, the write fails instead of timing out
+		if (s->writing && s->srv->slow_policy == SSE_SLOW_DISCONNECT && s->cursor < oldest_id(ch, next_id))
+			shutdown(s->io.fd, SHUT_RDWR);
+		s->conn.woken = true;
+		co_wake(s->conn.co);
+	}
+}
+
+// a line break is \r\n, \n or \r, returns the length of the one at s[i] or 0
+static size_t line_break(const char *s, const size_t i, const size_t n) {
+	if (s[i] == '\n')
+		return 1;
+	if (s[i] == '\r')
+		return i + 1 < n && s[i + 1] == '\n' ? 2 : 1;
+	return 0;
+}
+
+uint64_t sse_publish(sse_channel_t *ch, const char *event, const char *data, const size_t len) {
+	const size_t event_len = event != NULL ? strlen(event) : 0;
+	if (event != NULL && (strchr(event, '\n') != NULL || strchr(event, '\r') != NULL)) {
+		lprintf(ERROR, "event type with a line break");
+		return 0;
+	}
+	size_t lines = 1;
+	for (size_t i = 0; i < len; i++) {
+		const size_t n = line_break(data, i, len);
+		lines += n > 0;
+		i += n > 0 ? n - 1 : 0;
+	}
+	// "event: " type "\n", then "data: " line "\n" for every line and the blank line ending the event
+	const size_t body_max = (event != NULL ? 8 + event_len : 0) + lines * 7 + len + 1;
+	struct event *e = malloc(sizeof(*e) + SSE_ID_MAX + body_max);
+	if (e == NULL) {
+		sys_error_printf("malloc failed");
+		return 0;
+	}
+	atomic_init(&e->refs, 1);
+	e->size = sizeof(*e) + SSE_ID_MAX + body_max;
+	metrics_memory_add(METRIC_MEMORY_SSE_EVENTS, (int64_t) e->size);
+	char *o = e->data + SSE_ID_MAX;
+	if (event != NULL) {
+		memcpy(o, "event: ", 7);
+		memcpy(o + 7, event, event_len);
+		o[7 + event_len] = '\n';
+		o += 8 + event_len;
+	}
+	size_t line = 0;
+	for (size_t i = 0; i <= len; i++) {
+		const size_t n = i < len ? line_break(data, i, len) : 1;
+		if (n == 0)
+			continue;
+		memcpy(o, "data: ", 6);
+		if (i > line)
+			memcpy(o + 6, data + line, i - line);
+		o += 6 + (i - line);
+		*o++ = '\n';
+		i += n - 1;
+		line = i + 1;
+	}
+	*o++ = '\n';
+	const size_t body_len = (size_t) (o - (e->data + SSE_ID_MAX));
+	pthread_mutex_lock(&ch->mutex);
+	const uint64_t id = atomic_load_explicit(&ch->next_id, memory_order_relaxed);
+	char id_line[SSE_ID_MAX + 1];
+	const int id_len = snprintf(id_line, sizeof(id_line), "id: %llu\n", (unsigned long long) id);
+	e->off = SSE_ID_MAX - (size_t) id_len;
+	e->len = (size_t) id_len + body_len;
+	memcpy(e->data + e->off, id_line, (size_t) id_len);
+	struct event *old = ch->ring[id % ch->cap];
+	ch->ring[id % ch->cap] = e;
+	atomic_store_explicit(&ch->next_id, id + 1, memory_order_relaxed);
+	pthread_mutex_unlock(&ch->mutex);
+	event_unref(old);
+	metrics_add(METRIC_SSE_EVENTS_PUBLISHED, 1);
+	coro_loops_t *loops = atomic_load(&ch->loops);
+	if (loops == NULL)
+		return id;
+	for (size_t i = 0; i < CORO_LOOPS_MAX; i++) {
+		if (atomic_load_explicit(&ch->nstreams[i], memory_order_relaxed) == 0 ||
+		    atomic_exchange(&ch->wake_pending[i], true))
+			continue;
+		if (coro_submit_to(loops, i, wake_loop, &ch, sizeof(ch)) == -1) {
+			// the streams there catch up with the next publish or keep-alive
+			atomic_store(&ch->wake_pending[i], false);
+			lprintf(WARN, "sse loop %zu inbox full, its streams wake late", i);
+		}
+	}
+	return id;
+}
+
+int sse_accept(const struct HttpRequest *req, struct HttpResponse *res, sse_channel_t *ch) {
+	static char bad_request[] = "event streams need a GET over http/1.1";
+	// the body is chunked and has no end, http/2 has no connection to take over
+	if (req->conn == NULL || req->request_line.method != HTTP_METHOD_GET ||
+	    req->request_line.version != HTTP_VERSION_1_1) {
+		res->status_line.status_code = 400;
+		res->body.ptr = bad_request;
+		res->body.len = sizeof(bad_request) - 1;
+		return 0;
+	}
+	struct sse_subscription *sub = arena_alloc(req->arena, sizeof(*sub));
+	if (sub == NULL)
+		return -1;
+	sub->ch = ch;
+	sub->last_event_id = 0;
+	// a reconnecting client resumes after the last id it saw, anything but a plain number starts fresh
+	const struct str_view last = get_http_header("Last-Event-ID", &req->headers);
+	if (last.len > 0 && last.len < 20) {
+		uint64_t id = 0;
+		size_t i = 0;
+		for (; i < last.len && last.ptr[i] >= '0' && last.ptr[i] <= '9'; i++)
+			id = id * 10 + (uint64_t) (last.ptr[i] - '0');
+		if (i == last.len)
+			sub->last_event_id = id;
+	}
+	res->status_line.status_code = 200;
+	set_http_field("Content-Type", "text/event-stream", &res->headers);
+	set_http_field("Cache-Control", "no-cache", &res->headers);
+	set_http_field("Transfer-Encoding", "chunked", &res->headers);
+	// proxies that buffer responses would hold events back
+	set_http_field("X-Accel-Buffering", "no", &res->headers);
+	res->sse = sub;
+	return 0;
+}
+
+// everything between the cursor and the newest event, straight from the ring. -1 ends the stream
+static int flush(struct sse_stream *s) {
+	sse_channel_t *ch = s->ch;
+	while (1) {
+		struct event *batch[SSE_BATCH_EVENTS];
+		pthread_mutex_lock(&ch->mutex);
+		const uint64_t next_id = atomic_load_explicit(&ch->next_id, memory_order_relaxed);
+		const uint64_t oldest = oldest_id(ch, next_id);
+		if (s->cursor < oldest) {
+			if (s->srv->slow_policy == SSE_SLOW_DISCONNECT) {
+				pthread_mutex_unlock(&ch->mutex);
+				metrics_add(METRIC_SSE_SLOW_CLOSED, 1);
+				return -1;
+			}
+			metrics_add(METRIC_SSE_EVENTS_SKIPPED, oldest - s->cursor);
+			s->cursor = oldest;
+		}
+		const size_t n = next_id - s->cursor < SSE_BATCH_EVENTS ? (size_t) (next_id - s->cursor) : SSE_BATCH_EVENTS;
+		for (size_t i = 0; i < n; i++) {
+			batch[i] = ch->ring[(s->cursor + i) % ch->cap];
+			atomic_fetch_add_explicit(&batch[i]->refs, 1, memory_order_relaxed);
+		}
+		pthread_mutex_unlock(&ch->mutex);
+		if (n == 0)
+			return 0;
+		// the batch is one chunk: its size line, the events as they are in the ring and the chunk end
+		static char crlf[] = "\r\n";
+		struct iovec iov[SSE_BATCH_EVENTS + 2];
+		size_t len = 0;
+		for (size_t i = 0; i < n; i++) {
+			iov[i + 1] = (struct iovec) {.iov_base = batch[i]->data + batch[i]->off, .iov_len = batch[i]->len};
+			len += batch[i]->len;
+		}
+		char size_line[24];
+		iov[0] = (struct iovec) {
+			.iov_base = size_line, .iov_len = (size_t) snprintf(size_line, sizeof(size_line), "%zx\r\n", len)
+		};
+		iov[n + 1] = (struct iovec) {.iov_base = crlf, .iov_len = 2};
+		s->writing = true;
+		const ssize_t sent = conn_io_writev(&s->io, iov, (int) n + 2);
+		s->writing = false;
+		for (size_t i = 0; i < n; i++)
+			event_unref(batch[i]);
+		if (sent == -1)
+			return -1;
+		s->cursor += n;
+		s->keep_alive_ns = metrics_now_ns() + (uint64_t) s->srv->keep_alive_sec * 1000000000ull;
+		metrics_add(METRIC_SSE_EVENTS_SENT, n);
+		metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	}
+}
+
+static int send_static(struct sse_stream *s, char *data, const size_t len) {
+	struct iovec iov = {.iov_base = data, .iov_len = len};
+	const ssize_t sent = conn_io_writev(&s->io, &iov, 1);
+	if (sent == -1)
+		return -1;
+	metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	return 0;
+}
+
+// waits for an event, a drain or the keep-alive. -1 ends the stream
+static int wait_stream(struct sse_stream *s) {
+	static char comment[] = "3\r\n:\n\n\r\n";
+	const uint64_t now = metrics_now_ns();
+	const int timeout_ms = s->keep_alive_ns > now ? (int) ((s->keep_alive_ns - now) / 1000000) + 1 : 1;
+	if (co_wait(s->io.fd, POLLER_READ, timeout_ms) == -1) {
+		if (s->conn.woken)
+			return 0;
+		if (errno != ETIMEDOUT)
+			return -1;
+		if (metrics_now_ns() < s->keep_alive_ns)
+			return 0;
+		s->keep_alive_ns = metrics_now_ns() + (uint64_t) s->srv->keep_alive_sec * 1000000000ull;
+		return send_static(s, comment, sizeof(comment) - 1);
+	}
+	if (s->conn.woken)
+		return 0;
+	// a client has nothing to say on an event stream, readable is mostly it going away
+	char discard[SSE_DISCARD_BYTES];
+	return conn_io_recv(&s->io, discard, sizeof(discard)) > 0 ? 0 : -1;
+}
+
+static void run(struct sse_stream *s, const uint64_t last_event_id) {
+	static char last_chunk[] = "0\r\n\r\n";
+	sse_channel_t *ch = s->ch;
+	metrics_add(METRIC_SSE_OPENED, 1);
+	stream_join(&streams, &s->conn);
+	s->io.timeout_ms = (int) s->srv->send_timeout_sec * 1000;
+	s->keep_alive_ns = metrics_now_ns() + (uint64_t) s->srv->keep_alive_sec * 1000000000ull;
+	coro_loops_t *expected = NULL;
+	atomic_compare_exchange_strong(&ch->loops, &expected, s->srv->loops);
+	s->next = ch->streams[s->conn.loop];
+	if (s->next != NULL)
+		s->next->prev = s;
+	ch->streams[s->conn.loop] = s;
+	// counted before the cursor is read, so a publish either is behind the cursor or sees this stream to wake
+	atomic_fetch_add(&ch->nstreams[s->conn.loop], 1);
+	pthread_mutex_lock(&ch->mutex);
+	const uint64_t next_id = atomic_load_explicit(&ch->next_id, memory_order_relaxed);
+	s->cursor = next_id;
+	// a resumed stream starts with what's still in the ring, whatever the slow policy
+	if (last_event_id > 0 && last_event_id < next_id) {
+		const uint64_t oldest = oldest_id(ch, next_id);
+		s->cursor = last_event_id + 1 > oldest ? last_event_id + 1 : oldest;
+	}
+	pthread_mutex_unlock(&ch->mutex);
+	while (1) {
+		s->conn.woken = false;
+		if (flush(s) == -1)
+			break;
+		if (stream_draining(&streams, &s->conn)) {
+			send_static(s, last_chunk, sizeof(last_chunk) - 1);
+			break;
+		}
+		if (wait_stream(s) == -1)
+			break;
+	}
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		ch->streams[s->conn.loop] = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	stream_leave(&streams, &s->conn);
+	atomic_fetch_sub_explicit(&ch->nstreams[s->conn.loop], 1, memory_order_relaxed);
+	metrics_add(METRIC_SSE_CLOSED, 1);
+}
+
+static void run_handed_over(void *arg, conn_io_t *io) {
+	const struct handover *ho = arg;
+	if (io == NULL)
+		return;
+	struct sse_stream s = {.srv = ho->srv, .ch = ho->sub.ch, .io = *io};
+	run(&s, ho->sub.last_event_id);
+	*io = s.io;
+}
+
+int sse_start(const struct sse_server *srv, const conn_io_t *io, const struct sse_subscription *sub) {
+	if (co_running()) {
+		struct sse_stream s = {.srv = srv, .ch = sub->ch, .io = *io};
+		run(&s, sub->last_event_id);
+		return 0;
+	}
+	if (srv->loops == NULL) {
+		lprintf(ERROR, "no event loop for event streams");
+		return -1;
+	}
+	const struct handover ho = {.srv = srv, .sub = *sub};
+	if (stream_handover(&streams, srv->loops, io, srv->closed, run_handed_over, &ho, sizeof(ho)) == -1)
+		return -1;
+	return 1;
+}
+
+void sse_drain(const struct sse_server *srv) {
+	stream_drain(&streams, srv->loops);
+}
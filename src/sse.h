@@ -0,0 +1,61 @@
+#ifndef SSE_H
+#define SSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "coro.h"
+#include "parse_http.h"
+#include "tls.h"
+
+/* server-sent events (text/event-stream) over http/1.1. a channel keeps its latest events in a ring, each one
+ * formatted once when it's published and shared by reference. a route hands a request to a channel with
+ * sse_accept(), once the head is out the stream runs as a coroutine (inline with io-model coroutines, on the
+ * stream loops otherwise) and writes whatever it hasn't sent yet straight out of the ring, a chunk per writev
+ */
+
+#define SSE_RING_EVENTS_DEFAULT 1024
+
+enum sse_slow_policy {
+	SSE_SLOW_SKIP, // a stream the ring overtook continues with the oldest event still in it
+	SSE_SLOW_DISCONNECT // it's closed, the client reconnects with Last-Event-ID and gets what's left
+};
+
+typedef struct sse_channel sse_channel_t;
+
+// what sse_accept() found in the request, lives in the request arena
+struct sse_subscription {
+	sse_channel_t *ch;
+	uint64_t last_event_id; // from Last-Event-ID, 0 for only new events
+};
+
+struct sse_server {
+	coro_loops_t *loops; // where handed over streams run, NULL when there are none
+	unsigned int keep_alive_sec; // a comment after this long without an event, so proxies and dead peers notice
+	unsigned int send_timeout_sec;
+	enum sse_slow_policy slow_policy;
+	// hook into the caller's connection bookkeeping, gets the fd of a handed over stream once it's done
+	void (*closed)(int fd);
+};
+
+// events is the ring size, 0 is SSE_RING_EVENTS_DEFAULT. NULL if out of memory
+sse_channel_t *sse_channel_create(size_t events);
+// once no stream is on it anymore, after the loops stopped
+void sse_channel_destroy(sse_channel_t *ch);
+/* from any thread. event is the optional event type, data is split into data: lines at line breaks. returns
+ * the event's id, 0 if it couldn't be published
+ */
+uint64_t sse_publish(sse_channel_t *ch, const char *event, const char *data, size_t len);
+size_t sse_channel_streams(sse_channel_t *ch);
+
+// a 200 event stream head and res->sse for a GET over http/1.1, anything else a 400. returns 0 so a route
+// handler can return it
+int sse_accept(const struct HttpRequest *req, struct HttpResponse *res, sse_channel_t *ch);
+/* runs a stream whose head was just sent. in a coroutine it returns 0 once the stream is done and closing fd is
+ * up to the caller, otherwise io is handed to srv->loops and it returns 1. -1 if it couldn't start
+ */
+int sse_start(const struct sse_server *srv, const conn_io_t *io, const struct sse_subscription *sub);
+// every stream ends its body and closes, returns without waiting for them
+void sse_drain(const struct sse_server *srv);
+
+#endif //SSE_H
@@ -0,0 +1,88 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "stream.h"
+#include "log.h"
+
+struct handover {
+	void (*run)(void *arg, conn_io_t *io);
+	void (*closed)(int fd);
+	conn_io_t io;
+	alignas(max_align_t) char arg[STREAM_HANDOVER_ARG_MAX];
+};
+
+static_assert(sizeof(struct handover) <= CORO_ARG_MAX, "a handover must fit in a coroutine");
+
+void stream_join(struct stream_group *g, struct stream_conn *c) {
+	c->co = co_self();
+	c->loop = co_loop_index();
+	c->prev = NULL;
+	c->next = g->conns[c->loop];
+	if (c->next != NULL)
+		c->next->prev = c;
+	g->conns[c->loop] = c;
+}
+
+void stream_leave(struct stream_group *g, struct stream_conn *c) {
+	if (c->prev != NULL)
+		c->prev->next = c->next;
+	else
+		g->conns[c->loop] = c->next;
+	if (c->next != NULL)
+		c->next->prev = c->prev;
+}
+
+bool stream_draining(struct stream_group *g, const struct stream_conn *c) {
+	return c->draining || atomic_load(&g->draining);
+}
+
+static void drain_loop(void *arg) {
+	struct stream_group *g = *(struct stream_group **) arg;
+	for (struct stream_conn *c = g->conns[co_loop_index()]; c != NULL; c = c->next) {
+		c->draining = true;
+		c->woken = true;
+		co_wake(c->co);
+	}
+}
+
+void stream_drain(struct stream_group *g, coro_loops_t *loops) {
+	atomic_store(&g->draining, true);
+	if (loops == NULL)
+		return;
+	struct coro_stats st;
+	coro_loops_stats(loops, &st);
+	for (size_t i = 0; i < st.loops; i++) {
+		if (coro_submit_to(loops, i, drain_loop, &g, sizeof(g)) == -1)
+			lprintf(WARN, "%s loop %zu missed the drain", g->name, i);
+	}
+}
+
+// a handed over connection runs and closes here
+static void run_handed_over(void *arg) {
+	struct handover *ho = arg;
+	if (fcntl(ho->io.fd, F_SETFL, O_NONBLOCK) == -1) {
+		sys_error_printf("fcntl failed");
+		ho->run(ho->arg, NULL);
+	} else {
+		ho->run(ho->arg, &ho->io);
+	}
+	conn_io_shutdown(&ho->io);
+	shutdown(ho->io.fd, SHUT_WR);
+	ho->closed(ho->io.fd);
+}
+
+int stream_handover(struct stream_group *g, coro_loops_t *loops, const conn_io_t *io, void (*closed)(int fd),
+                    void (*run)(void *arg, conn_io_t *io), const void *arg, const size_t argn) {
+	if (argn > STREAM_HANDOVER_ARG_MAX) {
+		lprintf(ERROR, "%zu bytes of %s handover state", argn, g->name);
+		return -1;
+	}
+	struct handover ho = {.run = run, .closed = closed, .io = *io};
+	memcpy(ho.arg, arg, argn);
+	if (coro_submit(loops, run_handed_over, &ho, sizeof(ho)) == -1) {
+		lprintf(WARN, "%s loop inbox full, connection dropped", g->name);
+		return -1;
+	}
+	return 0;
+}
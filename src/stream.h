@@ -0,0 +1,47 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#include "coro.h"
+#include "tls.h"
+
+/* what websockets and event streams share: a connection that stays open parks as a coroutine on a loop and is on
+ * its group's list for that loop, so a drain can flag and wake every one of them from the loop it runs on.
+ * a connection from the thread pool is handed to the stream loops and closed there once it's done
+ */
+
+#define STREAM_HANDOVER_ARG_MAX 64 // bytes of the module's own state copied along with a handover
+
+// embedded in a connection, only touched on its own loop
+struct stream_conn {
+	struct coro *co;
+	size_t loop;
+	struct stream_conn *prev; // the group's connections on this loop
+	struct stream_conn *next;
+	bool woken; // by a publish, a broadcast or a drain, not the socket
+	bool draining;
+};
+
+struct stream_group {
+	const char *name; // for log lines
+	struct stream_conn *conns[CORO_LOOPS_MAX]; // list i is only touched on loop i
+	atomic_bool draining; // stops connections that start after a drain
+};
+
+// from the connection's coroutine, sets co and loop
+void stream_join(struct stream_group *g, struct stream_conn *c);
+void stream_leave(struct stream_group *g, struct stream_conn *c);
+// the drain reached c or it started after one
+bool stream_draining(struct stream_group *g, const struct stream_conn *c);
+// every connection of g gets draining and a wake on its own loop, returns without waiting for them
+void stream_drain(struct stream_group *g, coro_loops_t *loops);
+/* runs run(arg, io) as a coroutine on loops with io non-blocking, argn bytes of arg are copied. afterwards io is
+ * shut down and its fd goes to closed(). io is NULL when the socket couldn't be set up, run only frees what arg
+ * holds then. -1 if the inbox was full, nothing ran
+ */
+int stream_handover(struct stream_group *g, coro_loops_t *loops, const conn_io_t *io, void (*closed)(int fd),
+                    void (*run)(void *arg, conn_io_t *io), const void *arg, size_t argn);
+
+#endif //STREAM_H
@@ -1,41 +1,108 @@
+#include <limits.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <stdatomic.h>
+#include <string.h>
+#include <time.h>
 
 #include "thread_pool.h"
 
 #include <unistd.h>
 #include <sys/errno.h>
+#include <sys/mman.h>
 
 #include "log.h"
+#include "histogram.h"
+#include "affinity.h"
+
+#define THREAD_POOL_CACHE_LINE 128
+#define THREAD_POOL_WAIT_SUB_BITS 5
+#define THREAD_POOL_WAIT_MAX_US (60ull * 1000 * 1000)
+#define THREAD_POOL_IDLE_WAIT_NS 100000000 // 100ms, how often an idle worker checks for shutdown
 
 int thread_pool_destroy(thread_pool_t *tp);
 
 struct task {
 	void *(*start_routine)(void *);
 	void *args;
+	uint64_t enqueued_ns;
+	size_t inline_size; // 0 when args is a pointer
+	alignas(max_align_t) unsigned char inline_args[THREAD_POOL_TASK_ARGS_MAX];
 };
 
-struct thread_args {
-	thread_pool_t *tp;
+// written only by its worker, padded so workers don't share lines
+struct worker {
+	alignas(THREAD_POOL_CACHE_LINE) thread_pool_t *tp;
+	int cpu;
+	char *stack; // the mapping, guard page first, NULL until the worker is created
+	_Atomic uint64_t tasks;
+	_Atomic uint64_t busy_ns;
+	_Atomic uint64_t idle_ns;
+	struct histogram wait; // enqueue to dequeue, us
 };
 
 struct thread_pool_t {
-	bool volatile shutdown_requested;
-	bool volatile shutdown_graceful_requested;
+	atomic_bool shutdown_requested;
+	atomic_bool shutdown_graceful_requested;
 	atomic_uint open_connections;
 	size_t amount_threads;
 	size_t capacity;
+	size_t stack_map_size;
 	pthread_t *threads;
+	struct worker *workers;
 	size_t task_queue_size;
 	struct task *task_queue;
 	size_t write_index;
 	size_t read_index;
 	pthread_mutex_t queue_mutex;
 	pthread_cond_t queue_cond;
+	// written under queue_mutex, atomic so a snapshot doesn't need the lock
+	_Atomic size_t queue_depth;
+	_Atomic size_t queue_high_water;
+	_Atomic uint64_t rejected;
 };
 
+static uint64_t now_ns(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (uint64_t) t.tv_sec * 1000000000ull + (uint64_t) t.tv_nsec;
+}
+
+// single writer, so a relaxed load + store is enough
+static inline void add_relaxed(_Atomic uint64_t *c, const uint64_t n) {
+	atomic_store_explicit(c, atomic_load_explicit(c, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static int thread_pool_push(thread_pool_t *tp, void *(*worker_routine)(void *), void *args, const size_t inline_size);
+
+#ifdef __APPLE__
+typedef char mincore_vec_t;
+#else
+typedef unsigned char mincore_vec_t;
+#endif
+
+/* mapped here instead of left to pthread_create(), which reserves 8mb a thread by default and hides where.
+ * an overflow faults on the guard page below instead of running into the neighbouring mapping
+ */
+static char *stack_map(const size_t map_size) {
+	int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+#ifdef MAP_STACK
+	flags |= MAP_STACK;
+#endif
+	char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (map == MAP_FAILED) {
+		sys_error_printf("mmap failed");
+		return NULL;
+	}
+	if (mprotect(map, (size_t) sysconf(_SC_PAGESIZE), PROT_NONE) == -1) {
+		sys_error_printf("mprotect failed");
+		munmap(map, map_size);
+		return NULL;
+	}
+	return map;
+}
+
 // TODO: error checking and make this in another thread so it doesnt block the caller
 int thread_pool_add_task(thread_pool_t *tp, void *(*worker_routine)(void *), void *args) {
 	if (tp == NULL || worker_routine == NULL) {
@@ -45,6 +112,22 @@ int thread_pool_add_task(thread_pool_t *tp, void *(*worker_routine)(void *), voi
 	if (args == NULL) {
 		lprintf(WARN, "worker routine args is NULL");
 	}
+	return thread_pool_push(tp, worker_routine, args, 0);
+}
+
+int thread_pool_add_task_copy(thread_pool_t *tp, void *(*worker_routine)(void *), const void *args, const size_t size) {
+	if (tp == NULL || worker_routine == NULL || args == NULL) {
+		lprintf(ERROR, "null ptr arg");
+		return -1;
+	}
+	if (size == 0 || size > THREAD_POOL_TASK_ARGS_MAX) {
+		lprintf(ERROR, "task args size %zu out of range (1 - %d)", size, THREAD_POOL_TASK_ARGS_MAX);
+		return -1;
+	}
+	return thread_pool_push(tp, worker_routine, (void *) args, size);
+}
+
+static int thread_pool_push(thread_pool_t *tp, void *(*worker_routine)(void *), void *args, const size_t inline_size) {
 	{
 		const int lock_stat = pthread_mutex_lock(&tp->queue_mutex);
 		if (lock_stat != 0) {
@@ -54,12 +137,27 @@ int thread_pool_add_task(thread_pool_t *tp, void *(*worker_routine)(void *), voi
 		}
 	}
 	if (((tp->write_index + 1) % tp->task_queue_size) == tp->read_index) {
-		lprintf(ERROR, "thread pool task queue full");
+		const uint64_t rejected = atomic_load_explicit(&tp->rejected, memory_order_relaxed) + 1;
+		atomic_store_explicit(&tp->rejected, rejected, memory_order_relaxed);
+		pthread_mutex_unlock(&tp->queue_mutex);
+		lprintf(ERROR, "thread pool task queue full (%zu queued, %llu rejected so far)", tp->task_queue_size - 1,
+		        (unsigned long long) rejected);
 		return -1;
 	}
-	tp->task_queue[tp->write_index].start_routine = worker_routine;
-	tp->task_queue[tp->write_index].args = args;
+	struct task *t = &tp->task_queue[tp->write_index];
+	t->start_routine = worker_routine;
+	t->enqueued_ns = now_ns();
+	t->inline_size = inline_size;
+	if (inline_size == 0) {
+		t->args = args;
+	} else {
+		memcpy(t->inline_args, args, inline_size);
+	}
 	tp->write_index = (tp->write_index + 1) % tp->task_queue_size;
+	const size_t depth = atomic_load_explicit(&tp->queue_depth, memory_order_relaxed) + 1;
+	atomic_store_explicit(&tp->queue_depth, depth, memory_order_relaxed);
+	if (depth > atomic_load_explicit(&tp->queue_high_water, memory_order_relaxed))
+		atomic_store_explicit(&tp->queue_high_water, depth, memory_order_relaxed);
 	{
 		const int unlock_stat = pthread_mutex_unlock(&tp->queue_mutex);
 		if (unlock_stat != 0) {
@@ -83,8 +181,19 @@ int thread_pool_get_task(thread_pool_t *tp, struct task *buf) {
 	if (tp->read_index == tp->write_index) { // queue empty
 		return -1;
 	}
-	*buf = tp->task_queue[tp->read_index];
+	const struct task *t = &tp->task_queue[tp->read_index];
+	buf->start_routine = t->start_routine;
+	buf->enqueued_ns = t->enqueued_ns;
+	buf->inline_size = t->inline_size;
+	if (t->inline_size == 0) {
+		buf->args = t->args;
+	} else {
+		memcpy(buf->inline_args, t->inline_args, t->inline_size);
+		buf->args = buf->inline_args;
+	}
 	tp->read_index = (tp->read_index + 1) % tp->task_queue_size;
+	atomic_store_explicit(&tp->queue_depth, atomic_load_explicit(&tp->queue_depth, memory_order_relaxed) - 1,
+	                      memory_order_relaxed);
 	return 0;
 }
 
@@ -94,8 +203,10 @@ void *worker_routine(void *args) {
 		lprintf(ERROR, "null ptr");
 		return NULL;
 	}
-	thread_pool_t *targs = args;
-	while (!targs->shutdown_requested) {
+	struct worker *w = args;
+	thread_pool_t *targs = w->tp;
+	uint64_t idle_start = now_ns();
+	while (!atomic_load(&targs->shutdown_requested)) {
 		{
 			const int lock_stat = pthread_mutex_lock(&targs->queue_mutex);
 			if (lock_stat != 0) {
@@ -106,13 +217,18 @@ void *worker_routine(void *args) {
 		}
 		struct task t;
 		while (thread_pool_get_task(targs, &t) == -1) {
-			if (targs->shutdown_graceful_requested) {
+			if (atomic_load(&targs->shutdown_graceful_requested) || atomic_load(&targs->shutdown_requested)) {
 				pthread_mutex_unlock(&targs->queue_mutex);
-				return NULL;
+				goto exit;
 			}
+			// timedwait takes an absolute CLOCK_REALTIME time
 			struct timespec time;
-			time.tv_nsec = 100'000000; // 100ms
-			time.tv_sec = 10;
+			clock_gettime(CLOCK_REALTIME, &time);
+			time.tv_nsec += THREAD_POOL_IDLE_WAIT_NS;
+			if (time.tv_nsec >= 1000000000) {
+				time.tv_sec++;
+				time.tv_nsec -= 1000000000;
+			}
 			const int stat = pthread_cond_timedwait(&targs->queue_cond, &targs->queue_mutex, &time);
 			if (stat != 0) {
 				if (stat == ETIMEDOUT) {
@@ -124,10 +240,18 @@ void *worker_routine(void *args) {
 			}
 		}
 		pthread_mutex_unlock(&targs->queue_mutex);
+		const uint64_t start = now_ns();
+		histogram_record(&w->wait, (start - t.enqueued_ns) / 1000);
+		add_relaxed(&w->idle_ns, start - idle_start);
 		t.start_routine(t.args);
+		idle_start = now_ns();
+		add_relaxed(&w->busy_ns, idle_start - start);
+		add_relaxed(&w->tasks, 1);
 	next:
 		;
 	}
+exit:
+	add_relaxed(&w->idle_ns, now_ns() - idle_start);
 	return NULL;
 }
 
@@ -152,33 +276,76 @@ thread_pool_t *thread_pool_create(const struct thread_pool_attr *tp_attr) {
 		sys_error_printf("malloc failed");
 		return nullptr;
 	}
-	tp->amount_threads = tp_attr->pool_size; // number of threads created
+	tp->workers = aligned_alloc(THREAD_POOL_CACHE_LINE, sizeof(struct worker) * tp_attr->pool_size);
+	if (tp->workers == NULL) {
+		sys_error_printf("aligned_alloc failed");
+		return nullptr;
+	}
+	memset(tp->workers, 0, sizeof(struct worker) * tp_attr->pool_size);
+	for (size_t i = 0; i < tp_attr->pool_size; i++) {
+		tp->workers[i].tp = tp;
+		tp->workers[i].cpu = -1;
+		if (histogram_init(&tp->workers[i].wait, THREAD_POOL_WAIT_SUB_BITS, THREAD_POOL_WAIT_MAX_US) == -1)
+			return nullptr;
+	}
+	tp->amount_threads = 0; // number of threads created, counted up as they start
 	tp->capacity = tp_attr->pool_size; // number of threads space for
+	tp->task_queue_size = tp_attr->queue_size;
 	tp->write_index = 0;
 	tp->read_index = 0;
-	tp->shutdown_requested = false;
-	tp->shutdown_graceful_requested = false;
+	atomic_init(&tp->shutdown_requested, false);
+	atomic_init(&tp->shutdown_graceful_requested, false);
+	atomic_init(&tp->queue_depth, 0);
+	atomic_init(&tp->queue_high_water, 0);
+	atomic_init(&tp->rejected, 0);
 	pthread_mutexattr_t attr;
 	pthread_mutexattr_init(&attr);
 	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ERRORCHECK);
 	pthread_mutex_init(&tp->queue_mutex, &attr);
 	pthread_cond_init(&tp->queue_cond, nullptr);
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	size_t stack = tp_attr->stack_size ? tp_attr->stack_size : THREAD_POOL_STACK_DEFAULT;
+	if (stack < THREAD_POOL_STACK_MIN)
+		stack = THREAD_POOL_STACK_MIN;
+	if (stack < (size_t) PTHREAD_STACK_MIN)
+		stack = (size_t) PTHREAD_STACK_MIN;
+	tp->stack_map_size = page + (stack + page - 1) / page * page;
 	for (size_t i = 0; i < tp_attr->pool_size; i++) {
-		// TODO: cleanup
-		const int create_stat = pthread_create(&tp->threads[i], nullptr, worker_routine, tp);
+		tp->workers[i].stack = stack_map(tp->stack_map_size);
+		if (tp->workers[i].stack == NULL)
+			goto error_cleanup;
+		// pinned from the start, so the stack and everything the worker allocates is first touched on its node
+		pthread_attr_t thread_attr;
+		pthread_attr_init(&thread_attr);
+		pthread_attr_setstack(&thread_attr, tp->workers[i].stack + page, tp->stack_map_size - page);
+		if (tp_attr->ncpus > 0) {
+			const int cpu = tp_attr->cpus[i % tp_attr->ncpus];
+			if (affinity_attr_set(&thread_attr, cpu) == 0)
+				tp->workers[i].cpu = cpu;
+		}
+		const int create_stat = pthread_create(&tp->threads[i], &thread_attr, worker_routine, &tp->workers[i]);
+		pthread_attr_destroy(&thread_attr);
 		if (create_stat != 0) {
 			errno = create_stat;
 			sys_error_printf("pthread_create failed");
-			tp->shutdown_requested = true;
-			thread_pool_destroy(tp);
-			return nullptr;
+			goto error_cleanup;
 		}
+		tp->amount_threads = i + 1;
 	}
 	return tp;
+error_cleanup:
+	// the stacks are unmapped by destroy, so the workers that did start are joined first
+	thread_pool_shutdown_now(tp);
+	thread_pool_destroy(tp);
+	return nullptr;
 }
 
 int thread_pool_shutdown_graceful(thread_pool_t *tp) {
-	tp->shutdown_graceful_requested = true;
+	atomic_store(&tp->shutdown_graceful_requested, true);
+	// idle workers sleep on the cond, wake them instead of waiting out their timeout
+	pthread_mutex_lock(&tp->queue_mutex);
+	pthread_cond_broadcast(&tp->queue_cond);
+	pthread_mutex_unlock(&tp->queue_mutex);
 	for (size_t i = 0; i < tp->amount_threads; i++) {
 		pthread_join(tp->threads[i], nullptr);
 	}
@@ -186,43 +353,105 @@ int thread_pool_shutdown_graceful(thread_pool_t *tp) {
 }
 
 int thread_pool_shutdown_now(thread_pool_t *tp) {
-	tp->shutdown_requested = true;
+	atomic_store(&tp->shutdown_requested, true);
+	pthread_mutex_lock(&tp->queue_mutex);
+	pthread_cond_broadcast(&tp->queue_cond);
+	pthread_mutex_unlock(&tp->queue_mutex);
 	for (size_t i = 0; i < tp->amount_threads; i++) {
 		pthread_join(tp->threads[i], nullptr);
 	}
 	return 0;
 }
 
-int thread_pool_destroy(thread_pool_t *tp) {
-	free(tp->threads);
-	free(tp->task_queue);
-	free(tp);
-	return 0;
+size_t thread_pool_queue_depth(thread_pool_t *tp) {
+	return atomic_load_explicit(&tp->queue_depth, memory_order_relaxed);
 }
 
-void *thread_routine([[maybe_unused]] void *vargs) {
-	printf("test\n");
-	return NULL;
+size_t thread_pool_queue_capacity(thread_pool_t *tp) {
+	return tp->task_queue_size - 1;
 }
 
+int thread_pool_get_stats(thread_pool_t *tp, struct thread_pool_stats *stats) {
+	if (tp == NULL || stats == NULL) {
+		lprintf(ERROR, "null ptr arg");
+		return -1;
+	}
+	memset(stats, 0, sizeof(*stats));
+	struct histogram wait;
+	if (histogram_init(&wait, THREAD_POOL_WAIT_SUB_BITS, THREAD_POOL_WAIT_MAX_US) == -1)
+		return -1;
+	stats->workers = tp->amount_threads;
+	stats->queue_capacity = tp->task_queue_size - 1;
+	stats->queue_depth = atomic_load_explicit(&tp->queue_depth, memory_order_relaxed);
+	stats->queue_high_water = atomic_load_explicit(&tp->queue_high_water, memory_order_relaxed);
+	stats->rejected = atomic_load_explicit(&tp->rejected, memory_order_relaxed);
+	for (size_t i = 0; i < tp->amount_threads; i++) {
+		const struct worker *w = &tp->workers[i];
+		stats->tasks_executed += atomic_load_explicit(&w->tasks, memory_order_relaxed);
+		stats->busy_ns += atomic_load_explicit(&w->busy_ns, memory_order_relaxed);
+		stats->idle_ns += atomic_load_explicit(&w->idle_ns, memory_order_relaxed);
+		histogram_merge(&wait, &w->wait);
+	}
+	stats->wait_count = atomic_load_explicit(&wait.total, memory_order_relaxed);
+	stats->wait_sum_us = atomic_load_explicit(&wait.sum, memory_order_relaxed);
+	stats->wait_mean_us = histogram_mean(&wait);
+	stats->wait_p50_us = histogram_percentile(&wait, 50);
+	stats->wait_p99_us = histogram_percentile(&wait, 99);
+	stats->wait_max_us = histogram_percentile(&wait, 100);
+	histogram_free(&wait);
+	return 0;
+}
 
+int thread_pool_get_worker_stats(thread_pool_t *tp, const size_t worker, struct thread_pool_worker_stats *stats) {
+	if (tp == NULL || stats == NULL || worker >= tp->amount_threads) {
+		lprintf(ERROR, "bad worker stats arg");
+		return -1;
+	}
+	const struct worker *w = &tp->workers[worker];
+	stats->cpu = w->cpu;
+	stats->tasks_executed = atomic_load_explicit(&w->tasks, memory_order_relaxed);
+	stats->busy_ns = atomic_load_explicit(&w->busy_ns, memory_order_relaxed);
+	stats->idle_ns = atomic_load_explicit(&w->idle_ns, memory_order_relaxed);
+	return 0;
+}
 
-/*
-int main(void) {
-	struct thread_pool_attr attr = {.pool_size = 10, .queue_size = 10000};
-	thread_pool_t *tp = thread_pool_create(&attr);
-	if (tp == NULL) {
-		return 1;
+int thread_pool_stack_usage(thread_pool_t *tp, size_t *mapped, size_t *resident) {
+	if (tp == NULL || mapped == NULL || resident == NULL) {
+		lprintf(ERROR, "null ptr arg");
+		return -1;
 	}
-	for (int i = 0; i < 100; i++) {
-		if (thread_pool_add_task(tp, thread_routine, nullptr) == -1) {
-			thread_pool_destroy(tp);
-			return 1;
+	const size_t page = (size_t) sysconf(_SC_PAGESIZE);
+	const size_t pages = tp->stack_map_size / page;
+	mincore_vec_t *vec = malloc(pages);
+	if (vec == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	*mapped = 0;
+	*resident = 0;
+	for (size_t i = 0; i < tp->amount_threads; i++) {
+		if (mincore(tp->workers[i].stack, tp->stack_map_size, vec) == -1) {
+			sys_error_printf("mincore failed");
+			free(vec);
+			return -1;
 		}
+		*mapped += tp->stack_map_size;
+		for (size_t p = 0; p < pages; p++)
+			*resident += (vec[p] & 1) * page;
 	}
-	thread_pool_shutdown_graceful(tp);
-	thread_pool_destroy(tp);
-	printf("done\n");
+	free(vec);
+	return 0;
+}
+
+int thread_pool_destroy(thread_pool_t *tp) {
+	for (size_t i = 0; i < tp->capacity; i++) {
+		histogram_free(&tp->workers[i].wait);
+		if (tp->workers[i].stack != NULL)
+			munmap(tp->workers[i].stack, tp->stack_map_size);
+	}
+	free(tp->workers);
+	free(tp->threads);
+	free(tp->task_queue);
+	free(tp);
 	return 0;
 }
-*/
\ No newline at end of file
@@ -1,17 +1,66 @@
 #ifndef THREAD_POOL_H
 #define THREAD_POOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+#define THREAD_POOL_TASK_ARGS_MAX 160
+#define THREAD_POOL_STACK_DEFAULT (256 * 1024) // a blocking handler and a tls handshake with room to spare
+#define THREAD_POOL_STACK_MIN (64 * 1024) // smaller ones are raised, tls writes and proxy copies use 16kb of stack
+
 struct thread_pool_attr {
 	size_t pool_size;
 	size_t queue_size;
 	size_t resize_percent;
 	struct timeval size_down;
+	const int *cpus; // worker i is pinned to cpus[i % ncpus] before it starts, NULL pins nothing
+	size_t ncpus;
+	size_t stack_size; // usable bytes per worker, rounded up to pages, 0 is THREAD_POOL_STACK_DEFAULT
+};
+
+// counters are since the pool was created, busy time is added when a task finishes
+struct thread_pool_stats {
+	size_t workers;
+	size_t queue_capacity;
+	size_t queue_depth;
+	size_t queue_high_water;
+	uint64_t tasks_executed;
+	uint64_t rejected; // add_task calls that found the queue full
+	uint64_t busy_ns; // summed over workers
+	uint64_t idle_ns;
+	// enqueue to dequeue
+	uint64_t wait_count;
+	uint64_t wait_sum_us;
+	double wait_mean_us;
+	uint64_t wait_p50_us;
+	uint64_t wait_p99_us;
+	uint64_t wait_max_us;
+};
+
+struct thread_pool_worker_stats {
+	int cpu; // -1 if not pinned
+	uint64_t tasks_executed;
+	uint64_t busy_ns;
+	uint64_t idle_ns;
 };
 
 typedef struct thread_pool_t thread_pool_t;
 int thread_pool_destroy(thread_pool_t *tp);
 thread_pool_t *thread_pool_create(const struct thread_pool_attr *tp_attr);
 int thread_pool_add_task(thread_pool_t *tp, void *(*worker_routine)(void *), void *args);
+// copies args into the queue slot so the caller needs no allocation, the routine gets a pointer valid for the call
+int thread_pool_add_task_copy(thread_pool_t *tp, void *(*worker_routine)(void *), const void *args, size_t size);
+// connections waiting for a worker, one relaxed load so it can be checked per accept
+size_t thread_pool_queue_depth(thread_pool_t *tp);
+size_t thread_pool_queue_capacity(thread_pool_t *tp);
+// lock free reads, a snapshot taken while workers run can be a task behind
+int thread_pool_get_stats(thread_pool_t *tp, struct thread_pool_stats *stats);
+int thread_pool_get_worker_stats(thread_pool_t *tp, size_t worker, struct thread_pool_worker_stats *stats);
+/* bytes mapped for worker stacks (guard pages included) and how many of them are resident, which is roughly the
+ * deepest any worker went. a mincore() per worker, meant for a scrape rather than a hot path
+ */
+int thread_pool_stack_usage(thread_pool_t *tp, size_t *mapped, size_t *resident);
 int thread_pool_shutdown_now(thread_pool_t *tp);
 int thread_pool_shutdown_graceful(thread_pool_t *tp);
 
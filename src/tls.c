@@ -0,0 +1,440 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#ifdef CHINOOK_TLS
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#endif
+
+#include "coro.h"
+#include "log.h"
+#include "metrics.h"
+#include "tls.h"
+#include "capture.h"
+
+#define TLS_RECORD_MAX 16384
+
+// a coroutine parks where the socket buffer is full, a blocking fd only gets EAGAIN from its send timeout
+static int wait_writable(const conn_io_t *io) {
+	return (errno == EAGAIN || errno == EWOULDBLOCK) && co_running() &&
+	       co_wait(io->fd, POLLER_WRITE, io->timeout_ms) == 0
+		       ? 0
+		       : -1;
+}
+
+static ssize_t writev_all(const conn_io_t *io, struct iovec *iov, int iovcnt) {
+	const int fd = io->fd;
+	ssize_t total = 0;
+	while (iovcnt > 0 && iov->iov_len == 0) {
+		iov++;
+		iovcnt--;
+	}
+	while (iovcnt > 0) {
+		ssize_t sent = writev(fd, iov, iovcnt);
+		if (sent == -1) {
+			if (errno == EINTR || wait_writable(io) == 0)
+				continue;
+			sys_error_printf("writev failed");
+			return -1;
+		}
+		total += sent;
+		while (iovcnt > 0 && (size_t) sent >= iov->iov_len) {
+			sent -= (ssize_t) iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + sent;
+			iov->iov_len -= (size_t) sent;
+		}
+	}
+	return total;
+}
+
+// the page cache goes straight to the socket, with ktls the kernel encrypts on the way
+static ssize_t sendfile_all(const conn_io_t *io, const int file_fd, off_t offset, const size_t n) {
+	const int fd = io->fd;
+	size_t left = n;
+	while (left > 0) {
+#ifdef __linux__
+		const ssize_t sent = sendfile(fd, file_fd, &offset, left);
+		if (sent == -1) {
+			if (errno == EINTR || wait_writable(io) == 0)
+				continue;
+			sys_error_printf("sendfile failed");
+			return -1;
+		}
+#else
+		off_t len = (off_t) left;
+		// len is what went out, also when interrupted or stopped by a full socket buffer
+		if (sendfile(file_fd, fd, offset, &len, NULL, 0) == -1 && errno != EINTR && len == 0) {
+			if (wait_writable(io) == 0)
+				continue;
+			sys_error_printf("sendfile failed");
+			return -1;
+		}
+		const ssize_t sent = (ssize_t) len;
+		offset += len;
+#endif
+		if (sent == 0) {
+			lprintf(ERROR, "file ended %zu bytes early", left);
+			return -1;
+		}
+		left -= (size_t) sent;
+	}
+	return (ssize_t) n;
+}
+
+#ifdef CHINOOK_TLS
+
+struct tls_server {
+	SSL_CTX *ctx;
+};
+
+// the oldest queued openssl error, the queue is cleared
+static const char *tls_error_str(char *buf, const size_t bufn) {
+	const unsigned long e = ERR_get_error();
+	if (e == 0)
+		snprintf(buf, bufn, "%s", errno ? strerror(errno) : "connection closed");
+	else
+		ERR_error_string_n(e, buf, bufn);
+	ERR_clear_error();
+	return buf;
+}
+
+// h2 would have the connection reader and the stream tasks share one SSL, so only http/1.1 is offered
+static int select_alpn([[maybe_unused]] SSL *ssl, const unsigned char **out, unsigned char *outlen,
+                       const unsigned char *in, const unsigned int inlen, [[maybe_unused]] void *arg) {
+	static const unsigned char protos[] = "\x08http/1.1";
+	if (SSL_select_next_proto((unsigned char **) out, outlen, protos, sizeof(protos) - 1, in, inlen) !=
+	    OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+tls_server_t *tls_server_create(const struct tls_options *opt) {
+	char err[256];
+	if (opt->certificate == NULL || opt->private_key == NULL) {
+		lprintf(ERROR, "tls needs a certificate and a private key");
+		return NULL;
+	}
+	tls_server_t *t = malloc(sizeof(*t));
+	if (t == NULL) {
+		sys_error_printf("malloc failed");
+		return NULL;
+	}
+	t->ctx = SSL_CTX_new(TLS_server_method());
+	if (t->ctx == NULL) {
+		lprintf(ERROR, "SSL_CTX_new failed: %s", tls_error_str(err, sizeof(err)));
+		goto error_cleanup;
+	}
+	if (SSL_CTX_use_certificate_chain_file(t->ctx, opt->certificate) != 1) {
+		lprintf(ERROR, "can't load certificate %s: %s", opt->certificate, tls_error_str(err, sizeof(err)));
+		goto error_cleanup;
+	}
+	if (SSL_CTX_use_PrivateKey_file(t->ctx, opt->private_key, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(t->ctx) != 1) {
+		lprintf(ERROR, "can't load private key %s: %s", opt->private_key, tls_error_str(err, sizeof(err)));
+		goto error_cleanup;
+	}
+	SSL_CTX_set_min_proto_version(t->ctx, TLS1_2_VERSION);
+	uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_CIPHER_SERVER_PREFERENCE;
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	// most clients just close, that's a normal end of a keep-alive connection
+	options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+#ifdef SSL_OP_ENABLE_KTLS
+	if (opt->ktls)
+		options |= SSL_OP_ENABLE_KTLS;
+#else
+	if (opt->ktls)
+		lprintf(WARN, "openssl built without ktls, records are encrypted in userspace");
+#endif
+	if (!opt->tickets)
+		options |= SSL_OP_NO_TICKET;
+	SSL_CTX_set_options(t->ctx, options);
+	// a resumed handshake skips the certificate and the key exchange signature
+	if (opt->session_cache_size > 0) {
+		SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_SERVER);
+		SSL_CTX_sess_set_cache_size(t->ctx, (long) opt->session_cache_size);
+	} else {
+		SSL_CTX_set_session_cache_mode(t->ctx, SSL_SESS_CACHE_OFF);
+		// tls 1.3 without tickets would hand out ids for a cache that isn't there
+		if (!opt->tickets)
+			SSL_CTX_set_num_tickets(t->ctx, 0);
+	}
+	SSL_CTX_set_timeout(t->ctx, (long) opt->session_timeout_sec);
+	static const unsigned char sid_ctx[] = "chinook";
+	SSL_CTX_set_session_id_context(t->ctx, sid_ctx, sizeof(sid_ctx) - 1);
+	SSL_CTX_set_alpn_select_cb(t->ctx, select_alpn, NULL);
+	return t;
+error_cleanup:
+	SSL_CTX_free(t->ctx);
+	free(t);
+	return NULL;
+}
+
+void tls_server_destroy(tls_server_t *t) {
+	if (t == NULL)
+		return;
+	SSL_CTX_free(t->ctx);
+	free(t);
+}
+
+// in a coroutine WANT_READ and WANT_WRITE park until the socket is ready, on a blocking fd they're its timeout
+static int ssl_retry(const conn_io_t *io, SSL *ssl, const int ret) {
+	const int e = SSL_get_error(ssl, ret);
+	if ((e != SSL_ERROR_WANT_READ && e != SSL_ERROR_WANT_WRITE) || !co_running())
+		return -1;
+	ERR_clear_error();
+	return co_wait(io->fd, e == SSL_ERROR_WANT_READ ? POLLER_READ : POLLER_WRITE, io->timeout_ms);
+}
+
+int conn_io_accept(conn_io_t *io, tls_server_t *t) {
+	char err[256];
+	SSL *ssl = SSL_new(t->ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, io->fd) != 1) {
+		lprintf(ERROR, "SSL_new failed: %s", tls_error_str(err, sizeof(err)));
+		SSL_free(ssl);
+		return -1;
+	}
+	const uint64_t start_ns = metrics_now_ns();
+	ERR_clear_error();
+	errno = 0;
+	int ret;
+	while ((ret = SSL_accept(ssl)) != 1 && ssl_retry(io, ssl, ret) == 0) {
+	}
+	if (ret != 1) {
+		// scanners, plain http on the tls port and timeouts, not worth more than a debug line
+		lprintf(DEBUG, "tls handshake failed: %s", tls_error_str(err, sizeof(err)));
+		metrics_add(METRIC_TLS_HANDSHAKE_FAILURES, 1);
+		SSL_free(ssl);
+		return -1;
+	}
+	metrics_time(METRIC_TLS_HANDSHAKE, start_ns);
+	metrics_add(METRIC_TLS_HANDSHAKES, 1);
+	if (SSL_session_reused(ssl))
+		metrics_add(METRIC_TLS_RESUMED, 1);
+	io->ssl = ssl;
+	io->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+	if (io->ktls_send)
+		metrics_add(METRIC_TLS_KTLS, 1);
+	lprintf(DEBUG, "%s %s%s%s", SSL_get_version(ssl), SSL_get_cipher_name(ssl),
+	        SSL_session_reused(ssl) ? ", resumed" : "", io->ktls_send ? ", ktls" : "");
+	return 0;
+}
+
+// a broken connection gets no close_notify
+static void conn_io_fail(conn_io_t *io, const char *what) {
+	char err[256];
+	lprintf(DEBUG, "%s: %s", what, tls_error_str(err, sizeof(err)));
+	SSL_set_quiet_shutdown(io->ssl, 1);
+}
+
+static ssize_t io_recv(conn_io_t *io, void *buf, const size_t n) {
+	if (io->ssl == NULL)
+		return co_recv(io->fd, buf, n, io->timeout_ms);
+	size_t got;
+	ERR_clear_error();
+	errno = 0;
+	int ret;
+	while ((ret = SSL_read_ex(io->ssl, buf, n, &got)) != 1 && ssl_retry(io, io->ssl, ret) == 0) {
+	}
+	if (ret == 1)
+		return (ssize_t) got;
+	const int saved_errno = errno;
+	switch (SSL_get_error(io->ssl, 0)) {
+		case SSL_ERROR_ZERO_RETURN:
+			return 0;
+		case SSL_ERROR_WANT_READ:
+			// the receive timeout, or a coroutine's wait running out
+			errno = EAGAIN;
+			return -1;
+		case SSL_ERROR_SYSCALL:
+			if (saved_errno != 0) {
+				SSL_set_quiet_shutdown(io->ssl, 1);
+				errno = saved_errno;
+				return -1;
+			}
+			break;
+		default:
+			break;
+	}
+	// a protocol error from the peer ends the connection like a close
+	conn_io_fail(io, "SSL_read failed");
+	return 0;
+}
+
+static int ssl_write_all(conn_io_t *io, const void *buf, const size_t n) {
+	size_t written;
+	if (n == 0)
+		return 0;
+	ERR_clear_error();
+	// without SSL_MODE_ENABLE_PARTIAL_WRITE a blocking write only returns once everything is out, a non-blocking one
+	// is retried with the same buffer
+	int ret;
+	while ((ret = SSL_write_ex(io->ssl, buf, n, &written)) != 1 && ssl_retry(io, io->ssl, ret) == 0) {
+	}
+	if (ret == 1)
+		return 0;
+	conn_io_fail(io, "SSL_write failed");
+	return -1;
+}
+
+static ssize_t io_writev(conn_io_t *io, struct iovec *iov, const int iovcnt) {
+	if (io->ssl == NULL || io->ktls_send)
+		return writev_all(io, iov, iovcnt);
+	// small pieces are joined so a response head and a short body share one record
+	char chunk[TLS_RECORD_MAX];
+	size_t used = 0;
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; i++) {
+		const size_t len = iov[i].iov_len;
+		if (used + len <= sizeof(chunk)) {
+			memcpy(chunk + used, iov[i].iov_base, len);
+			used += len;
+			continue;
+		}
+		if (ssl_write_all(io, chunk, used) == -1)
+			return -1;
+		total += (ssize_t) used;
+		used = 0;
+		if (len < sizeof(chunk)) {
+			memcpy(chunk, iov[i].iov_base, len);
+			used = len;
+			continue;
+		}
+		if (ssl_write_all(io, iov[i].iov_base, len) == -1)
+			return -1;
+		total += (ssize_t) len;
+	}
+	if (ssl_write_all(io, chunk, used) == -1)
+		return -1;
+	return total + (ssize_t) used;
+}
+
+static ssize_t io_sendfile(conn_io_t *io, const int file_fd, off_t offset, const size_t n) {
+	if (io->ssl == NULL || io->ktls_send)
+		return sendfile_all(io, file_fd, offset, n);
+	// userspace encryption needs the bytes, one record at a time
+	char chunk[TLS_RECORD_MAX];
+	size_t left = n;
+	while (left > 0) {
+		const ssize_t got = pread(file_fd, chunk, left < sizeof(chunk) ? left : sizeof(chunk), offset);
+		if (got == -1) {
+			if (errno == EINTR)
+				continue;
+			sys_error_printf("pread failed");
+			return -1;
+		}
+		if (got == 0) {
+			lprintf(ERROR, "file ended %zu bytes early", left);
+			return -1;
+		}
+		if (ssl_write_all(io, chunk, (size_t) got) == -1)
+			return -1;
+		offset += got;
+		left -= (size_t) got;
+	}
+	return (ssize_t) n;
+}
+
+size_t conn_io_pending(const conn_io_t *io) {
+	return io->ssl != NULL ? (size_t) SSL_pending(io->ssl) : 0;
+}
+
+static void io_shutdown(conn_io_t *io) {
+	if (io->ssl == NULL)
+		return;
+	// one way, the peer's close_notify isn't waited for
+	SSL_shutdown(io->ssl);
+	SSL_free(io->ssl);
+	io->ssl = NULL;
+	io->ktls_send = false;
+}
+
+#else
+
+tls_server_t *tls_server_create([[maybe_unused]] const struct tls_options *opt) {
+	lprintf(ERROR, "tls is enabled but chinook was built without openssl");
+	return NULL;
+}
+
+void tls_server_destroy([[maybe_unused]] tls_server_t *t) {
+}
+
+int conn_io_accept([[maybe_unused]] conn_io_t *io, [[maybe_unused]] tls_server_t *t) {
+	return -1;
+}
+
+static ssize_t io_recv(conn_io_t *io, void *buf, const size_t n) {
+	return co_recv(io->fd, buf, n, io->timeout_ms);
+}
+
+static ssize_t io_writev(conn_io_t *io, struct iovec *iov, const int iovcnt) {
+	return writev_all(io, iov, iovcnt);
+}
+
+static ssize_t io_sendfile(conn_io_t *io, const int file_fd, const off_t offset, const size_t n) {
+	return sendfile_all(io, file_fd, offset, n);
+}
+
+size_t conn_io_pending([[maybe_unused]] const conn_io_t *io) {
+	return 0;
+}
+
+static void io_shutdown([[maybe_unused]] conn_io_t *io) {
+}
+
+#endif
+
+void conn_io_init(conn_io_t *io, const int fd) {
+	io->fd = fd;
+	io->ssl = NULL;
+	io->ktls_send = false;
+	io->timeout_ms = 0;
+	io->capture_id = 0;
+	io->capture_unanswered = false;
+}
+
+// the plaintext either way, what a replay over a plain connection has to send
+ssize_t conn_io_recv(conn_io_t *io, void *buf, const size_t n) {
+	const ssize_t got = io_recv(io, buf, n);
+	if (io->capture_id != 0 && got > 0) {
+		capture_data(io->capture_id, buf, (size_t) got);
+		io->capture_unanswered = true;
+	}
+	return got;
+}
+
+static void capture_answer(conn_io_t *io) {
+	if (io->capture_unanswered) {
+		capture_response(io->capture_id);
+		io->capture_unanswered = false;
+	}
+}
+
+ssize_t conn_io_writev(conn_io_t *io, struct iovec *iov, const int iovcnt) {
+	capture_answer(io);
+	return io_writev(io, iov, iovcnt);
+}
+
+ssize_t conn_io_sendfile(conn_io_t *io, const int file_fd, const off_t offset, const size_t n) {
+	capture_answer(io);
+	return io_sendfile(io, file_fd, offset, n);
+}
+
+void conn_io_shutdown(conn_io_t *io) {
+	if (io->capture_id != 0) {
+		capture_close(io->capture_id);
+		io->capture_id = 0;
+	}
+	io_shutdown(io);
+}
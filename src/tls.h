@@ -0,0 +1,53 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// tls termination with openssl, built when CHINOOK_TLS is defined. connections go through conn_io either
+// way, a plain one is just the fd
+
+struct tls_options {
+	bool enabled;
+	const char *certificate; // pem chain, leaf first
+	const char *private_key; // pem
+	size_t session_cache_size; // server side session ids, 0 turns the cache off
+	unsigned int session_timeout_sec; // lifetime of cached sessions and tickets
+	bool tickets; // stateless resumption, the ticket keys live and die with the process
+	bool ktls; // record encryption moves to the kernel after the handshake where it's supported
+};
+
+typedef struct tls_server tls_server_t;
+
+struct ssl_st;
+
+typedef struct conn_io {
+	int fd;
+	struct ssl_st *ssl; // NULL on a plain connection
+	bool ktls_send; // the kernel encrypts what's written to fd, writev and sendfile skip openssl
+	int timeout_ms; // each wait of a coroutine on the non-blocking fd, SO_RCVTIMEO only bounds blocking ones
+	uint32_t capture_id; // 0 unless the connection is captured, see capture.h
+	bool capture_unanswered; // data was captured and nothing written since
+} conn_io_t;
+
+// checks the certificate and key, NULL on failure
+tls_server_t *tls_server_create(const struct tls_options *opt);
+void tls_server_destroy(tls_server_t *t);
+
+void conn_io_init(conn_io_t *io, int fd);
+// server handshake, bounded by the receive timeout (timeout_ms in a coroutine). -1 leaves io plain
+int conn_io_accept(conn_io_t *io, tls_server_t *t);
+// recv() semantics, 0 is a close and -1 with errno EAGAIN a receive timeout
+ssize_t conn_io_recv(conn_io_t *io, void *buf, size_t n);
+// writes all of iov, returns the bytes sent or -1. iov is consumed
+ssize_t conn_io_writev(conn_io_t *io, struct iovec *iov, int iovcnt);
+// n bytes of file_fd from offset, zero copy on a plain or ktls connection. returns the bytes sent or -1
+ssize_t conn_io_sendfile(conn_io_t *io, int file_fd, off_t offset, size_t n);
+// decrypted bytes openssl holds back, readable without waiting for fd. always 0 on a plain connection
+size_t conn_io_pending(const conn_io_t *io);
+// close_notify and frees the tls state, fd stays open. ends the capture of a captured connection
+void conn_io_shutdown(conn_io_t *io);
+
+#endif //TLS_H
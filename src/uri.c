@@ -0,0 +1,207 @@
+#define _GNU_SOURCE // memmem
+#include <string.h>
+
+#include "uri.h"
+#include "log.h"
+
+static int hex_value(const char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+// %XX into out, %2F is left encoded so it stays part of its segment. -1 for a malformed escape or %00
+static ssize_t decode_path(const char *s, const size_t n, char *out) {
+	size_t o = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] != '%') {
+			out[o++] = s[i];
+			continue;
+		}
+		const int hi = i + 2 < n ? hex_value(s[i + 1]) : -1;
+		const int lo = hi != -1 ? hex_value(s[i + 2]) : -1;
+		if (lo == -1 || (hi == 0 && lo == 0))
+			return -1;
+		const int c = hi << 4 | lo;
+		if (c == '/') {
+			memcpy(out + o, s + i, 3);
+			o += 3;
+		} else {
+			out[o++] = (char) c;
+		}
+		i += 2;
+	}
+	return (ssize_t) o;
+}
+
+// RFC 3986 5.2.4 in place, and empty segments are dropped too. a path ending in a slash, "." or ".." keeps
+// a trailing slash, nothing climbs above the root
+static size_t remove_dot_segments(char *s, const size_t n) {
+	size_t o = 0;
+	size_t i = 0;
+	bool trailing = false;
+	while (i < n) {
+		while (i < n && s[i] == '/')
+			i++;
+		const size_t seg = i;
+		while (i < n && s[i] != '/')
+			i++;
+		const size_t seg_len = i - seg;
+		trailing = i < n || seg_len == 0;
+		if (seg_len == 0)
+			break;
+		if (seg_len == 1 && s[seg] == '.') {
+			trailing = true;
+			continue;
+		}
+		if (seg_len == 2 && s[seg] == '.' && s[seg + 1] == '.') {
+			while (o > 0 && s[o - 1] != '/')
+				o--;
+			if (o > 0)
+				o--;
+			trailing = true;
+			continue;
+		}
+		s[o++] = '/';
+		memmove(s + o, s + seg, seg_len);
+		o += seg_len;
+	}
+	if (o == 0 || trailing)
+		s[o++] = '/';
+	return o;
+}
+
+int uri_split(const struct str_view target, arena_t *arena, struct str_view *path, struct str_view *query) {
+	*query = (struct str_view) {NULL, 0};
+	if (target.len == 1 && target.ptr[0] == '*') {
+		*path = target;
+		return 0;
+	}
+	const char *p = target.ptr;
+	const char *end = target.ptr + target.len;
+	// a fragment isn't supposed to be sent, it's never part of the resource
+	const char *hash = memchr(p, '#', target.len);
+	if (hash != NULL)
+		end = hash;
+	if (p == end)
+		return -1;
+	if (*p != '/') {
+		// absolute-form, what's between the scheme and the path is the Host
+		const char *scheme_end = memmem(p, (size_t) (end - p), "://", 3);
+		if (scheme_end == NULL || scheme_end == p)
+			return -1;
+		p = scheme_end + 3;
+		while (p < end && *p != '/' && *p != '?')
+			p++;
+	}
+	const char *question = memchr(p, '?', (size_t) (end - p));
+	const char *path_end = question != NULL ? question : end;
+	if (question != NULL)
+		*query = (struct str_view) {question + 1, (size_t) (end - question - 1)};
+	const size_t n = (size_t) (path_end - p);
+	if (n == 0) {
+		*path = (struct str_view) {"/", 1};
+		return 0;
+	}
+	// memchr and memmem are vectorised in libc, most paths pass all three and are used as they are
+	if (memchr(p, '%', n) == NULL && memmem(p, n, "/.", 2) == NULL && memmem(p, n, "//", 2) == NULL) {
+		*path = (struct str_view) {p, n};
+		return 0;
+	}
+	// decoding only shrinks, removing dot segments adds at most the trailing slash a removed segment took
+	char *out = arena_alloc(arena, n + 1);
+	if (out == NULL)
+		return -1;
+	const ssize_t decoded = decode_path(p, n, out);
+	if (decoded == -1) {
+		lprintf(DEBUG, "bad escape in %.*s", (int) n, p);
+		return -1;
+	}
+	*path = (struct str_view) {out, remove_dot_segments(out, (size_t) decoded)};
+	return 0;
+}
+
+size_t uri_decode_query(const char *s, const size_t n, char *out) {
+	size_t o = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (s[i] == '+') {
+			out[o++] = ' ';
+			continue;
+		}
+		const int hi = s[i] == '%' && i + 2 < n ? hex_value(s[i + 1]) : -1;
+		const int lo = hi != -1 ? hex_value(s[i + 2]) : -1;
+		if (lo == -1) {
+			out[o++] = s[i];
+			continue;
+		}
+		out[o++] = (char) (hi << 4 | lo);
+		i += 2;
+	}
+	return o;
+}
+
+static bool needs_decoding(const struct str_view v) {
+	return memchr(v.ptr, '%', v.len) != NULL || memchr(v.ptr, '+', v.len) != NULL;
+}
+
+static struct str_view decode(const struct str_view v, arena_t *arena) {
+	if (!needs_decoding(v))
+		return v;
+	char *out = arena_alloc(arena, v.len + 1);
+	if (out == NULL)
+		return (struct str_view) {NULL, 0};
+	return (struct str_view) {out, uri_decode_query(v.ptr, v.len, out)};
+}
+
+// one entry per non-empty "name=value" between the &s. names are decoded here, values when they're asked for
+static int query_index_build(struct query_index *q, arena_t *arena) {
+	const char *end = q->raw.ptr + q->raw.len;
+	size_t n = 1;
+	for (const char *amp = q->raw.ptr; (amp = memchr(amp, '&', (size_t) (end - amp))) != NULL; amp++)
+		n++;
+	q->params = arena_alloc(arena, n * sizeof(struct query_param));
+	if (q->params == NULL)
+		return -1;
+	for (const char *p = q->raw.ptr;; p++) {
+		const char *amp = memchr(p, '&', (size_t) (end - p));
+		const char *piece_end = amp != NULL ? amp : end;
+		if (piece_end > p) {
+			const char *eq = memchr(p, '=', (size_t) (piece_end - p));
+			const struct str_view name = {p, (size_t) ((eq != NULL ? eq : piece_end) - p)};
+			struct query_param *param = &q->params[q->n++];
+			param->name = decode(name, arena);
+			param->value = eq != NULL ? (struct str_view) {eq + 1, (size_t) (piece_end - eq - 1)}
+				               : (struct str_view) {piece_end, 0};
+			param->decoded = false;
+			if (param->name.ptr == NULL)
+				return -1;
+		}
+		if (amp == NULL)
+			return 0;
+		p = amp;
+	}
+}
+
+struct str_view query_param(const struct HttpRequest *req, const char *name) {
+	struct query_index *q = req->query;
+	if (q == NULL || (q->params == NULL && query_index_build(q, req->arena) == -1))
+		return (struct str_view) {NULL, 0};
+	for (size_t i = 0; i < q->n; i++) {
+		struct query_param *param = &q->params[i];
+		if (!str_view_eq(param->name, name))
+			continue;
+		if (!param->decoded) {
+			const struct str_view v = decode(param->value, req->arena);
+			if (v.ptr == NULL)
+				return v;
+			param->value = v;
+			param->decoded = true;
+		}
+		return param->value;
+	}
+	return (struct str_view) {NULL, 0};
+}
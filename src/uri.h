@@ -0,0 +1,37 @@
+#ifndef URI_H
+#define URI_H
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "parse_http.h"
+
+/* the request target split once by the parser. the path is percent-decoded (except %2F, which would turn into
+ * a separator) with empty, "." and ".." segments removed, so routes, cache keys and file lookups see one spelling
+ * of it and can't climb above the root. a clean path (the usual case) stays a view into the request, only one
+ * that changed is copied into the arena. query parameters are indexed on the first lookup and a value is
+ * decoded the first time it's asked for
+ */
+
+struct query_param {
+	struct str_view name;
+	struct str_view value; // raw until decoded
+	bool decoded;
+};
+
+struct query_index {
+	struct str_view raw; // after the ?, without a fragment
+	struct query_param *params; // NULL until the first lookup
+	size_t n;
+};
+
+/* origin-form ("/a/b?c"), absolute-form ("http://host/a/b?c") or "*". -1 for anything else, a malformed escape
+ * or an encoded NUL in the path
+ */
+int uri_split(struct str_view target, arena_t *arena, struct str_view *path, struct str_view *query);
+// percent-decoding (and + as space) of n bytes of s into out, which has room for n. malformed escapes are kept
+size_t uri_decode_query(const char *s, size_t n, char *out);
+// the first value of name, "a" and "a=" both give an empty one. {NULL, 0} if it isn't there or there's no query
+struct str_view query_param(const struct HttpRequest *req, const char *name);
+
+#endif //URI_H
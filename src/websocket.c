@@ -0,0 +1,610 @@
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "websocket.h"
+#include "stream.h"
+#include "serialize_http.h"
+#include "metrics.h"
+#include "log.h"
+
+#define WEBSOCKET_IOV_MAX 64 // queued broadcasts written per writev
+#define WEBSOCKET_MESSAGE_KEEP (1024 * 64) // a larger message buffer is freed once its message was handled
+
+// a broadcast frame, head and payload, shared by every connection it's queued on
+struct frame {
+	_Atomic size_t refs;
+	size_t len;
+	uint8_t data[];
+};
+
+struct subscription {
+	websocket_channel_t *ch; // NULL for a free slot
+	websocket_t *ws;
+	struct subscription *prev;
+	struct subscription *next;
+};
+
+struct websocket_channel {
+	_Atomic(coro_loops_t *) loops; // of the first subscriber, every connection runs on the same group
+	struct subscription *subs[CORO_LOOPS_MAX]; // list i is only touched on loop i
+	_Atomic size_t nsubs[CORO_LOOPS_MAX]; // read by broadcasts to skip loops without subscribers
+};
+
+struct websocket {
+	const struct websocket_server *srv;
+	const struct websocket_handler *h;
+	conn_io_t io;
+	struct stream_conn conn; // the loop's connections, for a drain
+	struct frame **queue; // ring of queue_max
+	size_t queue_head;
+	size_t queue_len;
+	bool slow; // a broadcast found the queue full
+	bool writing; // parked in a flush of the queue
+	bool close_sent;
+	bool done;
+	bool awaiting_pong;
+	unsigned int close_code;
+	uint64_t ping_at_ns;
+	struct subscription subs[WEBSOCKET_SUBSCRIPTIONS_MAX];
+	// the message being joined, msg_op is 0 between messages
+	enum websocket_opcode msg_op;
+	char *msg;
+	size_t msg_len;
+	size_t msg_cap;
+	// the data frame whose payload is coming in
+	uint64_t payload_left;
+	uint64_t payload_off;
+	uint8_t mask[4];
+	bool fin;
+	size_t rstart; // unprocessed bytes are rbuf[rstart, rend)
+	size_t rend;
+	uint8_t rbuf[WEBSOCKET_RECV_BYTES];
+};
+
+// copied along with a handed over connection, initial is malloc()ed
+struct handover {
+	const struct websocket_server *srv;
+	const struct websocket_handler *h;
+	char *initial;
+	size_t initial_len;
+};
+
+struct delivery {
+	websocket_channel_t *ch;
+	struct frame *f;
+};
+
+static struct stream_group conns = {.name = "websocket"};
+
+// a comma separated header value that has token, case-insensitively
+static bool has_token(const struct str_view v, const char *token) {
+	const size_t n = strlen(token);
+	const char *p = v.ptr;
+	const char *end = v.ptr + v.len;
+	while (p < end) {
+		while (p < end && (*p == ' ' || *p == '\t' || *p == ','))
+			p++;
+		const char *e = p;
+		while (e < end && *e != ',')
+			e++;
+		const char *t = e;
+		while (t > p && (t[-1] == ' ' || t[-1] == '\t'))
+			t--;
+		if ((size_t) (t - p) == n && strncasecmp(p, token, n) == 0)
+			return true;
+		p = e;
+	}
+	return false;
+}
+
+int websocket_accept(const struct HttpRequest *req, struct HttpResponse *res, const struct websocket_handler *h) {
+	static char bad_request[] = "websocket upgrade expected";
+	const headers_t *headers = &req->headers;
+	const struct str_view key = get_http_header("Sec-WebSocket-Key", headers);
+	// the key is 16 random bytes in base64, on http/2 there's no connection to take over
+	if (req->conn == NULL || req->request_line.method != HTTP_METHOD_GET ||
+	    req->request_line.version != HTTP_VERSION_1_1 || !has_token(get_http_header("Upgrade", headers), "websocket") ||
+	    !has_token(get_http_header("Connection", headers), "upgrade") || key.len != 24) {
+		res->status_line.status_code = 400;
+		res->body.ptr = bad_request;
+		res->body.len = sizeof(bad_request) - 1;
+		return 0;
+	}
+	if (!HEADER_EQ("Sec-WebSocket-Version", headers, "13")) {
+		res->status_line.status_code = 426;
+		set_http_field("Sec-WebSocket-Version", "13", &res->headers);
+		return 0;
+	}
+	char *accept = arena_alloc(req->arena, WEBSOCKET_ACCEPT_LEN + 1);
+	if (accept == NULL)
+		return -1;
+	websocket_accept_key(key, accept);
+	res->status_line.status_code = 101;
+	set_http_field("Upgrade", "websocket", &res->headers);
+	set_http_field("Connection", "Upgrade", &res->headers);
+	set_http_field("Sec-WebSocket-Accept", accept, &res->headers);
+	res->websocket = h;
+	return 0;
+}
+
+static void frame_unref(struct frame *f) {
+	if (atomic_fetch_sub_explicit(&f->refs, 1, memory_order_acq_rel) == 1) {
+		metrics_memory_add(METRIC_MEMORY_WEBSOCKET_FRAMES, -(int64_t) (sizeof(*f) + f->len));
+		free(f);
+	}
+}
+
+static int send_frame(websocket_t *ws, const enum websocket_opcode op, const void *data, const size_t len) {
+	uint8_t head[WEBSOCKET_FRAME_HEAD_MAX];
+	struct iovec iov[2] = {
+		{.iov_base = head, .iov_len = websocket_frame_head(head, true, op, len)},
+		{.iov_base = (void *) data, .iov_len = len}
+	};
+	const ssize_t sent = conn_io_writev(&ws->io, iov, len > 0 ? 2 : 1);
+	if (sent == -1)
+		return -1;
+	metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	return 0;
+}
+
+static void send_close(websocket_t *ws, const unsigned int code) {
+	if (ws->close_sent)
+		return;
+	ws->close_sent = true;
+	ws->close_code = code;
+	const uint8_t payload[2] = {(uint8_t) (code >> 8), (uint8_t) code};
+	if (send_frame(ws, WEBSOCKET_OP_CLOSE, payload, sizeof(payload)) == -1)
+		ws->done = true;
+}
+
+// a peer that broke the protocol is sent the reason and dropped without waiting for its close
+static int fail(websocket_t *ws, const unsigned int code) {
+	lprintf(DEBUG, "websocket closed with %u", code);
+	send_close(ws, code);
+	ws->done = true;
+	return -1;
+}
+
+int websocket_send(websocket_t *ws, const enum websocket_opcode op, const void *data, const size_t len) {
+	if (ws->close_sent || ws->done)
+		return -1;
+	if (send_frame(ws, op, data, len) == -1) {
+		ws->done = true;
+		return -1;
+	}
+	return 0;
+}
+
+void websocket_close(websocket_t *ws, const unsigned int code) {
+	send_close(ws, code);
+}
+
+// queued broadcasts in as few writevs as possible, a reference is dropped once its frame is out
+static int flush_queue(websocket_t *ws) {
+	const size_t cap = ws->srv->queue_max;
+	while (ws->queue_len > 0) {
+		struct iovec iov[WEBSOCKET_IOV_MAX];
+		const size_t n = ws->queue_len < WEBSOCKET_IOV_MAX ? ws->queue_len : WEBSOCKET_IOV_MAX;
+		for (size_t i = 0; i < n; i++) {
+			const struct frame *f = ws->queue[(ws->queue_head + i) % cap];
+			iov[i] = (struct iovec) {.iov_base = (void *) f->data, .iov_len = f->len};
+		}
+		ws->writing = true;
+		const ssize_t sent = conn_io_writev(&ws->io, iov, (int) n);
+		ws->writing = false;
+		for (size_t i = 0; i < n; i++)
+			frame_unref(ws->queue[(ws->queue_head + i) % cap]);
+		ws->queue_head = (ws->queue_head + n) % cap;
+		ws->queue_len -= n;
+		if (sent == -1)
+			return -1;
+		metrics_add(METRIC_BYTES_SENT, (uint64_t) sent);
+	}
+	return 0;
+}
+
+static int deliver_message(websocket_t *ws) {
+	const enum websocket_opcode op = ws->msg_op;
+	ws->msg_op = 0;
+	if (op == WEBSOCKET_OP_TEXT && !websocket_utf8_valid(ws->msg, ws->msg_len))
+		return fail(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+	metrics_add(METRIC_WEBSOCKET_MESSAGES_RECEIVED, 1);
+	// after our close the peer's data is read and dropped until its close comes back
+	const int stat = ws->close_sent ? 0 : ws->h->message(ws, op, ws->msg, ws->msg_len, ws->h->user);
+	if (ws->msg_cap > WEBSOCKET_MESSAGE_KEEP) {
+		free(ws->msg);
+		ws->msg = NULL;
+		ws->msg_cap = 0;
+	}
+	ws->msg_len = 0;
+	if (stat == -1)
+		return fail(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+	return 0;
+}
+
+static bool close_code_valid(const unsigned int code) {
+	return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) || (code >= 3000 && code <= 4999);
+}
+
+// -1 ends the connection
+static int on_control(websocket_t *ws, const struct websocket_frame_head *fh, const uint8_t *payload) {
+	switch (fh->opcode) {
+		case WEBSOCKET_OP_PING:
+			if (!ws->close_sent && send_frame(ws, WEBSOCKET_OP_PONG, payload, fh->len) == -1) {
+				ws->done = true;
+				return -1;
+			}
+			return 0;
+		case WEBSOCKET_OP_PONG:
+			return 0;
+		case WEBSOCKET_OP_CLOSE: {
+			unsigned int code = WEBSOCKET_CLOSE_NO_STATUS;
+			if (fh->len == 1)
+				return fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+			if (fh->len >= 2) {
+				code = (unsigned int) payload[0] << 8 | payload[1];
+				if (!close_code_valid(code))
+					return fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+				if (!websocket_utf8_valid((const char *) payload + 2, fh->len - 2))
+					return fail(ws, WEBSOCKET_CLOSE_INVALID_DATA);
+			}
+			// our close is answered, or the peer's gets the same code back
+			if (!ws->close_sent) {
+				send_close(ws, code == WEBSOCKET_CLOSE_NO_STATUS ? WEBSOCKET_CLOSE_NORMAL : code);
+				ws->close_code = code;
+			}
+			ws->done = true;
+			return -1;
+		}
+		case WEBSOCKET_OP_CONTINUATION:
+		case WEBSOCKET_OP_TEXT:
+		case WEBSOCKET_OP_BINARY:
+		default:
+			return fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+	}
+}
+
+// everything in rbuf that can be handled, 0 when more has to be read
+static int on_frames(websocket_t *ws) {
+	while (!ws->done) {
+		uint8_t *p = ws->rbuf + ws->rstart;
+		const size_t avail = ws->rend - ws->rstart;
+		if (ws->payload_left > 0) {
+			// data frame payloads are unmasked into the message as they arrive, they can be longer than rbuf
+			const size_t n = avail < ws->payload_left ? avail : (size_t) ws->payload_left;
+			if (n == 0)
+				return 0;
+			memcpy(ws->msg + ws->msg_len, p, n);
+			websocket_unmask(ws->msg + ws->msg_len, n, ws->mask, ws->payload_off);
+			ws->msg_len += n;
+			ws->payload_off += n;
+			ws->payload_left -= n;
+			ws->rstart += n;
+			if (ws->payload_left == 0 && ws->fin && deliver_message(ws) == -1)
+				return -1;
+			continue;
+		}
+		struct websocket_frame_head fh;
+		const ssize_t head_len = websocket_frame_parse(p, avail, &fh);
+		if (head_len == -1)
+			return fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+		if (head_len == 0)
+			return 0;
+		if (fh.opcode >= WEBSOCKET_OP_CLOSE) {
+			// at most 125 bytes, they're handled once all of them are in rbuf
+			if (avail < (size_t) head_len + fh.len)
+				return 0;
+			websocket_unmask(p + head_len, fh.len, fh.mask, 0);
+			ws->rstart += (size_t) head_len + fh.len;
+			if (on_control(ws, &fh, p + head_len) == -1)
+				return -1;
+			continue;
+		}
+		// a continuation only inside a fragmented message, a new message only outside one
+		if ((fh.opcode == WEBSOCKET_OP_CONTINUATION) != (ws->msg_op != 0))
+			return fail(ws, WEBSOCKET_CLOSE_PROTOCOL_ERROR);
+		if (fh.len > ws->srv->message_max - ws->msg_len)
+			return fail(ws, WEBSOCKET_CLOSE_TOO_BIG);
+		if (ws->msg_len + fh.len > ws->msg_cap) {
+			const size_t cap = ws->msg_len + (size_t) fh.len;
+			char *msg = realloc(ws->msg, cap);
+			if (msg == NULL) {
+				sys_error_printf("realloc failed");
+				return fail(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+			}
+			ws->msg = msg;
+			ws->msg_cap = cap;
+		}
+		if (fh.opcode != WEBSOCKET_OP_CONTINUATION)
+			ws->msg_op = fh.opcode;
+		ws->payload_left = fh.len;
+		ws->payload_off = 0;
+		memcpy(ws->mask, fh.mask, sizeof(ws->mask));
+		ws->fin = fh.fin;
+		ws->rstart += (size_t) head_len;
+		if (fh.len == 0 && fh.fin && deliver_message(ws) == -1)
+			return -1;
+	}
+	return -1;
+}
+
+// waits for the socket, a wake from the loop or the next ping. -1 ends the connection
+static int wait_and_read(websocket_t *ws) {
+	if (conn_io_pending(&ws->io) == 0) {
+		const uint64_t now = metrics_now_ns();
+		const int timeout_ms = ws->ping_at_ns > now ? (int) ((ws->ping_at_ns - now) / 1000000) + 1 : 1;
+		const int stat = co_wait(ws->io.fd, POLLER_READ, timeout_ms);
+		if (ws->conn.woken)
+			return 0;
+		if (stat == -1) {
+			if (errno != ETIMEDOUT || ws->close_sent || ws->awaiting_pong) {
+				// a close that isn't answered in time or a peer that stopped answering pings
+				ws->done = true;
+				return -1;
+			}
+			if (metrics_now_ns() < ws->ping_at_ns)
+				return 0;
+			ws->awaiting_pong = true;
+			ws->ping_at_ns = metrics_now_ns() + (uint64_t) ws->srv->ping_interval_sec * 1000000000ull;
+			return websocket_send(ws, WEBSOCKET_OP_PING, NULL, 0);
+		}
+	}
+	if (ws->rstart > 0) {
+		memmove(ws->rbuf, ws->rbuf + ws->rstart, ws->rend - ws->rstart);
+		ws->rend -= ws->rstart;
+		ws->rstart = 0;
+	}
+	const ssize_t n = conn_io_recv(&ws->io, ws->rbuf + ws->rend, sizeof(ws->rbuf) - ws->rend);
+	if (n <= 0) {
+		ws->done = true;
+		return -1;
+	}
+	metrics_add(METRIC_BYTES_RECEIVED, (uint64_t) n);
+	ws->rend += (size_t) n;
+	// anything from the peer shows it's alive
+	ws->awaiting_pong = false;
+	ws->ping_at_ns = metrics_now_ns() + (uint64_t) ws->srv->ping_interval_sec * 1000000000ull;
+	return 0;
+}
+
+static void unsubscribe_slot(websocket_t *ws, struct subscription *s) {
+	websocket_channel_t *ch = s->ch;
+	if (s->prev != NULL)
+		s->prev->next = s->next;
+	else
+		ch->subs[ws->conn.loop] = s->next;
+	if (s->next != NULL)
+		s->next->prev = s->prev;
+	atomic_fetch_sub_explicit(&ch->nsubs[ws->conn.loop], 1, memory_order_relaxed);
+	s->ch = NULL;
+}
+
+static void run(websocket_t *ws) {
+	metrics_add(METRIC_WEBSOCKET_OPENED, 1);
+	ws->close_code = WEBSOCKET_CLOSE_ABNORMAL;
+	ws->ping_at_ns = metrics_now_ns() + (uint64_t) ws->srv->ping_interval_sec * 1000000000ull;
+	ws->io.timeout_ms = (int) ws->srv->send_timeout_sec * 1000;
+	stream_join(&conns, &ws->conn);
+	if (stream_draining(&conns, &ws->conn))
+		send_close(ws, WEBSOCKET_CLOSE_GOING_AWAY);
+	else if (ws->h->open != NULL && ws->h->open(ws, ws->h->user) == -1)
+		fail(ws, WEBSOCKET_CLOSE_INTERNAL_ERROR);
+	while (!ws->done) {
+		ws->conn.woken = false;
+		if (ws->queue_len > 0 && flush_queue(ws) == -1)
+			break;
+		if (ws->slow) {
+			fail(ws, WEBSOCKET_CLOSE_POLICY);
+			break;
+		}
+		if (ws->conn.draining)
+			send_close(ws, WEBSOCKET_CLOSE_GOING_AWAY);
+		if (on_frames(ws) == -1 || ws->done || wait_and_read(ws) == -1)
+			break;
+	}
+	stream_leave(&conns, &ws->conn);
+	for (size_t i = 0; i < WEBSOCKET_SUBSCRIPTIONS_MAX; i++) {
+		if (ws->subs[i].ch != NULL)
+			unsubscribe_slot(ws, &ws->subs[i]);
+	}
+	for (; ws->queue_len > 0; ws->queue_len--) {
+		frame_unref(ws->queue[ws->queue_head]);
+		ws->queue_head = (ws->queue_head + 1) % ws->srv->queue_max;
+	}
+	if (ws->h->close != NULL)
+		ws->h->close(ws, ws->close_code, ws->h->user);
+	if (ws->slow)
+		metrics_add(METRIC_WEBSOCKET_SLOW_CLOSED, 1);
+	metrics_add(METRIC_WEBSOCKET_CLOSED, 1);
+}
+
+static websocket_t *ws_new(const struct websocket_server *srv, const conn_io_t *io,
+                           const struct websocket_handler *h, const char *initial, const size_t initial_len) {
+	if (initial_len > WEBSOCKET_RECV_BYTES) {
+		lprintf(DEBUG, "%zu bytes of websocket frames before the 101", initial_len);
+		return NULL;
+	}
+	websocket_t *ws = malloc(sizeof(*ws));
+	struct frame **queue = malloc(sizeof(*queue) * srv->queue_max);
+	if (ws == NULL || queue == NULL) {
+		sys_error_printf("malloc failed");
+		free(ws);
+		free(queue);
+		return NULL;
+	}
+	memset(ws, 0, offsetof(struct websocket, rbuf));
+	ws->srv = srv;
+	ws->h = h;
+	ws->io = *io;
+	ws->queue = queue;
+	if (initial_len > 0)
+		memcpy(ws->rbuf, initial, initial_len);
+	ws->rend = initial_len;
+	return ws;
+}
+
+static void ws_free(websocket_t *ws) {
+	free(ws->queue);
+	free(ws->msg);
+	free(ws);
+}
+
+// a handed over connection runs here, initial is freed either way
+static void run_handed_over(void *arg, conn_io_t *io) {
+	const struct handover *ho = arg;
+	websocket_t *ws = io != NULL ? ws_new(ho->srv, io, ho->h, ho->initial, ho->initial_len) : NULL;
+	free(ho->initial);
+	if (ws == NULL)
+		return;
+	run(ws);
+	*io = ws->io;
+	ws_free(ws);
+}
+
+int websocket_start(const struct websocket_server *srv, const conn_io_t *io, const struct websocket_handler *h,
+                    const char *initial, const size_t initial_len) {
+	if (co_running()) {
+		websocket_t *ws = ws_new(srv, io, h, initial, initial_len);
+		if (ws == NULL)
+			return -1;
+		run(ws);
+		ws_free(ws);
+		return 0;
+	}
+	if (srv->loops == NULL) {
+		lprintf(ERROR, "no event loop for websocket connections");
+		return -1;
+	}
+	struct handover ho = {.srv = srv, .h = h, .initial = NULL, .initial_len = initial_len};
+	if (initial_len > 0) {
+		ho.initial = malloc(initial_len);
+		if (ho.initial == NULL) {
+			sys_error_printf("malloc failed");
+			return -1;
+		}
+		memcpy(ho.initial, initial, initial_len);
+	}
+	if (stream_handover(&conns, srv->loops, io, srv->closed, run_handed_over, &ho, sizeof(ho)) == -1) {
+		free(ho.initial);
+		return -1;
+	}
+	return 1;
+}
+
+void websocket_drain(const struct websocket_server *srv) {
+	stream_drain(&conns, srv->loops);
+}
+
+websocket_channel_t *websocket_channel_create(void) {
+	websocket_channel_t *ch = calloc(1, sizeof(*ch));
+	if (ch == NULL) {
+		sys_error_printf("calloc failed");
+		return NULL;
+	}
+	return ch;
+}
+
+void websocket_channel_destroy(websocket_channel_t *ch) {
+	free(ch);
+}
+
+int websocket_subscribe(websocket_t *ws, websocket_channel_t *ch) {
+	struct subscription *free_slot = NULL;
+	for (size_t i = 0; i < WEBSOCKET_SUBSCRIPTIONS_MAX; i++) {
+		if (ws->subs[i].ch == ch)
+			return 0;
+		if (ws->subs[i].ch == NULL && free_slot == NULL)
+			free_slot = &ws->subs[i];
+	}
+	if (free_slot == NULL) {
+		lprintf(ERROR, "websocket already on %d channels", WEBSOCKET_SUBSCRIPTIONS_MAX);
+		return -1;
+	}
+	coro_loops_t *expected = NULL;
+	atomic_compare_exchange_strong(&ch->loops, &expected, ws->srv->loops);
+	*free_slot = (struct subscription) {.ch = ch, .ws = ws, .prev = NULL, .next = ch->subs[ws->conn.loop]};
+	if (free_slot->next != NULL)
+		free_slot->next->prev = free_slot;
+	ch->subs[ws->conn.loop] = free_slot;
+	atomic_fetch_add_explicit(&ch->nsubs[ws->conn.loop], 1, memory_order_relaxed);
+	return 0;
+}
+
+void websocket_unsubscribe(websocket_t *ws, websocket_channel_t *ch) {
+	for (size_t i = 0; i < WEBSOCKET_SUBSCRIPTIONS_MAX; i++) {
+		if (ws->subs[i].ch == ch)
+			unsubscribe_slot(ws, &ws->subs[i]);
+	}
+}
+
+size_t websocket_channel_subscribers(websocket_channel_t *ch) {
+	size_t n = 0;
+	for (size_t i = 0; i < CORO_LOOPS_MAX; i++)
+		n += atomic_load_explicit(&ch->nsubs[i], memory_order_relaxed);
+	return n;
+}
+
+// runs on one loop for one broadcast, queues the frame for that loop's subscribers
+static void deliver(void *arg) {
+	const struct delivery *d = arg;
+	const size_t loop = co_loop_index();
+	size_t queued = 0;
+	for (struct subscription *s = d->ch->subs[loop]; s != NULL; s = s->next) {
+		websocket_t *ws = s->ws;
+		if (ws->done || ws->close_sent)
+			continue;
+		if (ws->queue_len == ws->srv->queue_max) {
+			// a peer that stopped reading won't take a close frame either, the stuck write fails instead of
+			// waiting out the send timeout
+			if (!ws->slow && ws->writing)
+				shutdown(ws->io.fd, SHUT_RDWR);
+			ws->slow = true;
+		} else {
+			atomic_fetch_add_explicit(&d->f->refs, 1, memory_order_relaxed);
+			ws->queue[(ws->queue_head + ws->queue_len++) % ws->srv->queue_max] = d->f;
+			queued++;
+		}
+		ws->conn.woken = true;
+		co_wake(ws->conn.co);
+	}
+	metrics_add(METRIC_WEBSOCKET_FRAMES_QUEUED, queued);
+	frame_unref(d->f);
+}
+
+int websocket_broadcast(websocket_channel_t *ch, const enum websocket_opcode op, const void *data, const size_t len) {
+	coro_loops_t *loops = atomic_load(&ch->loops);
+	if (loops == NULL)
+		return 0;
+	uint8_t head[WEBSOCKET_FRAME_HEAD_MAX];
+	const size_t head_len = websocket_frame_head(head, true, op, len);
+	struct frame *f = malloc(sizeof(*f) + head_len + len);
+	if (f == NULL) {
+		sys_error_printf("malloc failed");
+		return -1;
+	}
+	atomic_init(&f->refs, 1);
+	f->len = head_len + len;
+	metrics_memory_add(METRIC_MEMORY_WEBSOCKET_FRAMES, (int64_t) (sizeof(*f) + f->len));
+	memcpy(f->data, head, head_len);
+	if (len > 0)
+		memcpy(f->data + head_len, data, len);
+	int retval = 0;
+	for (size_t i = 0; i < CORO_LOOPS_MAX; i++) {
+		if (atomic_load_explicit(&ch->nsubs[i], memory_order_relaxed) == 0)
+			continue;
+		atomic_fetch_add_explicit(&f->refs, 1, memory_order_relaxed);
+		const struct delivery d = {.ch = ch, .f = f};
+		if (coro_submit_to(loops, i, deliver, &d, sizeof(d)) == -1) {
+			frame_unref(f);
+			retval = -1;
+		}
+	}
+	frame_unref(f);
+	return retval;
+}
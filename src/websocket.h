@@ -0,0 +1,83 @@
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <stddef.h>
+
+#include "coro.h"
+#include "parse_http.h"
+#include "tls.h"
+#include "websocket_frame.h"
+
+/* websocket connections (rfc 6455) after an http/1.1 upgrade. a route takes one with websocket_accept(), once the
+ * 101 is out the connection runs as a coroutine: inline where the server already runs coroutines, handed to the
+ * websocket event loops otherwise, so an open socket costs a small stack instead of a pool thread. messages arrive
+ * unmasked and joined from their fragments, text is checked to be utf-8, pings are answered and sent when the peer
+ * goes quiet. a broadcast builds its frame once, each loop with subscribers queues a reference to it for every
+ * one of them and wakes it, so only a connection's own loop ever writes to its socket
+ */
+
+#define WEBSOCKET_SUBSCRIPTIONS_MAX 8 // channels one connection can be on at once
+#define WEBSOCKET_RECV_BYTES (1024 * 16) // per connection, longer payloads go straight into the message
+
+enum websocket_close_code {
+	WEBSOCKET_CLOSE_NORMAL = 1000,
+	WEBSOCKET_CLOSE_GOING_AWAY = 1001, // drain
+	WEBSOCKET_CLOSE_PROTOCOL_ERROR = 1002,
+	WEBSOCKET_CLOSE_NO_STATUS = 1005, // the peer's close had no code, never sent
+	WEBSOCKET_CLOSE_ABNORMAL = 1006, // the connection ended without a close, never sent
+	WEBSOCKET_CLOSE_INVALID_DATA = 1007, // text that isn't utf-8
+	WEBSOCKET_CLOSE_POLICY = 1008, // too slow to take its broadcasts
+	WEBSOCKET_CLOSE_TOO_BIG = 1009,
+	WEBSOCKET_CLOSE_INTERNAL_ERROR = 1011
+};
+
+typedef struct websocket websocket_t;
+typedef struct websocket_channel websocket_channel_t;
+
+// called on the connection's coroutine, -1 from open or message closes it with 1011
+struct websocket_handler {
+	int (*open)(websocket_t *ws, void *user); // optional
+	// a whole text or binary message, data is valid until the call returns
+	int (*message)(websocket_t *ws, enum websocket_opcode op, const char *data, size_t len, void *user);
+	// the code of the peer's close or why the connection ended, subscriptions are already gone. optional
+	void (*close)(websocket_t *ws, unsigned int code, void *user);
+	void *user;
+};
+
+struct websocket_server {
+	coro_loops_t *loops; // where handed over connections run, NULL when there are none
+	size_t message_max; // a longer message closes the connection with 1009
+	size_t queue_max; // broadcast frames waiting on a connection before it's closed as too slow
+	unsigned int ping_interval_sec; // quiet time before a ping, no answer by the next one ends the connection
+	unsigned int send_timeout_sec;
+	// hook into the caller's connection bookkeeping, gets the fd of a handed over connection once it's done
+	void (*closed)(int fd);
+};
+
+// a valid upgrade gets a 101 and res->websocket = h, anything else a 400 (426 for another version). returns 0 so
+// a route handler can return it
+int websocket_accept(const struct HttpRequest *req, struct HttpResponse *res, const struct websocket_handler *h);
+/* runs a connection whose 101 was just sent, initial is what the client sent after the request. in a coroutine it
+ * returns 0 once the connection is done and closing fd is up to the caller, otherwise io is handed to srv->loops
+ * and it returns 1. -1 if it couldn't start
+ */
+int websocket_start(const struct websocket_server *srv, const conn_io_t *io, const struct websocket_handler *h,
+                    const char *initial, size_t initial_len);
+// every connection starts its close with 1001, returns without waiting for them
+void websocket_drain(const struct websocket_server *srv);
+
+// only from the connection's own callbacks, like everything taking a websocket_t
+int websocket_send(websocket_t *ws, enum websocket_opcode op, const void *data, size_t len);
+// sends a close, the connection ends when the peer answers or after the send timeout
+void websocket_close(websocket_t *ws, unsigned int code);
+int websocket_subscribe(websocket_t *ws, websocket_channel_t *ch);
+void websocket_unsubscribe(websocket_t *ws, websocket_channel_t *ch);
+
+websocket_channel_t *websocket_channel_create(void);
+// once nothing can subscribe anymore, after the loops stopped
+void websocket_channel_destroy(websocket_channel_t *ch);
+// from any thread. -1 if the frame couldn't be built or a loop's inbox was full, its subscribers then miss it
+int websocket_broadcast(websocket_channel_t *ch, enum websocket_opcode op, const void *data, size_t len);
+size_t websocket_channel_subscribers(websocket_channel_t *ch);
+
+#endif //WEBSOCKET_H
@@ -0,0 +1,234 @@
+#include <string.h>
+
+#include "websocket_frame.h"
+
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// gcc and clang lower these to sse2 on x86_64 and neon on aarch64, plain loops elsewhere
+typedef uint8_t vec16 __attribute__((vector_size(16)));
+typedef uint64_t u64x2 __attribute__((vector_size(16)));
+
+ssize_t websocket_frame_parse(const uint8_t *buf, const size_t n, struct websocket_frame_head *h) {
+	if (n < 2)
+		return 0;
+	// no extension was negotiated, so no reserved bit may be set
+	if (buf[0] & 0x70 || !(buf[1] & 0x80))
+		return -1;
+	h->fin = buf[0] & 0x80;
+	h->opcode = (enum websocket_opcode) (buf[0] & 0x0f);
+	switch (h->opcode) {
+		case WEBSOCKET_OP_CONTINUATION:
+		case WEBSOCKET_OP_TEXT:
+		case WEBSOCKET_OP_BINARY:
+		case WEBSOCKET_OP_CLOSE:
+		case WEBSOCKET_OP_PING:
+		case WEBSOCKET_OP_PONG:
+			break;
+		default:
+			return -1;
+	}
+	const unsigned int len7 = buf[1] & 0x7f;
+	const size_t len_bytes = len7 == 126 ? 2 : len7 == 127 ? 8 : 0;
+	const size_t head_len = 2 + len_bytes + 4;
+	if (n < head_len)
+		return 0;
+	h->len = len7;
+	if (len_bytes > 0) {
+		h->len = 0;
+		for (size_t i = 0; i < len_bytes; i++)
+			h->len = h->len << 8 | buf[2 + i];
+		// the shortest form is required and the top bit of the 64 bit one is always clear
+		if ((len_bytes == 2 && h->len < 126) || (len_bytes == 8 && (h->len <= 0xffff || h->len >> 63)))
+			return -1;
+	}
+	if (h->opcode >= WEBSOCKET_OP_CLOSE && (!h->fin || h->len > WEBSOCKET_CONTROL_MAX))
+		return -1;
+	memcpy(h->mask, buf + 2 + len_bytes, 4);
+	return (ssize_t) head_len;
+}
+
+size_t websocket_frame_head(uint8_t out[WEBSOCKET_FRAME_HEAD_MAX], const bool fin, const enum websocket_opcode opcode,
+                            const uint64_t len) {
+	out[0] = (uint8_t) ((fin ? 0x80 : 0) | opcode);
+	if (len < 126) {
+		out[1] = (uint8_t) len;
+		return 2;
+	}
+	if (len <= 0xffff) {
+		out[1] = 126;
+		out[2] = (uint8_t) (len >> 8);
+		out[3] = (uint8_t) len;
+		return 4;
+	}
+	out[1] = 127;
+	for (int i = 0; i < 8; i++)
+		out[2 + i] = (uint8_t) (len >> (56 - 8 * i));
+	return 10;
+}
+
+// 64 bytes per iteration in four independent vectors, the key repeats every 4 bytes so one 16 byte copy of it
+// fits every position
+void websocket_unmask(void *data, const size_t n, const uint8_t mask[4], const uint64_t offset) {
+	uint8_t *p = data;
+	uint8_t k[16];
+	for (size_t i = 0; i < sizeof(k); i++)
+		k[i] = mask[(offset + i) & 3];
+	vec16 kv;
+	memcpy(&kv, k, sizeof(kv));
+	size_t i = 0;
+	for (; i + 64 <= n; i += 64) {
+		vec16 a, b, c, d;
+		memcpy(&a, p + i, 16);
+		memcpy(&b, p + i + 16, 16);
+		memcpy(&c, p + i + 32, 16);
+		memcpy(&d, p + i + 48, 16);
+		a ^= kv;
+		b ^= kv;
+		c ^= kv;
+		d ^= kv;
+		memcpy(p + i, &a, 16);
+		memcpy(p + i + 16, &b, 16);
+		memcpy(p + i + 32, &c, 16);
+		memcpy(p + i + 48, &d, 16);
+	}
+	for (; i + 16 <= n; i += 16) {
+		vec16 a;
+		memcpy(&a, p + i, 16);
+		a ^= kv;
+		memcpy(p + i, &a, 16);
+	}
+	for (; i < n; i++)
+		p[i] ^= k[i & 15];
+}
+
+bool websocket_utf8_valid(const char *s, const size_t n) {
+	const uint8_t *p = (const uint8_t *) s;
+	const u64x2 high = {0x8080808080808080ull, 0x8080808080808080ull};
+	size_t i = 0;
+	while (i < n) {
+		// ascii runs, usually the whole message, 16 bytes at a time
+		if (i + 16 <= n) {
+			u64x2 v;
+			memcpy(&v, p + i, 16);
+			v &= high;
+			if ((v[0] | v[1]) == 0) {
+				i += 16;
+				continue;
+			}
+		}
+		const uint8_t c = p[i];
+		if (c < 0x80) {
+			i++;
+			continue;
+		}
+		size_t len;
+		uint8_t lo = 0x80, hi = 0xbf; // the range of the second byte, the others are always 80-bf
+		if (c >= 0xc2 && c <= 0xdf) {
+			len = 2;
+		} else if (c >= 0xe0 && c <= 0xef) {
+			len = 3;
+			if (c == 0xe0)
+				lo = 0xa0; // overlong
+			else if (c == 0xed)
+				hi = 0x9f; // surrogates
+		} else if (c >= 0xf0 && c <= 0xf4) {
+			len = 4;
+			if (c == 0xf0)
+				lo = 0x90; // overlong
+			else if (c == 0xf4)
+				hi = 0x8f; // past U+10FFFF
+		} else {
+			return false;
+		}
+		if (n - i < len || p[i + 1] < lo || p[i + 1] > hi)
+			return false;
+		for (size_t j = 2; j < len; j++) {
+			if ((p[i + j] & 0xc0) != 0x80)
+				return false;
+		}
+		i += len;
+	}
+	return true;
+}
+
+static uint32_t rol(const uint32_t x, const int n) {
+	return x << n | x >> (32 - n);
+}
+
+// only ever hashes a key and the guid, so the whole message is at most two blocks
+static void sha1(const uint8_t *msg, const size_t n, uint8_t out[20]) {
+	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	uint8_t buf[128] = {0};
+	const size_t blocks = n + 9 <= 64 ? 1 : 2;
+	memcpy(buf, msg, n);
+	buf[n] = 0x80;
+	const uint64_t bits = (uint64_t) n * 8;
+	for (int i = 0; i < 8; i++)
+		buf[blocks * 64 - 1 - (size_t) i] = (uint8_t) (bits >> (8 * i));
+	for (size_t b = 0; b < blocks; b++) {
+		uint32_t w[80];
+		for (int i = 0; i < 16; i++) {
+			const uint8_t *q = buf + b * 64 + (size_t) i * 4;
+			w[i] = (uint32_t) q[0] << 24 | (uint32_t) q[1] << 16 | (uint32_t) q[2] << 8 | q[3];
+		}
+		for (int i = 16; i < 80; i++)
+			w[i] = rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+		uint32_t a = h[0], bb = h[1], c = h[2], d = h[3], e = h[4];
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (bb & c) | (~bb & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = bb ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (bb & c) | (bb & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = bb ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			const uint32_t t = rol(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rol(bb, 30);
+			bb = a;
+			a = t;
+		}
+		h[0] += a;
+		h[1] += bb;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
+	}
+	for (int i = 0; i < 5; i++) {
+		out[i * 4] = (uint8_t) (h[i] >> 24);
+		out[i * 4 + 1] = (uint8_t) (h[i] >> 16);
+		out[i * 4 + 2] = (uint8_t) (h[i] >> 8);
+		out[i * 4 + 3] = (uint8_t) h[i];
+	}
+}
+
+void websocket_accept_key(const struct str_view key, char out[WEBSOCKET_ACCEPT_LEN + 1]) {
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	// the caller checked the key is 24 characters, longer ones are cut so they can't overflow
+	uint8_t msg[64 + sizeof(WEBSOCKET_GUID)];
+	const size_t key_len = key.len < 64 ? key.len : 64;
+	memcpy(msg, key.ptr, key_len);
+	memcpy(msg + key_len, WEBSOCKET_GUID, sizeof(WEBSOCKET_GUID) - 1);
+	uint8_t digest[21];
+	sha1(msg, key_len + sizeof(WEBSOCKET_GUID) - 1, digest);
+	digest[20] = 0;
+	// 20 bytes are six full groups and one of two bytes with one '='
+	size_t o = 0;
+	for (size_t i = 0; i < 21; i += 3) {
+		const uint32_t v = (uint32_t) digest[i] << 16 | (uint32_t) digest[i + 1] << 8 | digest[i + 2];
+		out[o++] = alphabet[v >> 18 & 63];
+		out[o++] = alphabet[v >> 12 & 63];
+		out[o++] = alphabet[v >> 6 & 63];
+		out[o++] = alphabet[v & 63];
+	}
+	out[WEBSOCKET_ACCEPT_LEN - 1] = '=';
+	out[WEBSOCKET_ACCEPT_LEN] = '\0';
+}
@@ -0,0 +1,45 @@
+#ifndef WEBSOCKET_FRAME_H
+#define WEBSOCKET_FRAME_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "parse_http.h"
+
+// rfc 6455 framing without any io, used by the websocket connections
+
+#define WEBSOCKET_FRAME_HEAD_MAX 14 // 2 + 8 byte length + 4 byte mask
+#define WEBSOCKET_CONTROL_MAX 125
+#define WEBSOCKET_ACCEPT_LEN 28 // base64 of a sha-1
+
+enum websocket_opcode {
+	WEBSOCKET_OP_CONTINUATION = 0x0,
+	WEBSOCKET_OP_TEXT = 0x1,
+	WEBSOCKET_OP_BINARY = 0x2,
+	WEBSOCKET_OP_CLOSE = 0x8,
+	WEBSOCKET_OP_PING = 0x9,
+	WEBSOCKET_OP_PONG = 0xa
+};
+
+struct websocket_frame_head {
+	bool fin;
+	enum websocket_opcode opcode;
+	uint8_t mask[4];
+	uint64_t len; // payload
+};
+
+/* a client frame head from the start of buf. the head length, 0 if more bytes are needed or -1 for a frame a
+ * client can't send: unmasked, reserved bits or opcodes, a fragmented or too long control frame
+ */
+ssize_t websocket_frame_parse(const uint8_t *buf, size_t n, struct websocket_frame_head *h);
+// an unmasked server frame head into out, returns its length
+size_t websocket_frame_head(uint8_t out[WEBSOCKET_FRAME_HEAD_MAX], bool fin, enum websocket_opcode opcode, uint64_t len);
+// xors n bytes with the mask, offset is how far into the payload data starts
+void websocket_unmask(void *data, size_t n, const uint8_t mask[4], uint64_t offset);
+// rejects overlong forms, surrogates and anything past U+10FFFF
+bool websocket_utf8_valid(const char *s, size_t n);
+// Sec-WebSocket-Accept for a Sec-WebSocket-Key, out gets WEBSOCKET_ACCEPT_LEN characters and a NUL
+void websocket_accept_key(struct str_view key, char out[WEBSOCKET_ACCEPT_LEN + 1]);
+
+#endif //WEBSOCKET_FRAME_H